@@ -0,0 +1,2025 @@
+/**
+ * Benchmarks for the statemachine engine
+ */
+#include "statemachine.h"
+#include "statemachine_executor.h"
+#include "statemachine_index.h"
+#include "statemachine_journal.h"
+#include "statemachine_trace.h"
+#include "thermostat.h"
+#include "thermostat_conditions.h"
+#include "thermostat_control.h"
+#include "thermostat_dispatch.h"
+#include "thermostat_ingest.h"
+#include "thermostat_simulator.h"
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+    BENCH_EVENT_A = 1,
+    BENCH_EVENT_B
+};
+
+/**
+ * Synthetic chart used to measure how transition cost scales with the size of a chart
+ */
+typedef struct {
+    statemachine_model_t model;
+    statemachine_t statemachine;
+    state_t *levels; // one substate array per level
+    transition_t *transitions;
+} bench_chart_t;
+
+#define BENCH_LENGTH(array) (sizeof(array) / sizeof((array)[0]))
+
+/**
+ * A setting a benchmark ran with
+ */
+typedef struct {
+    const char *key;
+    long value;
+} bench_param_t;
+
+/**
+ * A measurement, the key names its unit
+ */
+typedef struct {
+    const char *key;
+    double value;
+} bench_metric_t;
+
+static char bench_json; // report results as a JSON document instead of one line each
+static size_t bench_results; // results reported so far
+static int bench_filter_count;
+static char **bench_filters;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+/**
+ * Check whether a benchmark was selected on the command line
+ * @param name
+ * @return 1 if no benchmark was named or this one starts with one of the names given
+ */
+static int bench_selected(const char *name) {
+    for (int i = 0; i < bench_filter_count; i++) {
+        if (strncmp(name, bench_filters[i], strlen(bench_filters[i])) == 0) return 1;
+    }
+    return bench_filter_count == 0;
+}
+
+/**
+ * Report the result of a benchmark, either as a line of key=value pairs or as an element of the results array
+ * @param name
+ * @param params
+ * @param param_count
+ * @param metrics
+ * @param metric_count
+ */
+static void bench_report(const char *name, const bench_param_t *params, size_t param_count,
+                         const bench_metric_t *metrics, size_t metric_count) {
+    if (!bench_json) {
+        printf("%-18s", name);
+        for (size_t i = 0; i < param_count; i++) printf(" %s=%ld", params[i].key, params[i].value);
+        for (size_t i = 0; i < metric_count; i++) printf(" %s=%.1f", metrics[i].key, metrics[i].value);
+        printf("\n");
+        bench_results++;
+        return;
+    }
+    printf("%s\n    {\"name\": \"%s\", \"params\": {", bench_results++ ? "," : "", name);
+    for (size_t i = 0; i < param_count; i++) printf("%s\"%s\": %ld", i ? ", " : "", params[i].key, params[i].value);
+    printf("}, \"metrics\": {");
+    for (size_t i = 0; i < metric_count; i++) printf("%s\"%s\": %.3f", i ? ", " : "", metrics[i].key, metrics[i].value);
+    printf("}}");
+}
+
+static int bench_compare(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Get a percentile of samples sorted in ascending order
+ * @param samples
+ * @param count
+ * @param fraction between 0 and 1
+ * @return
+ */
+static double bench_percentile(const double *samples, size_t count, double fraction) {
+    size_t i = (size_t) ((double) count * fraction);
+    return samples[i < count ? i : count - 1];
+}
+
+/**
+ * Build a chain of nested states `depth` levels deep with two leaves at the bottom. Every level also gets `width`
+ * inactive sibling states so the chart grows without changing the path a transition takes.
+ * @param chart
+ * @param depth
+ * @param width
+ */
+static void bench_deep_chart(bench_chart_t *chart, int depth, int width) {
+    size_t level_size = (size_t) width + 3; // chain state or first leaf, second leaf, padding and the terminator
+    short id = 1;
+    chart->levels = calloc((size_t) depth * level_size + level_size, sizeof(state_t));
+    chart->model = (statemachine_model_t) {.root = {.id = id++, .substates = chart->levels, .initial.target = id}};
+    chart->statemachine = (statemachine_t) {0};
+    for (int level = 0; level < depth; level++) {
+        state_t *states = chart->levels + (size_t) level * level_size;
+        for (size_t i = 0; i + 1 < level_size; i++) {
+            states[i].id = id++;
+        }
+        if (level + 1 < depth) {
+            states[0].substates = states + level_size;
+            states[0].initial.target = id;
+        }
+    }
+    state_t *leaves = chart->levels + (size_t) (depth - 1) * level_size;
+    chart->transitions = calloc(3, sizeof(transition_t));
+    chart->transitions[0] = (transition_t) {.source = leaves[0].id, .target = leaves[1].id, .trigger.event = BENCH_EVENT_A};
+    chart->transitions[1] = (transition_t) {.source = leaves[1].id, .target = leaves[0].id, .trigger.event = BENCH_EVENT_B};
+    chart->transitions[2] = (transition_t) NULL_ELEMENT;
+    chart->model.transitions = chart->transitions;
+}
+
+/**
+ * Build a flat chart of `width` leaves under the root, each with a transition to the next one on the same event so
+ * every event has `width` candidate transitions
+ * @param chart
+ * @param width
+ */
+static void bench_wide_chart(bench_chart_t *chart, int width) {
+    chart->levels = calloc((size_t) width + 1, sizeof(state_t));
+    chart->transitions = calloc((size_t) width + 1, sizeof(transition_t));
+    chart->model = (statemachine_model_t) {.root = {.id = 1, .substates = chart->levels, .initial.target = 2},
+                                           .transitions = chart->transitions};
+    chart->statemachine = (statemachine_t) {0};
+    for (int i = 0; i < width; i++) {
+        chart->levels[i].id = (short) (i + 2);
+        chart->transitions[i] = (transition_t) {.source = (short) (i + 2), .target = (short) ((i + 1) % width + 2),
+                                                .trigger.event = BENCH_EVENT_A};
+    }
+}
+
+static void bench_free_chart(bench_chart_t *chart) {
+    statemachine_deinit(&chart->statemachine);
+    statemachine_release(&chart->model);
+    free(chart->levels);
+    free(chart->transitions);
+}
+
+/**
+ * Measure the cost of a transition between the two deepest leaves
+ * @param depth
+ * @param width
+ * @param iterations
+ */
+static void bench_deep_transition(int depth, int width, long iterations) {
+    bench_chart_t chart;
+    bench_deep_chart(&chart, depth, width);
+    statemachine_t *statemachine = &chart.statemachine;
+    if (statemachine_init(statemachine, &chart.model) == NULL) {
+        fprintf(stderr, "failed to initialize chart depth=%d width=%d\n", depth, width);
+        exit(1);
+    }
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        statemachine_dispatch(statemachine, BENCH_EVENT_A, NULL);
+        statemachine_dispatch(statemachine, BENCH_EVENT_B, NULL);
+    }
+    double elapsed = now_ns() - start;
+    bench_param_t params[] = {{"depth", depth}, {"states", (long) chart.model.table->state_count}};
+    bench_metric_t metrics[] = {{"ns_per_transition", elapsed / (double) (iterations * 2)}};
+    bench_report("deep_transition", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+    statemachine_terminate(statemachine);
+    bench_free_chart(&chart);
+}
+
+/**
+ * Chart whose actions record the order states are exited and entered and effects run in. It has a transition of every
+ * kind, and taking them in turn ends in the configuration it started from:
+ * 1 root, initial 2
+ *   2 A, initial 3: 3 A1 with an internal transition, 4 A2, a self transition on A and a local one from A to A2
+ *   5 B, initial 6: 6 B1, initial 7: 7 B11, with an external transition from A2 to B11 and one from B back to A
+ */
+enum {
+    BENCH_ORDER_INTERNAL = 1,
+    BENCH_ORDER_SELF,
+    BENCH_ORDER_LOCAL,
+    BENCH_ORDER_EXTERNAL,
+    BENCH_ORDER_ANCESTOR
+};
+
+static char bench_ordering; // the actions only record while this is set
+static char bench_order[256]; // what they ran, space separated
+static size_t bench_order_length;
+
+/**
+ * Record an action of the ordering chart, +id for an entry, -id for an exit and source>target for an effect
+ * @param action
+ * @param id
+ * @param target
+ */
+static void bench_order_add(char action, short id, short target) {
+    if (!bench_ordering || bench_order_length >= sizeof(bench_order)) return;
+    char *end = bench_order + bench_order_length;
+    size_t left = sizeof(bench_order) - bench_order_length;
+    int written = action == '>' ? snprintf(end, left, " %d>%d", id, target) : snprintf(end, left, " %c%d", action, id);
+    bench_order_length += written > 0 ? (size_t) written : 0;
+}
+
+static void bench_order_entry(statemachine_t *statemachine, state_t *state, trigger_t *trigger) {
+    (void) (statemachine);
+    (void) (trigger);
+    bench_order_add('+', state->id, 0);
+}
+
+static void bench_order_exit(statemachine_t *statemachine, state_t *state, trigger_t *trigger) {
+    (void) (statemachine);
+    (void) (trigger);
+    bench_order_add('-', state->id, 0);
+}
+
+static void bench_order_effect(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    (void) (statemachine);
+    (void) (trigger);
+    bench_order_add('>', transition->source, transition->target);
+}
+
+static state_t bench_order_a_states[] = {
+        {.id = 3, .entry = bench_order_entry, .exit = bench_order_exit},
+        {.id = 4, .entry = bench_order_entry, .exit = bench_order_exit},
+        NULL_ELEMENT
+};
+
+static state_t bench_order_b1_states[] = {
+        {.id = 7, .entry = bench_order_entry, .exit = bench_order_exit},
+        NULL_ELEMENT
+};
+
+static state_t bench_order_b_states[] = {
+        {.id = 6, .substates = bench_order_b1_states, .initial = {.target = 7, .effect = bench_order_effect},
+         .entry = bench_order_entry, .exit = bench_order_exit},
+        NULL_ELEMENT
+};
+
+static state_t bench_order_states[] = {
+        {.id = 2, .substates = bench_order_a_states, .initial = {.target = 3, .effect = bench_order_effect},
+         .entry = bench_order_entry, .exit = bench_order_exit},
+        {.id = 5, .substates = bench_order_b_states, .initial = {.target = 6, .effect = bench_order_effect},
+         .entry = bench_order_entry, .exit = bench_order_exit},
+        NULL_ELEMENT
+};
+
+static transition_t bench_order_transitions[] = {
+        {.source = 3, .trigger.event = BENCH_ORDER_INTERNAL, .effect = bench_order_effect},
+        {.source = 2, .target = 2, .trigger.event = BENCH_ORDER_SELF, .effect = bench_order_effect},
+        {.source = 2, .target = 4, .trigger.event = BENCH_ORDER_LOCAL, .effect = bench_order_effect},
+        {.source = 4, .target = 7, .trigger.event = BENCH_ORDER_EXTERNAL, .effect = bench_order_effect},
+        {.source = 5, .target = 2, .trigger.event = BENCH_ORDER_ANCESTOR, .effect = bench_order_effect},
+        NULL_ELEMENT
+};
+
+/**
+ * Check the statemachine's initial transition and a transition of every kind exit, run their effects and enter in the
+ * order the comment on transition_t gives, then measure taking them in turn
+ * @param iterations rounds through the transitions
+ * @return 0 if every transition ran its actions in order
+ */
+static int bench_ordering_check(size_t iterations) {
+    static const struct {
+        event_t event; // NULL_ELEMENT_ID for the initial transition
+        const char *name;
+        const char *order;
+    } steps[] = {
+            {NULL_ELEMENT_ID, "initial", "+1 0>2 +2 0>3 +3"},
+            {BENCH_ORDER_INTERNAL, "internal", "3>0"},
+            {BENCH_ORDER_SELF, "self", "-3 -2 2>2 +2 0>3 +3"},
+            {BENCH_ORDER_LOCAL, "local", "-3 2>4 +4"},
+            {BENCH_ORDER_EXTERNAL, "external", "-4 -2 4>7 +5 +6 +7"},
+            {BENCH_ORDER_ANCESTOR, "external from an ancestor", "-7 -6 -5 5>2 +2 0>3 +3"}
+    };
+    statemachine_model_t model = {.root = {.id = 1, .substates = bench_order_states,
+                                           .initial = {.target = 2, .effect = bench_order_effect},
+                                           .entry = bench_order_entry, .exit = bench_order_exit},
+                                  .transitions = bench_order_transitions};
+    statemachine_t statemachine = {0};
+    int status = 0;
+    bench_ordering = 1;
+    for (size_t i = 0; i < BENCH_LENGTH(steps) && status == 0; i++) {
+        bench_order_length = 0;
+        bench_order[0] = '\0';
+        if (steps[i].event == NULL_ELEMENT_ID) {
+            statemachine_init(&statemachine, &model);
+        } else {
+            statemachine_dispatch(&statemachine, steps[i].event, NULL);
+        }
+        const char *order = bench_order_length ? bench_order + 1 : bench_order;
+        if (strcmp(order, steps[i].order) != 0) {
+            fprintf(stderr, "ordering: the %s transition ran \"%s\" instead of \"%s\"\n", steps[i].name, order,
+                    steps[i].order);
+            status = -1;
+        }
+    }
+    bench_ordering = 0;
+    if (status == 0) {
+        double start = now_ns();
+        for (size_t i = 0; i < iterations; i++) {
+            for (size_t step = 1; step < BENCH_LENGTH(steps); step++) {
+                statemachine_dispatch(&statemachine, steps[step].event, NULL);
+            }
+        }
+        double elapsed = now_ns() - start;
+        bench_metric_t metrics[] = {{"ns_per_transition", elapsed / (double) (iterations * (BENCH_LENGTH(steps) - 1))}};
+        bench_report("ordering", NULL, 0, metrics, BENCH_LENGTH(metrics));
+    }
+    statemachine_deinit(&statemachine);
+    statemachine_release(&model);
+    return status;
+}
+
+/**
+ * Two state chart whose internal transition records how long each event waited before it was processed
+ */
+static double *bench_sent;
+static double *bench_latency;
+
+static void bench_record_latency(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    (void) (statemachine);
+    (void) (transition);
+    size_t i = (size_t) trigger->data;
+    bench_latency[i] = now_ns() - bench_sent[i];
+}
+
+static void bench_stop(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    (void) (transition);
+    (void) (trigger);
+    statemachine_terminate(statemachine);
+}
+
+static state_t bench_run_states[] = {
+        {.id = 2},
+        NULL_ELEMENT
+};
+
+static transition_t bench_run_transitions[] = {
+        {
+                .source = 2,
+                .trigger.event = BENCH_EVENT_A,
+                .effect = bench_record_latency
+        },
+        {
+                .source = 1,
+                .trigger.event = BENCH_EVENT_B,
+                .effect = bench_stop
+        },
+        NULL_ELEMENT
+};
+
+static void *bench_run_task(void *statemachine) {
+    statemachine_run((statemachine_t *) statemachine);
+    return NULL;
+}
+
+/**
+ * Measure how much CPU a statemachine_run thread uses while nothing is dispatched and how long events wait before they
+ * are processed, both spaced out and back to back
+ * @param events
+ * @param gap_ns time between dispatches, 0 to dispatch as fast as the queue accepts them
+ */
+static void bench_run(size_t events, long gap_ns) {
+    statemachine_model_t model = {.root = {.id = 1, .substates = bench_run_states, .initial.target = 2},
+                                  .transitions = bench_run_transitions};
+    statemachine_t statemachine = {0};
+    pthread_t thread;
+    struct timespec idle = {1, 0}, gap = {0, gap_ns}, cpu_start, cpu_end;
+    bench_sent = calloc(events, sizeof(double));
+    bench_latency = calloc(events, sizeof(double));
+    statemachine_init(&statemachine, &model);
+    pthread_create(&thread, NULL, bench_run_task, &statemachine);
+    // idle: the run thread should be asleep the whole time
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    nanosleep(&idle, NULL);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    double cpu_ms = (double) (cpu_end.tv_sec - cpu_start.tv_sec) * 1e3 +
+                    (double) (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e6;
+    for (size_t i = 0; i < events; i++) {
+        statemachine_queue_stats_t stats;
+        do {
+            // when the queue is full wait for the run thread to catch up and try again
+            statemachine_queue_stats(&statemachine, &stats);
+            if (stats.dispatched < i) statemachine_flush(&statemachine);
+            bench_sent[i] = now_ns();
+            statemachine_dispatch(&statemachine, BENCH_EVENT_A, (void *) i);
+            statemachine_queue_stats(&statemachine, &stats);
+        } while (stats.dispatched <= i);
+        if (gap_ns) nanosleep(&gap, NULL);
+    }
+    statemachine_flush(&statemachine);
+    qsort(bench_latency, events, sizeof(double), bench_compare);
+    bench_param_t params[] = {{"gap_ns", gap_ns}, {"events", (long) events}};
+    bench_metric_t metrics[] = {{"idle_cpu_ms_per_s", cpu_ms},
+                                {"p50_ns", bench_percentile(bench_latency, events, 0.5)},
+                                {"p99_ns", bench_percentile(bench_latency, events, 0.99)},
+                                {"p999_ns", bench_percentile(bench_latency, events, 0.999)},
+                                {"max_ns", bench_latency[events - 1]}};
+    bench_report("run_wakeup", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+    statemachine_dispatch(&statemachine, BENCH_EVENT_B, NULL);
+    pthread_join(thread, NULL);
+    statemachine_deinit(&statemachine);
+    statemachine_release(&model);
+    free(bench_sent);
+    free(bench_latency);
+}
+
+static void bench_timer_expire(statemachine_timer_t *timer, unsigned long generation) {
+    (void) (timer);
+    (void) (generation);
+}
+
+/**
+ * Measure arming and cancelling a timer while other timers are armed on the shared timer wheel. Both should cost the
+ * same however many timers are armed.
+ * @param armed number of timers already on the wheel
+ * @param iterations
+ */
+static void bench_timer(size_t armed, long iterations) {
+    statemachine_timer_t *timers = calloc(armed + 1, sizeof(statemachine_timer_t));
+    for (size_t i = 0; i <= armed; i++) {
+        timers[i].expire = bench_timer_expire;
+    }
+    // spread the armed timers over every level, far enough out that none expire during the run
+    for (size_t i = 0; i < armed; i++) {
+        statemachine_timer_arm(&timers[i], 60000UL + (unsigned long) (i * 7919 % 86400000UL));
+    }
+    statemachine_timer_t *probe = &timers[armed];
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        statemachine_timer_arm(probe, 60000UL + (unsigned long) (i % 3600000L));
+        statemachine_timer_cancel(probe);
+    }
+    double elapsed = now_ns() - start;
+    bench_param_t params[] = {{"armed", (long) armed}};
+    bench_metric_t metrics[] = {{"ns_per_op", elapsed / (double) iterations}};
+    bench_report("timer_arm_cancel", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+    for (size_t i = 0; i < armed; i++) {
+        statemachine_timer_cancel(&timers[i]);
+    }
+    statemachine_timer_sync();
+    free(timers);
+}
+
+/**
+ * Measure how much memory a thermostat costs and how long it takes to create one when many share a process. The heap
+ * usage includes the allocator's own overhead. The thermostat logs to stdout, which is silenced while it runs.
+ * @param count number of thermostats
+ */
+static void bench_thermostat_fleet(size_t count) {
+    thermostat_t **thermostats = calloc(count, sizeof(thermostat_t *));
+    int console = dup(STDOUT_FILENO), null = open("/dev/null", O_WRONLY);
+    fflush(stdout);
+    dup2(null, STDOUT_FILENO);
+    thermostat_destroy(thermostat_create()); // compile the shared model outside the measurement
+    size_t heap = mallinfo2().uordblks;
+    double start = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        thermostats[i] = thermostat_create();
+    }
+    double elapsed = now_ns() - start;
+    fflush(stdout);
+    size_t used = mallinfo2().uordblks - heap;
+    for (size_t i = 0; i < count; i++) {
+        thermostat_destroy(thermostats[i]);
+    }
+    fflush(stdout);
+    dup2(console, STDOUT_FILENO);
+    close(console);
+    close(null);
+    bench_param_t params[] = {{"instances", (long) count}};
+    bench_metric_t metrics[] = {{"sizeof_bytes", (double) sizeof(thermostat_t)},
+                                {"heap_bytes_per_instance", (double) used / (double) count},
+                                {"create_ns_per_instance", elapsed / (double) count}};
+    bench_report("thermostat_fleet", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+    free(thermostats);
+}
+
+/**
+ * Report the bytes the thermostat chart and synthetic charts of growing size take, shared by every statemachine
+ * running them and per statemachine
+ */
+static void bench_footprint() {
+    const int depths[] = {1, 16, 64}, widths[] = {16, 4096};
+    statemachine_footprint_t footprint;
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    thermostat_destroy(thermostat_create()); // compiles the thermostat chart
+    thermostat_logging = logging;
+    statemachine_footprint(&thermostat_model, &footprint);
+    bench_param_t params[] = {{"states", thermostat_model.table->state_count},
+                              {"transitions", (long) thermostat_model.table->transition_count}};
+    bench_metric_t metrics[] = {{"chart_bytes", (double) footprint.chart}, {"table_bytes", (double) footprint.table},
+                                {"instance_bytes", (double) footprint.instance},
+                                {"thermostat_bytes", (double) (footprint.instance - sizeof(statemachine_t) +
+                                                               sizeof(thermostat_t))}};
+    bench_report("footprint_thermostat", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+    for (size_t i = 0; i < BENCH_LENGTH(depths) + BENCH_LENGTH(widths); i++) {
+        bench_chart_t chart;
+        char deep = i < BENCH_LENGTH(depths);
+        if (deep) {
+            bench_deep_chart(&chart, depths[i], 0);
+        } else {
+            bench_wide_chart(&chart, widths[i - BENCH_LENGTH(depths)]);
+        }
+        if (statemachine_compile(&chart.model) != 0) {
+            fprintf(stderr, "failed to compile chart\n");
+            exit(1);
+        }
+        statemachine_footprint(&chart.model, &footprint);
+        bench_param_t chart_params[] = {{deep ? "depth" : "width", deep ? depths[i] : widths[i - BENCH_LENGTH(depths)]},
+                                        {"states", (long) chart.model.table->state_count},
+                                        {"transitions", (long) chart.model.table->transition_count}};
+        bench_metric_t chart_metrics[] = {{"chart_bytes", (double) footprint.chart},
+                                          {"table_bytes", (double) footprint.table},
+                                          {"instance_bytes", (double) footprint.instance}};
+        bench_report(deep ? "footprint_deep" : "footprint_wide", chart_params, BENCH_LENGTH(chart_params),
+                     chart_metrics, BENCH_LENGTH(chart_metrics));
+        bench_free_chart(&chart);
+    }
+}
+
+/**
+ * One producer thread of bench_executor, dispatches temperature readings to every thermostat whose index is its own
+ * modulo the number of producers
+ */
+typedef struct {
+    pthread_t thread;
+    thermostat_t **thermostats;
+    size_t count;
+    size_t first;
+    size_t stride;
+    long readings;
+    unsigned long sent;
+} bench_producer_t;
+
+static float bench_cold = 60, bench_hot = 80;
+
+static void *bench_produce(void *argument) {
+    bench_producer_t *producer = argument;
+    for (long reading = 0; reading < producer->readings; reading++) {
+        for (size_t i = producer->first; i < producer->count; i += producer->stride) {
+            statemachine_t *statemachine = &producer->thermostats[i]->statemachine;
+            // alternate so every reading moves the thermostat between HEAT and HEATING
+            float *temperature = (reading & 1) ? &bench_hot : &bench_cold;
+            for (;;) {
+                // this is the only producer for the thermostat so a change in dropped means this reading was dropped
+                unsigned long dropped = atomic_load_explicit(&statemachine->queue.dropped, memory_order_relaxed);
+                statemachine_dispatch(statemachine, THERMOSTAT_SET_TEMPERATURE, temperature);
+                if (atomic_load_explicit(&statemachine->queue.dropped, memory_order_relaxed) == dropped) break;
+                sched_yield();
+            }
+            producer->sent++;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Measure how many events per second a fleet of thermostats processes when run by an executor. One producer per worker
+ * dispatches readings to thermostats spread over every shard, so most events cross to another worker.
+ * @param workers
+ * @param count number of thermostats
+ * @param readings readings per thermostat
+ */
+static void bench_executor(unsigned int workers, size_t count, long readings) {
+    thermostat_t **thermostats = calloc(count, sizeof(thermostat_t *));
+    bench_producer_t *producers = calloc(workers, sizeof(bench_producer_t));
+    struct timespec settle = {0, 20000000};
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    for (size_t i = 0; i < count; i++) {
+        thermostats[i] = thermostat_create();
+        statemachine_dispatch(&thermostats[i]->statemachine, THERMOSTAT_SET_MODE_HEAT, NULL);
+    }
+    // let the minimum active time of heat mode pass so HEATING can be left
+    nanosleep(&settle, NULL);
+    statemachine_executor_t *executor = statemachine_executor_create(workers);
+    for (size_t i = 0; i < count; i++) {
+        statemachine_executor_add(executor, &thermostats[i]->statemachine);
+    }
+    statemachine_executor_flush(executor);
+    double start = now_ns();
+    for (unsigned int i = 0; i < workers; i++) {
+        producers[i] = (bench_producer_t) {.thermostats = thermostats, .count = count, .first = i, .stride = workers,
+                                           .readings = readings};
+        pthread_create(&producers[i].thread, NULL, bench_produce, &producers[i]);
+    }
+    unsigned long sent = 0;
+    for (unsigned int i = 0; i < workers; i++) {
+        pthread_join(producers[i].thread, NULL);
+        sent += producers[i].sent;
+    }
+    statemachine_executor_flush(executor);
+    double elapsed = now_ns() - start;
+    statemachine_executor_stats_t stats;
+    statemachine_executor_stats(executor, &stats);
+    bench_param_t params[] = {{"workers", workers}, {"thermostats", (long) count}};
+    bench_metric_t metrics[] = {{"events_per_s", (double) sent / (elapsed / 1e9)}, {"runs", (double) stats.runs},
+                                {"steals", (double) stats.steals}};
+    bench_report("executor", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+    for (size_t i = 0; i < count; i++) {
+        thermostat_destroy(thermostats[i]);
+    }
+    statemachine_executor_destroy(executor);
+    thermostat_logging = logging;
+    free(producers);
+    free(thermostats);
+}
+
+/**
+ * Compare statemachine_dispatch with statemachine_dispatch_batch delivering temperature readings to thermostats. The
+ * readings alternate between hot and cold so every one of them toggles HEATING.
+ * @param count number of thermostats
+ * @param run consecutive readings for the same thermostat in a batch
+ * @param readings readings per thermostat
+ */
+static void bench_dispatch_batch(size_t count, size_t run, long readings) {
+    thermostat_t **thermostats = calloc(count, sizeof(thermostat_t *));
+    size_t size = count * run;
+    statemachine_batch_entry_t *batch = calloc(size, sizeof(statemachine_batch_entry_t));
+    struct timespec settle = {0, 20000000};
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    for (size_t i = 0; i < count; i++) {
+        thermostats[i] = thermostat_create();
+        statemachine_dispatch(&thermostats[i]->statemachine, THERMOSTAT_SET_MODE_HEAT, NULL);
+    }
+    // let the minimum active time of heat mode pass so HEATING can be left
+    nanosleep(&settle, NULL);
+    for (size_t i = 0; i < size; i++) {
+        batch[i] = (statemachine_batch_entry_t) {.statemachine = &thermostats[i / run]->statemachine,
+                                                 .event = THERMOSTAT_SET_TEMPERATURE,
+                                                 .data = (i & 1) ? &bench_hot : &bench_cold};
+    }
+    long rounds = readings / (long) run;
+    double start = now_ns();
+    for (long round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < size; i++) {
+            statemachine_dispatch(batch[i].statemachine, batch[i].event, batch[i].data);
+        }
+    }
+    double single = (now_ns() - start) / ((double) rounds * (double) size);
+    start = now_ns();
+    for (long round = 0; round < rounds; round++) {
+        statemachine_dispatch_batch(batch, size);
+    }
+    double batched = (now_ns() - start) / ((double) rounds * (double) size);
+    bench_param_t params[] = {{"thermostats", (long) count}, {"run", (long) run}};
+    bench_metric_t metrics[] = {{"single_ns_per_event", single}, {"batch_ns_per_event", batched}};
+    bench_report("dispatch_batch", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+    for (size_t i = 0; i < count; i++) {
+        thermostat_destroy(thermostats[i]);
+    }
+    thermostat_logging = logging;
+    free(batch);
+    free(thermostats);
+}
+
+/**
+ * Measure streaming temperature readings from a file into a fleet of thermostats, parsing included. The readings go
+ * round the fleet alternating between hot and cold so every one of them toggles HEATING.
+ * @param count number of thermostats
+ * @param readings readings in the file
+ * @param binary write the file in the binary protocol instead of text
+ */
+static void bench_ingest(size_t count, size_t readings, char binary) {
+    char path[] = "/tmp/bench_ingest_XXXXXX";
+    int file = mkstemp(path);
+    if (file < 0) return;
+    FILE *stream = fdopen(file, "w");
+    if (binary) {
+        thermostat_ingest_header_t header = {THERMOSTAT_INGEST_MAGIC, THERMOSTAT_INGEST_VERSION,
+                                             sizeof(thermostat_reading_t)};
+        fwrite(&header, sizeof(header), 1, stream);
+    }
+    for (size_t i = 0; i < readings; i++) {
+        // a round of the fleet every reading apart
+        float temperature = (i / count) & 1 ? bench_hot : bench_cold;
+        if (binary) {
+            thermostat_reading_t reading = {(uint32_t) (i % count), temperature, i + 1};
+            fwrite(&reading, sizeof(reading), 1, stream);
+        } else {
+            fprintf(stream, "%zu %.2f %zu\n", i % count, temperature, i + 1);
+        }
+    }
+    fclose(stream);
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    thermostat_t **thermostats = calloc(count, sizeof(thermostat_t *));
+    for (size_t i = 0; i < count; i++) {
+        thermostats[i] = thermostat_create();
+        statemachine_dispatch(&thermostats[i]->statemachine, THERMOSTAT_SET_MODE_HEAT, NULL);
+    }
+    // let the minimum active time of heat mode pass so HEATING can be left
+    struct timespec settle = {0, 20000000};
+    nanosleep(&settle, NULL);
+    thermostat_ingest_t ingest;
+    file = open(path, O_RDONLY);
+    if (file >= 0 && thermostat_ingest_init(&ingest, thermostats, count) == 0) {
+        double start = now_ns();
+        int result = thermostat_ingest_fd(&ingest, file);
+        double elapsed = now_ns() - start;
+        if (result != 0 || ingest.stats.dispatched != readings) {
+            fprintf(stderr, "ingest: dispatched %lu of %zu readings\n", ingest.stats.dispatched, readings);
+        } else {
+            bench_param_t params[] = {{"thermostats", (long) count}, {"binary", binary}};
+            bench_metric_t metrics[] = {{"readings_per_s", (double) readings / (elapsed / 1e9)},
+                                        {"ns_per_reading", elapsed / (double) readings},
+                                        {"mb_per_s", (double) ingest.stats.bytes / 1e6 / (elapsed / 1e9)}};
+            bench_report("ingest", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+        }
+        thermostat_ingest_deinit(&ingest);
+    }
+    if (file >= 0) close(file);
+    unlink(path);
+    for (size_t i = 0; i < count; i++) {
+        thermostat_destroy(thermostats[i]);
+    }
+    free(thermostats);
+    thermostat_logging = logging;
+}
+
+/**
+ * A client of bench_control
+ */
+typedef struct {
+    const char *path;
+    size_t thermostats;
+    size_t requests;
+    size_t window; // requests sent before waiting for their responses
+    size_t answered;
+} bench_control_client_t;
+
+/**
+ * Send temperature readings to the control server a window at a time and count the responses
+ * @param argument the bench_control_client_t
+ * @return NULL
+ */
+static void *bench_control_client(void *argument) {
+    bench_control_client_t *client = argument;
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, client->path, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    char *requests = malloc(client->window * 32), responses[1 << 16];
+    for (size_t sent = 0; sent < client->requests;) {
+        size_t length = 0, count = 0;
+        for (; count < client->window && sent < client->requests; count++, sent++) {
+            length += (size_t) sprintf(requests + length, "%zu 3 %s\n", sent % client->thermostats,
+                                       (sent / client->thermostats) & 1 ? "80" : "60");
+        }
+        if (send(fd, requests, length, MSG_NOSIGNAL) != (ssize_t) length) break;
+        while (count > 0) {
+            ssize_t received = recv(fd, responses, sizeof(responses), 0);
+            if (received <= 0) break;
+            for (ssize_t i = 0; i < received; i++) {
+                if (responses[i] == '\n') {
+                    count--;
+                    client->answered++;
+                }
+            }
+        }
+        if (count > 0) break;
+    }
+    free(requests);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Measure requests answered per second by the control server with clients pipelining temperature readings to a fleet
+ * of thermostats
+ * @param clients connected at the same time
+ * @param count number of thermostats
+ * @param requests per client
+ */
+static void bench_control(size_t clients, size_t count, size_t requests) {
+    char path[] = "/tmp/bench_control_XXXXXX";
+    int file = mkstemp(path);
+    if (file < 0) return;
+    close(file);
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    thermostat_t **thermostats = calloc(count, sizeof(thermostat_t *));
+    for (size_t i = 0; i < count; i++) {
+        thermostats[i] = thermostat_create();
+        statemachine_dispatch(&thermostats[i]->statemachine, THERMOSTAT_SET_MODE_HEAT, NULL);
+    }
+    thermostat_control_t control;
+    if (thermostat_control_init(&control, thermostats, count) == 0 && thermostat_control_start(&control, path) == 0) {
+        pthread_t *threads = calloc(clients, sizeof(pthread_t));
+        bench_control_client_t *state = calloc(clients, sizeof(bench_control_client_t));
+        double start = now_ns();
+        for (size_t i = 0; i < clients; i++) {
+            state[i] = (bench_control_client_t) {path, count, requests, 64, 0};
+            pthread_create(&threads[i], NULL, bench_control_client, &state[i]);
+        }
+        size_t answered = 0;
+        for (size_t i = 0; i < clients; i++) {
+            pthread_join(threads[i], NULL);
+            answered += state[i].answered;
+        }
+        double elapsed = now_ns() - start;
+        thermostat_control_deinit(&control);
+        if (answered != clients * requests) {
+            fprintf(stderr, "control: answered %zu of %zu requests\n", answered, clients * requests);
+        } else {
+            bench_param_t params[] = {{"clients", (long) clients}, {"thermostats", (long) count}};
+            bench_metric_t metrics[] = {{"requests_per_s", (double) answered / (elapsed / 1e9)},
+                                        {"ns_per_request", elapsed / (double) answered}};
+            bench_report("control", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+        }
+        free(threads);
+        free(state);
+    }
+    unlink(path);
+    for (size_t i = 0; i < count; i++) {
+        thermostat_destroy(thermostats[i]);
+    }
+    free(thermostats);
+    thermostat_logging = logging;
+}
+
+/**
+ * Statemachine whose internal transitions check the payloads bench_payload sends it. Inline payloads carry an int and
+ * pooled ones a bench_payload_block_t, both numbered per producer.
+ */
+#define BENCH_PAYLOAD_PRODUCERS 8
+#define BENCH_PAYLOAD_FILL 40
+
+typedef struct {
+    uint32_t producer;
+    uint32_t sequence;
+    unsigned char fill[BENCH_PAYLOAD_FILL]; // every byte derived from the producer and sequence
+} bench_payload_block_t;
+
+typedef struct {
+    statemachine_t statemachine;
+    uint32_t last[BENCH_PAYLOAD_PRODUCERS]; // sequence of the last payload received from each producer
+    unsigned long received;
+    unsigned long corrupted; // payloads that weren't what was sent or came out of order
+} bench_payload_target_t;
+
+static void bench_payload_receive(bench_payload_target_t *target, uint32_t producer, uint32_t sequence) {
+    if (producer >= BENCH_PAYLOAD_PRODUCERS || sequence <= target->last[producer]) {
+        target->corrupted++;
+        return;
+    }
+    target->last[producer] = sequence;
+    target->received++;
+}
+
+static void bench_payload_inline(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    (void) (transition);
+    uint32_t value = (uint32_t) statemachine_trigger_int(trigger);
+    bench_payload_receive((bench_payload_target_t *) statemachine, value >> 24, value & 0xffffff);
+}
+
+static void bench_payload_pooled(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    (void) (transition);
+    const bench_payload_block_t *block = statemachine_trigger_payload(trigger);
+    bench_payload_target_t *target = (bench_payload_target_t *) statemachine;
+    for (int i = 0; i < BENCH_PAYLOAD_FILL; i++) {
+        if (block->fill[i] != (unsigned char) (block->sequence * 31 + block->producer + (uint32_t) i)) {
+            target->corrupted++;
+            return;
+        }
+    }
+    bench_payload_receive(target, block->producer, block->sequence);
+}
+
+static state_t bench_payload_states[] = {
+        {.id = 2},
+        NULL_ELEMENT
+};
+
+static transition_t bench_payload_transitions[] = {
+        {
+                .source = 2,
+                .trigger.event = BENCH_EVENT_A,
+                .effect = bench_payload_inline
+        },
+        {
+                .source = 2,
+                .trigger.event = BENCH_EVENT_B,
+                .effect = bench_payload_pooled
+        },
+        NULL_ELEMENT
+};
+
+typedef struct {
+    bench_payload_target_t *targets;
+    size_t count;
+    uint32_t producer;
+    uint32_t rounds;
+    unsigned long sent;
+} bench_payload_producer_t;
+
+/**
+ * Send numbered payloads round the statemachines, one inline, one pooled and a batch mixing both in turn
+ */
+static void *bench_payload_produce(void *argument) {
+    bench_payload_producer_t *producer = argument;
+    bench_payload_block_t block = {.producer = producer->producer};
+    statemachine_batch_entry_t batch[4];
+    for (uint32_t round = 0; round < producer->rounds; round++) {
+        for (size_t i = 0; i < producer->count; i++) {
+            statemachine_t *statemachine = &producer->targets[i].statemachine;
+            // sequences start at 1 and each round numbers 6 payloads
+            uint32_t sequence = round * 6 + 1;
+            statemachine_dispatch_int(statemachine, BENCH_EVENT_A, (int) (producer->producer << 24 | sequence));
+            block.sequence = sequence + 1;
+            for (int j = 0; j < BENCH_PAYLOAD_FILL; j++) {
+                block.fill[j] = (unsigned char) (block.sequence * 31 + block.producer + (uint32_t) j);
+            }
+            statemachine_dispatch_payload(statemachine, BENCH_EVENT_B, &block, sizeof(block));
+            for (size_t j = 0; j < BENCH_LENGTH(batch); j++) {
+                batch[j] = (statemachine_batch_entry_t) {.statemachine = statemachine, .event = BENCH_EVENT_A};
+                batch[j].size = sizeof(int);
+                batch[j].payload.i = (int) (producer->producer << 24 | (sequence + 2 + (uint32_t) j));
+            }
+            // the batch copies pooled payloads before returning so the block can be refilled
+            block.sequence = sequence + 4;
+            for (int j = 0; j < BENCH_PAYLOAD_FILL; j++) {
+                block.fill[j] = (unsigned char) (block.sequence * 31 + block.producer + (uint32_t) j);
+            }
+            batch[2] = (statemachine_batch_entry_t) {.statemachine = statemachine, .event = BENCH_EVENT_B,
+                                                    .data = &block, .size = sizeof(block)};
+            statemachine_dispatch_batch(batch, BENCH_LENGTH(batch));
+            producer->sent += 2 + BENCH_LENGTH(batch);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Stress inline and pooled payloads with producers dispatching concurrently to the same statemachines, whichever of
+ * them claims a statemachine processes it, and check every payload arrives intact and in the order its producer sent
+ * it, or is counted as dropped, and that every pool block is given back
+ * @param producers at most BENCH_PAYLOAD_PRODUCERS
+ * @param count number of statemachines
+ * @param rounds of payloads each producer sends each statemachine
+ * @return 0 if nothing was lost or corrupted
+ */
+static int bench_payload(uint32_t producers, size_t count, uint32_t rounds) {
+    statemachine_model_t model = {.root = {.id = 1, .substates = bench_payload_states, .initial.target = 2},
+                                  .transitions = bench_payload_transitions};
+    bench_payload_target_t *targets = calloc(count, sizeof(bench_payload_target_t));
+    bench_payload_producer_t *state = calloc(producers, sizeof(bench_payload_producer_t));
+    pthread_t *threads = calloc(producers, sizeof(pthread_t));
+    for (size_t i = 0; i < count; i++) {
+        statemachine_init(&targets[i].statemachine, &model);
+    }
+    double start = now_ns();
+    for (uint32_t i = 0; i < producers; i++) {
+        state[i] = (bench_payload_producer_t) {targets, count, i, rounds, 0};
+        pthread_create(&threads[i], NULL, bench_payload_produce, &state[i]);
+    }
+    unsigned long sent = 0, received = 0, corrupted = 0, dropped = 0, leaked = 0;
+    for (uint32_t i = 0; i < producers; i++) {
+        pthread_join(threads[i], NULL);
+        sent += state[i].sent;
+    }
+    for (size_t i = 0; i < count; i++) {
+        statemachine_queue_stats_t stats;
+        statemachine_flush(&targets[i].statemachine);
+        statemachine_queue_stats(&targets[i].statemachine, &stats);
+        received += targets[i].received;
+        corrupted += targets[i].corrupted;
+        dropped += stats.dropped;
+        // every block taken must have been given back once its event was processed or dropped
+        statemachine_pool_t *pool = atomic_load(&targets[i].statemachine.pool);
+        if (pool != NULL) leaked += (unsigned long) (STATEMACHINE_POOL_BLOCKS - __builtin_popcountll(pool->free));
+    }
+    double elapsed = now_ns() - start;
+    int result = 0;
+    if (corrupted != 0 || leaked != 0 || received + dropped != sent) {
+        fprintf(stderr, "payload: sent %lu, received %lu, dropped %lu, corrupted %lu, blocks leaked %lu\n", sent,
+                received, dropped, corrupted, leaked);
+        result = -1;
+    } else {
+        bench_param_t params[] = {{"producers", producers}, {"statemachines", (long) count}};
+        bench_metric_t metrics[] = {{"events_per_s", (double) received / (elapsed / 1e9)},
+                                    {"dropped", (double) dropped}};
+        bench_report("payload", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+    }
+    for (size_t i = 0; i < count; i++) {
+        statemachine_deinit(&targets[i].statemachine);
+    }
+    statemachine_release(&model);
+    free(threads);
+    free(state);
+    free(targets);
+    return result;
+}
+
+/**
+ * Measure dispatching a repeating sequence of events to a statemachine. A first pass times the whole sequence for the
+ * throughput, a second times every dispatch on its own for the latency distribution, which includes the cost of
+ * reading the clock.
+ * @param name
+ * @param statemachine an initialized statemachine
+ * @param events
+ * @param data attached to the event at the same position
+ * @param count number of events in the sequence
+ * @param iterations events dispatched per pass
+ * @param params
+ * @param param_count
+ */
+static void bench_dispatch(const char *name, statemachine_t *statemachine, const event_t *events, void *const *data,
+                           size_t count, size_t iterations, const bench_param_t *params, size_t param_count) {
+    double *latency = calloc(iterations, sizeof(double));
+    unsigned long transitions = 0;
+    double start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        if (statemachine_dispatch(statemachine, events[i % count], data[i % count]) != NULL) transitions++;
+    }
+    double elapsed = now_ns() - start;
+    for (size_t i = 0; i < iterations; i++) {
+        double sent = now_ns();
+        statemachine_dispatch(statemachine, events[i % count], data[i % count]);
+        latency[i] = now_ns() - sent;
+    }
+    qsort(latency, iterations, sizeof(double), bench_compare);
+    bench_metric_t metrics[] = {{"ns_per_event", elapsed / (double) iterations},
+                                {"transitions_per_s", (double) transitions / (elapsed / 1e9)},
+                                {"p50_ns", bench_percentile(latency, iterations, 0.5)},
+                                {"p99_ns", bench_percentile(latency, iterations, 0.99)},
+                                {"p999_ns", bench_percentile(latency, iterations, 0.999)}};
+    bench_report(name, params, param_count, metrics, BENCH_LENGTH(metrics));
+    free(latency);
+}
+
+/**
+ * Measure statemachine_step, statemachine_get_active_state and statemachine_is_in on a statemachine that has nothing
+ * left to do, which is what a loop polling a statemachine pays on every pass
+ * @param name
+ * @param statemachine an initialized statemachine
+ * @param iterations
+ * @param params
+ * @param param_count
+ */
+static void bench_poll(const char *name, statemachine_t *statemachine, long iterations, const bench_param_t *params,
+                       size_t param_count) {
+    volatile short id = 0;
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        statemachine_step(statemachine);
+    }
+    double step = (now_ns() - start) / (double) iterations;
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        id = statemachine_get_active_state(statemachine)->id;
+    }
+    double active = (now_ns() - start) / (double) iterations;
+    volatile char in = 0;
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        in = statemachine_is_in(statemachine, id);
+    }
+    double is_in = (now_ns() - start) / (double) iterations;
+    (void) (in);
+    bench_metric_t metrics[] = {{"step_ns", step}, {"get_active_state_ns", active}, {"is_in_ns", is_in}};
+    bench_report(name, params, param_count, metrics, BENCH_LENGTH(metrics));
+}
+
+/**
+ * Measure statemachine_init and statemachine_deinit of an instance of a compiled model
+ * @param name
+ * @param model
+ * @param iterations
+ * @param params
+ * @param param_count
+ */
+static void bench_init(const char *name, statemachine_model_t *model, long iterations, const bench_param_t *params,
+                       size_t param_count) {
+    statemachine_t *statemachine = calloc(1, sizeof(statemachine_t));
+    double init = 0, deinit = 0;
+    for (long i = 0; i < iterations; i++) {
+        memset(statemachine, 0, sizeof(statemachine_t));
+        double start = now_ns();
+        statemachine_init(statemachine, model);
+        double initialized = now_ns();
+        statemachine_deinit(statemachine);
+        init += initialized - start;
+        deinit += now_ns() - initialized;
+    }
+    bench_metric_t metrics[] = {{"init_ns", init / (double) iterations}, {"deinit_ns", deinit / (double) iterations}};
+    bench_report(name, params, param_count, metrics, BENCH_LENGTH(metrics));
+    free(statemachine);
+}
+
+/**
+ * Run the init, dispatch and poll benchmarks on the synthetic charts
+ * @param iterations events dispatched per pass
+ */
+static void bench_charts(size_t iterations) {
+    const int depths[] = {1, 4, 16, 64}, widths[] = {2, 16, 256, 4096};
+    const event_t deep_events[] = {BENCH_EVENT_A, BENCH_EVENT_B}, wide_events[] = {BENCH_EVENT_A};
+    void *const data[] = {NULL, NULL};
+    for (size_t i = 0; i < BENCH_LENGTH(depths) + BENCH_LENGTH(widths); i++) {
+        bench_chart_t chart;
+        char deep = i < BENCH_LENGTH(depths);
+        if (deep) {
+            bench_deep_chart(&chart, depths[i], 0);
+        } else {
+            bench_wide_chart(&chart, widths[i - BENCH_LENGTH(depths)]);
+        }
+        if (statemachine_init(&chart.statemachine, &chart.model) == NULL) {
+            fprintf(stderr, "failed to initialize chart\n");
+            exit(1);
+        }
+        bench_param_t params[] = {{deep ? "depth" : "width", deep ? depths[i] : widths[i - BENCH_LENGTH(depths)]},
+                                  {"states", (long) chart.model.table->state_count}};
+        bench_init(deep ? "init_deep" : "init_wide", &chart.model, 20000, params, BENCH_LENGTH(params));
+        bench_dispatch(deep ? "dispatch_deep" : "dispatch_wide", &chart.statemachine, deep ? deep_events : wide_events,
+                       data, deep ? 2 : 1, iterations, params, BENCH_LENGTH(params));
+        bench_poll(deep ? "poll_deep" : "poll_wide", &chart.statemachine, 1000000, params, BENCH_LENGTH(params));
+        bench_free_chart(&chart);
+    }
+}
+
+/**
+ * Run the init, dispatch and poll benchmarks on the thermostat chart. The thermostat heats and idles as readings
+ * alternate below and above its setpoint once heat mode has been on for its minimum active time.
+ * @param iterations events dispatched per pass
+ */
+static void bench_thermostat(size_t iterations) {
+    const event_t events[] = {THERMOSTAT_SET_TEMPERATURE, THERMOSTAT_SET_TEMPERATURE};
+    void *const data[] = {&bench_cold, &bench_hot};
+    struct timespec settle = {0, 20000000};
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    double start = now_ns();
+    for (long i = 0; i < 20000; i++) {
+        thermostat_destroy(thermostat_create());
+    }
+    bench_metric_t metrics[] = {{"create_destroy_ns", (now_ns() - start) / 20000}};
+    bench_report("init_thermostat", NULL, 0, metrics, BENCH_LENGTH(metrics));
+    thermostat_t *thermostat = thermostat_create();
+    statemachine_dispatch(&thermostat->statemachine, THERMOSTAT_SET_MODE_HEAT, NULL);
+    // let the minimum active time of heat mode pass so HEATING can be left
+    nanosleep(&settle, NULL);
+    bench_dispatch("dispatch_thermostat", &thermostat->statemachine, events, data, 2, iterations, NULL, 0);
+    bench_poll("poll_thermostat", &thermostat->statemachine, 1000000, NULL, 0);
+    thermostat_destroy(thermostat);
+    thermostat_logging = logging;
+}
+
+/**
+ * Measure what tracing adds to dispatching on the thermostat chart, written to /dev/null so only the cost of recording
+ * and draining is measured
+ * @param iterations events dispatched per pass
+ */
+static void bench_trace(size_t iterations) {
+    const event_t events[] = {THERMOSTAT_SET_TEMPERATURE, THERMOSTAT_SET_TEMPERATURE};
+    void *const data[] = {&bench_cold, &bench_hot};
+    struct timespec settle = {0, 20000000};
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    thermostat_t *thermostat = thermostat_create();
+    statemachine_dispatch(&thermostat->statemachine, THERMOSTAT_SET_MODE_HEAT, NULL);
+    // let the minimum active time of heat mode pass so HEATING can be left
+    nanosleep(&settle, NULL);
+    bench_param_t off[] = {{"tracing", 0}};
+    bench_dispatch("trace", &thermostat->statemachine, events, data, 2, iterations, off, BENCH_LENGTH(off));
+    if (statemachine_trace_start("/dev/null") == 0) {
+        statemachine_trace_stats_t stats;
+        bench_param_t on[] = {{"tracing", 1}};
+        bench_dispatch("trace", &thermostat->statemachine, events, data, 2, iterations, on, BENCH_LENGTH(on));
+        statemachine_trace_stop();
+        statemachine_trace_stats(&stats);
+        bench_metric_t metrics[] = {{"written", (double) stats.written}, {"dropped", (double) stats.dropped}};
+        bench_report("trace_records", NULL, 0, metrics, BENCH_LENGTH(metrics));
+    }
+    thermostat_destroy(thermostat);
+    thermostat_logging = logging;
+}
+
+/**
+ * Measure what collecting metrics adds to dispatching on the thermostat chart
+ * @param iterations events dispatched per pass
+ */
+static void bench_metrics(size_t iterations) {
+    const event_t events[] = {THERMOSTAT_SET_TEMPERATURE, THERMOSTAT_SET_TEMPERATURE};
+    void *const data[] = {&bench_cold, &bench_hot};
+    struct timespec settle = {0, 20000000};
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    thermostat_t *thermostat = thermostat_create();
+    statemachine_dispatch(&thermostat->statemachine, THERMOSTAT_SET_MODE_HEAT, NULL);
+    // let the minimum active time of heat mode pass so HEATING can be left
+    nanosleep(&settle, NULL);
+    for (char enabled = 0; enabled <= 1; enabled++) {
+        bench_param_t params[] = {{"enabled", enabled}};
+        statemachine_metrics_enable(enabled);
+        bench_dispatch("metrics", &thermostat->statemachine, events, data, 2, iterations, params, BENCH_LENGTH(params));
+    }
+    statemachine_metrics_enable(0);
+    statemachine_metrics_reset(&thermostat_model);
+    thermostat_destroy(thermostat);
+    thermostat_logging = logging;
+}
+
+/**
+ * Measure saving a fleet of thermostats to a snapshot file and restoring it, the thermostats are spread over every
+ * state and half of them have a minimum active time running
+ * @param count number of thermostats
+ */
+static void bench_snapshot(size_t count) {
+    const event_t modes[] = {THERMOSTAT_SET_MODE_OFF, THERMOSTAT_SET_MODE_HEAT, THERMOSTAT_SET_MODE_COOL};
+    char path[] = "/tmp/bench_snapshot_XXXXXX";
+    int file = mkstemp(path);
+    if (file < 0) return;
+    close(file);
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    thermostat_t **thermostats = calloc(count, sizeof(thermostat_t *));
+    for (size_t i = 0; i < count; i++) {
+        thermostats[i] = thermostat_create();
+        statemachine_dispatch(&thermostats[i]->statemachine, modes[i % BENCH_LENGTH(modes)], NULL);
+        statemachine_dispatch(&thermostats[i]->statemachine, THERMOSTAT_SET_TEMPERATURE,
+                              i % 2 ? &bench_cold : &bench_hot);
+    }
+    double start = now_ns();
+    int saved = thermostat_fleet_save(path, thermostats, count);
+    double save = now_ns() - start;
+    struct stat status;
+    stat(path, &status);
+    for (size_t i = 0; i < count; i++) {
+        thermostat_destroy(thermostats[i]);
+    }
+    free(thermostats);
+    size_t restored = 0;
+    start = now_ns();
+    thermostats = saved == 0 ? thermostat_fleet_restore(path, &restored) : NULL;
+    double restore = now_ns() - start;
+    for (size_t i = 0; thermostats != NULL && i < restored; i++) {
+        thermostat_destroy(thermostats[i]);
+    }
+    free(thermostats);
+    unlink(path);
+    thermostat_logging = logging;
+    if (restored != count) {
+        fprintf(stderr, "snapshot: restored %zu of %zu thermostats\n", restored, count);
+        return;
+    }
+    bench_param_t params[] = {{"instances", (long) count}};
+    bench_metric_t metrics[] = {{"save_ms", save / 1e6}, {"restore_ms", restore / 1e6},
+                                {"file_bytes_per_instance", (double) status.st_size / (double) count},
+                                {"restore_ns_per_instance", restore / (double) count}};
+    bench_report("snapshot", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+}
+
+/**
+ * Completion transition of a fresh statemachine whose guard reads an input only statemachine_changed reports
+ */
+static int bench_ready;
+
+static int bench_is_ready(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    (void) (statemachine);
+    (void) (transition);
+    (void) (trigger);
+    return bench_ready;
+}
+
+static state_t bench_ready_states[] = {
+        {.id = 2},
+        {.id = 3},
+        NULL_ELEMENT
+};
+
+static transition_t bench_ready_transitions[] = {
+        {
+                .source = 2,
+                .target = 3,
+                .guard = bench_is_ready,
+                .depends = 1
+        },
+        NULL_ELEMENT
+};
+
+/**
+ * Check statemachine_changed takes a completion transition its change enabled on a statemachine that has only been
+ * initialized, whose inputs are all marked changed without an event on its way to evaluate them
+ * @return 0 if it does
+ */
+static int bench_changed_fresh() {
+    statemachine_model_t model = {.root = {.id = 1, .substates = bench_ready_states, .initial.target = 2},
+                                  .transitions = bench_ready_transitions};
+    statemachine_t statemachine = {0};
+    bench_ready = 0;
+    statemachine_init(&statemachine, &model);
+    bench_ready = 1;
+    state_t *settled = statemachine_changed(&statemachine, 1);
+    int taken = settled != NULL && settled->id == 3 && statemachine_is_in(&statemachine, 3);
+    statemachine_deinit(&statemachine);
+    statemachine_release(&model);
+    if (!taken) {
+        fprintf(stderr, "completions: statemachine_changed didn't take the transition it enabled after init\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Measure polling a fleet of idle thermostats whose completion transitions only need evaluating when their inputs
+ * change, once with nothing changing between steps and once with every input changed before each step like it was
+ * before guards declared what they read
+ * @param count number of thermostats
+ * @param passes steps of every thermostat
+ */
+static void bench_completions(size_t count, long passes) {
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    thermostat_t **thermostats = calloc(count, sizeof(thermostat_t *));
+    for (size_t i = 0; i < count; i++) {
+        thermostats[i] = thermostat_create();
+        statemachine_dispatch(&thermostats[i]->statemachine, THERMOSTAT_SET_MODE_HEAT, NULL);
+        // warm enough that heat mode stays idle
+        statemachine_dispatch(&thermostats[i]->statemachine, THERMOSTAT_SET_TEMPERATURE, &bench_hot);
+    }
+    for (char changed = 0; changed <= 1; changed++) {
+        double start = now_ns();
+        for (long pass = 0; pass < passes; pass++) {
+            for (size_t i = 0; i < count; i++) {
+                if (changed) statemachine_changed(&thermostats[i]->statemachine, STATEMACHINE_INPUTS_ALL);
+                statemachine_step(&thermostats[i]->statemachine);
+            }
+        }
+        double elapsed = now_ns() - start;
+        // count the guards one more pass evaluates
+        statemachine_metrics_reset(&thermostat_model);
+        statemachine_metrics_enable(1);
+        for (size_t i = 0; i < count; i++) {
+            if (changed) statemachine_changed(&thermostats[i]->statemachine, STATEMACHINE_INPUTS_ALL);
+            statemachine_step(&thermostats[i]->statemachine);
+        }
+        statemachine_metrics_enable(0);
+        unsigned long guards = atomic_load_explicit(&thermostat_model.table->metrics->guard.count,
+                                                    memory_order_relaxed);
+        bench_param_t params[] = {{"instances", (long) count}, {"changed", changed}};
+        bench_metric_t metrics[] = {{"ns_per_step", elapsed / ((double) passes * (double) count)},
+                                    {"guards_per_step", (double) guards / (double) count}};
+        bench_report("completions", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+    }
+    statemachine_metrics_reset(&thermostat_model);
+    for (size_t i = 0; i < count; i++) {
+        thermostat_destroy(thermostats[i]);
+    }
+    free(thermostats);
+    thermostat_logging = logging;
+}
+
+/**
+ * Compare where a thermostat interpreting the chart and one running the generated dispatcher end up
+ * @param interpreted
+ * @param generated
+ * @param a what dispatching to the interpreted thermostat returned
+ * @param b what dispatching to the generated thermostat returned
+ * @return 0 if they agree
+ */
+static int bench_codegen_compare(thermostat_t *interpreted, thermostat_t *generated, state_t *a, state_t *b) {
+    state_t *x = statemachine_get_active_state(&interpreted->statemachine);
+    state_t *y = statemachine_get_active_state(&generated->statemachine);
+    if ((a == NULL) != (b == NULL) || (a != NULL && a->id != b->id) || (x == NULL) != (y == NULL) ||
+        (x != NULL && x->id != y->id) || interpreted->current_temperature != generated->current_temperature) {
+        return -1;
+    }
+    return memcmp(interpreted->modes, generated->modes, sizeof(interpreted->modes));
+}
+
+/**
+ * Dispatch the same random events to a thermostat interpreting the chart and one running the generated dispatcher,
+ * with and without metrics, and check they take the same transitions. Time events are replaced by setting what they
+ * set at random steps so both run the same sequence.
+ * @param steps
+ * @return 0 if the dispatcher behaves like the interpreter
+ */
+static int bench_codegen_check(size_t steps) {
+    static float temperatures[] = {60, 68, 72, 76, 80};
+    const event_t events[] = {THERMOSTAT_SET_MODE_OFF, THERMOSTAT_SET_MODE_HEAT, THERMOSTAT_SET_MODE_COOL,
+                              THERMOSTAT_SET_TEMPERATURE, THERMOSTAT_SET_TEMPERATURE, THERMOSTAT_SET_TEMPERATURE,
+                              THERMOSTAT_SET_HEAT_SETPOINT, THERMOSTAT_SET_COOL_SETPOINT,
+                              THERMOSTAT_SET_MIN_ACTIVE_TIME};
+    thermostat_t *thermostats[2] = {thermostat_create(), thermostat_create()};
+    unsigned long random = 88172645463325252UL;
+    int result = 0;
+    for (int i = 0; i < 2; i++) {
+        for (int mode = 0; mode < THERMOSTAT_MODE_COUNT; mode++) {
+            // long enough for no time event to fire while checking
+            thermostats[i]->modes[mode].minimum_active_time = 3600;
+        }
+    }
+    for (size_t step = 0; step < steps && result == 0; step++) {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        statemachine_metrics_enable(step >= steps / 2);
+        char elapsed = random % 8 == 0;
+        event_t event = events[(random >> 8) % BENCH_LENGTH(events)];
+        void *data = &temperatures[(random >> 16) % BENCH_LENGTH(temperatures)];
+        state_t *settled[2];
+        for (int i = 0; i < 2; i++) {
+            thermostat_model.dispatcher = i ? thermostat_dispatch : NULL;
+            if (elapsed) {
+                thermostats[i]->mode.current->minimum_active_time_elapsed = 1;
+                statemachine_changed(&thermostats[i]->statemachine, THERMOSTAT_INPUT_ACTIVE_TIME);
+            }
+            settled[i] = statemachine_dispatch(&thermostats[i]->statemachine, event, data);
+        }
+        state_t *a = settled[0], *b = settled[1];
+        if (bench_codegen_compare(thermostats[0], thermostats[1], a, b) != 0) {
+            fprintf(stderr, "generated dispatcher diverged from the interpreter at step %zu on event %c\n", step,
+                    event);
+            result = -1;
+        }
+    }
+    statemachine_metrics_enable(0);
+    statemachine_metrics_reset(&thermostat_model);
+    for (int i = 0; i < 2; i++) {
+        thermostat_model.dispatcher = i ? thermostat_dispatch : NULL;
+        statemachine_dispatch(&thermostats[i]->statemachine, THERMOSTAT_POWER_OFF, NULL);
+    }
+    if (result == 0 && (statemachine_is_active(&thermostats[0]->statemachine) ||
+                        statemachine_is_active(&thermostats[1]->statemachine))) {
+        fprintf(stderr, "generated dispatcher diverged from the interpreter powering off\n");
+        result = -1;
+    }
+    thermostat_model.dispatcher = NULL;
+    thermostat_destroy(thermostats[0]);
+    thermostat_destroy(thermostats[1]);
+    return result;
+}
+
+/**
+ * Measure dispatching on the thermostat chart through the interpreter and through the dispatcher generated from it,
+ * after checking the dispatcher behaves the same
+ * @param iterations events dispatched per pass
+ * @return 0 if the dispatcher passed the check
+ */
+static int bench_codegen(size_t iterations) {
+    const event_t events[] = {THERMOSTAT_SET_TEMPERATURE, THERMOSTAT_SET_TEMPERATURE};
+    void *const data[] = {&bench_cold, &bench_hot};
+    struct timespec settle = {0, 20000000};
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    if (thermostat_dispatch_install(&thermostat_model) != 0 || bench_codegen_check(100000) != 0) {
+        thermostat_logging = logging;
+        return -1;
+    }
+    thermostat_t *thermostat = thermostat_create();
+    statemachine_dispatch(&thermostat->statemachine, THERMOSTAT_SET_MODE_HEAT, NULL);
+    // let the minimum active time of heat mode pass so HEATING can be left
+    nanosleep(&settle, NULL);
+    for (char generated = 0; generated <= 1; generated++) {
+        bench_param_t params[] = {{"generated", generated}};
+        thermostat_model.dispatcher = generated ? thermostat_dispatch : NULL;
+        bench_dispatch("codegen", &thermostat->statemachine, events, data, 2, iterations, params,
+                       BENCH_LENGTH(params));
+    }
+    thermostat_model.dispatcher = NULL;
+    thermostat_destroy(thermostat);
+    thermostat_logging = logging;
+    return 0;
+}
+
+/**
+ * Give the thermostat journaled by bench_journal a fresh thermostat to replay it
+ * @param id
+ * @param context where the thermostat is kept, created on the first call
+ * @return
+ */
+static statemachine_t *bench_journal_resolve(uint32_t id, void *context) {
+    (void) (id);
+    thermostat_t **thermostat = context;
+    if (*thermostat == NULL) *thermostat = thermostat_create();
+    return *thermostat != NULL ? &(*thermostat)->statemachine : NULL;
+}
+
+/**
+ * A thread reading a thermostat while another one drives it
+ */
+typedef struct {
+    thermostat_t *thermostat;
+    pthread_mutex_t *lock; // taken around every event and read for the baseline, NULL to read the published view
+    atomic_int *done;
+    unsigned long reads;
+    unsigned long torn; // reads whose temperature doesn't match the state it was read with
+} bench_view_reader_t;
+
+/**
+ * Read the thermostat until the writer is done, checking it is HEATING exactly when its temperature is the cold one
+ */
+static void *bench_view_read(void *argument) {
+    bench_view_reader_t *reader = argument;
+    while (!atomic_load_explicit(reader->done, memory_order_relaxed)) {
+        float temperature;
+        short state;
+        if (reader->lock != NULL) {
+            pthread_mutex_lock(reader->lock);
+            temperature = reader->thermostat->current_temperature;
+            state = statemachine_get_active_state(&reader->thermostat->statemachine)->id;
+            pthread_mutex_unlock(reader->lock);
+        } else {
+            thermostat_view_t view;
+            thermostat_view(reader->thermostat, &view);
+            temperature = view.temperature;
+            state = view.state;
+        }
+        if ((temperature < (bench_cold + bench_hot) / 2) != (state == THERMOSTAT_HEATING)) reader->torn++;
+        reader->reads++;
+    }
+    return NULL;
+}
+
+/**
+ * Measure readers of a thermostat contending with the thread driving it between HEAT and HEATING, reading the published
+ * view or, as the baseline, taking a mutex the writer holds around every event
+ * @param readers threads, at most 8
+ * @param locked whether to read under the mutex instead of the view
+ * @param iterations events dispatched
+ * @return 0 if no reader saw a temperature with the state of another event
+ */
+static int bench_view(unsigned int readers, char locked, size_t iterations) {
+    const float temperatures[] = {bench_cold, bench_hot};
+    struct timespec settle = {0, 20000000};
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    atomic_int done = 0;
+    bench_view_reader_t state[8] = {0};
+    pthread_t threads[8];
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    thermostat_t *thermostat = thermostat_create();
+    statemachine_dispatch(&thermostat->statemachine, THERMOSTAT_SET_MODE_HEAT, NULL);
+    // let the minimum active time of the heat mode elapse so HEATING follows every reading
+    nanosleep(&settle, NULL);
+    statemachine_dispatch_float(&thermostat->statemachine, THERMOSTAT_SET_TEMPERATURE, bench_cold);
+    unsigned int started;
+    for (started = 0; started < readers && started < BENCH_LENGTH(threads); started++) {
+        state[started] = (bench_view_reader_t) {.thermostat = thermostat, .lock = locked ? &lock : NULL, .done = &done};
+        if (pthread_create(&threads[started], NULL, bench_view_read, &state[started]) != 0) break;
+    }
+    double start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+        if (locked) pthread_mutex_lock(&lock);
+        statemachine_dispatch_float(&thermostat->statemachine, THERMOSTAT_SET_TEMPERATURE, temperatures[i & 1]);
+        if (locked) pthread_mutex_unlock(&lock);
+    }
+    double elapsed = now_ns() - start;
+    atomic_store(&done, 1);
+    unsigned long reads = 0, torn = 0;
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        reads += state[i].reads;
+        torn += state[i].torn;
+    }
+    thermostat_destroy(thermostat);
+    thermostat_logging = logging;
+    if (torn != 0) {
+        fprintf(stderr, "view: %lu of %lu reads by %u readers were torn\n", torn, reads, started);
+        return -1;
+    }
+    bench_param_t params[] = {{"readers", started}, {"locked", locked}};
+    bench_metric_t metrics[] = {{"events_per_s", (double) iterations / (elapsed / 1e9)},
+                                {"reads_per_s", (double) reads / (elapsed / 1e9)}};
+    bench_report("view", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+    return 0;
+}
+
+/**
+ * Count the thermostats of a fleet in a state by looking at each of them
+ * @param thermostats
+ * @param count
+ * @param id of the state
+ * @return thermostats in the state or one of its substates
+ */
+static size_t bench_index_scan(thermostat_t **thermostats, size_t count, short id) {
+    size_t members = 0;
+    for (size_t i = 0; i < count; i++) {
+        members += (size_t) statemachine_is_in(&thermostats[i]->statemachine, id);
+    }
+    return members;
+}
+
+/**
+ * Check the index agrees with every thermostat on every state of the chart
+ * @param index
+ * @param thermostats
+ * @param count
+ * @return 0 if it does, -1 if a count differs
+ */
+static int bench_index_check(statemachine_index_t *index, thermostat_t **thermostats, size_t count) {
+    for (short id = THERMOSTAT_POWERED_ON; id <= THERMOSTAT_COOLING; id++) {
+        size_t scanned = bench_index_scan(thermostats, count, id), indexed = statemachine_index_count(index, id);
+        if (scanned != indexed) {
+            fprintf(stderr, "index: %zu thermostats in state %d, the index counts %zu\n", scanned, id, indexed);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Compare answering "how many thermostats are cooling" and "which heating thermostats are still below their setpoint"
+ * by looking at every thermostat against the index, and check the index stays in step as the fleet changes states
+ * @param count thermostats
+ * @param stride between the positions of the thermostats, the index has count * stride positions
+ * @param queries of each kind
+ * @return 0 on success, -1 if the index and the thermostats disagree
+ */
+static int bench_index(size_t count, size_t stride, size_t queries) {
+    thermostat_t **thermostats = calloc(count, sizeof(thermostat_t *));
+    statemachine_index_t index;
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    if (thermostats == NULL || statemachine_index_init(&index, &thermostat_model, count * stride) != 0) {
+        fprintf(stderr, "index: couldn't create an index of %zu positions\n", count * stride);
+        exit(1);
+    }
+    unsigned long long random = 1;
+    for (size_t i = 0; i < count; i++) {
+        thermostats[i] = thermostat_create();
+        if (thermostats[i] == NULL || statemachine_index_add(&index, &thermostats[i]->statemachine, i * stride) != 0) {
+            fprintf(stderr, "index: couldn't add thermostat %zu\n", i);
+            exit(1);
+        }
+        random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+        statemachine_dispatch(&thermostats[i]->statemachine, (random >> 33) % 3 == 0 ? THERMOSTAT_SET_MODE_OFF :
+                              (random >> 33) % 3 == 1 ? THERMOSTAT_SET_MODE_HEAT : THERMOSTAT_SET_MODE_COOL, NULL);
+        statemachine_dispatch_float(&thermostats[i]->statemachine, THERMOSTAT_SET_TEMPERATURE,
+                                    (random >> 40) & 1 ? bench_cold : bench_hot);
+    }
+    int status = bench_index_check(&index, thermostats, count);
+    size_t scanned = 0, indexed = 0, below = 0;
+    double start = now_ns();
+    for (size_t q = 0; q < queries; q++) {
+        scanned += bench_index_scan(thermostats, count, THERMOSTAT_COOLING);
+    }
+    double scan = now_ns() - start;
+    start = now_ns();
+    for (size_t q = 0; q < queries; q++) {
+        indexed += statemachine_index_count(&index, THERMOSTAT_COOLING);
+    }
+    double counted = now_ns() - start;
+    start = now_ns();
+    for (size_t q = 0; q < queries; q++) {
+        for (size_t i = statemachine_index_next(&index, THERMOSTAT_HEATING, 0); i < index.capacity;
+             i = statemachine_index_next(&index, THERMOSTAT_HEATING, i + 1)) {
+            thermostat_view_t view;
+            thermostat_view(thermostats[i / stride], &view);
+            below += (size_t) (view.temperature < view.heat_setpoint);
+        }
+    }
+    double listed = now_ns() - start;
+    if (scanned != indexed) {
+        fprintf(stderr, "index: scanning found %zu cooling, the index %zu\n", scanned, indexed);
+        status = -1;
+    }
+    // every thermostat changes states, the index follows them
+    for (size_t i = 0; status == 0 && i < count; i++) {
+        statemachine_dispatch(&thermostats[i]->statemachine, i % 2 ? THERMOSTAT_SET_MODE_HEAT : THERMOSTAT_SET_MODE_COOL,
+                              NULL);
+        statemachine_dispatch_float(&thermostats[i]->statemachine, THERMOSTAT_SET_TEMPERATURE,
+                                    i % 4 < 2 ? bench_cold : bench_hot);
+    }
+    if (status == 0) status = bench_index_check(&index, thermostats, count);
+    for (size_t i = 0; i < count; i++) {
+        thermostat_destroy(thermostats[i]);
+    }
+    for (short id = THERMOSTAT_POWERED_ON; status == 0 && id <= THERMOSTAT_COOLING; id++) {
+        if (statemachine_index_count(&index, id) != 0) {
+            fprintf(stderr, "index: destroyed thermostats are still in state %d\n", id);
+            status = -1;
+        }
+    }
+    statemachine_index_deinit(&index);
+    free(thermostats);
+    thermostat_logging = logging;
+    if (status != 0) return -1;
+    bench_param_t params[] = {{"thermostats", (long) count}, {"positions", (long) index.capacity}};
+    bench_metric_t metrics[] = {{"scan_count_us", scan / 1e3 / (double) queries},
+                                {"index_count_us", counted / 1e3 / (double) queries},
+                                {"index_list_us", listed / 1e3 / (double) queries},
+                                {"cooling", (double) indexed / (double) queries},
+                                {"heating_below_setpoint", (double) below / (double) queries}};
+    bench_report("index", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+    return 0;
+}
+
+/**
+ * Evaluate the on and off conditions of a fleet of thermostats, half of them heating and half cooling, against rounds
+ * of readings drifting around their setpoints with every kernel the cpu supports, and check every kernel finds the
+ * same thermostats as the scalar one
+ * @param count thermostats
+ * @param rounds of readings
+ * @return 0 on success, -1 if the kernels disagree
+ */
+static int bench_conditions(size_t count, size_t rounds) {
+    const char *names[] = {"conditions_scalar", "conditions_sse", "conditions_avx2"};
+    float *readings = malloc(rounds * count * sizeof(float));
+    size_t *changed = malloc(count * sizeof(size_t));
+    unsigned long long random = 1, expected = 0;
+    if (readings == NULL || changed == NULL) {
+        fprintf(stderr, "conditions: couldn't allocate %zu rounds of %zu readings\n", rounds, count);
+        exit(1);
+    }
+    for (size_t i = 0; i < rounds * count; i++) {
+        random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+        float previous = i < count ? 72 : readings[i - count];
+        readings[i] = previous + (float) ((int) (random >> 59) - 16) / 32;
+    }
+    thermostat_kernel_t widest = THERMOSTAT_KERNEL_SCALAR;
+    for (thermostat_kernel_t kernel = THERMOSTAT_KERNEL_SCALAR; kernel <= widest; kernel++) {
+        thermostat_conditions_t conditions;
+        if (thermostat_conditions_init(&conditions, count) != 0) {
+            fprintf(stderr, "conditions: couldn't allocate %zu thermostats\n", count);
+            exit(1);
+        }
+        widest = conditions.kernel;
+        conditions.kernel = kernel;
+        for (size_t i = 0; i < count; i++) {
+            conditions.temperature[i] = 72;
+            conditions.setpoint[i] = 72;
+            conditions.invert[i] = i & 1 ? UINT32_MAX : 0;
+        }
+        unsigned long long found = 0, checksum = 0;
+        double start = now_ns();
+        for (size_t round = 0; round < rounds; round++) {
+            size_t n = thermostat_conditions_changed(&conditions, readings + round * count, 0, count, changed);
+            found += n;
+            for (size_t i = 0; i < n; i++) checksum = checksum * 31 + changed[i];
+        }
+        double elapsed = now_ns() - start;
+        thermostat_conditions_deinit(&conditions);
+        if (kernel == THERMOSTAT_KERNEL_SCALAR) {
+            expected = checksum;
+        } else if (checksum != expected) {
+            fprintf(stderr, "conditions: %s found other thermostats than the scalar kernel\n", names[kernel]);
+            free(readings);
+            free(changed);
+            return -1;
+        }
+        bench_param_t params[] = {{"thermostats", (long) count}, {"rounds", (long) rounds}};
+        bench_metric_t metrics[] = {{"ns_per_thermostat", elapsed / (double) (rounds * count)},
+                                    {"changed_fraction", (double) found / (double) (rounds * count)}};
+        bench_report(names[kernel], params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+    }
+    free(readings);
+    free(changed);
+    return 0;
+}
+
+/**
+ * Measure what journaling adds to dispatching on the thermostat chart and how fast the journal replays. Replaying
+ * leaves timers on the virtual clock, so it has to run after every other benchmark. The journal is replayed again with
+ * its last record cut in half, which has to replay the records before it.
+ * @param iterations events dispatched per pass
+ * @return 0 if both replays matched, -1 if one didn't
+ */
+static int bench_journal(size_t iterations) {
+    const event_t events[] = {THERMOSTAT_SET_TEMPERATURE, THERMOSTAT_SET_TEMPERATURE};
+    void *const data[] = {&bench_cold, &bench_hot};
+    struct timespec settle = {0, 20000000};
+    char path[] = "/tmp/bench_journal_XXXXXX";
+    int file = mkstemp(path), status = 0;
+    if (file < 0) return 0;
+    close(file);
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    thermostat_t *thermostat = thermostat_create();
+    bench_param_t off[] = {{"journaling", 0}};
+    statemachine_dispatch(&thermostat->statemachine, THERMOSTAT_SET_MODE_HEAT, NULL);
+    nanosleep(&settle, NULL);
+    bench_dispatch("journal", &thermostat->statemachine, events, data, 2, iterations, off, BENCH_LENGTH(off));
+    thermostat_destroy(thermostat);
+    // journal a thermostat from its creation so the journal can be replayed on a fresh one
+    if (statemachine_journal_start(path, thermostat_payload_size) == 0) {
+        thermostat = thermostat_create();
+        statemachine_dispatch(&thermostat->statemachine, THERMOSTAT_SET_MODE_HEAT, NULL);
+        // let the minimum active time of heat mode pass so HEATING can be left
+        nanosleep(&settle, NULL);
+        bench_param_t on[] = {{"journaling", 1}};
+        bench_dispatch("journal", &thermostat->statemachine, events, data, 2, iterations, on, BENCH_LENGTH(on));
+        if (statemachine_journal_stop() != 0) status = -1;
+        thermostat_destroy(thermostat);
+        struct stat file_status;
+        stat(path, &file_status);
+        thermostat = NULL;
+        statemachine_journal_replay_t replay;
+        double start = now_ns();
+        int result = statemachine_journal_replay(path, bench_journal_resolve, &thermostat, &replay);
+        double elapsed = now_ns() - start;
+        if (thermostat != NULL) thermostat_destroy(thermostat);
+        if (result != 0) {
+            fprintf(stderr, "journal: replay %s at byte %zu\n", result > 0 ? "diverged" : "failed", replay.mismatch);
+            status = -1;
+        } else {
+            bench_metric_t metrics[] = {{"events", (double) replay.events},
+                                        {"bytes_per_event", (double) file_status.st_size / (double) replay.events},
+                                        {"replay_events_per_s", (double) replay.events / (elapsed / 1e9)}};
+            bench_report("journal_replay", NULL, 0, metrics, BENCH_LENGTH(metrics));
+            // a crash can leave part of a record at the end
+            thermostat = NULL;
+            if (truncate(path, file_status.st_size - (off_t) sizeof(statemachine_journal_record_t) / 2) != 0 ||
+                (result = statemachine_journal_replay(path, bench_journal_resolve, &thermostat, &replay)) != 0 ||
+                replay.truncated != sizeof(statemachine_journal_record_t) / 2) {
+                fprintf(stderr, "journal: replay of a cut off journal %s\n", result > 0 ? "diverged" : "failed");
+                status = -1;
+            }
+            if (thermostat != NULL) thermostat_destroy(thermostat);
+        }
+    }
+    unlink(path);
+    thermostat_logging = logging;
+    return status;
+}
+
+/**
+ * Simulate the same fleet on one thread and on several and report how much faster than real time it ran. Exits with an
+ * error if the runs disagree, the result of a simulation may only depend on its seed.
+ * @param count number of thermostats
+ * @param days simulated
+ * @param threads of the second run
+ * @return 0 if both runs simulated the same cycles
+ */
+static int bench_simulator(size_t count, unsigned long long days, unsigned int threads) {
+    // every reading sent on one thread, then only the readings that matter on one thread and on several
+    thermostat_simulation_stats_t runs[3];
+    char logging = thermostat_logging;
+    thermostat_logging = 0;
+    for (int run = 0; run < 3; run++) {
+        thermostat_simulation_t simulation;
+        if (thermostat_simulation_init(&simulation, count, 0, 1) != 0) {
+            fprintf(stderr, "simulator: couldn't simulate %zu thermostats\n", count);
+            thermostat_logging = logging;
+            return -1;
+        }
+        simulation.unfiltered = run == 0;
+        if (thermostat_simulation_run(&simulation, days * THERMOSTAT_SIMULATOR_DAY, run == 2 ? threads : 1) != 0) {
+            fprintf(stderr, "simulator: couldn't simulate %zu thermostats\n", count);
+            thermostat_simulation_deinit(&simulation);
+            thermostat_logging = logging;
+            return -1;
+        }
+        runs[run] = simulation.stats;
+        thermostat_simulation_deinit(&simulation);
+        thermostat_simulation_stats_t *stats = &runs[run];
+        bench_param_t params[] = {{"thermostats", (long) count}, {"days", (long) days},
+                                  {"threads", run == 2 ? (long) threads : 1}, {"unfiltered", run == 0}};
+        double elapsed = (double) stats->elapsed / 1e9;
+        bench_metric_t metrics[] = {{"simulated_s_per_s", (double) stats->simulated / 1e3 / elapsed},
+                                    {"readings_per_s", (double) stats->readings / elapsed},
+                                    {"sent_per_s", (double) stats->dispatched / elapsed},
+                                    {"heating_cycles", (double) stats->heating_cycles},
+                                    {"cooling_cycles", (double) stats->cooling_cycles}};
+        bench_report("simulator", params, BENCH_LENGTH(params), metrics, BENCH_LENGTH(metrics));
+    }
+    thermostat_logging = logging;
+    for (int run = 1; run < 3; run++) {
+        thermostat_simulation_stats_t *every = &runs[0], *stats = &runs[run];
+        if (every->heating_cycles != stats->heating_cycles || every->cooling_cycles != stats->cooling_cycles ||
+            every->heating_time != stats->heating_time || every->cooling_time != stats->cooling_time ||
+            every->time_events != stats->time_events) {
+            fprintf(stderr, "simulator: %u threads sending only the readings that matter simulated other cycles than "
+                            "1 sending every reading\n", run == 2 ? threads : 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Run the benchmarks. Pass --json to get the results as a JSON document for tracking them across releases, and the
+ * names, or name prefixes, of the benchmarks to run only those.
+ */
+int main(int argc, char **argv) {
+    bench_filters = calloc((size_t) argc, sizeof(char *));
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            bench_json = 1;
+        } else {
+            bench_filters[bench_filter_count++] = argv[i];
+        }
+    }
+    unsigned int cpus = (unsigned int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (bench_json) printf("{\"suite\": \"statemachine\", \"cpus\": %u, \"results\": [", cpus);
+    if (bench_selected("charts")) bench_charts(1000000);
+    if (bench_selected("ordering") && bench_ordering_check(1000000) != 0) {
+        free(bench_filters);
+        return 1;
+    }
+    if (bench_selected("thermostat")) bench_thermostat(1000000);
+    if (bench_selected("trace")) bench_trace(1000000);
+    if (bench_selected("metrics")) bench_metrics(1000000);
+    if (bench_selected("codegen") && bench_codegen(1000000) != 0) {
+        free(bench_filters);
+        return 1;
+    }
+    if (bench_selected("completions")) {
+        if (bench_changed_fresh() != 0) {
+            free(bench_filters);
+            return 1;
+        }
+        bench_completions(4096, 100);
+    }
+    if (bench_selected("snapshot")) bench_snapshot(100000);
+    if (bench_selected("deep_transition")) {
+        const int depths[] = {4, 16};
+        const int widths[] = {0, 16, 256, 1024};
+        for (size_t d = 0; d < BENCH_LENGTH(depths); d++) {
+            for (size_t w = 0; w < BENCH_LENGTH(widths); w++) {
+                bench_deep_transition(depths[d], widths[w], 200000);
+            }
+        }
+    }
+    if (bench_selected("run_wakeup")) {
+        bench_run(2000, 100000);
+        bench_run(100000, 0);
+    }
+    if (bench_selected("timer_arm_cancel")) {
+        bench_timer(0, 1000000);
+        bench_timer(1000, 1000000);
+        bench_timer(100000, 1000000);
+    }
+    if (bench_selected("thermostat_fleet")) bench_thermostat_fleet(100000);
+    if (bench_selected("footprint")) bench_footprint();
+    if (bench_selected("executor")) {
+        const unsigned int workers[] = {1, 2, 4, 8};
+        for (size_t i = 0; i < BENCH_LENGTH(workers); i++) {
+            bench_executor(workers[i], 4096, 64);
+        }
+        if (cpus > 8) bench_executor(cpus, 4096, 64);
+    }
+    if (bench_selected("dispatch_batch")) {
+        bench_dispatch_batch(1, 4096, 1 << 20);
+        bench_dispatch_batch(4096, 1, 256);
+        bench_dispatch_batch(4096, 16, 256);
+    }
+    if (bench_selected("ingest")) {
+        for (char binary = 0; binary <= 1; binary++) {
+            bench_ingest(1, 1000000, binary);
+            bench_ingest(4096, 1000000, binary);
+        }
+    }
+    if (bench_selected("control")) {
+        bench_control(1, 4096, 200000);
+        bench_control(64, 4096, 10000);
+    }
+    if (bench_selected("payload") && (bench_payload(1, 4096, 64) != 0 || bench_payload(4, 64, 4096) != 0 ||
+                                      bench_payload(BENCH_PAYLOAD_PRODUCERS, 1, 65536) != 0)) {
+        free(bench_filters);
+        return 1;
+    }
+    if (bench_selected("view")) {
+        unsigned int readers[] = {1, 2, 4};
+        for (size_t i = 0; i < BENCH_LENGTH(readers); i++) {
+            if (bench_view(readers[i], 1, 200000) != 0 || bench_view(readers[i], 0, 200000) != 0) {
+                free(bench_filters);
+                return 1;
+            }
+        }
+    }
+    if (bench_selected("index") && (bench_index(100000, 1, 100) != 0 || bench_index(100000, 10, 100) != 0)) {
+        free(bench_filters);
+        return 1;
+    }
+    if (bench_selected("conditions") && bench_conditions(65536, 64) != 0) {
+        free(bench_filters);
+        return 1;
+    }
+    if (bench_selected("journal") && bench_journal(1000000) != 0) {
+        free(bench_filters);
+        return 1;
+    }
+    if (bench_selected("simulator") && bench_simulator(1000, 1, cpus > 1 ? cpus : 4) != 0) {
+        free(bench_filters);
+        return 1;
+    }
+    if (bench_json) printf("\n]}\n");
+    free(bench_filters);
+    return 0;
+}
@@ -5,28 +5,117 @@
 #ifndef EMERSON_THERMOSTAT_STATEMACHINE_H
 #define EMERSON_THERMOSTAT_STATEMACHINE_H
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include "statemachine_metrics.h"
+#include "statemachine_timer.h"
 
 // change statemachine type if you need more than 256 events
 typedef short event_t;
 
+// number of events a statemachine can hold before dispatch starts dropping them, must be a power of two
+#ifndef STATEMACHINE_QUEUE_SIZE
+#define STATEMACHINE_QUEUE_SIZE 16
+#endif
+
+// states a statemachine can keep on its active path without allocating it, models nested deeper allocate their path
+#ifndef STATEMACHINE_PATH_INLINE
+#define STATEMACHINE_PATH_INLINE 4
+#endif
+
+// bytes of payload a trigger carries inline, larger payloads are copied into a block of the statemachine's pool
+#ifndef STATEMACHINE_PAYLOAD_INLINE
+#define STATEMACHINE_PAYLOAD_INLINE 8
+#endif
+
+// bytes of a pool block, the largest payload an event can carry
+#ifndef STATEMACHINE_POOL_BLOCK
+#define STATEMACHINE_POOL_BLOCK 64
+#endif
+
+// blocks in the pool of a statemachine, payloads of events that are queued or being processed hold one each, at most 64
+#ifndef STATEMACHINE_POOL_BLOCKS
+#define STATEMACHINE_POOL_BLOCKS STATEMACHINE_QUEUE_SIZE
+#endif
+
+// every input a completion transition can depend on, see transition_t
+#define STATEMACHINE_INPUTS_ALL (~0UL)
+
+// layout of the snapshots written by statemachine_snapshot, snapshots of other versions are refused
+#define STATEMACHINE_SNAPSHOT_VERSION 1
+// bytes of a snapshot before its timers: version, most nested active state, armed timer count and model fingerprint
+#define STATEMACHINE_SNAPSHOT_HEADER 10
+// bytes of a snapshot per armed timer: time event index and deadline
+#define STATEMACHINE_SNAPSHOT_TIMEOUT 10
+
 // A placeholder for arrays to allow omitting the array size
 #define NULL_ELEMENT_ID (0)
 #define NULL_ELEMENT {NULL_ELEMENT_ID}
 
 
+/**
+ * Payload a trigger carries inline, read through the typed accessors below
+ */
+typedef union statemachine_payload {
+    unsigned char bytes[STATEMACHINE_PAYLOAD_INLINE];
+    float f;
+    int i;
+    long l;
+    double d;
+    void *pointer;
+} statemachine_payload_t;
+
 /**
  * a Trigger is what drives the statemachine execution. Triggers can either be external or internal. They are
- * always associated with an event. They may have extra parameters however the first item in the structure must be
- * a trigger struct.
+ * always associated with an event. Triggers are copied into the event queue when dispatched along with their payload,
+ * which is kept inline if it fits and in a block of the statemachine's pool otherwise, so the dispatching thread's copy
+ * of it can go away right after dispatching. While the event is processed data points at the copy. Data dispatched
+ * with statemachine_dispatch is only pointed to and must stay valid until the event has been processed.
  */
 typedef struct trigger {
     event_t event;
-    char active;
+    unsigned short size; // bytes of payload copied with the event, 0 if data is only a pointer
     void *data;
+    statemachine_payload_t payload; // holds payloads of up to STATEMACHINE_PAYLOAD_INLINE bytes
 } trigger_t;
 
+/**
+ * Get the payload of a trigger
+ * @param trigger
+ * @return the inline payload, the pool block or the data the trigger was dispatched with
+ */
+static inline const void *statemachine_trigger_payload(const trigger_t *trigger) {
+    return trigger->size != 0 && trigger->size <= STATEMACHINE_PAYLOAD_INLINE ? trigger->payload.bytes : trigger->data;
+}
+
+/**
+ * Read the payload of a trigger as a float
+ * @param trigger
+ * @return 0 if the trigger has no payload
+ */
+static inline float statemachine_trigger_float(const trigger_t *trigger) {
+    const void *payload = statemachine_trigger_payload(trigger);
+    float value = 0;
+    if (payload != NULL) memcpy(&value, payload, sizeof(value));
+    return value;
+}
+
+/**
+ * Read the payload of a trigger as an int
+ * @param trigger
+ * @return 0 if the trigger has no payload
+ */
+static inline int statemachine_trigger_int(const trigger_t *trigger) {
+    const void *payload = statemachine_trigger_payload(trigger);
+    int value = 0;
+    if (payload != NULL) memcpy(&value, payload, sizeof(value));
+    return value;
+}
+
 struct statemachine;
 
 /**
@@ -46,18 +135,38 @@ struct statemachine;
  * A transition with a target state that is not a descendant of its source is a external transition. An external transition will exit the source state
  * and invoke the entry behavior of every state as it descends to an external target.
  *
+ * A transition with an after callback and no trigger event is triggered by a time event. A timer is armed for the
+ * number of milliseconds after returns every time the source state is entered and cancelled when it is exited. Unless a
+ * thread is running the statemachine with statemachine_run, time events are processed on the timer thread.
+ *
+ * A completion transition can declare the inputs its guard reads as bits in depends. Once the statemachine has settled
+ * it is only evaluated again when the configuration changes or one of its inputs does, either through the changes of a
+ * transition that was taken or through statemachine_changed. Completion transitions without depends are evaluated
+ * every time the statemachine settles.
  */
+/**
+ * The event a transition is triggered by. What was dispatched with the event is what guards and effects are passed as
+ * their trigger, a transition only names the event.
+ */
+typedef struct transition_trigger {
+    event_t event;
+} transition_trigger_t;
+
 typedef struct transition {
     short source;
     short target;
-    trigger_t trigger;
-    int (*guard)(struct statemachine *, struct transition *);
-    void (*effect)(struct statemachine *, struct transition *);
+    transition_trigger_t trigger;
+    int (*guard)(struct statemachine *, struct transition *, trigger_t *trigger); // trigger is NULL for completion transitions
+    void (*effect)(struct statemachine *, struct transition *, trigger_t *trigger);
+    unsigned long (*after)(struct statemachine *, struct transition *); // milliseconds to wait after entering the source
+    unsigned long depends; // inputs the guard of a completion transition reads
+    unsigned long changes; // inputs the effect writes
 } transition_t;
 
 /**
  * A state is the core context of a statemachine. A statemachine must always settle on a state before continuing its execution.
- * A state has a unique ID that is used by a transition as its source and target properties.
+ * A state has a unique ID that is used by a transition as its source and target properties. States are part of the model
+ * and shared by every statemachine running it, whether a state is active is tracked by each statemachine.
  */
 typedef struct state {
     short id;
@@ -65,54 +174,483 @@ typedef struct state {
     transition_t initial; // optional initial transition to a substate
     void (*entry)(struct statemachine *, struct state *, trigger_t *trigger); // executed when the state is entered
     void (*exit)(struct statemachine *, struct state *, trigger_t *trigger); // executed when exiting the state
-    char active;
-    void *data;
+    void *data; // read-only data shared by every statemachine running the model
 } state_t ;
 
 
 /**
- * The statemachine is itself a top level state. Events are processed starting from the most nested state to the top.
+ * The exits and entries of a transition worked out at compile time. The active descendants of the source are exited
+ * first, then the states in exits, then the effect runs before the states in entries are entered. States are stored by
+ * their pre-order index in the plan_states of the table, the exits first and the entries right after them.
  */
-typedef struct statemachine {
+typedef struct statemachine_plan {
+    unsigned char internal; // internal transitions only execute their effect
+    unsigned short exit_count; // the source and its ancestors below the least common ancestor, innermost first
+    unsigned short entry_count; // path down to the target followed by its initial transitions, outermost first
+    unsigned short settled; // the state the statemachine settles on
+    uint32_t first; // position of the first exit in plan_states and plan_effects
+} statemachine_plan_t;
+
+/**
+ * Lookup tables built by statemachine_compile(). States are numbered in pre-order so the root is index 0 and a state's
+ * descendants follow it, which lets ancestry checks compare indices instead of walking the tree. Transitions are
+ * bucketed by their source state id and event so processing only visits the transitions that can fire from each active
+ * state. Buckets keep the authoring order of the transitions array which is also their priority, and hold positions in
+ * it. What scanning a bucket checks is kept per transition in arrays of its own so the transitions themselves are only
+ * read once one is taken. Every array is packed into a single block.
+ */
+typedef struct statemachine_table {
+    unsigned short state_count;
+    unsigned short max_depth; // depth of the most nested state
+    short max_state_id; // largest state id in the chart, transition tables are indexed by state id
+    event_t max_event; // largest event in the chart
+    unsigned short event_count; // number of distinct events
+    unsigned short timeout_count; // number of time event transitions
+    uint32_t fingerprint; // hash of the state tree and transitions, identifies the chart snapshots were taken of
+    size_t transition_count;
+    uint32_t plan_length; // entries in plan_states and plan_effects
+    size_t bytes; // taken by the table and its block
+    unsigned short *state_index; // state id -> pre-order index
+    unsigned short *parent; // pre-order index -> pre-order index of the parent, the root is its own parent
+    unsigned short *depth; // pre-order index -> nesting depth, the root has a depth of 0
+    unsigned short *post; // pre-order index -> post-order index
+    unsigned short *event_index; // event -> dense event index, 0 marks an event without transitions
+    unsigned short *event_offsets; // (state id, event index) -> first entry in event_transitions
+    unsigned short *event_transitions;
+    unsigned short *completion_offsets; // state id -> first entry in completion_transitions
+    unsigned short *completion_transitions;
+    unsigned short *timeout_offsets; // state id -> first entry in timeout_transitions
+    unsigned short *timeout_transitions; // time event transitions, their position is also their timer's index
+    unsigned short *targets; // transition -> pre-order index of its target, USHRT_MAX for internal transitions
+    unsigned long *depends; // transition -> its depends
+    int (**guards)(struct statemachine *, struct transition *, trigger_t *); // transition -> its guard
+    state_t **states; // pre-order index -> state
+    transition_t *transitions; // the transitions array the plans were built from
+    statemachine_plan_t *plans; // one plan per entry in transitions
+    statemachine_plan_t initial; // enters the root and follows its initial transitions
+    unsigned short *plan_states; // the exits and entries of every plan
+    unsigned short *plan_effects; // state whose initial transition executes before each entry, USHRT_MAX for none
+    void *block; // holds every array above
+    statemachine_metrics_t *metrics; // collected while statemachine_metrics_enable is on
+} statemachine_table_t;
+
+/**
+ * A cell of the event queue. The sequence tells producers and the consumer whose turn it is to use the cell.
+ */
+typedef struct statemachine_event {
+    atomic_size_t sequence;
+    trigger_t trigger;
+} statemachine_event_t;
+
+/**
+ * Fixed blocks holding the payloads too large to be carried inline, allocated the first time a statemachine is
+ * dispatched one. Producers take a block by clearing its bit and the thread processing the statemachine gives it back
+ * once the event has been processed, so no payload is allocated or freed with malloc.
+ */
+typedef struct statemachine_pool {
+    atomic_uint_least64_t free; // bit per block, set while the block is free
+    _Alignas(max_align_t) unsigned char blocks[STATEMACHINE_POOL_BLOCKS][STATEMACHINE_POOL_BLOCK];
+} statemachine_pool_t;
+
+/**
+ * Timestamps a statemachine keeps for metrics, allocated the first time it is dispatched to or changes state while
+ * metrics are collected
+ */
+typedef struct statemachine_timing {
+    uint64_t queued[STATEMACHINE_QUEUE_SIZE]; // when the event in the queue cell at the same position was dispatched
+    uint64_t entered[]; // when each state in pre-order was entered, 0 if it was entered while metrics were off
+} statemachine_timing_t;
+
+/**
+ * Bounded multi-producer single-consumer ring buffer of dispatched events. Any thread may dispatch without locking,
+ * events are processed in the order they were queued.
+ */
+typedef struct statemachine_queue {
+    statemachine_event_t events[STATEMACHINE_QUEUE_SIZE];
+    atomic_size_t tail; // next cell producers claim, also the number of events queued so far
+    atomic_size_t head; // next cell the consumer reads
+    atomic_ulong dropped; // events rejected because the queue was full
+    atomic_ulong unhandled; // events processed without any transition consuming them
+    atomic_ulong batched; // events of a batch processed directly without being queued
+} statemachine_queue_t;
+
+/**
+ * Counters of a statemachine event queue
+ */
+typedef struct statemachine_queue_stats {
+    unsigned long dispatched;
+    unsigned long dropped;
+    unsigned long unhandled;
+} statemachine_queue_stats_t;
+
+/**
+ * Lets the thread in statemachine_run sleep until there is work to do
+ */
+typedef struct statemachine_waiter {
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // signalled when an event is dispatched
+    pthread_cond_t idle; // broadcast when the event queue has been drained
+    atomic_int sleeping; // the running thread is waiting on wake
+    atomic_char running; // a thread is inside statemachine_run
+} statemachine_waiter_t;
+
+/**
+ * The timer of a time event transition. When it expires an event identifying the transition and the generation the
+ * timer was armed with is dispatched to the statemachine, which discards it if the timer has been armed again since.
+ */
+typedef struct statemachine_timeout {
+    statemachine_timer_t timer;
+    struct statemachine *statemachine;
+    unsigned long long entered; // tick of statemachine_timer_now the source state was entered on
+} statemachine_timeout_t;
+
+/**
+ * The model is the chart a statemachine runs: a top level state and the transitions between its substates. A model is
+ * compiled once and then only read, so any number of statemachines can share it.
+ */
+typedef struct statemachine_model {
     state_t root;
     transition_t *transitions;
-    volatile char processing;
+    statemachine_table_t *table; // built by statemachine_compile
+    /**
+     * Optional replacement for interpreting the chart when processing events and completion transitions, generated
+     * from this model by statemachine_codegen. Time events are still interpreted.
+     */
+    state_t *(*dispatcher)(struct statemachine *statemachine, trigger_t *trigger);
+    /**
+     * Optional callback run by the thread processing a statemachine once it has entered its initial configuration or
+     * been restored and after every event has run to completion, to publish what readers on other threads may look at
+     */
+    void (*settled)(struct statemachine *statemachine);
+} statemachine_model_t;
+
+/**
+ * Link of a statemachine in the queue of statemachines with events waiting for an executor worker
+ */
+typedef struct statemachine_ready {
+    _Atomic(struct statemachine_ready *) next;
+} statemachine_ready_t;
+
+struct statemachine_shard;
+
+/**
+ * A statemachine is one running instance of a model. It holds the active configuration and the pending events, anything
+ * else an instance needs goes in a struct that embeds the statemachine as its first member. Events are processed
+ * starting from the most nested state to the top.
+ */
+typedef struct statemachine {
+    statemachine_model_t *model;
+    uint64_t *active; // active configuration, one bit per state in pre-order
+    uint64_t active_word; // holds the active configuration of models with up to 64 states
+    state_t **path; // active states from the root down, indexed by depth
+    state_t *path_states[STATEMACHINE_PATH_INLINE]; // holds the path of models nested less than this deep
+    atomic_ulong changed; // inputs changed since completion transitions were last evaluated
+    unsigned long evaluating; // inputs completion transitions are evaluated for while processing
+    unsigned short path_length; // number of active states, the most nested one is last on the path
+    atomic_flag processing; // held by the thread processing the event queue
+    atomic_char scheduled; // handed to its worker and not yet picked up
+    atomic_uchar running; // workers that picked it up and haven't returned from processing it yet
+    atomic_char settling; // statemachine_changed queued an event and no step has taken the changed inputs since
+    unsigned int id; // identifies the statemachine in traces, assigned by its first statemachine_init
+    statemachine_queue_t queue;
+    _Atomic(statemachine_waiter_t *) waiter; // created by statemachine_run
+    statemachine_timeout_t *timeouts; // one per time event transition
+    _Atomic(struct statemachine_shard *) shard; // executor worker owning the statemachine, see statemachine_executor.h
+    statemachine_ready_t ready;
+    _Atomic(statemachine_timing_t *) timing;
+    _Atomic(statemachine_pool_t *) pool; // holds payloads larger than STATEMACHINE_PAYLOAD_INLINE
+    struct statemachine_index *index; // keeping track of the states it is in, see statemachine_index.h
+    size_t position; // of the statemachine in its index
 } statemachine_t;
 
 /**
- * dispatch an event to the statemachine and optionally attach data to its trigger. If the statemachine is already
- * processing an event it stores the event in the statemachines event pool (transitions) and processes on the next
- * step of execution
+ * Build the lookup tables used to process events. The transitions array and state tree are left untouched so charts
+ * are still authored as plain arrays. statemachine_init compiles the model if this hasn't been called, models shared
+ * between threads should be compiled up front.
+ * @param model
+ * @return 0 on success, -1 if the tables couldn't be allocated or a transition references an unknown state
+ */
+int statemachine_compile(statemachine_model_t *model);
+/**
+ * Release the tables built by statemachine_compile. No statemachine may be running the model.
+ * @param model
+ */
+void statemachine_release(statemachine_model_t *model);
+/**
+ * Bytes a chart takes and each statemachine running it
+ */
+typedef struct statemachine_footprint {
+    size_t chart; // the state and transition arrays the chart is authored in
+    size_t table; // built by statemachine_compile and shared by every statemachine, metrics excluded
+    size_t instance; // a statemachine and what statemachine_init allocates for it
+} statemachine_footprint_t;
+/**
+ * Measure the memory a compiled model takes. Payload pools, metrics timestamps and the waiter of statemachine_run are
+ * only allocated once a statemachine needs them and aren't counted.
+ * @param model
+ * @param footprint
+ * @return 0 on success, -1 if the model isn't compiled
+ */
+int statemachine_footprint(const statemachine_model_t *model, statemachine_footprint_t *footprint);
+
+/**
+ * dispatch an event to the statemachine and optionally attach data to its trigger. The event is added to the
+ * statemachine event queue and, unless another thread is already processing the statemachine, processed along with any
+ * other queued events before returning. Safe to call from any thread and from within actions. The data is only pointed
+ * to and must stay valid until the event is processed, use statemachine_dispatch_payload to have it copied.
  * @param statemachine
  * @param event
  * @param data
- * @return state this statemachine settled on after dispatching the event
+ * @return state this statemachine settled on after dispatching the event, NULL if the event was left for the thread
+ * processing the statemachine, for the statemachine_run thread or executor worker running it, or dropped because the
+ * queue was full
  */
 state_t *statemachine_dispatch(statemachine_t *statemachine, event_t event, void *data);
+/**
+ * dispatch an event with a copy of a payload, like statemachine_dispatch otherwise. Payloads of up to
+ * STATEMACHINE_PAYLOAD_INLINE bytes travel inline with the event, larger ones up to STATEMACHINE_POOL_BLOCK bytes are
+ * copied into a block of the statemachine's pool that is given back once the event has been processed. Guards and
+ * effects read it with statemachine_trigger_payload or the typed accessors.
+ * @param statemachine
+ * @param event
+ * @param payload
+ * @param size bytes of payload
+ * @return like statemachine_dispatch, NULL as well if the payload is larger than STATEMACHINE_POOL_BLOCK or every block
+ * of the pool is taken, in which case the event is counted as dropped
+ */
+state_t *statemachine_dispatch_payload(statemachine_t *statemachine, event_t event, const void *payload, size_t size);
 
 /**
- * Get the most nested active state in the the state machine configuration
- * @param state
+ * dispatch an event carrying a float, read it with statemachine_trigger_float
+ * @param statemachine
+ * @param event
+ * @param value
+ * @return like statemachine_dispatch
+ */
+static inline state_t *statemachine_dispatch_float(statemachine_t *statemachine, event_t event, float value) {
+    return statemachine_dispatch_payload(statemachine, event, &value, sizeof(value));
+}
+
+/**
+ * dispatch an event carrying an int, read it with statemachine_trigger_int
+ * @param statemachine
+ * @param event
+ * @param value
+ * @return like statemachine_dispatch
+ */
+static inline state_t *statemachine_dispatch_int(statemachine_t *statemachine, event_t event, int value) {
+    return statemachine_dispatch_payload(statemachine, event, &value, sizeof(value));
+}
+
+/**
+ * An event of a batch and the statemachine it goes to
+ */
+typedef struct statemachine_batch_entry {
+    statemachine_t *statemachine;
+    event_t event;
+    void *data; // pointed to like with statemachine_dispatch, or the payload to copy if it is larger than inline
+    unsigned short size; // bytes of payload copied with the event like statemachine_dispatch_payload, 0 for none
+    statemachine_payload_t payload; // payloads of up to STATEMACHINE_PAYLOAD_INLINE bytes
+} statemachine_batch_entry_t;
+
+/**
+ * dispatch a batch of events to one or many statemachines. Consecutive entries for the same statemachine are handled as
+ * a run: the statemachine is looked up and claimed for processing once and the run's events are processed in order
+ * without going through its queue, or, if another thread is processing it, queued and handed over with a single
+ * notification. Every event still runs to completion before the next one is processed.
+ * @param entries
+ * @param count
+ * @return number of events processed or queued, less than count if a queue was full or a payload didn't fit the pool
+ */
+size_t statemachine_dispatch_batch(const statemachine_batch_entry_t *entries, size_t count);
+
+/**
+ * Get the most nested active state in the the state machine configuration. The active path is kept up to date as
+ * states are entered and exited so this doesn't search the chart.
+ * @param statemachine
  * @return the active state unless the statemachine hasn't been initialized in which it will return NULL
  */
-state_t *statemachine_get_active_state(state_t *state);
+state_t *statemachine_get_active_state(statemachine_t *statemachine);
+/**
+ * Check if a statemachine has been initialized and hasn't terminated
+ * @param statemachine
+ * @return
+ */
+char statemachine_is_active(statemachine_t *statemachine);
 /**
- * Initialize the statemachine executing its initial transition
+ * Check if a state is part of the active configuration of a statemachine, which holds for the most nested active state
+ * and all of its ancestors. Costs a bit test.
  * @param statemachine
- * @return the state in which the statemachine settled on
+ * @param id
+ * @return 0 if the state isn't active or isn't part of the statemachine's model
  */
-state_t *statemachine_init(statemachine_t *statemachine);
+char statemachine_is_in(statemachine_t *statemachine, short id);
+/**
+ * Tell a statemachine inputs its completion transitions depend on have changed outside of its transitions, so they are
+ * evaluated again. The statemachine is processed the way statemachine_dispatch processes it. Safe to call from any
+ * thread and from within actions.
+ * @param statemachine
+ * @param inputs bits of the inputs that changed
+ * @return the state the statemachine settled on, NULL if a completion transition wasn't taken here or the change was
+ * left for whoever processes the statemachine. If the queue was full the change is evaluated with the next event.
+ */
+state_t *statemachine_changed(statemachine_t *statemachine, unsigned long inputs);
+
+/**
+ * Get the most bytes a snapshot of a statemachine running a model can take
+ * @param model a compiled model
+ * @return
+ */
+size_t statemachine_snapshot_size(statemachine_model_t *model);
+/**
+ * Save the active configuration of a statemachine and the time its armed time events are due. Snapshots hold the
+ * most nested active state, the deadline of each armed timer as wall clock milliseconds, so time spent down before a
+ * restore counts towards them, and the fingerprint of the model, in native byte order. Queued events are not saved,
+ * flush the statemachine first and take the snapshot while no other thread processes it.
+ * @param statemachine an initialized statemachine
+ * @param buffer
+ * @param size bytes available in buffer
+ * @return bytes the snapshot takes, nothing is written if it is more than size
+ */
+size_t statemachine_snapshot(statemachine_t *statemachine, void *buffer, size_t size);
+/**
+ * Initialize a statemachine into the configuration a snapshot saved instead of executing the initial transition. No
+ * entry action runs, the timers are armed for what was left of them, expiring right away if their deadline passed, and
+ * completion transitions are evaluated the next time the statemachine is processed. The data the actions work on is
+ * restored by the caller. Like statemachine_init the statemachine must be zeroed before its first initialization.
+ * @param statemachine
+ * @param model
+ * @param snapshot
+ * @param size bytes in snapshot
+ * @return 0 on success, -1 if the model couldn't be compiled or the configuration allocated, or if the snapshot is of
+ * another version or chart or is truncated, which leaves the statemachine as it was
+ */
+int statemachine_restore(statemachine_t *statemachine, statemachine_model_t *model, const void *snapshot,
+                         size_t size);
+
+/**
+ * Initialize a statemachine to run a model and execute its initial transition. The statemachine must be zeroed before
+ * its first initialization.
+ * @param statemachine
+ * @param model
+ * @return the state in which the statemachine settled on, NULL if the model couldn't be compiled or the active
+ * configuration couldn't be allocated
+ */
+state_t *statemachine_init(statemachine_t *statemachine, statemachine_model_t *model);
+/**
+ * Arm the timers of the time event transitions leaving an active state again, for what their after callback returns
+ * now less the time since the state was entered, so a duration changed while the state is active applies to it. Time
+ * events already due expire right away, again if they were taken already. Call it from the actions of the statemachine.
+ * @param statemachine
+ * @param state id of the source state
+ * @return 0 on success, -1 if the state isn't active
+ */
+int statemachine_rearm(statemachine_t *statemachine, short state);
 /**
  * Terminate the statemachine and exit all of the nested states
  * @param statemachine
  */
 void statemachine_terminate(statemachine_t *statemachine);
 /**
- * Step through the statemachines triggers and if any are active process them
+ * Terminate the statemachine if it is still active and free what statemachine_init and statemachine_run allocated for
+ * it. The model is left compiled for other statemachines.
  * @param statemachine
- * @param triggger
- * @return the state it settled on if a trigger was ready to be processed
+ */
+void statemachine_deinit(statemachine_t *statemachine);
+/**
+ * Process queued events and take enabled completion transitions
+ * @param statemachine
+ * @return the state it settled on if a transition was taken
  */
 state_t *statemachine_step(statemachine_t *statemachine);
+/**
+ * Process the statemachine on the calling thread until it terminates. The thread sleeps while there is nothing to do
+ * and wakes when an event is dispatched or a time event fires. While it runs statemachine_dispatch only queues events
+ * and leaves processing to this thread.
+ * @param statemachine an initialized statemachine
+ * @return 0 once the statemachine has terminated, -1 if the waiter couldn't be created
+ */
+int statemachine_run(statemachine_t *statemachine);
+/**
+ * Wait until every event dispatched before the call has been processed, by whichever thread processes the
+ * statemachine. Events nothing else is processing are processed on the calling thread, not ones an executor worker or
+ * statemachine_run owns. Don't call it from within actions of the statemachine.
+ * @param statemachine
+ */
+void statemachine_flush(statemachine_t *statemachine);
+/**
+ * Wait for the thread processing a statemachine, if any, to finish and keep every other thread from processing it
+ * until statemachine_unhold. Events dispatched meanwhile are queued. Use it to read or change a statemachine that
+ * timers, an executor or statemachine_run may be processing at any time.
+ * @param statemachine
+ */
+void statemachine_hold(statemachine_t *statemachine);
+/**
+ * Let a held statemachine be processed again. The events dispatched while it was held are processed on the calling
+ * thread, or left to the thread running the statemachine with statemachine_run.
+ * @param statemachine
+ */
+void statemachine_unhold(statemachine_t *statemachine);
+/**
+ * Read the event queue counters
+ * @param statemachine
+ * @param stats
+ */
+void statemachine_queue_stats(statemachine_t *statemachine, statemachine_queue_stats_t *stats);
+/**
+ * Activate a state, invoke its entry action and start its time events. For dispatchers generated by
+ * statemachine_codegen, which precompute the states a transition enters and exits.
+ * @param statemachine
+ * @param state
+ * @param trigger
+ */
+void statemachine_enter_state(statemachine_t *statemachine, state_t *state, trigger_t *trigger);
+/**
+ * Stop the time events of an active state, invoke its exit action and deactivate it. For generated dispatchers.
+ * @param statemachine
+ * @param state
+ * @param trigger
+ */
+void statemachine_leave_state(statemachine_t *statemachine, state_t *state, trigger_t *trigger);
+/**
+ * Trace and count a transition before its states are exited. For generated dispatchers.
+ * @param statemachine
+ * @param transition
+ * @param trigger
+ */
+void statemachine_begin_transition(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger);
+/**
+ * Evaluate the guard of a transition, measuring it if metrics are collected. For generated dispatchers.
+ * @param statemachine
+ * @param transition
+ * @param trigger
+ * @return
+ */
+int statemachine_evaluate_guard(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger);
+/**
+ * Execute the effect of a transition, measuring it if metrics are collected. For generated dispatchers.
+ * @param statemachine
+ * @param transition
+ * @param trigger
+ */
+void statemachine_execute_effect(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger);
+
+/**
+ * Zero the metrics of a model
+ * @param model a compiled model
+ */
+void statemachine_metrics_reset(statemachine_model_t *model);
+/**
+ * Print the metrics collected for a model: histograms of the time from dispatch until the statemachine settled, of
+ * guards and of effects, how often each transition fired or was rejected by its guard and how long each state was
+ * active. States still active don't count the time since they were last entered.
+ * @param file
+ * @param model a compiled model
+ * @param json print a JSON object instead of text
+ * @param state_name optional names for state ids
+ * @param event_name optional names for events
+ */
+void statemachine_metrics_print(FILE *file, statemachine_model_t *model, char json,
+                                const char *(*state_name)(short id), const char *(*event_name)(event_t event));
 
 #endif //EMERSON_THERMOSTAT_STATEMACHINE_H
@@ -0,0 +1,81 @@
+//
+// Runs many statemachines on a pool of worker threads
+//
+
+#ifndef EMERSON_THERMOSTAT_STATEMACHINE_EXECUTOR_H
+#define EMERSON_THERMOSTAT_STATEMACHINE_EXECUTOR_H
+
+#include "statemachine.h"
+
+// number of statemachines a worker can have lined up for others to steal, must be a power of two
+#ifndef STATEMACHINE_EXECUTOR_DEQUE_SIZE
+#define STATEMACHINE_EXECUTOR_DEQUE_SIZE 1024
+#endif
+
+/**
+ * A pool of worker threads, each owning a shard of the statemachines added to the executor. Dispatching to a
+ * statemachine in the executor queues the event and hands the statemachine to the worker owning it, which processes
+ * its events without taking any lock. Workers that run out of statemachines steal from the shards of busy workers.
+ */
+typedef struct statemachine_executor statemachine_executor_t;
+
+/**
+ * Counters of an executor
+ */
+typedef struct statemachine_executor_stats {
+    unsigned long runs; // times a worker processed the events of a statemachine
+    unsigned long steals; // runs of a statemachine taken from another worker's shard
+} statemachine_executor_stats_t;
+
+/**
+ * Start an executor. Worker n is pinned to cpu n modulo the number of cpus where the platform allows it.
+ * @param workers number of worker threads, 0 for one per online cpu
+ * @return NULL if the executor couldn't be allocated or its threads started
+ */
+statemachine_executor_t *statemachine_executor_create(unsigned int workers);
+/**
+ * Add a statemachine to the shard of the next worker in turn. From then on statemachine_dispatch only queues events
+ * and the worker processes them. A statemachine run by an executor can't also be run with statemachine_run.
+ * @param executor
+ * @param statemachine an initialized statemachine
+ * @return the worker owning the statemachine
+ */
+unsigned int statemachine_executor_add(statemachine_executor_t *executor, statemachine_t *statemachine);
+/**
+ * Take a statemachine out of its executor. Waits until no worker is processing it, events still queued are processed
+ * on the calling thread.
+ * @param statemachine
+ */
+void statemachine_executor_remove(statemachine_t *statemachine);
+/**
+ * Wait until every statemachine in the executor has processed the events dispatched to it
+ * @param executor
+ */
+void statemachine_executor_flush(statemachine_executor_t *executor);
+/**
+ * Read the executor counters
+ * @param executor
+ * @param stats
+ */
+void statemachine_executor_stats(statemachine_executor_t *executor, statemachine_executor_stats_t *stats);
+/**
+ * Get the number of workers of an executor
+ * @param executor
+ * @return
+ */
+unsigned int statemachine_executor_workers(statemachine_executor_t *executor);
+/**
+ * Stop the workers once the dispatched events are processed and free the executor. Statemachines still in the executor
+ * must not be dispatched to afterwards.
+ * @param executor
+ */
+void statemachine_executor_destroy(statemachine_executor_t *executor);
+
+/**
+ * Hand a statemachine with queued events to the worker owning it. Called by statemachine_dispatch.
+ * @param statemachine
+ * @param shard
+ */
+void statemachine_executor_schedule(statemachine_t *statemachine, struct statemachine_shard *shard);
+
+#endif //EMERSON_THERMOSTAT_STATEMACHINE_EXECUTOR_H
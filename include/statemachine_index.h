@@ -0,0 +1,90 @@
+//
+// Which of many statemachines are in each state of their chart, kept up to date as they enter and leave states
+//
+
+#ifndef EMERSON_THERMOSTAT_STATEMACHINE_INDEX_H
+#define EMERSON_THERMOSTAT_STATEMACHINE_INDEX_H
+
+#include "statemachine.h"
+
+/**
+ * A bitset per state of a chart over a fleet of statemachines running it. Each statemachine added to the index gets a
+ * position and sets its bit in the bitset of every state it enters and clears it in the bitset of every state it
+ * leaves, from whichever thread processes it. Counting the members of a state is a popcount over its bitset and
+ * listing them walks its set bits, so neither looks at the statemachines. Readers on other threads see each
+ * statemachine's membership as of its last entry or exit, not a snapshot of the whole fleet at one instant.
+ */
+typedef struct statemachine_index {
+    statemachine_model_t *model;
+    size_t capacity; // positions statemachines can be added at
+    size_t words; // 64 bit words per bitset
+    atomic_uint_least64_t *members; // the bitset of each state in pre-order, one after the other
+} statemachine_index_t;
+
+/**
+ * Create the bitsets of an index
+ * @param index
+ * @param model compiled if it isn't yet, only statemachines running it can be added
+ * @param capacity number of positions
+ * @return 0 on success, -1 if the model couldn't be compiled or the bitsets allocated
+ */
+int statemachine_index_init(statemachine_index_t *index, statemachine_model_t *model, size_t capacity);
+/**
+ * Free the bitsets of an index. Every statemachine must have been removed or deinitialized.
+ * @param index
+ */
+void statemachine_index_deinit(statemachine_index_t *index);
+/**
+ * Add a statemachine to an index at a position of its own, its current states are indexed right away. Waits for any
+ * thread processing the statemachine to finish so no state is entered or left halfway through, like
+ * statemachine_executor_remove. It stays in the index until it is removed or deinitialized.
+ * @param index
+ * @param statemachine initialized with the model of the index
+ * @param position below the capacity, not used by another statemachine
+ * @return 0 on success, -1 if the statemachine runs another model, is in an index already or the position is out of
+ * range
+ */
+int statemachine_index_add(statemachine_index_t *index, statemachine_t *statemachine, size_t position);
+/**
+ * Take a statemachine out of its index, waiting for any thread processing it to finish
+ * @param statemachine
+ */
+void statemachine_index_remove(statemachine_t *statemachine);
+/**
+ * Count the statemachines in a state
+ * @param index
+ * @param id of the state
+ * @return 0 if the chart has no such state
+ */
+size_t statemachine_index_count(const statemachine_index_t *index, short id);
+/**
+ * Find the next statemachine in a state, in order of position. Iterate over the members of a state with
+ *
+ *     for (size_t i = statemachine_index_next(index, id, 0); i < index->capacity;
+ *          i = statemachine_index_next(index, id, i + 1))
+ *
+ * @param index
+ * @param id of the state
+ * @param position to start looking at
+ * @return position of the first member at or after position, the capacity if there is none
+ */
+size_t statemachine_index_next(const statemachine_index_t *index, short id, size_t position);
+
+/**
+ * Set or clear the bit of a statemachine in the bitset of a state. Called by the engine as states are entered and left.
+ * @param statemachine in an index
+ * @param state pre-order index of the state
+ * @param active
+ */
+static inline void statemachine_index_update(statemachine_t *statemachine, unsigned short state, char active) {
+    statemachine_index_t *index = statemachine->index;
+    atomic_uint_least64_t *word = &index->members[(size_t) state * index->words + statemachine->position / 64];
+    uint64_t bit = 1ULL << (statemachine->position % 64);
+    if (active) {
+        atomic_fetch_or_explicit(word, bit, memory_order_relaxed);
+    } else {
+        atomic_fetch_and_explicit(word, ~bit, memory_order_relaxed);
+    }
+}
+
+#endif //EMERSON_THERMOSTAT_STATEMACHINE_INDEX_H
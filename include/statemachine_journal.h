@@ -0,0 +1,148 @@
+//
+// Append-only journal of the events statemachines process, and its deterministic replay
+//
+
+#ifndef EMERSON_THERMOSTAT_STATEMACHINE_JOURNAL_H
+#define EMERSON_THERMOSTAT_STATEMACHINE_JOURNAL_H
+
+#include "statemachine.h"
+
+// bytes of records buffered in memory before the thread processing an event has to write them out itself
+#ifndef STATEMACHINE_JOURNAL_BUFFER
+#define STATEMACHINE_JOURNAL_BUFFER (1 << 16)
+#endif
+
+// longest time in milliseconds a record waits before the journal thread writes it and syncs the file
+#ifndef STATEMACHINE_JOURNAL_INTERVAL
+#define STATEMACHINE_JOURNAL_INTERVAL 100
+#endif
+
+#define STATEMACHINE_JOURNAL_MAGIC "SMJN"
+#define STATEMACHINE_JOURNAL_VERSION 1
+
+/**
+ * What a journal record describes
+ */
+typedef enum {
+    STATEMACHINE_JOURNAL_EVENT = 1, // event was processed, its payload follows the record
+    STATEMACHINE_JOURNAL_TRANSITION // a transition from source to target was taken while processing the last event
+} statemachine_journal_kind_t;
+
+/**
+ * A journal file starts with this header followed by records. Both are written in the byte order of the host.
+ */
+typedef struct statemachine_journal_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+} statemachine_journal_header_t;
+
+/**
+ * One step of a statemachine in the order its events were processed. Time events are journaled with the negative
+ * event they are queued with and passes over the completion transitions with event 0.
+ */
+typedef struct statemachine_journal_record {
+    uint64_t timestamp; // CLOCK_MONOTONIC nanoseconds
+    uint64_t inputs; // inputs changed since the statemachine last processed an event, see statemachine_changed
+    uint32_t statemachine; // id of the statemachine
+    int16_t event;
+    int16_t source;
+    int16_t target;
+    uint8_t kind;
+    uint8_t size; // bytes of payload following an event record
+    uint8_t reserved[4];
+} statemachine_journal_record_t;
+
+/**
+ * Where a replay ended
+ */
+typedef struct statemachine_journal_replay {
+    size_t events; // event records replayed
+    size_t transitions; // transition records matched
+    size_t mismatch; // offset of the record the replay diverged at, 0 if it matched the journal to the end
+    const char *reason; // why it diverged
+    size_t truncated; // bytes of a record cut off at the end of the journal, left out of the replay
+} statemachine_journal_replay_t;
+
+/**
+ * Set while journaling or replaying, read with statemachine_journal_enabled
+ */
+extern atomic_char statemachine_journaling;
+
+/**
+ * Start journaling every event processed by any statemachine in the process and the transitions it took. Records are
+ * appended to a buffer under a lock and a journal thread writes and syncs them every STATEMACHINE_JOURNAL_INTERVAL
+ * milliseconds, so a crash loses at most that much.
+ * @param path file to write, truncated
+ * @param payload_size bytes of data an event dispatched without a copied payload carries, copied from its trigger into
+ * the journal, 0 for none
+ * @return 0 on success, -1 if journaling is already on or the file or thread couldn't be created
+ */
+int statemachine_journal_start(const char *path, size_t (*payload_size)(event_t event));
+/**
+ * Stop journaling, write out and sync the records still buffered and close the file
+ * @return bytes of records that couldn't be written, 0 if the journal is complete. Nothing is written after the first
+ * write that fails, so the journal ends with the records before it.
+ */
+size_t statemachine_journal_stop();
+/**
+ * Feed a journal back through statemachine_dispatch on the calling thread as fast as possible and check every
+ * transition taken against the journal. Timers are moved to a virtual clock that follows the journal's timestamps and
+ * never expires them, each journaled time event fires its timer when its record comes up, so the replay takes the same
+ * steps whatever the timing of the run that was journaled. Timers stay on the virtual clock afterwards. Statemachines
+ * must start from the configuration they were in when journaling started and only be processed by the replay. A
+ * journal cut off by a crash or a failed write is replayed up to its last whole record, the transitions a statemachine
+ * takes for its last journaled event past the cut aren't checked.
+ * @param path
+ * @param resolve returns the statemachine replaying the one journaled under an id, called for every event record
+ * @param context passed to resolve
+ * @param replay filled in with how far the replay got
+ * @return 0 if the replay matched the journal, 1 if it diverged, -1 if the journal couldn't be read, a statemachine
+ * couldn't be resolved, timers are armed on the real clock or a replay is already running
+ */
+int statemachine_journal_replay(const char *path, statemachine_t *(*resolve)(uint32_t id, void *context),
+                                void *context, statemachine_journal_replay_t *replay);
+/**
+ * Journal an event or, while replaying, check it against the journal. Use statemachine_journal_event.
+ * @param statemachine
+ * @param trigger
+ */
+void statemachine_journal_write_event(statemachine_t *statemachine, const trigger_t *trigger);
+/**
+ * Journal a transition or, while replaying, check it against the journal. Use statemachine_journal_transition.
+ * @param statemachine
+ * @param transition
+ * @param trigger
+ */
+void statemachine_journal_write_transition(statemachine_t *statemachine, const transition_t *transition,
+                                           const trigger_t *trigger);
+
+/**
+ * Check whether journaling or a replay is on
+ * @return
+ */
+static inline char statemachine_journal_enabled() {
+    return atomic_load_explicit(&statemachine_journaling, memory_order_relaxed);
+}
+
+/**
+ * Journal an event about to be processed if journaling is on. Costs a load and a branch while it is off.
+ * @param statemachine
+ * @param trigger
+ */
+static inline void statemachine_journal_event(statemachine_t *statemachine, const trigger_t *trigger) {
+    if (statemachine_journal_enabled()) statemachine_journal_write_event(statemachine, trigger);
+}
+
+/**
+ * Journal a transition being taken if journaling is on
+ * @param statemachine
+ * @param transition
+ * @param trigger
+ */
+static inline void statemachine_journal_transition(statemachine_t *statemachine, const transition_t *transition,
+                                                   const trigger_t *trigger) {
+    if (statemachine_journal_enabled()) statemachine_journal_write_transition(statemachine, transition, trigger);
+}
+
+#endif //EMERSON_THERMOSTAT_STATEMACHINE_JOURNAL_H
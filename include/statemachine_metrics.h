@@ -0,0 +1,111 @@
+//
+// Counters and latency histograms of statemachine models
+//
+
+#ifndef EMERSON_THERMOSTAT_STATEMACHINE_METRICS_H
+#define EMERSON_THERMOSTAT_STATEMACHINE_METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// histogram buckets split every power of two into 2^n linear sub-buckets, 4 keeps values within 6.25% of the truth
+#define STATEMACHINE_HISTOGRAM_SUB_BITS 4
+#define STATEMACHINE_HISTOGRAM_BUCKETS ((64 - STATEMACHINE_HISTOGRAM_SUB_BITS + 1) << STATEMACHINE_HISTOGRAM_SUB_BITS)
+
+/**
+ * Log-linear histogram of nanosecond durations in the style of HdrHistogram. Any thread can record into it without
+ * locking.
+ */
+typedef struct statemachine_histogram {
+    atomic_ulong counts[STATEMACHINE_HISTOGRAM_BUCKETS];
+    atomic_ulong count;
+    atomic_ullong sum;
+    atomic_ullong max;
+} statemachine_histogram_t;
+
+/**
+ * Counters of a transition
+ */
+typedef struct statemachine_transition_metrics {
+    atomic_ulong fired; // times the transition was taken
+    atomic_ulong rejected; // times its guard returned 0
+    atomic_ullong guard_ns; // time spent in its guard
+    atomic_ullong effect_ns; // time spent in its effect
+} statemachine_transition_metrics_t;
+
+/**
+ * Counters of a state
+ */
+typedef struct statemachine_state_metrics {
+    atomic_ulong entries;
+    atomic_ullong residency_ns; // time spent active, added when the state is exited
+} statemachine_state_metrics_t;
+
+/**
+ * Metrics of every statemachine running a model, kept with its compiled tables
+ */
+typedef struct statemachine_metrics {
+    statemachine_histogram_t latency; // from dispatching an event until the statemachine settled after processing it
+    statemachine_histogram_t guard; // guard evaluations
+    statemachine_histogram_t effect; // transition effects
+    statemachine_transition_metrics_t *transitions; // one per entry in the model's transitions
+    statemachine_state_metrics_t *states; // one per state in pre-order
+} statemachine_metrics_t;
+
+/**
+ * Set while metrics are collected, read with statemachine_metrics_enabled
+ */
+extern atomic_char statemachine_measuring;
+
+/**
+ * Check whether metrics are collected
+ * @return
+ */
+static inline char statemachine_metrics_enabled() {
+    return atomic_load_explicit(&statemachine_measuring, memory_order_relaxed);
+}
+
+/**
+ * Read the clock metrics are measured with
+ * @return CLOCK_MONOTONIC nanoseconds
+ */
+static inline uint64_t statemachine_metrics_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+/**
+ * Start or stop collecting metrics for every model. While stopped the engine only checks this flag.
+ * @param enabled
+ */
+void statemachine_metrics_enable(char enabled);
+/**
+ * Allocate zeroed metrics for a model
+ * @param transition_count
+ * @param state_count
+ * @return NULL if they couldn't be allocated
+ */
+statemachine_metrics_t *statemachine_metrics_create(size_t transition_count, size_t state_count);
+/**
+ * Free metrics allocated by statemachine_metrics_create
+ * @param metrics
+ */
+void statemachine_metrics_destroy(statemachine_metrics_t *metrics);
+/**
+ * Add a duration to a histogram
+ * @param histogram
+ * @param nanoseconds
+ */
+void statemachine_histogram_record(statemachine_histogram_t *histogram, uint64_t nanoseconds);
+/**
+ * Get a percentile of a histogram
+ * @param histogram
+ * @param fraction between 0 and 1
+ * @return the largest value the bucket holding the percentile can hold, 0 if nothing was recorded
+ */
+uint64_t statemachine_histogram_percentile(statemachine_histogram_t *histogram, double fraction);
+
+#endif //EMERSON_THERMOSTAT_STATEMACHINE_METRICS_H
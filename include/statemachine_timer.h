@@ -0,0 +1,77 @@
+//
+// Timer service used by statemachine time events
+//
+
+#ifndef EMERSON_THERMOSTAT_STATEMACHINE_TIMER_H
+#define EMERSON_THERMOSTAT_STATEMACHINE_TIMER_H
+
+// the timer wheel has this many levels of 64 slots, one tick is a millisecond. Timers further out than the last level
+// reaches (about 12 days with 5 levels) are parked in it and moved down when their slot comes around.
+#ifndef STATEMACHINE_TIMER_LEVELS
+#define STATEMACHINE_TIMER_LEVELS 5
+#endif
+
+/**
+ * A timer owned by the caller and linked into the shared timer wheel while it is armed. Timers are intrusive so arming
+ * and cancelling never allocate.
+ */
+typedef struct statemachine_timer {
+    struct statemachine_timer *next;
+    struct statemachine_timer **link; // the pointer linking the timer into its slot, NULL while the timer isn't armed
+    unsigned short slot; // level * 64 + slot the timer is linked into
+    unsigned long long expires; // tick the timer expires at
+    unsigned long generation; // incremented every time the timer is armed
+    /**
+     * Called from the timer thread once the timer expires. The generation is the one the timer was armed with, compare
+     * it to the current generation to tell whether the timer was armed again before the expiry was handled.
+     */
+    void (*expire)(struct statemachine_timer *timer, unsigned long generation);
+} statemachine_timer_t;
+
+/**
+ * Arm a timer on the shared timer wheel, starting the timer thread on first use. A timer that is already armed is moved
+ * to its new expiry. O(1).
+ * @param timer
+ * @param milliseconds
+ * @return the generation the timer was armed with, 0 if the timer thread couldn't be started
+ */
+unsigned long statemachine_timer_arm(statemachine_timer_t *timer, unsigned long milliseconds);
+/**
+ * Take a timer off the wheel. Does nothing if it isn't armed. O(1).
+ * @param timer
+ */
+void statemachine_timer_cancel(statemachine_timer_t *timer);
+/**
+ * Get when an armed timer expires
+ * @param timer
+ * @return the tick on the clock of statemachine_timer_now, 0 if the timer isn't armed
+ */
+unsigned long long statemachine_timer_expires(statemachine_timer_t *timer);
+/**
+ * Wait until the timer thread has finished calling the expire callbacks it had collected. Call this after cancelling
+ * timers and before freeing them.
+ */
+void statemachine_timer_sync();
+/**
+ * Move timers to a virtual clock, or move the virtual clock forward to a tick. Once virtual, statemachine_timer_now
+ * returns the virtual time and timers are armed relative to it but never expire, whoever drives the clock decides
+ * when their time events happen, see statemachine_timer_advance. Replays use it to run at their own pace.
+ * @param now tick the virtual clock starts at or is moved to, it never goes back
+ * @return 0 on success, -1 if timers are armed on the real clock or the timer thread couldn't be started
+ */
+int statemachine_timer_virtual(unsigned long long now);
+/**
+ * Move the virtual clock forward to a tick and expire the timers due on the way, in the order they expire, on the
+ * calling thread. The clock stops at every tick a timer expires on while its callback runs, so time events dispatched
+ * from it and the timers they arm see the time they were due at. Only one thread may drive the clock.
+ * @param now tick to move the virtual clock to, it never goes back
+ * @return number of timers that expired, 0 as well if timers aren't on a virtual clock
+ */
+unsigned long statemachine_timer_advance(unsigned long long now);
+/**
+ * Read the clock timers run on
+ * @return monotonic time in milliseconds, or the virtual time once statemachine_timer_virtual was called
+ */
+unsigned long long statemachine_timer_now();
+
+#endif //EMERSON_THERMOSTAT_STATEMACHINE_TIMER_H
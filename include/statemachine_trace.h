@@ -0,0 +1,120 @@
+//
+// Binary tracing of statemachine activity
+//
+
+#ifndef EMERSON_THERMOSTAT_STATEMACHINE_TRACE_H
+#define EMERSON_THERMOSTAT_STATEMACHINE_TRACE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// records each thread can have waiting to be written before new ones are dropped, must be a power of two
+#ifndef STATEMACHINE_TRACE_RING_SIZE
+#define STATEMACHINE_TRACE_RING_SIZE 8192
+#endif
+
+// longest time in milliseconds a record waits in its ring before the trace thread writes it out
+#ifndef STATEMACHINE_TRACE_INTERVAL
+#define STATEMACHINE_TRACE_INTERVAL 10
+#endif
+
+#define STATEMACHINE_TRACE_MAGIC "SMTR"
+#define STATEMACHINE_TRACE_VERSION 1
+
+/**
+ * What a trace record describes
+ */
+typedef enum {
+    STATEMACHINE_TRACE_ENTRY = 1, // source was entered
+    STATEMACHINE_TRACE_EXIT, // source was exited
+    STATEMACHINE_TRACE_TRANSITION, // a transition from source to target was taken on event
+    STATEMACHINE_TRACE_UNHANDLED, // no transition consumed event
+    STATEMACHINE_TRACE_DROPPED // event was dispatched while the queue was full
+} statemachine_trace_kind_t;
+
+/**
+ * A trace file starts with this header followed by records. Both are written in the byte order of the host.
+ */
+typedef struct statemachine_trace_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+} statemachine_trace_header_t;
+
+/**
+ * One traced step of a statemachine. Time events are traced with the negative event they are queued with and
+ * completion transitions and initial entries with event 0.
+ */
+typedef struct statemachine_trace_record {
+    uint64_t timestamp; // CLOCK_MONOTONIC nanoseconds
+    uint32_t statemachine; // id of the statemachine
+    uint16_t thread; // tracing thread, in the order threads first traced
+    int16_t event;
+    int16_t source;
+    int16_t target;
+    uint8_t kind;
+    uint8_t reserved[3];
+} statemachine_trace_record_t;
+
+/**
+ * Counters of the tracer
+ */
+typedef struct statemachine_trace_stats {
+    unsigned long written; // records written to the trace file
+    unsigned long dropped; // records lost because the ring of their thread was full
+} statemachine_trace_stats_t;
+
+/**
+ * Set while tracing is on, read with statemachine_trace_enabled
+ */
+extern atomic_char statemachine_tracing;
+
+/**
+ * Start tracing every statemachine in the process. Records go to a lock-free ring of the thread producing them and a
+ * trace thread writes them to the file in the background.
+ * @param path file to write, truncated
+ * @return 0 on success, -1 if tracing is already on or the file or thread couldn't be created
+ */
+int statemachine_trace_start(const char *path);
+/**
+ * Stop tracing, write out the records still in the rings and close the file
+ */
+void statemachine_trace_stop();
+/**
+ * Read the tracer counters of the current or last trace
+ * @param stats
+ */
+void statemachine_trace_stats(statemachine_trace_stats_t *stats);
+/**
+ * Append a record to the ring of the calling thread. Use statemachine_trace which skips this while tracing is off.
+ * @param statemachine
+ * @param kind
+ * @param event
+ * @param source
+ * @param target
+ */
+void statemachine_trace_write(unsigned int statemachine, statemachine_trace_kind_t kind, short event, short source,
+                              short target);
+
+/**
+ * Check whether tracing is on
+ * @return
+ */
+static inline char statemachine_trace_enabled() {
+    return atomic_load_explicit(&statemachine_tracing, memory_order_relaxed);
+}
+
+/**
+ * Trace a step of a statemachine if tracing is on. Costs a load and a branch while it is off.
+ * @param statemachine
+ * @param kind
+ * @param event
+ * @param source
+ * @param target
+ */
+static inline void statemachine_trace(unsigned int statemachine, statemachine_trace_kind_t kind, short event,
+                                      short source, short target) {
+    if (statemachine_trace_enabled()) statemachine_trace_write(statemachine, kind, event, source, target);
+}
+
+#endif //EMERSON_THERMOSTAT_STATEMACHINE_TRACE_H
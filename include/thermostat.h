@@ -7,7 +7,6 @@
 
 
 #include "statemachine.h"
-#include <time.h>
 
 /**
  * Thermostat Events
@@ -23,6 +22,21 @@ enum {
     THERMOSTAT_POWER_OFF = '9'
 };
 
+// menu command printing the statemachine metrics, handled by the menu instead of being dispatched
+#define THERMOSTAT_PRINT_METRICS '7'
+
+// layout of thermostat snapshots and fleet snapshot files, others are refused
+#define THERMOSTAT_SNAPSHOT_VERSION 1
+
+/**
+ * Inputs the guards of the thermostat's completion transitions read, see transition_t depends
+ */
+enum {
+    THERMOSTAT_INPUT_TEMPERATURE = 1 << 0, // current temperature reading
+    THERMOSTAT_INPUT_SETPOINT = 1 << 1, // setpoints of the modes
+    THERMOSTAT_INPUT_ACTIVE_TIME = 1 << 2 // the current mode's minimum active time elapsed
+};
+
 
 /**
  * State ID enumeration
@@ -36,34 +50,159 @@ enum {
     THERMOSTAT_COOLING
 };
 
+/**
+ * Position of each mode in thermostat_t modes
+ */
+enum {
+    THERMOSTAT_MODE_OFF,
+    THERMOSTAT_MODE_HEAT,
+    THERMOSTAT_MODE_COOL,
+    THERMOSTAT_MODE_COUNT
+};
+
 /**
  * A mode is a thermostat state for heating, cooling, & off
  */
 typedef struct {
     float setpoint; // set this to control when the mode activates
-    time_t active_timestamp;
+    char minimum_active_time_elapsed; // set by a time event once the mode has been active for its minimum active time
     char invert;
     float minimum_active_time; // set this to prevent short cycling the equipment in seconds
 } thermostat_mode_data_t;
 
 
+/**
+ * What other threads can read of a thermostat, see thermostat_view
+ */
+typedef struct thermostat_view {
+    short state; // id of the active leaf state, 0 once powered off
+    short mode; // position of the current mode in thermostat_t modes
+    float temperature;
+    float heat_setpoint;
+    float cool_setpoint;
+} thermostat_view_t;
+
 /**
  * The system region is responsible for responding to user input
  */
 typedef struct {
     statemachine_t statemachine; // base struct
     float current_temperature; // current temperature reading
+    thermostat_mode_data_t modes[THERMOSTAT_MODE_COUNT]; // this thermostat's off, heat and cool modes
     struct {
         thermostat_mode_data_t *current;
         thermostat_mode_data_t *cool;
         thermostat_mode_data_t *heat;
     } mode;
+    atomic_uint view_sequence; // odd while the thread processing the thermostat publishes its view
+    atomic_uint_least64_t view[2]; // thermostat_view_t published after every event
 } thermostat_t;
 
+/**
+ * Thermostats log their transitions to the console when this is set. Off by default, the engine's binary trace (see
+ * statemachine_trace.h) records the same steps without slowing down dispatch.
+ */
+extern char thermostat_logging;
+
+/**
+ * Defaults of the off, heat and cool modes every thermostat starts with
+ */
+extern const thermostat_mode_data_t thermostat_mode_data[THERMOSTAT_MODE_COUNT];
+
+/**
+ * The thermostat chart, shared by every thermostat
+ */
+extern statemachine_model_t thermostat_model;
+
+/**
+ * Create a thermostat with the default setpoints and start its statemachine. Any number of thermostats can run in one
+ * process, they all share thermostat_model.
+ * @return NULL if it couldn't be allocated
+ */
+thermostat_t *thermostat_create();
+/**
+ * Terminate a thermostat and free it
+ * @param thermostat
+ */
+void thermostat_destroy(thermostat_t *thermostat);
+
+/**
+ * Read what a thermostat looked like once its last event had run to completion, from any thread. The thread processing
+ * the thermostat publishes it with a sequence lock, so readers never block it and never see the fields of two
+ * different events. A reader only retries while a publication is under way.
+ * @param thermostat
+ * @param view
+ */
+void thermostat_view(thermostat_t *thermostat, thermostat_view_t *view);
+
+/**
+ * Get the most bytes a thermostat snapshot can take, which is also the size of each record in a fleet snapshot file
+ * @return 0 if the thermostat chart couldn't be compiled
+ */
+size_t thermostat_snapshot_size();
+/**
+ * Save a thermostat: its temperature, the setpoints, minimum active times and elapsed flags of its modes, the current
+ * mode and its statemachine snapshot, see statemachine_snapshot. Take it while no other thread processes the thermostat,
+ * hold it with statemachine_hold if one could.
+ * @param thermostat
+ * @param buffer
+ * @param size bytes available in buffer
+ * @return bytes the snapshot takes, nothing is written if it is more than size
+ */
+size_t thermostat_snapshot(thermostat_t *thermostat, void *buffer, size_t size);
+/**
+ * Create a thermostat from a snapshot. It resumes in the state it was saved in without running any entry action, and
+ * a minimum active time that was running goes on from where it was.
+ * @param snapshot
+ * @param size bytes in snapshot
+ * @return NULL if the snapshot is of another version or chart, is truncated or the thermostat couldn't be allocated
+ */
+thermostat_t *thermostat_restore(const void *snapshot, size_t size);
+/**
+ * Save a fleet of thermostats to a file of fixed size records. The file is written through a memory mapping next to
+ * the path and renamed over it once complete, so a crash while saving leaves the previous snapshot in place.
+ * @param path
+ * @param thermostats
+ * @param count
+ * @return 0 on success, -1 if the file couldn't be written
+ */
+int thermostat_fleet_save(const char *path, thermostat_t **thermostats, size_t count);
+/**
+ * Restore a fleet saved by thermostat_fleet_save. The file is mapped and every record restored in place.
+ * @param path
+ * @param count set to the number of thermostats restored
+ * @return array of the thermostats in the order they were saved, free it after destroying them, NULL if the file
+ * couldn't be read or a record couldn't be restored
+ */
+thermostat_t **thermostat_fleet_restore(const char *path, size_t *count);
+
+/**
+ * Get the display name of a thermostat state
+ * @param id
+ * @return NULL if the id isn't a thermostat state
+ */
+const char *thermostat_state_name(short id);
+/**
+ * Get the display name of a thermostat event
+ * @param event
+ * @return NULL if the event isn't a thermostat event
+ */
+const char *thermostat_event_name(event_t event);
+
+/**
+ * Get the size of the data a thermostat event carries, for statemachine_journal_start
+ * @param event
+ * @return 0 for events without data
+ */
+size_t thermostat_payload_size(event_t event);
+
 /**
  * Thermostat run
+ * @param snapshot optional file the thermostat is restored from on start and saved to after every command
+ * @param control optional Unix domain socket clients can control the thermostat through alongside the menu, as
+ * thermostat 0, see thermostat_control_serve
  */
-void thermostat_run();
+void thermostat_run(const char *snapshot, const char *control);
 
 
 
@@ -0,0 +1,68 @@
+//
+// Evaluates the on and off conditions of the heat and cool modes of a fleet of thermostats a block at a time
+//
+
+#ifndef EMERSON_THERMOSTAT_THERMOSTAT_CONDITIONS_H
+#define EMERSON_THERMOSTAT_THERMOSTAT_CONDITIONS_H
+
+#include "thermostat.h"
+
+/**
+ * Instruction sets the conditions can be evaluated with
+ */
+typedef enum {
+    THERMOSTAT_KERNEL_SCALAR,
+    THERMOSTAT_KERNEL_SSE, // 4 thermostats at a time
+    THERMOSTAT_KERNEL_AVX2 // 8 thermostats at a time
+} thermostat_kernel_t;
+
+/**
+ * What the guards of the completion transitions between idling and running a mode read of each thermostat of a fleet,
+ * one array per field. thermostat_mode_on_constraint() holds when the temperature is below the setpoint, or above it if
+ * the mode is inverted, and thermostat_mode_off_constraint() when it is at or above the setpoint, or at or below it,
+ * once the minimum active time has elapsed. A reading that leaves both comparisons as they were for the last reading
+ * sent can't make either transition fire, now or when the minimum active time elapses, so it may be held back without
+ * changing what the thermostat does.
+ */
+typedef struct thermostat_conditions {
+    float *temperature; // last reading sent to each thermostat
+    float *setpoint; // of the current mode of each thermostat, NaN in a mode without equipment
+    uint32_t *invert; // all bits set for the thermostats whose mode runs its equipment above the setpoint
+    size_t count;
+    thermostat_kernel_t kernel; // the widest the cpu supports, may be narrowed
+} thermostat_conditions_t;
+
+/**
+ * Allocate the arrays of a fleet, every thermostat starts out in a mode without equipment
+ * @param conditions
+ * @param count number of thermostats
+ * @return 0 on success, -1 if it couldn't be allocated
+ */
+int thermostat_conditions_init(thermostat_conditions_t *conditions, size_t count);
+/**
+ * Free the arrays of a fleet
+ * @param conditions
+ */
+void thermostat_conditions_deinit(thermostat_conditions_t *conditions);
+/**
+ * Copy the temperature, setpoint and mode a thermostat published last. Call it again whenever its mode or setpoints
+ * change.
+ * @param conditions
+ * @param position of the thermostat
+ * @param thermostat
+ */
+void thermostat_conditions_track(thermostat_conditions_t *conditions, size_t position, thermostat_t *thermostat);
+/**
+ * Find the thermostats of a range whose on or off condition a new reading changes, the ones whose completion
+ * transitions may fire, and make those readings their last ones. The others need not be sent their reading.
+ * @param conditions
+ * @param readings new temperature of every thermostat, by position
+ * @param first position of the range
+ * @param last one past the last position of the range
+ * @param changed filled with the positions found, in order, room for last - first of them
+ * @return number of positions found
+ */
+size_t thermostat_conditions_changed(thermostat_conditions_t *conditions, const float *readings, size_t first,
+                                     size_t last, size_t *changed);
+
+#endif //EMERSON_THERMOSTAT_THERMOSTAT_CONDITIONS_H
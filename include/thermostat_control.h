@@ -0,0 +1,101 @@
+//
+// Non-blocking control server driving a fleet of thermostats from local clients over a Unix domain socket
+//
+
+#ifndef EMERSON_THERMOSTAT_THERMOSTAT_CONTROL_H
+#define EMERSON_THERMOSTAT_THERMOSTAT_CONTROL_H
+
+#include "thermostat.h"
+#include "statemachine_index.h"
+
+// longest request line a client can send
+#ifndef THERMOSTAT_CONTROL_LINE
+#define THERMOSTAT_CONTROL_LINE 256
+#endif
+
+// bytes of responses a connection holds before it stops reading requests until the client catches up
+#ifndef THERMOSTAT_CONTROL_OUTPUT
+#define THERMOSTAT_CONTROL_OUTPUT (1 << 14)
+#endif
+
+// command of a request that only returns the thermostat's state
+#define THERMOSTAT_CONTROL_QUERY '?'
+// takes the place of the thermostat id in a request that counts the thermostats in a state
+#define THERMOSTAT_CONTROL_FLEET '*'
+
+/**
+ * Counters of a control server
+ */
+typedef struct thermostat_control_stats {
+    unsigned long connections; // accepted so far
+    unsigned long requests; // answered, errors included
+    unsigned long errors; // requests that were refused
+} thermostat_control_stats_t;
+
+/**
+ * Serves requests for a fleet of thermostats. The value of a command is carried inline with its event.
+ */
+typedef struct thermostat_control {
+    thermostat_t **thermostats;
+    size_t count;
+    statemachine_index_t *index; // of the thermostats by position, optional, answers fleet requests
+    int wake[2]; // pipe thermostat_control_stop writes to
+    int listener;
+    int epoll;
+    const char *path; // of the socket, removed when the server stops
+    pthread_t thread; // serving the socket if started with thermostat_control_start
+    char started;
+    thermostat_control_stats_t stats;
+} thermostat_control_t;
+
+/**
+ * Get ready to serve a fleet of thermostats
+ * @param control
+ * @param thermostats addressed by their position in the array, must outlive the server
+ * @param count
+ * @return 0 on success, -1 if the wake pipe couldn't be created
+ */
+int thermostat_control_init(thermostat_control_t *control, thermostat_t **thermostats, size_t count);
+/**
+ * Stop a server started with thermostat_control_start and wait for its thread, and close what thermostat_control_init
+ * opened.
+ * @param control
+ */
+void thermostat_control_deinit(thermostat_control_t *control);
+/**
+ * Listen on a Unix domain socket and serve every client that connects on the calling thread until
+ * thermostat_control_stop is called. Sockets are non-blocking and watched with epoll, so a slow client never holds up
+ * the others.
+ *
+ * A request is a line of a thermostat id, a command and, for commands that take one, a value, separated by spaces. The
+ * commands are the menu keys: the THERMOSTAT_SET_* events, THERMOSTAT_POWER_OFF and THERMOSTAT_CONTROL_QUERY. Clients
+ * may send any number of requests without waiting, each is answered by one line in the order they were sent, once its
+ * command has been processed. A query doesn't wait for the thermostat, it is answered from the state it published last:
+ *
+ *     ok <id> <state id> <temperature> <heat setpoint> <cool setpoint> <state name>
+ *     error <reason>
+ *
+ * With an index a request of THERMOSTAT_CONTROL_FLEET and a state id is answered with how many thermostats are in the
+ * state, counted from the index without looking at any of them:
+ *
+ *     ok * <state id> <count> <state name>
+ *
+ * @param control
+ * @param path of the socket, replaced if it exists and removed when done
+ * @return 0 once stopped, -1 if the socket couldn't be created
+ */
+int thermostat_control_serve(thermostat_control_t *control, const char *path);
+/**
+ * Serve the socket like thermostat_control_serve on a thread of its own until thermostat_control_deinit
+ * @param control
+ * @param path of the socket, must outlive the server
+ * @return 0 on success, -1 if the socket or the thread couldn't be created
+ */
+int thermostat_control_start(thermostat_control_t *control, const char *path);
+/**
+ * Make thermostat_control_serve return. Safe to call from any thread and from signal handlers.
+ * @param control
+ */
+void thermostat_control_stop(thermostat_control_t *control);
+
+#endif //EMERSON_THERMOSTAT_THERMOSTAT_CONTROL_H
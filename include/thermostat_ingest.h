@@ -0,0 +1,111 @@
+//
+// Streams temperature readings from files, pipes and Unix domain sockets into a fleet of thermostats
+//
+
+#ifndef EMERSON_THERMOSTAT_THERMOSTAT_INGEST_H
+#define EMERSON_THERMOSTAT_THERMOSTAT_INGEST_H
+
+#include "thermostat.h"
+
+// bytes read from a stream at a time, also the longest line the text protocol accepts
+#ifndef THERMOSTAT_INGEST_BUFFER
+#define THERMOSTAT_INGEST_BUFFER (1 << 16)
+#endif
+
+// readings collected before they are dispatched with statemachine_dispatch_batch
+#ifndef THERMOSTAT_INGEST_BATCH
+#define THERMOSTAT_INGEST_BATCH 256
+#endif
+
+// sensor connections a socket serves at the same time, more wait to be accepted
+#ifndef THERMOSTAT_INGEST_CONNECTIONS
+#define THERMOSTAT_INGEST_CONNECTIONS 16
+#endif
+
+#define THERMOSTAT_INGEST_MAGIC "THIN"
+#define THERMOSTAT_INGEST_VERSION 1
+
+/**
+ * A reading of the binary protocol. A binary stream starts with a thermostat_ingest_header_t and is followed by these
+ * records, both in the byte order of the host.
+ */
+typedef struct thermostat_reading {
+    uint32_t id; // position of the thermostat in the fleet
+    float temperature;
+    uint64_t timestamp; // milliseconds, 0 if the reading has none
+} thermostat_reading_t;
+
+/**
+ * Starts a binary stream, any other stream is read as text
+ */
+typedef struct thermostat_ingest_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+} thermostat_ingest_header_t;
+
+/**
+ * Counters of an ingestion
+ */
+typedef struct thermostat_ingest_stats {
+    unsigned long long bytes; // read from every stream
+    unsigned long readings; // parsed from every stream
+    unsigned long dispatched; // readings dispatched to their thermostat
+    unsigned long dropped; // readings a full event queue rejected
+    unsigned long stale; // readings older than the last one dispatched to their thermostat
+    unsigned long unknown; // readings of ids outside the fleet
+    unsigned long malformed; // lines or streams that couldn't be parsed
+} thermostat_ingest_stats_t;
+
+/**
+ * Feeds readings into a fleet of thermostats. The temperature of a reading is carried inline with its event.
+ */
+typedef struct thermostat_ingest {
+    thermostat_t **thermostats;
+    size_t count;
+    uint64_t *timestamps; // timestamp of the latest reading dispatched to each thermostat
+    size_t size; // entries in the batch being collected
+    statemachine_batch_entry_t entries[THERMOSTAT_INGEST_BATCH];
+    int wake[2]; // pipe thermostat_ingest_stop writes to
+    thermostat_ingest_stats_t stats;
+} thermostat_ingest_t;
+
+/**
+ * Get ready to feed readings into a fleet of thermostats
+ * @param ingest
+ * @param thermostats read by the id of a reading, must outlive the ingestion
+ * @param count
+ * @return 0 on success, -1 if it couldn't be allocated
+ */
+int thermostat_ingest_init(thermostat_ingest_t *ingest, thermostat_t **thermostats, size_t count);
+/**
+ * Free what thermostat_ingest_init allocated
+ * @param ingest
+ */
+void thermostat_ingest_deinit(thermostat_ingest_t *ingest);
+/**
+ * Read readings from a file or pipe until it ends. The text protocol has one reading per line of a thermostat id, a
+ * temperature in decimal notation and an optional timestamp in milliseconds, separated by spaces, tabs or commas, blank
+ * lines and lines starting with '#' are skipped. Readings are parsed in place in the read buffer and dispatched in
+ * batches, nothing is allocated per reading. A reading with a timestamp older than the last one dispatched to its
+ * thermostat is dropped.
+ * @param ingest
+ * @param fd
+ * @return 0 once the stream ended, -1 if reading it failed
+ */
+int thermostat_ingest_fd(thermostat_ingest_t *ingest, int fd);
+/**
+ * Listen on a Unix domain socket and read readings from every sensor that connects, in either protocol, until
+ * thermostat_ingest_stop is called
+ * @param ingest
+ * @param path of the socket, replaced if it exists and removed when done
+ * @return 0 once stopped, -1 if the socket couldn't be created
+ */
+int thermostat_ingest_listen(thermostat_ingest_t *ingest, const char *path);
+/**
+ * Make thermostat_ingest_listen return. Safe to call from any thread and from signal handlers.
+ * @param ingest
+ */
+void thermostat_ingest_stop(thermostat_ingest_t *ingest);
+
+#endif //EMERSON_THERMOSTAT_THERMOSTAT_INGEST_H
@@ -0,0 +1,99 @@
+//
+// Runs a fleet of thermostats against a thermal model of their rooms on the virtual timer clock, faster than real time
+//
+
+#ifndef EMERSON_THERMOSTAT_THERMOSTAT_SIMULATOR_H
+#define EMERSON_THERMOSTAT_THERMOSTAT_SIMULATOR_H
+
+#include "thermostat.h"
+#include "thermostat_conditions.h"
+
+// simulated milliseconds between the temperature readings of a room
+#ifndef THERMOSTAT_SIMULATOR_STEP
+#define THERMOSTAT_SIMULATOR_STEP 10000
+#endif
+
+#define THERMOSTAT_SIMULATOR_DAY (24ULL * 60 * 60 * 1000)
+
+/**
+ * The room a thermostat is in. Its temperature drifts toward the outdoor temperature, which swings around its mean
+ * over the day, and is pushed up while the thermostat is HEATING and down while it is COOLING. Rates are in degrees
+ * per hour.
+ */
+typedef struct thermostat_room {
+    float temperature;
+    float outdoor; // mean outdoor temperature
+    float swing; // the outdoor temperature peaks this much above the mean mid-afternoon and as much below at night
+    float leakage; // fraction of the difference to the outdoor temperature lost per hour
+    float heating; // the heater's output
+    float cooling; // the air conditioner's output
+    short running; // THERMOSTAT_HEATING or THERMOSTAT_COOLING while one of them is on, 0 otherwise
+} thermostat_room_t;
+
+/**
+ * Counters of a simulation
+ */
+typedef struct thermostat_simulation_stats {
+    unsigned long long simulated; // milliseconds of simulated time
+    unsigned long long elapsed; // wall clock nanoseconds it took
+    unsigned long long readings; // temperature readings the rooms took
+    unsigned long long dispatched; // readings sent to their thermostat
+    unsigned long time_events; // timers that expired
+    unsigned long heating_cycles; // times a heater turned on
+    unsigned long cooling_cycles; // times an air conditioner turned on
+    unsigned long long heating_time; // milliseconds heaters ran, summed over every room
+    unsigned long long cooling_time; // milliseconds air conditioners ran, summed over every room
+} thermostat_simulation_stats_t;
+
+/**
+ * A fleet of thermostats and their rooms. Each room gets a climate of its own, rooms with a mean outdoor temperature
+ * below the default setpoint are heated and the others cooled. Unless every reading is asked for, a room only sends the
+ * readings that thermostat_conditions_changed() finds could make its thermostat turn its equipment on or off, which
+ * leaves what the thermostats do as it would be with every reading sent.
+ */
+typedef struct thermostat_simulation {
+    thermostat_t **thermostats;
+    thermostat_room_t *rooms;
+    float *readings; // the temperature of every room after the last step
+    thermostat_conditions_t conditions; // of every thermostat as of the last reading it was sent
+    size_t *changed; // positions of the readings to send in the current step
+    size_t count;
+    char unfiltered; // send every reading to its thermostat
+    size_t heated; // rooms in heat mode, the others are in cool mode
+    unsigned long step; // simulated milliseconds between readings
+    unsigned long long start; // tick of the virtual clock the simulation started at
+    unsigned long long now; // tick of the virtual clock the simulation has reached
+    thermostat_simulation_stats_t stats;
+} thermostat_simulation_t;
+
+/**
+ * Move timers to the virtual clock and create a fleet of thermostats in rooms of random climates. Call it before any
+ * timer is armed on the real clock, time only moves for the rest of the process while a simulation runs.
+ * @param simulation
+ * @param count number of thermostats
+ * @param step simulated milliseconds between readings, THERMOSTAT_SIMULATOR_STEP if 0
+ * @param seed of the climates, the same seed and count always simulate the same fleet
+ * @return 0 on success, -1 if timers are armed on the real clock or the thermostats couldn't be created
+ */
+int thermostat_simulation_init(thermostat_simulation_t *simulation, size_t count, unsigned long step,
+                               unsigned long seed);
+/**
+ * Destroy the thermostats of a simulation and free its rooms
+ * @param simulation
+ */
+void thermostat_simulation_deinit(thermostat_simulation_t *simulation);
+/**
+ * Simulate the fleet for a while, as fast as the thermostats process their readings. Every step the virtual clock is
+ * moved forward, which fires the time events due, and every room is moved forward through the thermal model and takes
+ * a reading for its thermostat. The result only depends on the seed, the step and the duration, not on the threads or
+ * on whether every reading is sent. The readings held back are sent at the end, so every thermostat ends up with the
+ * temperature of its room.
+ * @param simulation
+ * @param duration simulated milliseconds, rounded down to whole steps
+ * @param threads the rooms are split between, 1 to run on the calling thread, fewer run if not all of them can be
+ * started
+ * @return 0 on success, -1 if it couldn't be allocated
+ */
+int thermostat_simulation_run(thermostat_simulation_t *simulation, unsigned long long duration, unsigned int threads);
+
+#endif //EMERSON_THERMOSTAT_THERMOSTAT_SIMULATOR_H
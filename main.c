@@ -1,7 +1,303 @@
 #include "include/thermostat.h"
+#include "include/statemachine_index.h"
+#include "include/statemachine_journal.h"
+#include "include/statemachine_trace.h"
+#include "include/thermostat_control.h"
+#include "include/thermostat_ingest.h"
+#include "include/thermostat_simulator.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef THERMOSTAT_GENERATED_DISPATCH
+#include "thermostat_dispatch.h"
+#endif
 
+/**
+ * Thermostats created to replay a journal, in the order their ids first came up
+ */
+typedef struct {
+    thermostat_t **thermostats;
+    size_t count;
+    size_t capacity;
+} replay_fleet_t;
 
-int main() {
-    thermostat_run();
+/**
+ * Give every thermostat id found in a journal a fresh thermostat to replay it
+ * @param id
+ * @param context the replay_fleet_t
+ * @return NULL if the thermostat couldn't be created
+ */
+static statemachine_t *replay_resolve(uint32_t id, void *context) {
+    (void) (id);
+    replay_fleet_t *fleet = context;
+    if (fleet->count == fleet->capacity) {
+        size_t capacity = fleet->capacity ? fleet->capacity * 2 : 16;
+        thermostat_t **thermostats = realloc(fleet->thermostats, capacity * sizeof(thermostat_t *));
+        if (thermostats == NULL) return NULL;
+        fleet->thermostats = thermostats;
+        fleet->capacity = capacity;
+    }
+    thermostat_t *thermostat = thermostat_create();
+    if (thermostat == NULL) return NULL;
+    fleet->thermostats[fleet->count++] = thermostat;
+    return &thermostat->statemachine;
+}
+
+/**
+ * Replay a journal and report whether the thermostats took the journaled transitions
+ * @param path
+ * @return exit status, 0 if the replay matched
+ */
+static int replay(const char *path) {
+    replay_fleet_t fleet = {0};
+    statemachine_journal_replay_t result;
+    uint64_t start = statemachine_metrics_now();
+    int status = statemachine_journal_replay(path, replay_resolve, &fleet, &result);
+    double elapsed = (double) (statemachine_metrics_now() - start) / 1e9;
+    if (status < 0) {
+        fprintf(stderr, "couldn't replay %s\n", path);
+    } else {
+        printf("replayed %zu events and %zu transitions of %zu thermostats in %.3f ms, %.0f events/s\n",
+               result.events, result.transitions, fleet.count, elapsed * 1e3,
+               elapsed > 0 ? (double) result.events / elapsed : 0);
+        if (status > 0) printf("diverged at byte %zu: %s\n", result.mismatch, result.reason);
+        if (result.truncated != 0) printf("left out %zu bytes cut off at the end\n", result.truncated);
+    }
+    for (size_t i = 0; i < fleet.count; i++) {
+        thermostat_destroy(fleet.thermostats[i]);
+    }
+    free(fleet.thermostats);
+    return status == 0 ? 0 : status > 0 ? 2 : 1;
+}
+
+// prefix of an ingestion source that is a Unix domain socket to listen on
+#define INGEST_SOCKET "unix:"
+
+static thermostat_ingest_t *listening;
+static thermostat_control_t *controlling;
+
+/**
+ * Stop listening for readings and serving control clients on SIGINT and SIGTERM
+ * @param signal
+ */
+static void fleet_stop(int signal) {
+    (void) (signal);
+    if (listening != NULL) thermostat_ingest_stop(listening);
+    if (controlling != NULL) thermostat_control_stop(controlling);
+}
+
+/**
+ * Stream temperature readings into the fleet and report them
+ * @param ingest
+ * @param source file, pipe, - for stdin or unix: and the path of a socket to listen on until interrupted
+ * @return 0 on success, -1 if the source couldn't be read
+ */
+static int fleet_ingest(thermostat_ingest_t *ingest, const char *source) {
+    int status;
+    uint64_t start = statemachine_metrics_now();
+    if (strncmp(source, INGEST_SOCKET, strlen(INGEST_SOCKET)) == 0) {
+        listening = ingest;
+        status = thermostat_ingest_listen(ingest, source + strlen(INGEST_SOCKET));
+        listening = NULL;
+    } else {
+        int fd = strcmp(source, "-") == 0 ? STDIN_FILENO : open(source, O_RDONLY | O_CLOEXEC);
+        status = fd < 0 ? -1 : thermostat_ingest_fd(ingest, fd);
+        if (fd > STDIN_FILENO) close(fd);
+    }
+    double elapsed = (double) (statemachine_metrics_now() - start) / 1e9;
+    if (status != 0) fprintf(stderr, "couldn't read readings from %s\n", source);
+    thermostat_ingest_stats_t *stats = &ingest->stats;
+    printf("ingested %lu readings, %llu bytes in %.3f ms, %.0f readings/s\n"
+           "dispatched %lu, dropped %lu, stale %lu, unknown thermostat %lu, malformed %lu\n",
+           stats->readings, stats->bytes, elapsed * 1e3, elapsed > 0 ? (double) stats->readings / elapsed : 0,
+           stats->dispatched, stats->dropped, stats->stale, stats->unknown, stats->malformed);
+    return status;
+}
+
+/**
+ * Run a fleet of thermostats in heat mode, or the fleet saved in a fleet snapshot, without the menu. Temperature
+ * readings are streamed into it from a source and clients control it through a socket, then the program reports where
+ * the thermostats ended up.
+ * @param source optional source of readings, see fleet_ingest, without one the control socket is served until
+ * interrupted
+ * @param count thermostats created if there is no snapshot
+ * @param snapshot optional fleet snapshot file restored from before and saved to after
+ * @param control optional Unix domain socket to serve control clients on
+ * @return exit status
+ */
+static int fleet_run(const char *source, size_t count, const char *snapshot, const char *control) {
+    thermostat_t **thermostats = snapshot != NULL && access(snapshot, F_OK) == 0 ?
+                                 thermostat_fleet_restore(snapshot, &count) : NULL;
+    if (thermostats == NULL) {
+        thermostats = calloc(count, sizeof(thermostat_t *));
+        for (size_t i = 0; thermostats != NULL && i < count; i++) {
+            thermostats[i] = thermostat_create();
+            if (thermostats[i] == NULL) return 1;
+            statemachine_dispatch(&thermostats[i]->statemachine, THERMOSTAT_SET_MODE_HEAT, NULL);
+        }
+    }
+    thermostat_ingest_t ingest;
+    thermostat_control_t server;
+    statemachine_index_t index;
+    if (thermostats == NULL || thermostat_ingest_init(&ingest, thermostats, count) != 0 ||
+        thermostat_control_init(&server, thermostats, count) != 0 ||
+        statemachine_index_init(&index, &thermostat_model, count) != 0) {
+        fprintf(stderr, "couldn't create %zu thermostats\n", count);
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        statemachine_index_add(&index, &thermostats[i]->statemachine, i);
+    }
+    server.index = &index;
+    signal(SIGINT, fleet_stop);
+    signal(SIGTERM, fleet_stop);
+    int status = 0;
+    if (control != NULL && source != NULL) {
+        status = thermostat_control_start(&server, control);
+    } else if (control != NULL) {
+        controlling = &server;
+        status = thermostat_control_serve(&server, control);
+        controlling = NULL;
+    }
+    if (status != 0) {
+        fprintf(stderr, "couldn't listen on %s\n", control);
+    } else if (source != NULL) {
+        status = fleet_ingest(&ingest, source);
+    }
+    // commands still coming in from clients are done with before the fleet is reported and saved
+    thermostat_control_deinit(&server);
+    if (control != NULL) {
+        printf("served %lu requests on %lu connections, %lu refused\n", server.stats.requests,
+               server.stats.connections, server.stats.errors);
+    }
+    for (size_t i = 0; i < count; i++) {
+        statemachine_flush(&thermostats[i]->statemachine);
+    }
+    size_t states[THERMOSTAT_COOLING + 1] = {0};
+    for (short id = THERMOSTAT_POWERED_ON; id <= THERMOSTAT_COOLING; id++) {
+        states[id] = statemachine_index_count(&index, id);
+    }
+    // a thermostat heating or cooling is in the mode's state too, each is reported in the innermost state it is in
+    states[THERMOSTAT_POWERED_ON] -= states[THERMOSTAT_OFF] + states[THERMOSTAT_HEAT] + states[THERMOSTAT_COOL];
+    states[THERMOSTAT_HEAT] -= states[THERMOSTAT_HEATING];
+    states[THERMOSTAT_COOL] -= states[THERMOSTAT_COOLING];
+    for (short id = THERMOSTAT_POWERED_ON; id <= THERMOSTAT_COOLING; id++) {
+        if (states[id] != 0) printf("%-16s %zu\n", thermostat_state_name(id), states[id]);
+    }
+    if (snapshot != NULL && thermostat_fleet_save(snapshot, thermostats, count) != 0) {
+        fprintf(stderr, "couldn't save the fleet to %s\n", snapshot);
+        status = -1;
+    }
+    thermostat_ingest_deinit(&ingest);
+    for (size_t i = 0; i < count; i++) {
+        thermostat_destroy(thermostats[i]);
+    }
+    statemachine_index_deinit(&index);
+    free(thermostats);
+    return status == 0 ? 0 : 1;
+}
+
+/**
+ * Simulate a fleet of thermostats in rooms of random climates for a number of days as fast as the cpus allow and
+ * report how hard their equipment worked
+ * @param count
+ * @param days
+ * @return exit status
+ */
+static int simulate(size_t count, double days) {
+    thermostat_simulation_t simulation;
+    if (thermostat_simulation_init(&simulation, count, 0, 1) != 0) {
+        fprintf(stderr, "couldn't create %zu thermostats to simulate\n", count);
+        return 1;
+    }
+    unsigned int threads = (unsigned int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (thermostat_simulation_run(&simulation, (unsigned long long) (days * THERMOSTAT_SIMULATOR_DAY), threads) != 0) {
+        fprintf(stderr, "couldn't run the simulation\n");
+        thermostat_simulation_deinit(&simulation);
+        return 1;
+    }
+    thermostat_simulation_stats_t *stats = &simulation.stats;
+    double elapsed = (double) stats->elapsed / 1e9, simulated = (double) stats->simulated / 1e3;
+    double heated = (double) simulation.heated, cooled = (double) (count - simulation.heated);
+    double daily = simulated / 86400;
+    printf("simulated %zu thermostats for %.1f days in %.3f s, %.0f simulated seconds per second\n"
+           "%llu readings, %llu sent to their thermostat, %lu time events\n", count, daily, elapsed,
+           elapsed > 0 ? simulated / elapsed : 0, stats->readings, stats->dispatched, stats->time_events);
+    if (heated > 0 && daily > 0) {
+        printf("%.0f heated rooms: %lu heating cycles, %.1f per room per day, heating %.1f%% of the time\n", heated,
+               stats->heating_cycles, (double) stats->heating_cycles / heated / daily,
+               (double) stats->heating_time / 1e3 / simulated / heated * 100);
+    }
+    if (cooled > 0 && daily > 0) {
+        printf("%.0f cooled rooms: %lu cooling cycles, %.1f per room per day, cooling %.1f%% of the time\n", cooled,
+               stats->cooling_cycles, (double) stats->cooling_cycles / cooled / daily,
+               (double) stats->cooling_time / 1e3 / simulated / cooled * 100);
+    }
+    thermostat_simulation_deinit(&simulation);
     return 0;
 }
+
+int main(int argc, char **argv) {
+    const char *trace = NULL, *snapshot = NULL, *journal = NULL, *journaled = NULL, *source = NULL, *control = NULL;
+    size_t fleet = 0;
+    double days = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--log") == 0) {
+            thermostat_logging = 1;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (strcmp(argv[i], "--state") == 0 && i + 1 < argc) {
+            snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+            journal = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            journaled = argv[++i];
+        } else if (strcmp(argv[i], "--ingest") == 0 && i + 1 < argc) {
+            source = argv[++i];
+        } else if (strcmp(argv[i], "--control") == 0 && i + 1 < argc) {
+            control = argv[++i];
+        } else if (strcmp(argv[i], "--fleet") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0) {
+            fleet = (size_t) atol(argv[++i]);
+        } else if (strcmp(argv[i], "--simulate") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            days = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--log] [--trace file] [--state file] [--journal file] [--replay file]\n"
+                            "       [--control socket] [--ingest file|-|unix:socket] [--fleet count]\n"
+                            "       [--simulate days]\n", argv[0]);
+            return 1;
+        }
+    }
+#ifdef THERMOSTAT_GENERATED_DISPATCH
+    if (thermostat_dispatch_install(&thermostat_model) != 0) {
+        fprintf(stderr, "the generated dispatcher doesn't match the thermostat chart\n");
+        return 1;
+    }
+#endif
+    if (trace != NULL && statemachine_trace_start(trace) != 0) {
+        fprintf(stderr, "couldn't write trace to %s\n", trace);
+        return 1;
+    }
+    if (journaled != NULL) {
+        int status = replay(journaled);
+        statemachine_trace_stop();
+        return status;
+    }
+    if (journal != NULL && statemachine_journal_start(journal, thermostat_payload_size) != 0) {
+        fprintf(stderr, "couldn't write journal to %s\n", journal);
+        return 1;
+    }
+    int status = 0;
+    if (days > 0) {
+        status = simulate(fleet != 0 ? fleet : 1, days);
+    } else if (source != NULL || fleet != 0) {
+        status = fleet_run(source, fleet != 0 ? fleet : 1, snapshot, control);
+    } else {
+        thermostat_run(snapshot, control);
+    }
+    size_t lost = statemachine_journal_stop();
+    if (lost != 0) fprintf(stderr, "couldn't write the last %zu bytes of journal to %s\n", lost, journal);
+    statemachine_trace_stop();
+    return status;
+}
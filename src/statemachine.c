@@ -3,159 +3,475 @@
 //
 
 #include "statemachine.h"
+#include "statemachine_executor.h"
+#include "statemachine_index.h"
+#include "statemachine_journal.h"
+#include "statemachine_trace.h"
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-state_t *
-execute_transition(statemachine_t *statemachine, state_t *source, state_t *target, transition_t *transition);
+// marks a state id that isn't part of the chart
+#define NO_STATE_INDEX USHRT_MAX
 
-state_t *statemachine_get_active_state(state_t *state) {
-    state_t *active = NULL;
-    if (state->active) {
-        for (state_t *substate=state->substates; substate != NULL && substate->id != NULL_ELEMENT_ID; substate++) {
-            if ((active = statemachine_get_active_state(substate)) != NULL) return active;
-        }
-        return state;
+// last id given to a statemachine
+static atomic_uint statemachine_ids;
+
+/**
+ * get the pre-order index of a state
+ * @param table
+ * @param state
+ * @return
+ */
+static inline unsigned short get_state_index(const statemachine_table_t *table, const state_t *state) {
+    return table->state_index[state->id];
+}
+
+/**
+ * is the state at one pre-order index a descendant of the state at another. The pre-order index of a descendant comes
+ * after its ancestor and its post-order index comes before it.
+ * @param table
+ * @param ancestor
+ * @param descendant
+ * @return true if the descendant is a descendant of the ancestor
+ */
+static inline char is_descendant_index(const statemachine_table_t *table, unsigned short ancestor,
+                                       unsigned short descendant) {
+    return ancestor < descendant && table->post[descendant] < table->post[ancestor];
+}
+
+/**
+ * Check if the state at a pre-order index is part of the active configuration of a statemachine
+ * @param statemachine
+ * @param index
+ * @return
+ */
+static inline char is_active_index(const statemachine_t *statemachine, unsigned short index) {
+    return (statemachine->active[index >> 6] >> (index & 63)) & 1;
+}
+
+/**
+ * Check if a state is part of the active configuration of a statemachine
+ * @param statemachine
+ * @param state
+ * @return
+ */
+static inline char is_active(const statemachine_t *statemachine, const state_t *state) {
+    return is_active_index(statemachine, get_state_index(statemachine->model->table, state));
+}
+
+/**
+ * Add a state to or remove it from the active configuration of a statemachine. States are entered outermost first and
+ * left innermost first so the active path only ever grows or shrinks at its end.
+ * @param statemachine
+ * @param state
+ * @param active
+ */
+static inline void set_active(statemachine_t *statemachine, state_t *state, char active) {
+    const statemachine_table_t *table = statemachine->model->table;
+    unsigned short index = get_state_index(table, state);
+    // completion transitions may become enabled whatever their inputs
+    statemachine->evaluating = STATEMACHINE_INPUTS_ALL;
+    if (active) {
+        statemachine->active[index >> 6] |= 1ULL << (index & 63);
+        statemachine->path[table->depth[index]] = state;
+        statemachine->path_length = (unsigned short) (table->depth[index] + 1);
+    } else {
+        statemachine->active[index >> 6] &= ~(1ULL << (index & 63));
+        statemachine->path_length = table->depth[index];
     }
-    return active;
+    if (statemachine->index != NULL) statemachine_index_update(statemachine, index, active);
+}
+
+state_t *statemachine_get_active_state(statemachine_t *statemachine) {
+    if (statemachine->active == NULL || statemachine->path_length == 0) return NULL;
+    return statemachine->path[statemachine->path_length - 1];
+}
+
+char statemachine_is_active(statemachine_t *statemachine) {
+    return statemachine->active != NULL && statemachine->path_length != 0;
+}
+
+char statemachine_is_in(statemachine_t *statemachine, short id) {
+    if (statemachine->active == NULL) return 0;
+    const statemachine_table_t *table = statemachine->model->table;
+    if (id < 0 || id > table->max_state_id || table->state_index[id] == NO_STATE_INDEX) return 0;
+    unsigned short index = table->state_index[id];
+    return (statemachine->active[index >> 6] >> (index & 63)) & 1;
+}
+
+/**
+ * get a state given its id
+ * @param statemachine
+ * @param id
+ * @return NULL if the id isn't a state of this statemachine
+ */
+static inline state_t *get_state(const statemachine_t *statemachine, short id) {
+    const statemachine_table_t *table = statemachine->model->table;
+    if (id < 0 || id > table->max_state_id || table->state_index[id] == NO_STATE_INDEX) return NULL;
+    return table->states[table->state_index[id]];
 }
+
 /**
- * is the substate a descendant of the ancestor state
+ * Arm the timers of the time event transitions leaving a state
+ * @param statemachine
  * @param state
- * @param substate
- * @return true if the substate is a descendant of the ancestor state
- */
-char is_descendant(const state_t *state, const state_t *substate) {
-    if (state == substate) return 0;
-    for (state_t *iter = state->substates; iter != NULL && iter->id != NULL_ELEMENT_ID; iter++) {
-        if (iter == substate || is_descendant(iter, substate)) {
-            return 1;
-        }
+ */
+static void arm_timeouts(statemachine_t *statemachine, state_t *state) {
+    const statemachine_table_t *table = statemachine->model->table;
+    unsigned short first = table->timeout_offsets[state->id], last = table->timeout_offsets[state->id + 1];
+    unsigned long long now = first < last ? statemachine_timer_now() : 0;
+    for (unsigned short i = first; i < last; i++) {
+        transition_t *transition = &table->transitions[table->timeout_transitions[i]];
+        statemachine->timeouts[i].entered = now;
+        statemachine_timer_arm(&statemachine->timeouts[i].timer, transition->after(statemachine, transition));
     }
-    return 0;
 }
 
 /**
- * get a substate given its id
+ * Cancel the timers of the time event transitions leaving a state
+ * @param statemachine
  * @param state
- * @param id
- * @return NULL if the id isn't a substate of this state
  */
-state_t *get_state_by_id(state_t *state, short id) {
-    if (state->id == id) return state;
-    for (state_t *substate = state->substates; substate != NULL && substate->id != NULL_ELEMENT_ID; substate++) {
-        if (substate->id == id) {
-            return substate;
-        } else if ((state = get_state_by_id(substate, id)) != NULL) {
-            return state;
-        }
+static void cancel_timeouts(statemachine_t *statemachine, state_t *state) {
+    const statemachine_table_t *table = statemachine->model->table;
+    for (unsigned short i = table->timeout_offsets[state->id]; i < table->timeout_offsets[state->id + 1]; i++) {
+        statemachine_timer_cancel(&statemachine->timeouts[i].timer);
     }
-    return NULL;
 }
+
 /**
- * Get the ancestor of this state by traversing down from the root state
- * @param ancestor
- * @param descendant
- * @return the ancestor unless descendant is a top level state it will return NULL
- */
-state_t *get_ancestor_state(state_t *ancestor, state_t *descendant) {
-    for (state_t *substate = ancestor->substates;
-         substate != NULL && substate->id != NULL_ELEMENT_ID; substate++) {
-        if (substate == descendant) {
-            return ancestor;
-        } else if (is_descendant(substate, descendant)) {
-            return get_ancestor_state(substate, descendant);
+ * Get the timestamps a statemachine keeps for metrics, allocating them if it hasn't got any yet. Producers may race to
+ * allocate them, the first one to publish its allocation wins.
+ * @param statemachine
+ * @return NULL if they couldn't be allocated
+ */
+static statemachine_timing_t *get_timing(statemachine_t *statemachine) {
+    statemachine_timing_t *timing = atomic_load_explicit(&statemachine->timing, memory_order_acquire), *created;
+    if (timing != NULL) return timing;
+    created = calloc(1, sizeof(statemachine_timing_t) + statemachine->model->table->state_count * sizeof(uint64_t));
+    if (created == NULL) return NULL;
+    if (!atomic_compare_exchange_strong_explicit(&statemachine->timing, &timing, created, memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        free(created);
+        return timing;
+    }
+    return created;
+}
+
+/**
+ * Get the pool of a statemachine, allocated the first time a payload doesn't fit inline
+ * @param statemachine
+ * @return NULL if it couldn't be allocated
+ */
+static statemachine_pool_t *get_pool(statemachine_t *statemachine) {
+    statemachine_pool_t *pool = atomic_load_explicit(&statemachine->pool, memory_order_acquire), *created;
+    if (pool != NULL) return pool;
+    created = malloc(sizeof(statemachine_pool_t));
+    if (created == NULL) return NULL;
+    atomic_init(&created->free, STATEMACHINE_POOL_BLOCKS == 64 ? UINT64_MAX
+                                                             : ((uint_least64_t) 1 << STATEMACHINE_POOL_BLOCKS) - 1);
+    if (!atomic_compare_exchange_strong_explicit(&statemachine->pool, &pool, created, memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        free(created);
+        return pool;
+    }
+    return created;
+}
+
+/**
+ * Take a free block of a statemachine's pool. Any thread may take blocks concurrently.
+ * @param statemachine
+ * @return NULL if every block is taken or the pool couldn't be allocated
+ */
+static void *pool_take(statemachine_t *statemachine) {
+    statemachine_pool_t *pool = get_pool(statemachine);
+    if (pool == NULL) return NULL;
+    uint_least64_t free = atomic_load_explicit(&pool->free, memory_order_relaxed);
+    while (free != 0) {
+        if (atomic_compare_exchange_weak_explicit(&pool->free, &free, free & (free - 1), memory_order_acquire,
+                                                  memory_order_relaxed)) {
+            return pool->blocks[__builtin_ctzll(free)];
         }
     }
     return NULL;
 }
 
+/**
+ * Give a block back to a statemachine's pool
+ * @param statemachine
+ * @param block taken with pool_take
+ */
+static void pool_give(statemachine_t *statemachine, void *block) {
+    statemachine_pool_t *pool = atomic_load_explicit(&statemachine->pool, memory_order_relaxed);
+    size_t index = (size_t) ((unsigned char *) block - pool->blocks[0]) / STATEMACHINE_POOL_BLOCK;
+    atomic_fetch_or_explicit(&pool->free, (uint_least64_t) 1 << index, memory_order_release);
+}
+
+/**
+ * Copy a payload into a trigger, inline if it fits and into a block of the pool otherwise
+ * @param statemachine
+ * @param trigger
+ * @param payload
+ * @param size
+ * @return 0 on success, -1 if the payload is larger than a block or the pool is exhausted
+ */
+static int trigger_copy(statemachine_t *statemachine, trigger_t *trigger, const void *payload, size_t size) {
+    trigger->size = (unsigned short) size;
+    trigger->data = NULL;
+    if (size <= STATEMACHINE_PAYLOAD_INLINE) {
+        if (size != 0) memcpy(trigger->payload.bytes, payload, size);
+        return 0;
+    }
+    if (size > STATEMACHINE_POOL_BLOCK || (trigger->data = pool_take(statemachine)) == NULL) return -1;
+    memcpy(trigger->data, payload, size);
+    return 0;
+}
+
+/**
+ * Give back the pool block holding a trigger's payload, if it has one
+ * @param statemachine
+ * @param trigger
+ */
+static inline void trigger_release(statemachine_t *statemachine, const trigger_t *trigger) {
+    if (trigger->size > STATEMACHINE_PAYLOAD_INLINE) pool_give(statemachine, trigger->data);
+}
+
+/**
+ * Get the metrics of a transition
+ * @param table
+ * @param transition
+ * @return NULL if the transition isn't in the model's transitions, like the initial transitions of states
+ */
+static statemachine_transition_metrics_t *get_transition_metrics(const statemachine_table_t *table,
+                                                                 const transition_t *transition) {
+    if (transition < table->transitions || transition >= table->transitions + table->transition_count) return NULL;
+    return &table->metrics->transitions[transition - table->transitions];
+}
 
 /**
- * Exit a state by first recursively exiting its active substates. Then invoke its exit action
+ * Count an entry into a state and note when it happened
+ * @param statemachine
+ * @param state
+ */
+static void measure_entry(statemachine_t *statemachine, state_t *state) {
+    const statemachine_table_t *table = statemachine->model->table;
+    unsigned short index = get_state_index(table, state);
+    statemachine_timing_t *timing = get_timing(statemachine);
+    atomic_fetch_add_explicit(&table->metrics->states[index].entries, 1, memory_order_relaxed);
+    if (timing != NULL) timing->entered[index] = statemachine_metrics_now();
+}
+
+/**
+ * Add the time a state was active to its residency. States entered while metrics were off aren't counted.
+ * @param statemachine
+ * @param state
+ */
+static void measure_exit(statemachine_t *statemachine, state_t *state) {
+    statemachine_timing_t *timing = atomic_load_explicit(&statemachine->timing, memory_order_relaxed);
+    if (timing == NULL) return;
+    const statemachine_table_t *table = statemachine->model->table;
+    unsigned short index = get_state_index(table, state);
+    if (timing->entered[index] != 0 && statemachine_metrics_enabled()) {
+        atomic_fetch_add_explicit(&table->metrics->states[index].residency_ns,
+                                  statemachine_metrics_now() - timing->entered[index], memory_order_relaxed);
+    }
+    timing->entered[index] = 0;
+}
+
+/**
+ * Stop the time events of an active state, invoke its exit action and deactivate it. Its substates must have been
+ * exited already.
+ * @param statemachine
+ * @param state
+ * @param trigger
+ */
+static void leave_state(statemachine_t *statemachine, state_t *state, trigger_t *trigger) {
+    cancel_timeouts(statemachine, state);
+    statemachine_trace(statemachine->id, STATEMACHINE_TRACE_EXIT, trigger ? trigger->event : 0, state->id, 0);
+    if (state->exit != NULL) {
+        state->exit(statemachine, state, trigger);
+    }
+    measure_exit(statemachine, state);
+    set_active(statemachine, state, 0);
+}
+
+/**
+ * Leave the active states nested below a state, innermost first
+ * @param statemachine
+ * @param state an active state
+ * @param trigger
+ */
+static void exit_substates(statemachine_t *statemachine, state_t *state, trigger_t *trigger) {
+    unsigned short depth = statemachine->model->table->depth[get_state_index(statemachine->model->table, state)];
+    while (statemachine->path_length > depth + 1) {
+        leave_state(statemachine, statemachine->path[statemachine->path_length - 1], trigger);
+    }
+}
+
+/**
+ * Exit a state by first exiting its active substates. Then invoke its exit action
  * @param statemachine
  * @param state
  * @param trigger
  * @return
  */
 state_t *exit_state(statemachine_t *statemachine, state_t *state, trigger_t *trigger) {
-    if (state->active) {
-        for (state_t *substate = state->substates;
-             substate != NULL && substate->id != NULL_ELEMENT_ID; substate++) {
-            exit_state(statemachine, substate, trigger);
-        }
-        if (state->exit != NULL) {
-            state->exit(statemachine, state, trigger);
-        }
-        state->active = 0;
+    if (is_active(statemachine, state)) {
+        exit_substates(statemachine, state, trigger);
+        leave_state(statemachine, state, trigger);
         return state;
     }
     return NULL;
 }
 
-state_t *enter_state(statemachine_t *statemachine, state_t *current, state_t *target, trigger_t *trigger) {
-    // if the current state isn't active lets activate it and preform its entry behavior
-    if (!current->active) {
-        current->active = 1;
-        if (current->entry != NULL) {
-            current->entry(statemachine, current, trigger);
+void execute_transition_effect(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    if (transition->effect != NULL) {
+        if (!statemachine_metrics_enabled()) {
+            transition->effect(statemachine, transition, trigger);
+            return;
         }
+        const statemachine_table_t *table = statemachine->model->table;
+        statemachine_transition_metrics_t *metrics = get_transition_metrics(table, transition);
+        uint64_t start = statemachine_metrics_now();
+        transition->effect(statemachine, transition, trigger);
+        uint64_t elapsed = statemachine_metrics_now() - start;
+        statemachine_histogram_record(&table->metrics->effect, elapsed);
+        if (metrics != NULL) atomic_fetch_add_explicit(&metrics->effect_ns, elapsed, memory_order_relaxed);
     }
-    // If this is a compl
-    if (target == NULL || current == target) {
-        if (current->initial.target != NULL_ELEMENT_ID) {
-            target = get_state_by_id((state_t *)statemachine, current->initial.target);
-            return execute_transition(statemachine, current, target, &current->initial);
-        }
-    } else if (is_descendant(current, target)) {
-        for (state_t *substate = current->substates;
-             substate != NULL && substate->id != NULL_ELEMENT_ID; substate++) {
-            if (substate == target || is_descendant(substate, target)) {
-                return enter_state(statemachine, substate, target, trigger);
-            }
-        }
+}
+
+/**
+ * Activate a state, invoke its entry action and start the timers of its time events
+ * @param statemachine
+ * @param state
+ * @param trigger
+ */
+static void enter_state(statemachine_t *statemachine, state_t *state, trigger_t *trigger) {
+    set_active(statemachine, state, 1);
+    statemachine_trace(statemachine->id, STATEMACHINE_TRACE_ENTRY, trigger ? trigger->event : 0, state->id, 0);
+    if (statemachine_metrics_enabled()) measure_entry(statemachine, state);
+    if (state->entry != NULL) {
+        state->entry(statemachine, state, trigger);
     }
-    return current;
+    arm_timeouts(statemachine, state);
 }
 
+void statemachine_enter_state(statemachine_t *statemachine, state_t *state, trigger_t *trigger) {
+    enter_state(statemachine, state, trigger);
+}
 
+void statemachine_leave_state(statemachine_t *statemachine, state_t *state, trigger_t *trigger) {
+    leave_state(statemachine, state, trigger);
+}
 
-void execute_transition_effect(statemachine_t *statemachine, transition_t *transition) {
-    if (transition->effect != NULL) {
-        transition->effect(statemachine, transition);
+void statemachine_begin_transition(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    statemachine->evaluating |= transition->changes;
+    statemachine_trace(statemachine->id, STATEMACHINE_TRACE_TRANSITION, trigger ? trigger->event : 0,
+                       transition->source, transition->target);
+    statemachine_journal_transition(statemachine, transition, trigger);
+    if (statemachine_metrics_enabled()) {
+        statemachine_transition_metrics_t *metrics = get_transition_metrics(statemachine->model->table, transition);
+        if (metrics != NULL) atomic_fetch_add_explicit(&metrics->fired, 1, memory_order_relaxed);
     }
 }
 
-state_t *
-execute_transition(statemachine_t *statemachine, state_t *source, state_t *target, transition_t *transition) {
-    if (target == NULL) {
-        execute_transition_effect(statemachine, transition);
+void statemachine_execute_effect(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    execute_transition_effect(statemachine, transition, trigger);
+}
+
+/**
+ * Execute the compiled plan of a transition as a straight sequence of exits, effect and entries
+ * @param statemachine
+ * @param source the state the transition was taken from
+ * @param plan
+ * @param transition NULL when entering the initial configuration
+ * @param trigger
+ * @return the state the statemachine settled on
+ */
+static state_t *execute_plan(statemachine_t *statemachine, state_t *source, const statemachine_plan_t *plan,
+                             transition_t *transition, trigger_t *trigger) {
+    if (transition != NULL) statemachine_begin_transition(statemachine, transition, trigger);
+    if (plan->internal) {
+        execute_transition_effect(statemachine, transition, trigger);
         return source;
-    } else {
-        for (state_t *substate = source->substates;
-             substate != NULL && substate->id != NULL_ELEMENT_ID; substate++) {
-            if (exit_state(statemachine, substate, &transition->trigger) != NULL) break;
-        }
-        if (source == target || !is_descendant(source, target)) {
-            exit_state(statemachine, source, &transition->trigger);
-            source = get_ancestor_state((state_t *) statemachine, source);
+    }
+    const statemachine_table_t *table = statemachine->model->table;
+    const unsigned short *exits = table->plan_states + plan->first, *entries = exits + plan->exit_count;
+    const unsigned short *effects = table->plan_effects + plan->first + plan->exit_count;
+    if (source != NULL) exit_substates(statemachine, source, trigger);
+    for (unsigned short i = 0; i < plan->exit_count; i++) {
+        leave_state(statemachine, table->states[exits[i]], trigger);
+    }
+    if (transition != NULL) {
+        execute_transition_effect(statemachine, transition, trigger);
+    }
+    for (unsigned short i = 0; i < plan->entry_count; i++) {
+        if (effects[i] != NO_STATE_INDEX) {
+            execute_transition_effect(statemachine, &table->states[effects[i]]->initial, trigger);
         }
-        execute_transition_effect(statemachine, transition);
-        return enter_state(statemachine, source, target, &transition->trigger);
+        enter_state(statemachine, table->states[entries[i]], trigger);
     }
+    return table->states[plan->settled];
+}
+
+/**
+ * Execute a transition from the state it was found on
+ * @param statemachine
+ * @param source
+ * @param index position of the transition in the transitions array
+ * @param trigger
+ * @return the state the statemachine settled on
+ */
+static state_t *execute_transition(statemachine_t *statemachine, state_t *source, unsigned short index,
+                                   trigger_t *trigger) {
+    const statemachine_table_t *table = statemachine->model->table;
+    return execute_plan(statemachine, source, &table->plans[index], &table->transitions[index], trigger);
 }
 /**
  * Check to see if a transition has a guard and if it does evaluate it.
  * @param statemachine
  * @param transition
+ * @param trigger
  * @return
  */
-int evaluate_transition(statemachine_t *statemachine, transition_t *transition) {
+int evaluate_transition(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
     if (transition->guard != NULL) {
-        return transition->guard(statemachine, transition);
+        if (!statemachine_metrics_enabled()) return transition->guard(statemachine, transition, trigger);
+        const statemachine_table_t *table = statemachine->model->table;
+        statemachine_transition_metrics_t *metrics = get_transition_metrics(table, transition);
+        uint64_t start = statemachine_metrics_now();
+        int enabled = transition->guard(statemachine, transition, trigger);
+        uint64_t elapsed = statemachine_metrics_now() - start;
+        statemachine_histogram_record(&table->metrics->guard, elapsed);
+        if (metrics != NULL) {
+            atomic_fetch_add_explicit(&metrics->guard_ns, elapsed, memory_order_relaxed);
+            if (!enabled) atomic_fetch_add_explicit(&metrics->rejected, 1, memory_order_relaxed);
+        }
+        return enabled;
     }
     return 1;
 }
 
+int statemachine_evaluate_guard(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    return evaluate_transition(statemachine, transition, trigger);
+}
+
+/**
+ * Evaluate the guard of a transition found in a bucket. Transitions without a guard are enabled without being read.
+ * @param statemachine
+ * @param table
+ * @param index position of the transition in the transitions array
+ * @param trigger
+ * @return
+ */
+static inline int evaluate_guard(statemachine_t *statemachine, const statemachine_table_t *table, unsigned short index,
+                                 trigger_t *trigger) {
+    return table->guards[index] == NULL || evaluate_transition(statemachine, &table->transitions[index], trigger);
+}
+
 /**
  * A completion transition has the highest priority of all transitions. It's essentially a transition without an event.
  * @param statemachine
@@ -163,20 +479,19 @@ int evaluate_transition(statemachine_t *statemachine, transition_t *transition)
  * @return
  */
 state_t *process_completion_transitions(statemachine_t *statemachine, state_t *current) {
-    // loop trough all of the transitions
-    for (transition_t *transition=statemachine->transitions; transition != NULL && transition->source != NULL_ELEMENT_ID; transition++) {
-        // is this transition an outgoing transition for the current state
-        if (transition->source == current->id) {
-            // make sure it doesn't have an event
-
-            if (transition->trigger.event == NULL_ELEMENT_ID) {
-                state_t *target = get_state_by_id((state_t *)statemachine, transition->target);
-                if (target != NULL) {
-                    if (!target->active || is_descendant(target, current)) {
-                        if (evaluate_transition(statemachine, transition)) {
-                            return execute_transition(statemachine, current, target, transition);
-                        }
-                    }
+    statemachine_table_t *table = statemachine->model->table;
+    if (current->id < 0 || current->id > table->max_state_id) return NULL;
+    // only the completion transitions leaving the current state
+    unsigned short index = get_state_index(table, current);
+    for (unsigned short i = table->completion_offsets[current->id]; i < table->completion_offsets[current->id + 1]; i++) {
+        unsigned short transition = table->completion_transitions[i], target = table->targets[transition];
+        // it was disabled when the statemachine last settled and none of its inputs changed since
+        unsigned long depends = table->depends[transition];
+        if (depends != 0 && (depends & statemachine->evaluating) == 0) continue;
+        if (target != NO_STATE_INDEX) {
+            if (!is_active_index(statemachine, target) || is_descendant_index(table, target, index)) {
+                if (evaluate_guard(statemachine, table, transition, NULL)) {
+                    return execute_transition(statemachine, current, transition, NULL);
                 }
             }
         }
@@ -185,74 +500,1304 @@ state_t *process_completion_transitions(statemachine_t *statemachine, state_t *c
 }
 
 /**
- * Process an active trigger. If trigger is NULL process all transitions with active triggers.
+ * Look up the dense index of an event
+ * @param table
+ * @param event
+ * @return 0 if no transition is triggered by the event
+ */
+static unsigned short get_event_index(const statemachine_table_t *table, event_t event) {
+    if (event <= NULL_ELEMENT_ID || event > table->max_event) return 0;
+    return table->event_index[event];
+}
+
+/**
+ * Process a trigger in an active state. If trigger is NULL only completion transitions are processed. Completion
+ * transitions of a state are checked before its event transitions.
  * @param statemachine
  * @param current
  * @param trigger
- * @return
+ * @return the state the statemachine settled on or NULL if no transition was taken
  */
-state_t *process(statemachine_t *statemachine, state_t *current, trigger_t *trigger) {
+static state_t *process_state(statemachine_t *statemachine, state_t *current, trigger_t *trigger) {
     state_t *state;
-    if (current->active) {
-        // first make sure a substate won't consume this event
-        for (state_t *substate = current->substates;
-             substate != NULL && substate->id != NULL_ELEMENT_ID; substate++) {
-            if (substate->active) {
-                if ((state = process(statemachine, substate, trigger))) return state;
+    if ((state = process_completion_transitions(statemachine, current)) != NULL) return state;
+    if (trigger == NULL) return NULL;
+    statemachine_table_t *table = statemachine->model->table;
+    if (current->id < 0 || current->id > table->max_state_id) return NULL;
+    size_t bucket = (size_t) current->id * table->event_count + get_event_index(table, trigger->event);
+    for (unsigned short i = table->event_offsets[bucket]; i < table->event_offsets[bucket + 1]; i++) {
+        unsigned short transition = table->event_transitions[i];
+        if (evaluate_guard(statemachine, table, transition, trigger)) {
+            return execute_transition(statemachine, current, transition, trigger);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Process a trigger starting from the most nested active state so substates get to consume it before their ancestors
+ * @param statemachine
+ * @param trigger NULL to only process completion transitions
+ * @return the state the statemachine settled on or NULL if no transition was taken
+ */
+state_t *process(statemachine_t *statemachine, trigger_t *trigger) {
+    state_t *state;
+    for (unsigned short depth = statemachine->path_length; depth-- > 0;) {
+        if ((state = process_state(statemachine, statemachine->path[depth], trigger)) != NULL) return state;
+    }
+    return NULL;
+}
+
+/**
+ * Process a trigger from the root of the chart, through the model's generated dispatcher if it has one
+ * @param statemachine
+ * @param trigger NULL to only process completion transitions
+ * @return the state the statemachine settled on or NULL if no transition was taken
+ */
+static inline state_t *process_root(statemachine_t *statemachine, trigger_t *trigger) {
+    statemachine_model_t *model = statemachine->model;
+    if (model->dispatcher != NULL) return model->dispatcher(statemachine, trigger);
+    return process(statemachine, trigger);
+}
+
+/**
+ * Process a time event. The event identifies the time event transition and carries the generation its timer was armed
+ * with. It is discarded if the source state has been left or entered again since the timer was armed.
+ * @param statemachine
+ * @param trigger
+ * @return the state the statemachine settled on or NULL if no transition was taken
+ */
+static state_t *process_timeout(statemachine_t *statemachine, trigger_t *trigger) {
+    const statemachine_table_t *table = statemachine->model->table;
+    size_t index = (size_t) (-(trigger->event + 1));
+    if (index >= table->timeout_count) return NULL;
+    if (statemachine->timeouts[index].timer.generation != (unsigned long) (uintptr_t) trigger->data) return NULL;
+    unsigned short transition = table->timeout_transitions[index];
+    state_t *source = get_state(statemachine, table->transitions[transition].source);
+    if (!is_active(statemachine, source) || !evaluate_guard(statemachine, table, transition, trigger)) return NULL;
+    return execute_transition(statemachine, source, transition, trigger);
+}
+
+/**
+ * Take completion transitions until none are enabled. The number of rounds is bounded so a cycle of completion
+ * transitions whose guards are all true can't stall the statemachine.
+ * @param statemachine
+ * @return the state the statemachine settled on or NULL if no transition was taken
+ */
+static state_t *settle(statemachine_t *statemachine) {
+    state_t *settled = NULL, *state;
+    for (unsigned int round = 0; round <= statemachine->model->table->state_count; round++) {
+        if ((state = process_root(statemachine, NULL)) == NULL) return settled;
+        settled = state;
+    }
+    // still not settled, evaluate everything again on the next step
+    atomic_fetch_or_explicit(&statemachine->changed, STATEMACHINE_INPUTS_ALL, memory_order_relaxed);
+    return settled;
+}
+
+/**
+ * Start a processing step by taking the inputs changed since the last one. Completion transitions depending on other
+ * inputs are skipped until a transition changes the configuration or their inputs.
+ * @param statemachine
+ */
+static inline void collect_changes(statemachine_t *statemachine) {
+    // inputs changed after this need an event of their own, the ones before are taken here
+    atomic_store_explicit(&statemachine->settling, 0, memory_order_seq_cst);
+    statemachine->evaluating = atomic_exchange_explicit(&statemachine->changed, 0, memory_order_seq_cst);
+}
+
+/**
+ * Prepare the event queue. Every cell starts out free for the first lap around the ring.
+ * @param queue
+ */
+static void queue_init(statemachine_queue_t *queue) {
+    for (size_t i = 0; i < STATEMACHINE_QUEUE_SIZE; i++) {
+        atomic_init(&queue->events[i].sequence, i);
+    }
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+/**
+ * Add an event to the queue. Producers claim a cell by advancing the tail and publish it by bumping the cell sequence so
+ * any number of threads can push concurrently without locking.
+ * @param queue
+ * @param trigger
+ * @param timing NULL unless the statemachine keeps timestamps for metrics
+ * @return 0 on success, -1 if the queue is full
+ */
+static int queue_push(statemachine_queue_t *queue, const trigger_t *trigger, statemachine_timing_t *timing) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    statemachine_event_t *cell;
+    for (;;) {
+        cell = &queue->events[tail & (STATEMACHINE_QUEUE_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) tail;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &tail, tail + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
                 break;
             }
+        } else if (difference < 0) {
+            // the consumer hasn't freed this cell since the last lap
+            return -1;
+        } else {
+            tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
         }
-        if ((state = process_completion_transitions(statemachine, current)) != NULL) return state;
-        for (transition_t *transition=statemachine->transitions; transition != NULL && transition->source != NULL_ELEMENT_ID; transition++) {
-            if (trigger == NULL) trigger = &transition->trigger;
-            if (current->id == transition->source && transition->trigger.event == trigger->event && trigger->active) {
-                printf("is trigger data null? %d", trigger->data == NULL);
-                memcpy(&transition->trigger, trigger, sizeof(trigger_t));
-                if (evaluate_transition(statemachine, transition)) {
-                    state_t *target = get_state_by_id((state_t *)statemachine, transition->target);
-                    state = execute_transition(statemachine, current, target, transition);
-                    trigger->active = 0;
-                    return state;
-                }
-            }
+    }
+    cell->trigger = *trigger;
+    if (timing != NULL) {
+        timing->queued[tail & (STATEMACHINE_QUEUE_SIZE - 1)] = statemachine_metrics_enabled() ? statemachine_metrics_now()
+                                                                                              : 0;
+    }
+    atomic_store_explicit(&cell->sequence, tail + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * Take the oldest event from the queue. Only the thread processing the statemachine may call this.
+ * @param queue
+ * @param trigger
+ * @param timing NULL unless the statemachine keeps timestamps for metrics
+ * @param queued set to when the event was dispatched, 0 if that wasn't measured
+ * @return 0 on success, -1 if the queue is empty
+ */
+static int queue_pop(statemachine_queue_t *queue, trigger_t *trigger, const statemachine_timing_t *timing,
+                     uint64_t *queued) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    statemachine_event_t *cell = &queue->events[head & (STATEMACHINE_QUEUE_SIZE - 1)];
+    if (atomic_load_explicit(&cell->sequence, memory_order_acquire) != head + 1) return -1;
+    *trigger = cell->trigger;
+    *queued = timing != NULL ? timing->queued[head & (STATEMACHINE_QUEUE_SIZE - 1)] : 0;
+    atomic_store_explicit(&cell->sequence, head + STATEMACHINE_QUEUE_SIZE, memory_order_release);
+    atomic_store_explicit(&queue->head, head + 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * Check if an event is waiting in the queue
+ * @param queue
+ * @return
+ */
+static int queue_ready(statemachine_queue_t *queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    statemachine_event_t *cell = &queue->events[head & (STATEMACHINE_QUEUE_SIZE - 1)];
+    return atomic_load_explicit(&cell->sequence, memory_order_acquire) == head + 1;
+}
+
+/**
+ * Check whether no producer has claimed a cell of the queue, filled or not
+ * @param queue
+ * @return
+ */
+static int queue_empty(statemachine_queue_t *queue) {
+    return atomic_load_explicit(&queue->tail, memory_order_relaxed) ==
+           atomic_load_explicit(&queue->head, memory_order_relaxed);
+}
+
+/**
+ * Process one event and settle the completion transitions it enabled. Only the thread holding the processing flag may
+ * call this.
+ * @param statemachine
+ * @param trigger
+ * @return the state the statemachine settled on or NULL if no transition was taken
+ */
+static state_t *process_event(statemachine_t *statemachine, trigger_t *trigger) {
+    state_t *settled, *state;
+    // an inline payload is pointed to where this copy of the trigger keeps it
+    if (trigger->size != 0 && trigger->size <= STATEMACHINE_PAYLOAD_INLINE) trigger->data = trigger->payload.bytes;
+    collect_changes(statemachine);
+    statemachine_journal_event(statemachine, trigger);
+    if (trigger->event == NULL_ELEMENT_ID) {
+        // dispatched by statemachine_changed, only completion transitions are processed
+        settled = settle(statemachine);
+    } else {
+        // time events use negative events which can't be authored
+        settled = trigger->event < NULL_ELEMENT_ID ? process_timeout(statemachine, trigger)
+                                                   : process_root(statemachine, trigger);
+        if (settled == NULL) {
+            // events are not deferred, an event that no active state consumed is discarded
+            atomic_fetch_add_explicit(&statemachine->queue.unhandled, 1, memory_order_relaxed);
+            statemachine_trace(statemachine->id, STATEMACHINE_TRACE_UNHANDLED, trigger->event, 0, 0);
+        } else if ((state = settle(statemachine)) != NULL) {
+            settled = state;
         }
+    }
+    // the event has run to completion, nothing reads its payload anymore
+    trigger_release(statemachine, trigger);
+    if (statemachine->model->settled != NULL) statemachine->model->settled(statemachine);
+    return settled;
+}
 
+/**
+ * Process queued events until the queue is empty. Only the thread holding the processing flag may call this.
+ * @param statemachine
+ * @param settled updated with the state the statemachine settled on if a transition was taken
+ */
+static void process_queue(statemachine_t *statemachine, state_t **settled) {
+    statemachine_timing_t *timing = atomic_load_explicit(&statemachine->timing, memory_order_acquire);
+    state_t *state;
+    trigger_t trigger;
+    uint64_t queued;
+    while (queue_pop(&statemachine->queue, &trigger, timing, &queued) == 0) {
+        if ((state = process_event(statemachine, &trigger)) != NULL) *settled = state;
+        if (queued != 0 && statemachine_metrics_enabled()) {
+            statemachine_histogram_record(&statemachine->model->table->metrics->latency,
+                                          statemachine_metrics_now() - queued);
+        }
     }
+}
 
-    return NULL;
+/**
+ * Process queued events one at a time, settling completion transitions after each transition. Only one thread
+ * processes a statemachine at a time. A thread that finds it busy leaves its events for the processing thread which
+ * checks the queue again after it lets go so no event is left behind.
+ * @param statemachine
+ * @param completions take enabled completion transitions even if no event is queued
+ * @return the state the statemachine settled on or NULL if another thread is processing or nothing happened
+ */
+static state_t *statemachine_process(statemachine_t *statemachine, char completions) {
+    state_t *settled = NULL, *state;
+    trigger_t settling = {.event = NULL_ELEMENT_ID};
+    while (!atomic_flag_test_and_set_explicit(&statemachine->processing, memory_order_acquire)) {
+        if (completions) {
+            collect_changes(statemachine);
+            // journaled like statemachine_changed, passes with no input changed are left out of the journal
+            if (statemachine->evaluating != 0) statemachine_journal_event(statemachine, &settling);
+            if ((state = settle(statemachine)) != NULL) settled = state;
+        }
+        completions = 0;
+        process_queue(statemachine, &settled);
+        atomic_flag_clear_explicit(&statemachine->processing, memory_order_seq_cst);
+        // pairs with the fence in statemachine_dispatch, either the producer sees the flag cleared or we see its event
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!queue_ready(&statemachine->queue)) break;
+    }
+    return settled;
+}
+
+/**
+ * Get the timestamps a producer records the dispatch time of its event in
+ * @param statemachine
+ * @return NULL unless metrics are collected or were collected before
+ */
+static inline statemachine_timing_t *get_dispatch_timing(statemachine_t *statemachine) {
+    if (statemachine_metrics_enabled()) return get_timing(statemachine);
+    return atomic_load_explicit(&statemachine->timing, memory_order_acquire);
 }
 
+/**
+ * Wake the thread running the statemachine if it is waiting for events
+ * @param waiter
+ */
+static void waiter_notify(statemachine_waiter_t *waiter) {
+    if (atomic_load_explicit(&waiter->sleeping, memory_order_seq_cst)) {
+        pthread_mutex_lock(&waiter->lock);
+        pthread_cond_signal(&waiter->wake);
+        pthread_mutex_unlock(&waiter->lock);
+    }
+}
 
-state_t *statemachine_process(statemachine_t *statemachine, trigger_t *trigger) {
-    statemachine->processing = 1;
-    state_t *state = process(statemachine, (state_t *)statemachine, trigger);
-    statemachine->processing = 0;
-    return state;
+/**
+ * Count an event that couldn't be queued
+ * @param statemachine
+ * @param event
+ */
+static void drop_event(statemachine_t *statemachine, event_t event) {
+    atomic_fetch_add_explicit(&statemachine->queue.dropped, 1, memory_order_relaxed);
+    statemachine_trace(statemachine->id, STATEMACHINE_TRACE_DROPPED, event, 0, 0);
+}
+
+/**
+ * Queue a trigger and process it unless another thread owns processing
+ * @param this
+ * @param trigger its pool block, if it has one, is given back if it can't be queued
+ * @return like statemachine_dispatch
+ */
+static state_t *dispatch_trigger(statemachine_t *this, const trigger_t *trigger) {
+    if (queue_push(&this->queue, trigger, get_dispatch_timing(this)) != 0) {
+        trigger_release(this, trigger);
+        drop_event(this, trigger->event);
+        return NULL;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    struct statemachine_shard *shard = atomic_load_explicit(&this->shard, memory_order_acquire);
+    if (shard != NULL) {
+        // an executor worker owns processing
+        statemachine_executor_schedule(this, shard);
+        return NULL;
+    }
+    statemachine_waiter_t *waiter = atomic_load_explicit(&this->waiter, memory_order_acquire);
+    if (waiter != NULL && atomic_load_explicit(&waiter->running, memory_order_acquire)) {
+        // the thread in statemachine_run owns processing
+        waiter_notify(waiter);
+        return NULL;
+    }
+    return statemachine_process(this, 0);
 }
 
 state_t *statemachine_dispatch(statemachine_t *this, event_t event, void *data) {
-    // if the statemaching is in the middle of processing a trigger add it to the pool
-    transition_t *transition;
-    for (transition = this->transitions; transition->source != NULL_ELEMENT_ID; transition++) {
-        if (!transition->trigger.active && transition->trigger.event == event) {
-            transition->trigger.data = data;
-            transition->trigger.active = 1;
-            if (!this->processing) {
-                return statemachine_process(this, &transition->trigger);
+    trigger_t trigger = {.event = event, .data = data};
+    return dispatch_trigger(this, &trigger);
+}
+
+state_t *statemachine_dispatch_payload(statemachine_t *this, event_t event, const void *payload, size_t size) {
+    trigger_t trigger = {.event = event};
+    if (trigger_copy(this, &trigger, payload, size) != 0) {
+        drop_event(this, event);
+        return NULL;
+    }
+    return dispatch_trigger(this, &trigger);
+}
+
+/**
+ * Make the trigger of a batch entry, copying its payload like statemachine_dispatch_payload
+ * @param statemachine
+ * @param entry
+ * @param trigger
+ * @return 0 on success, -1 if the payload couldn't be copied, the event is counted as dropped
+ */
+static int entry_trigger(statemachine_t *statemachine, const statemachine_batch_entry_t *entry, trigger_t *trigger) {
+    trigger->event = entry->event;
+    trigger->size = entry->size;
+    trigger->data = entry->data;
+    if (entry->size != 0 && entry->size <= STATEMACHINE_PAYLOAD_INLINE) {
+        trigger->payload = entry->payload;
+    } else if (entry->size != 0 && trigger_copy(statemachine, trigger, entry->data, entry->size) != 0) {
+        drop_event(statemachine, entry->event);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Dispatch a run of batch entries that all go to the same statemachine. If nothing else is processing it the events are
+ * processed directly without going through the queue while it is empty, otherwise they are queued and whoever processes
+ * the statemachine is told once for the whole run.
+ * @param statemachine
+ * @param entries
+ * @param count
+ * @return number of events processed or queued
+ */
+static size_t dispatch_run(statemachine_t *statemachine, const statemachine_batch_entry_t *entries, size_t count) {
+    struct statemachine_shard *shard = atomic_load_explicit(&statemachine->shard, memory_order_acquire);
+    statemachine_waiter_t *waiter = atomic_load_explicit(&statemachine->waiter, memory_order_acquire);
+    char owned = shard != NULL || (waiter != NULL && atomic_load_explicit(&waiter->running, memory_order_acquire));
+    state_t *settled = NULL;
+    size_t accepted = 0, i = 0;
+    if (!owned && !atomic_flag_test_and_set_explicit(&statemachine->processing, memory_order_acquire)) {
+        // events of the batch are measured from when the batch was dispatched
+        uint64_t dispatched = statemachine_metrics_enabled() ? statemachine_metrics_now() : 0;
+        // events queued before the batch go first
+        process_queue(statemachine, &settled);
+        // a cell claimed but not yet filled by another producer stops the queue from draining, whatever was queued
+        // behind it, events of this thread included, stays ahead of the rest of the run which is queued after it
+        for (; i < count && queue_empty(&statemachine->queue); i++) {
+            trigger_t trigger;
+            if (entry_trigger(statemachine, &entries[i], &trigger) != 0) continue;
+            accepted++;
+            process_event(statemachine, &trigger);
+            if (dispatched != 0 && statemachine_metrics_enabled()) {
+                statemachine_histogram_record(&statemachine->model->table->metrics->latency,
+                                              statemachine_metrics_now() - dispatched);
             }
+            // anything the event dispatched from its actions goes before the next entry, as it would with
+            // statemachine_dispatch
+            process_queue(statemachine, &settled);
+        }
+        atomic_fetch_add_explicit(&statemachine->queue.batched, accepted, memory_order_relaxed);
+        atomic_flag_clear_explicit(&statemachine->processing, memory_order_seq_cst);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (i == count) {
+            if (queue_ready(&statemachine->queue)) statemachine_process(statemachine, 0);
+            return accepted;
         }
     }
-    return NULL;
+    for (; i < count; i++) {
+        trigger_t trigger;
+        if (entry_trigger(statemachine, &entries[i], &trigger) != 0) continue;
+        if (queue_push(&statemachine->queue, &trigger, get_dispatch_timing(statemachine)) != 0) {
+            trigger_release(statemachine, &trigger);
+            atomic_fetch_add_explicit(&statemachine->queue.dropped, count - i, memory_order_relaxed);
+            for (; i < count; i++) {
+                statemachine_trace(statemachine->id, STATEMACHINE_TRACE_DROPPED, entries[i].event, 0, 0);
+            }
+            break;
+        }
+        accepted++;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if (shard != NULL) {
+        statemachine_executor_schedule(statemachine, shard);
+    } else if (owned) {
+        waiter_notify(waiter);
+    } else {
+        statemachine_process(statemachine, 0);
+    }
+    return accepted;
+}
+
+size_t statemachine_dispatch_batch(const statemachine_batch_entry_t *entries, size_t count) {
+    size_t accepted = 0;
+    for (size_t first = 0, last; first < count; first = last) {
+        for (last = first + 1; last < count && entries[last].statemachine == entries[first].statemachine; last++);
+        accepted += dispatch_run(entries[first].statemachine, entries + first, last - first);
+    }
+    return accepted;
+}
+
+state_t *statemachine_changed(statemachine_t *statemachine, unsigned long inputs) {
+    atomic_fetch_or_explicit(&statemachine->changed, inputs, memory_order_seq_cst);
+    // an event queued for an earlier change that no step has taken yet takes this one along. Inputs changed by init,
+    // restore or a pass that didn't settle have no event on its way, so they don't count.
+    if (atomic_exchange_explicit(&statemachine->settling, 1, memory_order_seq_cst)) return NULL;
+    return statemachine_dispatch(statemachine, NULL_ELEMENT_ID, NULL);
 }
 
 state_t *statemachine_step(statemachine_t *statemachine) {
-    return statemachine_process(statemachine, NULL);
+    return statemachine_process(statemachine, 1);
+}
+
+/**
+ * Create the waiter used by statemachine_run
+ * @return NULL if it couldn't be allocated
+ */
+static statemachine_waiter_t *waiter_create() {
+    statemachine_waiter_t *waiter = calloc(1, sizeof(statemachine_waiter_t));
+    if (waiter == NULL) return NULL;
+    pthread_mutex_init(&waiter->lock, NULL);
+    pthread_cond_init(&waiter->wake, NULL);
+    pthread_cond_init(&waiter->idle, NULL);
+    atomic_init(&waiter->sleeping, 0);
+    atomic_init(&waiter->running, 0);
+    return waiter;
+}
+
+static void waiter_destroy(statemachine_waiter_t *waiter) {
+    if (waiter != NULL) {
+        pthread_mutex_destroy(&waiter->lock);
+        pthread_cond_destroy(&waiter->wake);
+        pthread_cond_destroy(&waiter->idle);
+        free(waiter);
+    }
+}
+
+/**
+ * Block until an event is dispatched. The sleeping flag is raised before the queue is checked
+ * so a producer either sees it and signals or its event is found by the check.
+ * @param statemachine
+ * @param waiter
+ */
+static void waiter_wait(statemachine_t *statemachine, statemachine_waiter_t *waiter) {
+    pthread_mutex_lock(&waiter->lock);
+    atomic_store_explicit(&waiter->sleeping, 1, memory_order_seq_cst);
+    pthread_cond_broadcast(&waiter->idle);
+    if (!queue_ready(&statemachine->queue)) {
+        pthread_cond_wait(&waiter->wake, &waiter->lock);
+    }
+    atomic_store_explicit(&waiter->sleeping, 0, memory_order_seq_cst);
+    pthread_mutex_unlock(&waiter->lock);
+}
+
+int statemachine_run(statemachine_t *statemachine) {
+    statemachine_waiter_t *waiter = atomic_load_explicit(&statemachine->waiter, memory_order_acquire);
+    if (waiter == NULL) {
+        if ((waiter = waiter_create()) == NULL) return -1;
+        atomic_store_explicit(&statemachine->waiter, waiter, memory_order_release);
+    }
+    atomic_store_explicit(&waiter->running, 1, memory_order_release);
+    while (statemachine_is_active(statemachine)) {
+        statemachine_process(statemachine, 1);
+        if (!statemachine_is_active(statemachine)) break;
+        waiter_wait(statemachine, waiter);
+    }
+    pthread_mutex_lock(&waiter->lock);
+    atomic_store_explicit(&waiter->running, 0, memory_order_release);
+    pthread_cond_broadcast(&waiter->idle);
+    pthread_mutex_unlock(&waiter->lock);
+    // anything dispatched while we were stopping
+    statemachine_process(statemachine, 0);
+    return 0;
+}
+
+void statemachine_flush(statemachine_t *statemachine) {
+    statemachine_waiter_t *waiter = atomic_load_explicit(&statemachine->waiter, memory_order_acquire);
+    size_t target = atomic_load_explicit(&statemachine->queue.tail, memory_order_acquire);
+    if (waiter != NULL) {
+        pthread_mutex_lock(&waiter->lock);
+        while (atomic_load_explicit(&waiter->running, memory_order_relaxed) &&
+               !(atomic_load_explicit(&waiter->sleeping, memory_order_relaxed) &&
+                 atomic_load_explicit(&statemachine->queue.head, memory_order_relaxed) >= target)) {
+            pthread_cond_wait(&waiter->idle, &waiter->lock);
+        }
+        pthread_mutex_unlock(&waiter->lock);
+    }
+    for (;;) {
+        // an executor worker or the thread in statemachine_run processes the events, otherwise whoever gets to them
+        char owned = atomic_load_explicit(&statemachine->shard, memory_order_acquire) != NULL ||
+                     (waiter != NULL && atomic_load_explicit(&waiter->running, memory_order_acquire));
+        if (!owned) statemachine_process(statemachine, 0);
+        // the last event taken off the queue has run to completion once the thread that took it lets go
+        if (atomic_load_explicit(&statemachine->queue.head, memory_order_acquire) >= target &&
+            !atomic_flag_test_and_set_explicit(&statemachine->processing, memory_order_acquire)) {
+            atomic_flag_clear_explicit(&statemachine->processing, memory_order_seq_cst);
+            atomic_thread_fence(memory_order_seq_cst);
+            // a dispatcher that found the flag held here left its event for this thread
+            if (!owned && queue_ready(&statemachine->queue)) statemachine_process(statemachine, 0);
+            return;
+        }
+        sched_yield();
+    }
+}
+
+void statemachine_hold(statemachine_t *statemachine) {
+    while (atomic_flag_test_and_set_explicit(&statemachine->processing, memory_order_acquire)) sched_yield();
 }
 
-state_t *statemachine_init(statemachine_t *this) {
-    return enter_state(this, (state_t *) this, NULL, NULL);
+void statemachine_unhold(statemachine_t *statemachine) {
+    statemachine_waiter_t *waiter = atomic_load_explicit(&statemachine->waiter, memory_order_acquire);
+    atomic_flag_clear_explicit(&statemachine->processing, memory_order_seq_cst);
+    // a running statemachine_run finds the queued events itself, it doesn't sleep while any are queued
+    if (waiter == NULL || !atomic_load_explicit(&waiter->running, memory_order_acquire)) statemachine_step(statemachine);
+}
+
+void statemachine_queue_stats(statemachine_t *statemachine, statemachine_queue_stats_t *stats) {
+    // every event that made it into the queue advanced the tail
+    stats->dispatched = atomic_load_explicit(&statemachine->queue.tail, memory_order_relaxed) +
+                        atomic_load_explicit(&statemachine->queue.batched, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&statemachine->queue.dropped, memory_order_relaxed);
+    stats->unhandled = atomic_load_explicit(&statemachine->queue.unhandled, memory_order_relaxed);
+}
+
+/**
+ * Find the largest state id in the state tree and count the states
+ * @param state
+ * @param count
+ * @return
+ */
+static short get_max_state_id(const state_t *state, size_t *count) {
+    short max = state->id;
+    (*count)++;
+    for (state_t *substate = state->substates; substate != NULL && substate->id != NULL_ELEMENT_ID; substate++) {
+        short id = get_max_state_id(substate, count);
+        if (id > max) max = id;
+    }
+    return max;
+}
+
+/**
+ * Number the states in pre-order and post-order and record their parents and depth
+ * @param table
+ * @param state
+ * @param parent
+ * @param depth
+ * @param post
+ * @return 0 on success, -1 if a state id is used more than once
+ */
+static int index_states(statemachine_table_t *table, state_t *state, unsigned short parent, unsigned short depth,
+                        unsigned short *post) {
+    if (state->id < 0 || table->state_index[state->id] != NO_STATE_INDEX) return -1;
+    unsigned short index = table->state_count++;
+    table->states[index] = state;
+    table->state_index[state->id] = index;
+    table->parent[index] = parent;
+    table->depth[index] = depth;
+    if (depth > table->max_depth) table->max_depth = depth;
+    for (state_t *substate = state->substates; substate != NULL && substate->id != NULL_ELEMENT_ID; substate++) {
+        if (index_states(table, substate, index, depth + 1, post) != 0) return -1;
+    }
+    table->post[index] = (*post)++;
+    return 0;
+}
+
+/**
+ * Turn per bucket counts into offsets. offsets must have count + 1 entries with the counts stored one entry to the right.
+ * @param offsets
+ * @param count
+ */
+static void accumulate_offsets(unsigned short *offsets, size_t count) {
+    for (size_t i = 1; i <= count; i++) {
+        offsets[i] += offsets[i - 1];
+    }
+}
+
+/**
+ * Free a table and everything it owns
+ * @param table
+ */
+static void free_table(statemachine_table_t *table) {
+    if (table != NULL) {
+        if (table->block != NULL) {
+            free(table->block);
+        } else {
+            // compiling failed before the arrays were packed
+            free(table->states);
+            free(table->state_index);
+            free(table->parent);
+            free(table->depth);
+            free(table->post);
+            free(table->event_index);
+            free(table->event_offsets);
+            free(table->event_transitions);
+            free(table->completion_offsets);
+            free(table->completion_transitions);
+            free(table->timeout_offsets);
+            free(table->timeout_transitions);
+            free(table->targets);
+            free(table->depends);
+            free(table->guards);
+            free(table->plans);
+            free(table->plan_states);
+            free(table->plan_effects);
+        }
+        statemachine_metrics_destroy(table->metrics);
+        free(table);
+    }
+}
+
+/**
+ * Build the state index of the table
+ * @param table
+ * @param root
+ * @return 0 on success, -1 on failure
+ */
+static int compile_states(statemachine_table_t *table, state_t *root) {
+    size_t state_count = 0;
+    short max_state_id = get_max_state_id(root, &state_count);
+    if (max_state_id < 0 || state_count >= NO_STATE_INDEX) return -1;
+    table->max_state_id = max_state_id;
+    table->states = calloc(state_count, sizeof(state_t *));
+    table->state_index = malloc(((size_t) max_state_id + 1) * sizeof(unsigned short));
+    table->parent = calloc(state_count, sizeof(unsigned short));
+    table->depth = calloc(state_count, sizeof(unsigned short));
+    table->post = calloc(state_count, sizeof(unsigned short));
+    if (table->states == NULL || table->state_index == NULL || table->parent == NULL || table->depth == NULL ||
+        table->post == NULL) {
+        return -1;
+    }
+    for (size_t id = 0; id <= (size_t) max_state_id; id++) {
+        table->state_index[id] = NO_STATE_INDEX;
+    }
+    unsigned short post = 0;
+    return index_states(table, root, 0, 0, &post);
+}
+
+/**
+ * Build the transition lookup tables
+ * @param table
+ * @param transitions
+ * @return 0 on success, -1 on failure
+ */
+static int compile_transitions(statemachine_table_t *table, transition_t *transitions) {
+    event_t max_event = NULL_ELEMENT_ID;
+    size_t event_transition_count = 0, completion_transition_count = 0, timeout_transition_count = 0;
+    for (transition_t *transition = transitions;
+         transition != NULL && transition->source != NULL_ELEMENT_ID; transition++) {
+        if (transition->source < 0 || transition->source > table->max_state_id ||
+            table->state_index[transition->source] == NO_STATE_INDEX) {
+            return -1;
+        }
+        if (transition->target != NULL_ELEMENT_ID && (transition->target < 0 || transition->target > table->max_state_id ||
+                                                      table->state_index[transition->target] == NO_STATE_INDEX)) {
+            return -1;
+        }
+        if (transition->trigger.event < NULL_ELEMENT_ID) return -1;
+        if (transition->after != NULL) {
+            // time events can't also be triggered by an event
+            if (transition->trigger.event != NULL_ELEMENT_ID) return -1;
+            timeout_transition_count++;
+        } else if (transition->trigger.event == NULL_ELEMENT_ID) {
+            completion_transition_count++;
+        } else {
+            event_transition_count++;
+            if (transition->trigger.event > max_event) max_event = transition->trigger.event;
+        }
+    }
+    if (event_transition_count + completion_transition_count + timeout_transition_count > USHRT_MAX) return -1;
+    // time events are numbered by negative events
+    if (timeout_transition_count > SHRT_MAX) return -1;
+    // number the events, index 0 is reserved for events without transitions
+    table->max_event = max_event;
+    table->event_index = calloc((size_t) max_event + 1, sizeof(unsigned short));
+    if (table->event_index == NULL) return -1;
+    size_t event_count = 1;
+    for (transition_t *transition = transitions;
+         transition != NULL && transition->source != NULL_ELEMENT_ID; transition++) {
+        if (transition->trigger.event != NULL_ELEMENT_ID && table->event_index[transition->trigger.event] == 0) {
+            table->event_index[transition->trigger.event] = event_count++;
+        }
+    }
+    size_t state_count = (size_t) table->max_state_id + 1;
+    table->event_count = event_count;
+    size_t transition_count = event_transition_count + completion_transition_count + timeout_transition_count;
+    table->event_transitions = calloc(event_transition_count + 1, sizeof(unsigned short));
+    table->completion_transitions = calloc(completion_transition_count + 1, sizeof(unsigned short));
+    table->event_offsets = calloc(state_count * event_count + 1, sizeof(unsigned short));
+    table->completion_offsets = calloc(state_count + 1, sizeof(unsigned short));
+    table->timeout_count = timeout_transition_count;
+    table->timeout_transitions = calloc(timeout_transition_count + 1, sizeof(unsigned short));
+    table->timeout_offsets = calloc(state_count + 1, sizeof(unsigned short));
+    table->targets = calloc(transition_count + 1, sizeof(unsigned short));
+    table->depends = calloc(transition_count + 1, sizeof(unsigned long));
+    table->guards = calloc(transition_count + 1, sizeof(*table->guards));
+    unsigned short *event_offsets = table->event_offsets, *completion_offsets = table->completion_offsets;
+    unsigned short *timeout_offsets = table->timeout_offsets;
+    if (table->event_transitions == NULL || table->completion_transitions == NULL || event_offsets == NULL ||
+        completion_offsets == NULL || table->timeout_transitions == NULL || timeout_offsets == NULL ||
+        table->targets == NULL || table->depends == NULL || table->guards == NULL) {
+        return -1;
+    }
+    // count the transitions in each bucket
+    for (transition_t *transition = transitions;
+         transition != NULL && transition->source != NULL_ELEMENT_ID; transition++) {
+        if (transition->after != NULL) {
+            timeout_offsets[transition->source + 1]++;
+        } else if (transition->trigger.event == NULL_ELEMENT_ID) {
+            completion_offsets[transition->source + 1]++;
+        } else {
+            unsigned short index = table->event_index[transition->trigger.event];
+            event_offsets[(size_t) transition->source * event_count + index + 1]++;
+        }
+    }
+    accumulate_offsets(event_offsets, state_count * event_count);
+    accumulate_offsets(completion_offsets, state_count);
+    accumulate_offsets(timeout_offsets, state_count);
+    // fill the buckets in authoring order, the offsets are shifted while filling and restored afterwards
+    for (unsigned short i = 0; i < transition_count; i++) {
+        transition_t *transition = &transitions[i];
+        table->targets[i] = transition->target != NULL_ELEMENT_ID ? table->state_index[transition->target]
+                                                                   : NO_STATE_INDEX;
+        table->depends[i] = transition->depends;
+        table->guards[i] = transition->guard;
+        if (transition->after != NULL) {
+            table->timeout_transitions[timeout_offsets[transition->source]++] = i;
+        } else if (transition->trigger.event == NULL_ELEMENT_ID) {
+            table->completion_transitions[completion_offsets[transition->source]++] = i;
+        } else {
+            unsigned short index = table->event_index[transition->trigger.event];
+            table->event_transitions[event_offsets[(size_t) transition->source * event_count + index]++] = i;
+        }
+    }
+    memmove(event_offsets + 1, event_offsets, state_count * event_count * sizeof(unsigned short));
+    event_offsets[0] = 0;
+    memmove(completion_offsets + 1, completion_offsets, state_count * sizeof(unsigned short));
+    completion_offsets[0] = 0;
+    memmove(timeout_offsets + 1, timeout_offsets, state_count * sizeof(unsigned short));
+    timeout_offsets[0] = 0;
+    return 0;
+}
+
+/**
+ * Find the deepest state that is an ancestor of, or the same as, both states
+ * @param table
+ * @param a pre-order index
+ * @param b pre-order index
+ * @return pre-order index of the least common ancestor
+ */
+static unsigned short get_common_ancestor(const statemachine_table_t *table, unsigned short a, unsigned short b) {
+    while (table->depth[a] > table->depth[b]) a = table->parent[a];
+    while (table->depth[b] > table->depth[a]) b = table->parent[b];
+    while (a != b) {
+        a = table->parent[a];
+        b = table->parent[b];
+    }
+    return a;
+}
+
+/**
+ * Append the states below the ancestor down to and including the descendant to the plan entries
+ * @param table
+ * @param plan
+ * @param ancestor pre-order index
+ * @param descendant pre-order index
+ */
+static void plan_path(const statemachine_table_t *table, statemachine_plan_t *plan, unsigned short ancestor,
+                      unsigned short descendant) {
+    unsigned short count = table->depth[descendant] - table->depth[ancestor];
+    size_t end = plan->first + plan->exit_count + plan->entry_count;
+    for (unsigned short i = count; i > 0; i--) {
+        table->plan_states[end + i - 1] = descendant;
+        table->plan_effects[end + i - 1] = NO_STATE_INDEX;
+        descendant = table->parent[descendant];
+    }
+    plan->entry_count += count;
+}
+
+/**
+ * Append the initial transitions of a state to the plan entries. Each initial transition executes its effect before the
+ * first state on its path is entered.
+ * @param table
+ * @param plan
+ * @param index pre-order index of the state
+ * @return 0 on success, -1 if an initial transition doesn't target a descendant
+ */
+static int plan_initial(const statemachine_table_t *table, statemachine_plan_t *plan, unsigned short index) {
+    for (state_t *state = table->states[index]; state->initial.target != NULL_ELEMENT_ID; state = table->states[index]) {
+        short id = state->initial.target;
+        if (id < 0 || id > table->max_state_id || table->state_index[id] == NO_STATE_INDEX) return -1;
+        unsigned short target = table->state_index[id];
+        if (!is_descendant_index(table, index, target)) return -1;
+        size_t first = plan->first + plan->exit_count + plan->entry_count;
+        plan_path(table, plan, index, target);
+        table->plan_effects[first] = index;
+        index = target;
+    }
+    return 0;
+}
+
+/**
+ * Work out the exits and entries of a transition.
+ *
+ * Local transitions stay inside their source. Self transitions exit and re-enter their source. A transition to an
+ * ancestor exits everything below the ancestor and runs its initial transition again. Any other transition exits up to
+ * the least common ancestor of its source and target.
+ * @param table
+ * @param plan
+ * @param transition
+ * @return 0 on success, -1 on failure
+ */
+static int compile_plan(const statemachine_table_t *table, statemachine_plan_t *plan, transition_t *transition) {
+    unsigned short source = table->state_index[transition->source];
+    if (transition->target == NULL_ELEMENT_ID) {
+        plan->internal = 1;
+        plan->settled = source;
+        return 0;
+    }
+    unsigned short target = table->state_index[transition->target], domain;
+    if (is_descendant_index(table, source, target)) {
+        domain = source;
+    } else if (source == target) {
+        domain = table->parent[source];
+    } else if (is_descendant_index(table, target, source)) {
+        domain = target;
+    } else {
+        domain = get_common_ancestor(table, source, target);
+    }
+    for (unsigned short index = source; index != domain; index = table->parent[index]) {
+        table->plan_effects[plan->first + plan->exit_count] = NO_STATE_INDEX;
+        table->plan_states[plan->first + plan->exit_count++] = index;
+    }
+    plan_path(table, plan, domain, target);
+    if (plan_initial(table, plan, target) != 0) return -1;
+    plan->settled = plan->entry_count ? table->plan_states[plan->first + plan->exit_count + plan->entry_count - 1]
+                                      : target;
+    return 0;
+}
+
+/**
+ * Build a plan for every transition and one for entering the initial configuration
+ * @param table
+ * @param transitions
+ * @return 0 on success, -1 on failure
+ */
+static int compile_plans(statemachine_table_t *table, transition_t *transitions) {
+    // a plan never exits or enters more states than the chart is deep
+    size_t capacity = (size_t) table->max_depth + 1, count = 0;
+    for (transition_t *transition = transitions;
+         transition != NULL && transition->source != NULL_ELEMENT_ID; transition++) {
+        count++;
+    }
+    table->transitions = transitions;
+    table->transition_count = count;
+    // plans are laid out at a fixed stride while compiling and packed afterwards
+    if ((count + 1) * capacity * 2 > UINT32_MAX) return -1;
+    table->plans = calloc(count + 1, sizeof(statemachine_plan_t));
+    table->plan_states = calloc((count + 1) * capacity * 2, sizeof(unsigned short));
+    table->plan_effects = calloc((count + 1) * capacity * 2, sizeof(unsigned short));
+    if (table->plans == NULL || table->plan_states == NULL || table->plan_effects == NULL) return -1;
+    for (size_t i = 0; i <= count; i++) {
+        statemachine_plan_t *plan = i < count ? &table->plans[i] : &table->initial;
+        plan->first = (uint32_t) (i * capacity * 2);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (compile_plan(table, &table->plans[i], &transitions[i]) != 0) return -1;
+    }
+    statemachine_plan_t *initial = &table->initial;
+    table->plan_states[initial->first] = 0;
+    table->plan_effects[initial->first] = NO_STATE_INDEX;
+    initial->entry_count++;
+    if (plan_initial(table, initial, 0) != 0) return -1;
+    initial->settled = table->plan_states[initial->first + initial->entry_count - 1];
+    // close the gaps each plan left in the storage, plans are moved down in the order they were laid out
+    uint32_t used = 0;
+    for (size_t i = 0; i <= count; i++) {
+        statemachine_plan_t *plan = i < count ? &table->plans[i] : &table->initial;
+        size_t length = (size_t) plan->exit_count + plan->entry_count;
+        memmove(table->plan_states + used, table->plan_states + plan->first, length * sizeof(unsigned short));
+        memmove(table->plan_effects + used, table->plan_effects + plan->first, length * sizeof(unsigned short));
+        plan->first = used;
+        used += (uint32_t) length;
+    }
+    table->plan_length = used;
+    return 0;
+}
+
+/**
+ * An array of the table and its size, see pack_table
+ */
+typedef struct {
+    void *array; // the table's pointer to the array
+    size_t size;
+    size_t alignment;
+} table_array_t;
+
+/**
+ * Move every array of the table into a single block so processing an event walks one contiguous allocation instead of
+ * one per array. Arrays of pointers come first so the arrays of shorts after them pack without padding.
+ * @param table
+ * @return 0 on success, -1 if the block couldn't be allocated
+ */
+static int pack_table(statemachine_table_t *table) {
+    size_t ids = (size_t) table->max_state_id + 1, states = table->state_count, count = table->transition_count;
+    size_t events = table->event_offsets[ids * table->event_count];
+    size_t completions = table->completion_offsets[ids], timeouts = table->timeout_count;
+    table_array_t arrays[] = {
+            {&table->states, states * sizeof(state_t *), _Alignof(state_t *)},
+            {&table->guards, (count + 1) * sizeof(*table->guards), _Alignof(void (*)(void))},
+            {&table->depends, (count + 1) * sizeof(unsigned long), _Alignof(unsigned long)},
+            {&table->plans, (count + 1) * sizeof(statemachine_plan_t), _Alignof(statemachine_plan_t)},
+            {&table->state_index, ids * sizeof(unsigned short), _Alignof(unsigned short)},
+            {&table->depth, states * sizeof(unsigned short), _Alignof(unsigned short)},
+            {&table->parent, states * sizeof(unsigned short), _Alignof(unsigned short)},
+            {&table->post, states * sizeof(unsigned short), _Alignof(unsigned short)},
+            {&table->event_index, ((size_t) table->max_event + 1) * sizeof(unsigned short), _Alignof(unsigned short)},
+            {&table->completion_offsets, (ids + 1) * sizeof(unsigned short), _Alignof(unsigned short)},
+            {&table->completion_transitions, (completions + 1) * sizeof(unsigned short), _Alignof(unsigned short)},
+            {&table->event_offsets, (ids * table->event_count + 1) * sizeof(unsigned short), _Alignof(unsigned short)},
+            {&table->event_transitions, (events + 1) * sizeof(unsigned short), _Alignof(unsigned short)},
+            {&table->targets, (count + 1) * sizeof(unsigned short), _Alignof(unsigned short)},
+            {&table->plan_states, table->plan_length * sizeof(unsigned short), _Alignof(unsigned short)},
+            {&table->plan_effects, table->plan_length * sizeof(unsigned short), _Alignof(unsigned short)},
+            {&table->timeout_offsets, (ids + 1) * sizeof(unsigned short), _Alignof(unsigned short)},
+            {&table->timeout_transitions, (timeouts + 1) * sizeof(unsigned short), _Alignof(unsigned short)},
+    };
+    size_t size = 0, offsets[sizeof(arrays) / sizeof(arrays[0])];
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++) {
+        size = (size + arrays[i].alignment - 1) & ~(arrays[i].alignment - 1);
+        offsets[i] = size;
+        size += arrays[i].size;
+    }
+    unsigned char *block = malloc(size ? size : 1);
+    if (block == NULL) return -1;
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++) {
+        void *array, *packed = block + offsets[i];
+        // the table's pointers have different types, they are read and written as plain pointers
+        memcpy(&array, arrays[i].array, sizeof(void *));
+        if (arrays[i].size != 0) memcpy(packed, array, arrays[i].size);
+        free(array);
+        memcpy(arrays[i].array, &packed, sizeof(void *));
+    }
+    table->block = block;
+    table->bytes = sizeof(statemachine_table_t) + size;
+    return 0;
+}
+
+/**
+ * Dispatch the time event of an expired timer. Runs on the timer thread.
+ * @param timer
+ * @param generation
+ */
+static void expire_timeout(statemachine_timer_t *timer, unsigned long generation) {
+    statemachine_timeout_t *timeout = (statemachine_timeout_t *) timer;
+    statemachine_t *statemachine = timeout->statemachine;
+    event_t event = (event_t) -(timeout - statemachine->timeouts + 1);
+    statemachine_dispatch(statemachine, event, (void *) (uintptr_t) generation);
+}
+
+/**
+ * Mix a value into an FNV-1a hash
+ * @param hash
+ * @param value
+ * @return
+ */
+static inline uint32_t fingerprint_add(uint32_t hash, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        hash = (hash ^ ((value >> (8 * i)) & 0xFF)) * 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * Hash what a snapshot depends on: the states in pre-order with their depth and the ends, events and time events of
+ * the transitions, which fix the meaning of saved state ids and timer indices
+ * @param table
+ * @return
+ */
+static uint32_t fingerprint_table(const statemachine_table_t *table) {
+    uint32_t hash = 2166136261U;
+    for (unsigned short i = 0; i < table->state_count; i++) {
+        hash = fingerprint_add(hash, (uint32_t) (uint16_t) table->states[i]->id | (uint32_t) table->depth[i] << 16);
+    }
+    for (size_t i = 0; i < table->transition_count; i++) {
+        transition_t *transition = &table->transitions[i];
+        hash = fingerprint_add(hash, (uint32_t) (uint16_t) transition->source | (uint32_t) (uint16_t) transition->target << 16);
+        hash = fingerprint_add(hash, (uint32_t) (uint16_t) transition->trigger.event | (transition->after != NULL) << 16);
+    }
+    return hash;
+}
+
+int statemachine_compile(statemachine_model_t *model) {
+    statemachine_table_t *table = calloc(1, sizeof(statemachine_table_t));
+    if (table == NULL) return -1;
+    if (compile_states(table, &model->root) != 0 || compile_transitions(table, model->transitions) != 0 ||
+        compile_plans(table, model->transitions) != 0 || pack_table(table) != 0 ||
+        (table->metrics = statemachine_metrics_create(table->transition_count, table->state_count)) == NULL) {
+        free_table(table);
+        return -1;
+    }
+    table->fingerprint = fingerprint_table(table);
+    statemachine_release(model);
+    model->table = table;
+    return 0;
+}
+
+void statemachine_release(statemachine_model_t *model) {
+    free_table(model->table);
+    model->table = NULL;
+}
+
+int statemachine_footprint(const statemachine_model_t *model, statemachine_footprint_t *footprint) {
+    const statemachine_table_t *table = model->table;
+    if (table == NULL) return -1;
+    // every state array ends with a null element, which the root's doesn't need
+    size_t arrays = 0;
+    for (unsigned short i = 0; i < table->state_count; i++) {
+        if (table->states[i]->substates != NULL && table->states[i]->substates->id != NULL_ELEMENT_ID) arrays++;
+    }
+    footprint->chart = (table->state_count + arrays) * sizeof(state_t) +
+                       (table->transition_count + 1) * sizeof(transition_t);
+    footprint->table = table->bytes;
+    size_t words = ((size_t) table->state_count + 63) / 64;
+    footprint->instance = sizeof(statemachine_t) + table->timeout_count * sizeof(statemachine_timeout_t);
+    if (words > 1) footprint->instance += words * sizeof(uint64_t);
+    if (table->max_depth >= STATEMACHINE_PATH_INLINE) {
+        footprint->instance += (table->max_depth + 1U) * sizeof(state_t *);
+    }
+    return 0;
+}
+
+/**
+ * Allocate the active configuration and time event timers of a statemachine. Models with up to 64 states keep their
+ * active configuration inside the statemachine, and models nested less than STATEMACHINE_PATH_INLINE deep their active
+ * path.
+ * @param statemachine
+ * @return 0 on success, -1 if they couldn't be allocated
+ */
+static int allocate_instance(statemachine_t *statemachine) {
+    const statemachine_table_t *table = statemachine->model->table;
+    size_t words = ((size_t) table->state_count + 63) / 64;
+    statemachine->active_word = 0;
+    statemachine->active = words > 1 ? calloc(words, sizeof(uint64_t)) : &statemachine->active_word;
+    if (statemachine->active == NULL) return -1;
+    statemachine->path_length = 0;
+    statemachine->path = table->max_depth < STATEMACHINE_PATH_INLINE ? statemachine->path_states
+                                                                     : calloc(table->max_depth + 1U, sizeof(state_t *));
+    if (statemachine->path == NULL) return -1;
+    if (table->timeout_count) {
+        statemachine->timeouts = calloc(table->timeout_count, sizeof(statemachine_timeout_t));
+        if (statemachine->timeouts == NULL) return -1;
+        for (unsigned short i = 0; i < table->timeout_count; i++) {
+            statemachine->timeouts[i].statemachine = statemachine;
+            statemachine->timeouts[i].timer.expire = expire_timeout;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Free what allocate_instance allocated. Timers are cancelled first and any expiry already collected by the timer
+ * thread is waited for since it may still be dispatching to this statemachine.
+ * @param statemachine
+ */
+static void free_instance(statemachine_t *statemachine) {
+    if (statemachine->index != NULL) {
+        // whatever the statemachine was in, it isn't anymore
+        for (unsigned short depth = 0; depth < statemachine->path_length; depth++) {
+            statemachine_index_update(statemachine, get_state_index(statemachine->model->table,
+                                                                    statemachine->path[depth]), 0);
+        }
+    }
+    if (statemachine->timeouts != NULL) {
+        for (unsigned short i = 0; i < statemachine->model->table->timeout_count; i++) {
+            statemachine_timer_cancel(&statemachine->timeouts[i].timer);
+        }
+        statemachine_timer_sync();
+        free(statemachine->timeouts);
+        statemachine->timeouts = NULL;
+    }
+    if (statemachine->active != &statemachine->active_word) free(statemachine->active);
+    statemachine->active = NULL;
+    if (statemachine->path != statemachine->path_states) free(statemachine->path);
+    statemachine->path = NULL;
+    statemachine->path_length = 0;
+    free(atomic_load_explicit(&statemachine->timing, memory_order_relaxed));
+    atomic_store_explicit(&statemachine->timing, NULL, memory_order_relaxed);
+    free(atomic_load_explicit(&statemachine->pool, memory_order_relaxed));
+    atomic_store_explicit(&statemachine->pool, NULL, memory_order_relaxed);
+}
+
+state_t *statemachine_init(statemachine_t *this, statemachine_model_t *model) {
+    if (model->table == NULL && statemachine_compile(model) != 0) return NULL;
+    if (this->active != NULL) {
+        if (this->model == model && statemachine_is_active(this)) return statemachine_get_active_state(this);
+        free_instance(this);
+    }
+    // an index only tracks the statemachines running its model
+    if (this->index != NULL && this->index->model != model) this->index = NULL;
+    this->model = model;
+    if (this->id == 0) this->id = atomic_fetch_add_explicit(&statemachine_ids, 1, memory_order_relaxed) + 1;
+    if (allocate_instance(this) != 0) {
+        free_instance(this);
+        return NULL;
+    }
+    atomic_flag_clear(&this->processing);
+    // nothing has been evaluated yet
+    atomic_store_explicit(&this->changed, STATEMACHINE_INPUTS_ALL, memory_order_relaxed);
+    atomic_store_explicit(&this->settling, 0, memory_order_relaxed);
+    queue_init(&this->queue);
+    state_t *state = execute_plan(this, NULL, &model->table->initial, NULL, NULL);
+    if (model->settled != NULL) model->settled(this);
+    return state;
+}
+
+/**
+ * Read the wall clock snapshot deadlines are kept on
+ * @return milliseconds since the epoch
+ */
+static uint64_t snapshot_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000ULL + (uint64_t) now.tv_nsec / 1000000ULL;
+}
+
+size_t statemachine_snapshot_size(statemachine_model_t *model) {
+    return STATEMACHINE_SNAPSHOT_HEADER + (size_t) model->table->timeout_count * STATEMACHINE_SNAPSHOT_TIMEOUT;
+}
+
+size_t statemachine_snapshot(statemachine_t *this, void *buffer, size_t size) {
+    const statemachine_table_t *table = this->model->table;
+    unsigned char *bytes = buffer;
+    uint64_t wall = snapshot_now();
+    unsigned long long now = statemachine_timer_now();
+    uint16_t version = STATEMACHINE_SNAPSHOT_VERSION, armed = 0;
+    state_t *active = statemachine_get_active_state(this);
+    int16_t state = active != NULL ? active->id : NULL_ELEMENT_ID;
+    size_t length = STATEMACHINE_SNAPSHOT_HEADER;
+    for (uint16_t i = 0; i < table->timeout_count; i++) {
+        unsigned long long expires = statemachine_timer_expires(&this->timeouts[i].timer);
+        if (expires == 0) continue;
+        uint64_t deadline = wall + (expires > now ? expires - now : 0);
+        if (length + STATEMACHINE_SNAPSHOT_TIMEOUT <= size) {
+            memcpy(bytes + length, &i, sizeof(i));
+            memcpy(bytes + length + 2, &deadline, sizeof(deadline));
+        }
+        length += STATEMACHINE_SNAPSHOT_TIMEOUT;
+        armed++;
+    }
+    if (length > size) return length;
+    memcpy(bytes, &version, sizeof(version));
+    memcpy(bytes + 2, &state, sizeof(state));
+    memcpy(bytes + 4, &armed, sizeof(armed));
+    memcpy(bytes + 6, &table->fingerprint, sizeof(table->fingerprint));
+    return length;
+}
+
+int statemachine_restore(statemachine_t *this, statemachine_model_t *model, const void *snapshot, size_t size) {
+    if (model->table == NULL && statemachine_compile(model) != 0) return -1;
+    const statemachine_table_t *table = model->table;
+    const unsigned char *bytes = snapshot;
+    uint16_t version, armed;
+    int16_t id;
+    uint32_t fingerprint;
+    if (size < STATEMACHINE_SNAPSHOT_HEADER) return -1;
+    memcpy(&version, bytes, sizeof(version));
+    memcpy(&id, bytes + 2, sizeof(id));
+    memcpy(&armed, bytes + 4, sizeof(armed));
+    memcpy(&fingerprint, bytes + 6, sizeof(fingerprint));
+    if (version != STATEMACHINE_SNAPSHOT_VERSION || fingerprint != table->fingerprint || armed > table->timeout_count ||
+        size < STATEMACHINE_SNAPSHOT_HEADER + (size_t) armed * STATEMACHINE_SNAPSHOT_TIMEOUT) {
+        return -1;
+    }
+    unsigned short leaf = NO_STATE_INDEX;
+    if (id != NULL_ELEMENT_ID) {
+        if (id < 0 || id > table->max_state_id || table->state_index[id] == NO_STATE_INDEX) return -1;
+        leaf = table->state_index[id];
+    }
+    // a timer can only be armed while the source of its time event is active
+    for (uint16_t i = 0; i < armed; i++) {
+        uint16_t timeout;
+        memcpy(&timeout, bytes + STATEMACHINE_SNAPSHOT_HEADER + (size_t) i * STATEMACHINE_SNAPSHOT_TIMEOUT,
+               sizeof(timeout));
+        if (timeout >= table->timeout_count || leaf == NO_STATE_INDEX) return -1;
+        unsigned short source = table->state_index[table->transitions[table->timeout_transitions[timeout]].source];
+        if (source > leaf || table->post[source] < table->post[leaf]) return -1;
+    }
+    if (this->active != NULL) free_instance(this);
+    // an index only tracks the statemachines running its model
+    if (this->index != NULL && this->index->model != model) this->index = NULL;
+    this->model = model;
+    if (this->id == 0) this->id = atomic_fetch_add_explicit(&statemachine_ids, 1, memory_order_relaxed) + 1;
+    if (allocate_instance(this) != 0) {
+        free_instance(this);
+        return -1;
+    }
+    atomic_flag_clear(&this->processing);
+    atomic_store_explicit(&this->changed, STATEMACHINE_INPUTS_ALL, memory_order_relaxed);
+    atomic_store_explicit(&this->settling, 0, memory_order_relaxed);
+    queue_init(&this->queue);
+    if (leaf != NO_STATE_INDEX) {
+        // the path from the saved state up to the root is the whole active configuration
+        for (unsigned short index = leaf;; index = table->parent[index]) {
+            this->active[index >> 6] |= 1ULL << (index & 63);
+            this->path[table->depth[index]] = table->states[index];
+            if (this->index != NULL) statemachine_index_update(this, index, 1);
+            if (index == 0) break;
+        }
+        this->path_length = (unsigned short) (table->depth[leaf] + 1);
+    }
+    // before any timer is armed, a time event could otherwise be processed first
+    if (model->settled != NULL) model->settled(this);
+    uint64_t now = snapshot_now();
+    unsigned long long tick = armed > 0 ? statemachine_timer_now() : 0;
+    for (uint16_t i = 0; i < armed; i++) {
+        const unsigned char *timeout = bytes + STATEMACHINE_SNAPSHOT_HEADER + (size_t) i * STATEMACHINE_SNAPSHOT_TIMEOUT;
+        uint16_t index;
+        uint64_t deadline;
+        memcpy(&index, timeout, sizeof(index));
+        memcpy(&deadline, timeout + 2, sizeof(deadline));
+        unsigned long left = deadline > now ? (unsigned long) (deadline - now) : 0;
+        transition_t *transition = &table->transitions[table->timeout_transitions[index]];
+        // the entry isn't saved, count it back from the duration the restored data gives
+        unsigned long after = transition->after(this, transition), since = after > left ? after - left : 0;
+        this->timeouts[index].entered = tick > since ? tick - since : 0;
+        statemachine_timer_arm(&this->timeouts[index].timer, left);
+    }
+    return 0;
+}
+
+int statemachine_rearm(statemachine_t *this, short state) {
+    state_t *source = get_state(this, state);
+    if (source == NULL || !is_active(this, source)) return -1;
+    const statemachine_table_t *table = this->model->table;
+    unsigned long long now = statemachine_timer_now();
+    for (unsigned short i = table->timeout_offsets[state]; i < table->timeout_offsets[state + 1]; i++) {
+        transition_t *transition = &table->transitions[table->timeout_transitions[i]];
+        unsigned long after = transition->after(this, transition);
+        unsigned long long since = now - this->timeouts[i].entered;
+        statemachine_timer_arm(&this->timeouts[i].timer, since < after ? (unsigned long) (after - since) : 0);
+    }
+    return 0;
 }
 
 void statemachine_terminate(statemachine_t *this) {
-    exit_state(this, (state_t *) this, NULL);
+    exit_state(this, &this->model->root, NULL);
+}
+
+void statemachine_deinit(statemachine_t *this) {
+    if (this->active == NULL) return;
+    if (atomic_load_explicit(&this->shard, memory_order_acquire) != NULL) statemachine_executor_remove(this);
+    statemachine_terminate(this);
+    free_instance(this);
+    this->index = NULL;
+    waiter_destroy(atomic_exchange(&this->waiter, NULL));
 }
\ No newline at end of file
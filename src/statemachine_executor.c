@@ -0,0 +1,447 @@
+//
+// Sharded executor with work stealing for fleets of statemachines
+//
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "statemachine_executor.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+
+/**
+ * A worker and the statemachines it owns. Statemachines with events arrive on the inbound queue, which any thread may
+ * push to, and are moved by the worker onto its deque. The worker takes work from the bottom of its deque while other
+ * workers steal from the top (Chase-Lev), so only stealing ever contends.
+ */
+typedef struct statemachine_shard {
+    // consumer side of the inbound queue, only touched by the worker
+    _Alignas(CACHE_LINE) statemachine_ready_t *inbound_tail;
+    statemachine_ready_t stub;
+    struct statemachine_executor *executor;
+    unsigned int index;
+    pthread_t thread;
+    unsigned long runs;
+    unsigned long steals;
+    // producer side of the inbound queue
+    _Alignas(CACHE_LINE) _Atomic(statemachine_ready_t *) inbound_head;
+    // the deque
+    _Alignas(CACHE_LINE) atomic_long top;
+    _Alignas(CACHE_LINE) atomic_long bottom;
+    _Atomic(statemachine_t *) deque[STATEMACHINE_EXECUTOR_DEQUE_SIZE];
+    // sleeping
+    _Alignas(CACHE_LINE) atomic_int sleeping;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} statemachine_shard_t;
+
+struct statemachine_executor {
+    unsigned int worker_count;
+    atomic_uint next; // shard the next statemachine added goes to
+    atomic_int stopping;
+    atomic_int idle; // workers asleep
+    _Alignas(CACHE_LINE) atomic_long pending; // statemachines handed to a worker and not yet processed
+    pthread_mutex_t lock;
+    pthread_cond_t drained; // broadcast when pending drops to 0
+    statemachine_shard_t *shards;
+};
+
+/**
+ * Get the statemachine a ready link belongs to
+ * @param ready
+ * @return
+ */
+static inline statemachine_t *ready_statemachine(statemachine_ready_t *ready) {
+    return (statemachine_t *) ((char *) ready - offsetof(statemachine_t, ready));
+}
+
+/**
+ * Add a link to a shard's inbound queue. Producers swap themselves in as the head and then link the previous head to
+ * them, which is all the synchronization the queue needs (Vyukov's intrusive MPSC queue).
+ * @param shard
+ * @param ready
+ */
+static void inbound_push(statemachine_shard_t *shard, statemachine_ready_t *ready) {
+    atomic_store_explicit(&ready->next, NULL, memory_order_relaxed);
+    statemachine_ready_t *previous = atomic_exchange_explicit(&shard->inbound_head, ready, memory_order_acq_rel);
+    atomic_store_explicit(&previous->next, ready, memory_order_release);
+}
+
+/**
+ * Take the oldest link off a shard's inbound queue. Only the worker owning the shard may call this.
+ * @param shard
+ * @return NULL if the queue is empty or a producer is half way through a push
+ */
+static statemachine_ready_t *inbound_pop(statemachine_shard_t *shard) {
+    statemachine_ready_t *tail = shard->inbound_tail;
+    statemachine_ready_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &shard->stub) {
+        if (next == NULL) return NULL;
+        shard->inbound_tail = tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        shard->inbound_tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&shard->inbound_head, memory_order_acquire)) return NULL;
+    // tail is the last link, put the stub behind it so it can be taken
+    inbound_push(shard, &shard->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next == NULL) return NULL;
+    shard->inbound_tail = next;
+    return tail;
+}
+
+static int inbound_empty(statemachine_shard_t *shard) {
+    return atomic_load_explicit(&shard->inbound_head, memory_order_seq_cst) == shard->inbound_tail;
+}
+
+/**
+ * Put a statemachine at the bottom of the worker's own deque
+ * @param shard
+ * @param statemachine
+ * @return 0 on success, -1 if the deque is full
+ */
+static int deque_push(statemachine_shard_t *shard, statemachine_t *statemachine) {
+    long bottom = atomic_load_explicit(&shard->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&shard->top, memory_order_acquire);
+    if (bottom - top >= STATEMACHINE_EXECUTOR_DEQUE_SIZE) return -1;
+    atomic_store_explicit(&shard->deque[bottom & (STATEMACHINE_EXECUTOR_DEQUE_SIZE - 1)], statemachine,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&shard->bottom, bottom + 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * Take the statemachine at the bottom of the worker's own deque
+ * @param shard
+ * @return NULL if the deque is empty or a thief took the last statemachine
+ */
+static statemachine_t *deque_pop(statemachine_shard_t *shard) {
+    long bottom = atomic_load_explicit(&shard->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&shard->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&shard->top, memory_order_relaxed);
+    statemachine_t *statemachine = NULL;
+    if (top <= bottom) {
+        statemachine = atomic_load_explicit(&shard->deque[bottom & (STATEMACHINE_EXECUTOR_DEQUE_SIZE - 1)],
+                                            memory_order_relaxed);
+        if (top == bottom) {
+            // last one, race the thieves for it
+            if (!atomic_compare_exchange_strong_explicit(&shard->top, &top, top + 1, memory_order_seq_cst,
+                                                         memory_order_relaxed)) {
+                statemachine = NULL;
+            }
+            atomic_store_explicit(&shard->bottom, bottom + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&shard->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return statemachine;
+}
+
+/**
+ * Take the statemachine at the top of another worker's deque
+ * @param shard
+ * @return NULL if the deque is empty or another thread won the race for it
+ */
+static statemachine_t *deque_steal(statemachine_shard_t *shard) {
+    long top = atomic_load_explicit(&shard->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&shard->bottom, memory_order_acquire);
+    if (top >= bottom) return NULL;
+    statemachine_t *statemachine = atomic_load_explicit(&shard->deque[top & (STATEMACHINE_EXECUTOR_DEQUE_SIZE - 1)],
+                                                        memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&shard->top, &top, top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return statemachine;
+}
+
+static long deque_size(statemachine_shard_t *shard) {
+    return atomic_load_explicit(&shard->bottom, memory_order_seq_cst) -
+           atomic_load_explicit(&shard->top, memory_order_seq_cst);
+}
+
+/**
+ * Wake a worker if it is asleep
+ * @param shard
+ * @return 1 if it was asleep
+ */
+static int shard_wake(statemachine_shard_t *shard) {
+    if (!atomic_load_explicit(&shard->sleeping, memory_order_seq_cst)) return 0;
+    pthread_mutex_lock(&shard->lock);
+    pthread_cond_signal(&shard->wake);
+    pthread_mutex_unlock(&shard->lock);
+    return 1;
+}
+
+/**
+ * Wake one sleeping worker other than the given one so it can steal
+ * @param executor
+ * @param shard
+ */
+static void executor_wake_thief(struct statemachine_executor *executor, statemachine_shard_t *shard) {
+    if (atomic_load_explicit(&executor->idle, memory_order_seq_cst) == 0) return;
+    for (unsigned int i = 1; i < executor->worker_count; i++) {
+        if (shard_wake(&executor->shards[(shard->index + i) % executor->worker_count])) return;
+    }
+}
+
+void statemachine_executor_schedule(statemachine_t *statemachine, struct statemachine_shard *shard) {
+    // a statemachine is handed over once until its worker picks it up, further events ride along
+    if (atomic_load_explicit(&statemachine->scheduled, memory_order_seq_cst) ||
+        atomic_exchange_explicit(&statemachine->scheduled, 1, memory_order_seq_cst)) {
+        return;
+    }
+    atomic_fetch_add_explicit(&shard->executor->pending, 1, memory_order_relaxed);
+    inbound_push(shard, &statemachine->ready);
+    atomic_thread_fence(memory_order_seq_cst);
+    shard_wake(shard);
+}
+
+/**
+ * Process the events of a statemachine. The scheduled flag is cleared first so an event dispatched while it is being
+ * processed hands the statemachine over again, and the worker counts itself as running it before that so
+ * statemachine_executor_remove waits until it is done with the statemachine.
+ * @param shard
+ * @param statemachine
+ */
+static void shard_run(statemachine_shard_t *shard, statemachine_t *statemachine) {
+    struct statemachine_executor *executor = shard->executor;
+    atomic_fetch_add_explicit(&statemachine->running, 1, memory_order_seq_cst);
+    atomic_store_explicit(&statemachine->scheduled, 0, memory_order_seq_cst);
+    statemachine_step(statemachine);
+    // the statemachine may be freed as soon as this is seen
+    atomic_fetch_sub_explicit(&statemachine->running, 1, memory_order_seq_cst);
+    shard->runs++;
+    if (atomic_fetch_sub_explicit(&executor->pending, 1, memory_order_acq_rel) == 1) {
+        pthread_mutex_lock(&executor->lock);
+        pthread_cond_broadcast(&executor->drained);
+        pthread_mutex_unlock(&executor->lock);
+    }
+}
+
+/**
+ * Move statemachines from the inbound queue onto the deque while it has room
+ * @param shard
+ * @return number of statemachines moved
+ */
+static unsigned int shard_collect(statemachine_shard_t *shard) {
+    unsigned int count = 0;
+    statemachine_ready_t *ready;
+    while (deque_size(shard) < STATEMACHINE_EXECUTOR_DEQUE_SIZE && (ready = inbound_pop(shard)) != NULL) {
+        deque_push(shard, ready_statemachine(ready));
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Look for a statemachine to steal, starting with the worker after this one
+ * @param shard
+ * @return NULL if every other deque is empty
+ */
+static statemachine_t *shard_steal(statemachine_shard_t *shard) {
+    struct statemachine_executor *executor = shard->executor;
+    for (unsigned int i = 1; i < executor->worker_count; i++) {
+        statemachine_t *statemachine = deque_steal(&executor->shards[(shard->index + i) % executor->worker_count]);
+        if (statemachine != NULL) return statemachine;
+    }
+    return NULL;
+}
+
+/**
+ * Check if any other worker has statemachines to steal
+ * @param shard
+ * @return
+ */
+static int shard_can_steal(statemachine_shard_t *shard) {
+    struct statemachine_executor *executor = shard->executor;
+    for (unsigned int i = 1; i < executor->worker_count; i++) {
+        if (deque_size(&executor->shards[(shard->index + i) % executor->worker_count]) > 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Sleep until a statemachine is handed to this worker or another worker asks for help. The sleeping flag is raised
+ * before checking for work so whoever hands over work either sees it or its work is found by the check.
+ * @param shard
+ */
+static void shard_sleep(statemachine_shard_t *shard) {
+    struct statemachine_executor *executor = shard->executor;
+    pthread_mutex_lock(&shard->lock);
+    atomic_store_explicit(&shard->sleeping, 1, memory_order_seq_cst);
+    atomic_fetch_add_explicit(&executor->idle, 1, memory_order_seq_cst);
+    if (inbound_empty(shard) && !shard_can_steal(shard) &&
+        !atomic_load_explicit(&executor->stopping, memory_order_seq_cst)) {
+        pthread_cond_wait(&shard->wake, &shard->lock);
+    }
+    atomic_fetch_sub_explicit(&executor->idle, 1, memory_order_seq_cst);
+    atomic_store_explicit(&shard->sleeping, 0, memory_order_seq_cst);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void *shard_task(void *argument) {
+    statemachine_shard_t *shard = argument;
+    struct statemachine_executor *executor = shard->executor;
+    for (;;) {
+        if (shard_collect(shard) > 1 || deque_size(shard) > 1) {
+            // more than this worker can start on right now
+            executor_wake_thief(executor, shard);
+        }
+        statemachine_t *statemachine = deque_pop(shard);
+        if (statemachine == NULL && (statemachine = shard_steal(shard)) != NULL) shard->steals++;
+        if (statemachine != NULL) {
+            shard_run(shard, statemachine);
+            continue;
+        }
+        if (!inbound_empty(shard)) {
+            // a producer is half way through a push
+            sched_yield();
+            continue;
+        }
+        if (atomic_load_explicit(&executor->stopping, memory_order_seq_cst) &&
+            atomic_load_explicit(&executor->pending, memory_order_seq_cst) == 0) {
+            break;
+        }
+        shard_sleep(shard);
+    }
+    return NULL;
+}
+
+/**
+ * Pin a worker to a cpu
+ * @param shard
+ */
+static void shard_pin(statemachine_shard_t *shard) {
+#ifdef __linux__
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    if (cpus <= 0) return;
+    CPU_ZERO(&set);
+    CPU_SET(shard->index % (unsigned long) cpus, &set);
+    pthread_setaffinity_np(shard->thread, sizeof(set), &set);
+#else
+    (void) (shard);
+#endif
+}
+
+/**
+ * Stop the workers once pending work is done and free the executor
+ * @param executor
+ * @param started number of workers whose thread was started
+ */
+static void executor_stop(struct statemachine_executor *executor, unsigned int started) {
+    atomic_store_explicit(&executor->stopping, 1, memory_order_seq_cst);
+    for (unsigned int i = 0; i < started; i++) {
+        statemachine_shard_t *shard = &executor->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        pthread_cond_signal(&shard->wake);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(executor->shards[i].thread, NULL);
+    }
+    for (unsigned int i = 0; i < executor->worker_count; i++) {
+        pthread_mutex_destroy(&executor->shards[i].lock);
+        pthread_cond_destroy(&executor->shards[i].wake);
+    }
+    pthread_mutex_destroy(&executor->lock);
+    pthread_cond_destroy(&executor->drained);
+    free(executor->shards);
+    free(executor);
+}
+
+statemachine_executor_t *statemachine_executor_create(unsigned int workers) {
+    if (workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (unsigned int) cpus : 1;
+    }
+    struct statemachine_executor *executor = calloc(1, sizeof(struct statemachine_executor));
+    if (executor == NULL) return NULL;
+    size_t size = (sizeof(statemachine_shard_t) * workers + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    executor->shards = aligned_alloc(CACHE_LINE, size);
+    if (executor->shards == NULL) {
+        free(executor);
+        return NULL;
+    }
+    pthread_mutex_init(&executor->lock, NULL);
+    pthread_cond_init(&executor->drained, NULL);
+    for (unsigned int i = 0; i < workers; i++) {
+        statemachine_shard_t *shard = &executor->shards[i];
+        *shard = (statemachine_shard_t) {.executor = executor, .index = i};
+        atomic_init(&shard->stub.next, NULL);
+        atomic_init(&shard->inbound_head, &shard->stub);
+        shard->inbound_tail = &shard->stub;
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->wake, NULL);
+    }
+    executor->worker_count = workers;
+    for (unsigned int i = 0; i < workers; i++) {
+        if (pthread_create(&executor->shards[i].thread, NULL, shard_task, &executor->shards[i]) != 0) {
+            executor_stop(executor, i);
+            return NULL;
+        }
+        shard_pin(&executor->shards[i]);
+    }
+    return executor;
+}
+
+unsigned int statemachine_executor_add(statemachine_executor_t *executor, statemachine_t *statemachine) {
+    unsigned int index = atomic_fetch_add_explicit(&executor->next, 1, memory_order_relaxed) % executor->worker_count;
+    statemachine_shard_t *shard = &executor->shards[index];
+    atomic_store_explicit(&statemachine->scheduled, 0, memory_order_relaxed);
+    atomic_store_explicit(&statemachine->shard, shard, memory_order_seq_cst);
+    // events dispatched before the statemachine joined
+    statemachine_executor_schedule(statemachine, shard);
+    return index;
+}
+
+void statemachine_executor_remove(statemachine_t *statemachine) {
+    atomic_store_explicit(&statemachine->shard, NULL, memory_order_seq_cst);
+    // once it is neither handed over nor held by a worker no worker can reach it again, a worker counts itself as
+    // running it before clearing scheduled so one of the two is always seen
+    while (atomic_load_explicit(&statemachine->scheduled, memory_order_seq_cst) ||
+           atomic_load_explicit(&statemachine->running, memory_order_seq_cst)) {
+        sched_yield();
+    }
+    while (atomic_flag_test_and_set_explicit(&statemachine->processing, memory_order_acquire)) sched_yield();
+    atomic_flag_clear_explicit(&statemachine->processing, memory_order_release);
+    statemachine_step(statemachine);
+}
+
+void statemachine_executor_flush(statemachine_executor_t *executor) {
+    pthread_mutex_lock(&executor->lock);
+    while (atomic_load_explicit(&executor->pending, memory_order_acquire) > 0) {
+        pthread_cond_wait(&executor->drained, &executor->lock);
+    }
+    pthread_mutex_unlock(&executor->lock);
+}
+
+void statemachine_executor_stats(statemachine_executor_t *executor, statemachine_executor_stats_t *stats) {
+    // the counters belong to the workers, read them once they're drained for exact numbers
+    stats->runs = 0;
+    stats->steals = 0;
+    for (unsigned int i = 0; i < executor->worker_count; i++) {
+        stats->runs += executor->shards[i].runs;
+        stats->steals += executor->shards[i].steals;
+    }
+}
+
+unsigned int statemachine_executor_workers(statemachine_executor_t *executor) {
+    return executor->worker_count;
+}
+
+void statemachine_executor_destroy(statemachine_executor_t *executor) {
+    if (executor != NULL) executor_stop(executor, executor->worker_count);
+}
@@ -0,0 +1,88 @@
+//
+// Which of many statemachines are in each state of their chart, kept up to date as they enter and leave states
+//
+
+#include "statemachine_index.h"
+#include <limits.h>
+#include <stdlib.h>
+
+int statemachine_index_init(statemachine_index_t *index, statemachine_model_t *model, size_t capacity) {
+    index->model = model;
+    index->capacity = capacity;
+    index->words = (capacity + 63) / 64;
+    index->members = NULL;
+    if (model->table == NULL && statemachine_compile(model) != 0) return -1;
+    size_t words = (size_t) model->table->state_count * index->words;
+    index->members = calloc(words ? words : 1, sizeof(atomic_uint_least64_t));
+    return index->members != NULL ? 0 : -1;
+}
+
+void statemachine_index_deinit(statemachine_index_t *index) {
+    free(index->members);
+    index->members = NULL;
+}
+
+/**
+ * Set or clear the bits of a statemachine for the states on its active path
+ * @param statemachine
+ * @param active
+ */
+static void index_path(statemachine_t *statemachine, char active) {
+    const statemachine_table_t *table = statemachine->model->table;
+    for (unsigned short depth = 0; depth < statemachine->path_length; depth++) {
+        statemachine_index_update(statemachine, table->state_index[statemachine->path[depth]->id], active);
+    }
+}
+
+int statemachine_index_add(statemachine_index_t *index, statemachine_t *statemachine, size_t position) {
+    if (statemachine->model != index->model || statemachine->index != NULL || position >= index->capacity) return -1;
+    statemachine_hold(statemachine);
+    statemachine->index = index;
+    statemachine->position = position;
+    if (statemachine->active != NULL) index_path(statemachine, 1);
+    statemachine_unhold(statemachine);
+    return 0;
+}
+
+void statemachine_index_remove(statemachine_t *statemachine) {
+    if (statemachine->index == NULL) return;
+    statemachine_hold(statemachine);
+    if (statemachine->active != NULL) index_path(statemachine, 0);
+    statemachine->index = NULL;
+    statemachine_unhold(statemachine);
+}
+
+/**
+ * Get the bitset of a state
+ * @param index
+ * @param id of the state
+ * @return NULL if the chart has no such state
+ */
+static const atomic_uint_least64_t *index_members(const statemachine_index_t *index, short id) {
+    const statemachine_table_t *table = index->model->table;
+    if (id < 0 || id > table->max_state_id || table->state_index[id] == USHRT_MAX) return NULL;
+    return index->members + (size_t) table->state_index[id] * index->words;
+}
+
+size_t statemachine_index_count(const statemachine_index_t *index, short id) {
+    const atomic_uint_least64_t *members = index_members(index, id);
+    size_t count = 0;
+    if (members == NULL) return 0;
+    for (size_t i = 0; i < index->words; i++) {
+        count += (size_t) __builtin_popcountll(atomic_load_explicit(&members[i], memory_order_relaxed));
+    }
+    return count;
+}
+
+size_t statemachine_index_next(const statemachine_index_t *index, short id, size_t position) {
+    const atomic_uint_least64_t *members = index_members(index, id);
+    if (members == NULL || position >= index->capacity) return index->capacity;
+    size_t word = position / 64;
+    // bits below the position are masked off the first word
+    uint64_t bits = atomic_load_explicit(&members[word], memory_order_relaxed) & (~0ULL << (position % 64));
+    while (bits == 0) {
+        if (++word == index->words) return index->capacity;
+        bits = atomic_load_explicit(&members[word], memory_order_relaxed);
+    }
+    return word * 64 + (size_t) __builtin_ctzll(bits);
+}
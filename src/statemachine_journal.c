@@ -0,0 +1,441 @@
+//
+// Append-only journal of the events statemachines process, written in batches by a background thread, and its replay
+//
+
+#include "statemachine_journal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// statemachine_journaling while events are journaled and while a journal is replayed
+#define JOURNAL_RECORDING 1
+#define JOURNAL_REPLAYING 2
+// marks the end of a chain of records
+#define JOURNAL_NONE SIZE_MAX
+
+typedef struct {
+    pthread_mutex_t lock; // guards everything but the file writes
+    pthread_mutex_t writing; // held while a buffer is written so buffers reach the file in order
+    pthread_cond_t wake; // signalled to stop the journal thread
+    pthread_t thread;
+    char running; // records are accepted
+    char stopping;
+    int file;
+    size_t (*payload_size)(event_t event);
+    unsigned char *buffer; // records are appended here
+    unsigned char *spare; // written out by the journal thread while the other buffer fills
+    size_t used;
+    size_t lost; // bytes that couldn't be written, nothing more is once a write fails
+} journal_t;
+
+/**
+ * A statemachine of a replay and the next record of it the replay expects
+ */
+typedef struct {
+    uint32_t id;
+    statemachine_t *statemachine; // NULL until its first event is replayed
+    size_t cursor; // index of the next record of this statemachine, JOURNAL_NONE past its last one
+    size_t last; // index of its last record, JOURNAL_NONE marks a free entry
+} replay_machine_t;
+
+typedef struct {
+    const unsigned char *bytes;
+    size_t *offsets; // record index -> offset in bytes
+    size_t *next; // record index -> index of the next record of the same statemachine
+    size_t count;
+    replay_machine_t *machines; // open addressing by id
+    size_t capacity; // power of two
+    replay_machine_t *current; // statemachine whose event is being replayed
+    size_t expected; // index of the event being replayed until it has been processed
+    statemachine_journal_replay_t *result;
+} replayer_t;
+
+atomic_char statemachine_journaling;
+
+static journal_t journal = {.lock = PTHREAD_MUTEX_INITIALIZER, .writing = PTHREAD_MUTEX_INITIALIZER, .file = -1};
+static replayer_t replayer;
+
+/**
+ * Write a whole buffer to the journal file. Once a write fails the rest of the buffer and every later one is counted as
+ * lost instead, records appended after a partial one couldn't be told apart.
+ * @param bytes
+ * @param size
+ */
+static void journal_write(const unsigned char *bytes, size_t size) {
+    while (size > 0 && journal.lost == 0) {
+        ssize_t written = write(journal.file, bytes, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) break;
+        bytes += written;
+        size -= (size_t) written;
+    }
+    journal.lost += size;
+}
+
+/**
+ * Write out the records buffered so far on the calling thread. The journal lock must be held.
+ */
+static void journal_flush() {
+    pthread_mutex_lock(&journal.writing);
+    journal_write(journal.buffer, journal.used);
+    journal.used = 0;
+    pthread_mutex_unlock(&journal.writing);
+}
+
+static void *journal_task(void *argument) {
+    (void) (argument);
+    pthread_mutex_lock(&journal.lock);
+    while (!journal.stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += STATEMACHINE_JOURNAL_INTERVAL * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&journal.wake, &journal.lock, &deadline);
+        if (journal.used == 0) continue;
+        // swap buffers so events keep being journaled while this batch is written and synced
+        unsigned char *batch = journal.buffer;
+        size_t size = journal.used;
+        journal.buffer = journal.spare;
+        journal.spare = batch;
+        journal.used = 0;
+        pthread_mutex_lock(&journal.writing);
+        pthread_mutex_unlock(&journal.lock);
+        journal_write(batch, size);
+        fdatasync(journal.file);
+        pthread_mutex_unlock(&journal.writing);
+        pthread_mutex_lock(&journal.lock);
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return NULL;
+}
+
+int statemachine_journal_start(const char *path, size_t (*payload_size)(event_t event)) {
+    statemachine_journal_header_t header = {.version = STATEMACHINE_JOURNAL_VERSION,
+                                            .record_size = sizeof(statemachine_journal_record_t)};
+    memcpy(header.magic, STATEMACHINE_JOURNAL_MAGIC, sizeof(header.magic));
+    pthread_mutex_lock(&journal.lock);
+    if (journal.running || atomic_load(&statemachine_journaling) != 0) {
+        pthread_mutex_unlock(&journal.lock);
+        return -1;
+    }
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&journal.wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+    journal.buffer = malloc(STATEMACHINE_JOURNAL_BUFFER);
+    journal.spare = malloc(STATEMACHINE_JOURNAL_BUFFER);
+    journal.file = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    journal.payload_size = payload_size;
+    journal.used = 0;
+    journal.lost = 0;
+    journal.stopping = 0;
+    if (journal.buffer == NULL || journal.spare == NULL || journal.file < 0 ||
+        pthread_create(&journal.thread, NULL, journal_task, NULL) != 0) {
+        free(journal.buffer);
+        free(journal.spare);
+        if (journal.file >= 0) close(journal.file);
+        journal.file = -1;
+        pthread_cond_destroy(&journal.wake);
+        pthread_mutex_unlock(&journal.lock);
+        return -1;
+    }
+    journal_write((const unsigned char *) &header, sizeof(header));
+    journal.running = 1;
+    pthread_mutex_unlock(&journal.lock);
+    atomic_store_explicit(&statemachine_journaling, JOURNAL_RECORDING, memory_order_release);
+    return 0;
+}
+
+size_t statemachine_journal_stop() {
+    pthread_mutex_lock(&journal.lock);
+    if (!journal.running) {
+        pthread_mutex_unlock(&journal.lock);
+        return 0;
+    }
+    atomic_store_explicit(&statemachine_journaling, 0, memory_order_release);
+    journal.stopping = 1;
+    pthread_cond_signal(&journal.wake);
+    pthread_mutex_unlock(&journal.lock);
+    pthread_join(journal.thread, NULL);
+    pthread_mutex_lock(&journal.lock);
+    journal.running = 0;
+    journal_flush();
+    fdatasync(journal.file);
+    close(journal.file);
+    journal.file = -1;
+    free(journal.buffer);
+    free(journal.spare);
+    journal.buffer = journal.spare = NULL;
+    pthread_cond_destroy(&journal.wake);
+    size_t lost = journal.lost;
+    pthread_mutex_unlock(&journal.lock);
+    return lost;
+}
+
+/**
+ * Append a record and its payload to the journal buffer
+ * @param record
+ * @param payload
+ */
+static void journal_append(const statemachine_journal_record_t *record, const void *payload) {
+    size_t size = sizeof(*record) + record->size;
+    pthread_mutex_lock(&journal.lock);
+    if (journal.running) {
+        if (journal.used + size > STATEMACHINE_JOURNAL_BUFFER) journal_flush();
+        memcpy(journal.buffer + journal.used, record, sizeof(*record));
+        if (record->size) memcpy(journal.buffer + journal.used + sizeof(*record), payload, record->size);
+        journal.used += size;
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+static uint64_t journal_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+/**
+ * Stop a replay at a record
+ * @param index the record the replay diverged at, JOURNAL_NONE if it ran out of records
+ * @param reason
+ */
+static void replay_diverge(size_t index, const char *reason) {
+    if (replayer.result->mismatch != 0) return;
+    replayer.result->mismatch = index == JOURNAL_NONE ? replayer.offsets[replayer.count] : replayer.offsets[index];
+    replayer.result->reason = reason;
+}
+
+static inline const statemachine_journal_record_t *replay_record(size_t index, statemachine_journal_record_t *record) {
+    // records follow payloads of any length, copy them out rather than reading them unaligned
+    memcpy(record, replayer.bytes + replayer.offsets[index], sizeof(*record));
+    return record;
+}
+
+/**
+ * Check an event a replayed statemachine processes is the one being replayed
+ * @param statemachine
+ * @param trigger
+ */
+static void replay_event(statemachine_t *statemachine, const trigger_t *trigger) {
+    statemachine_journal_record_t record;
+    if (replayer.current == NULL || statemachine != replayer.current->statemachine ||
+        replayer.expected == JOURNAL_NONE || replay_record(replayer.expected, &record)->event != trigger->event) {
+        replay_diverge(replayer.expected != JOURNAL_NONE ? replayer.expected
+                                                         : replayer.current != NULL ? replayer.current->cursor
+                                                                                    : JOURNAL_NONE,
+                       "an event was processed that wasn't journaled at this point");
+        return;
+    }
+    replayer.expected = JOURNAL_NONE;
+    replayer.result->events++;
+}
+
+/**
+ * Check a transition a replayed statemachine takes is the next one journaled for it
+ * @param statemachine
+ * @param transition
+ * @param trigger
+ */
+static void replay_transition(statemachine_t *statemachine, const transition_t *transition, const trigger_t *trigger) {
+    statemachine_journal_record_t record;
+    replay_machine_t *machine = replayer.current;
+    if (machine == NULL || statemachine != machine->statemachine) {
+        replay_diverge(machine != NULL ? machine->cursor : JOURNAL_NONE,
+                       "a statemachine other than the one replaying an event took a transition");
+        return;
+    }
+    size_t index = machine->cursor;
+    // past the last record of a statemachine only while replaying its last event, whose records may have been cut off
+    if (index == JOURNAL_NONE && replayer.result->truncated != 0) return;
+    if (index == JOURNAL_NONE || replay_record(index, &record)->kind != STATEMACHINE_JOURNAL_TRANSITION ||
+        record.source != transition->source || record.target != transition->target ||
+        record.event != (trigger != NULL ? trigger->event : NULL_ELEMENT_ID)) {
+        replay_diverge(index, "a transition was taken that wasn't journaled at this point");
+        return;
+    }
+    machine->cursor = replayer.next[index];
+    replayer.result->transitions++;
+}
+
+void statemachine_journal_write_event(statemachine_t *statemachine, const trigger_t *trigger) {
+    if (atomic_load_explicit(&statemachine_journaling, memory_order_relaxed) == JOURNAL_REPLAYING) {
+        replay_event(statemachine, trigger);
+        return;
+    }
+    // copied payloads know their size, data that is only pointed to is sized by the callback
+    size_t size = trigger->size;
+    if (size == 0 && trigger->event > NULL_ELEMENT_ID && trigger->data != NULL && journal.payload_size != NULL) {
+        size = journal.payload_size(trigger->event);
+    }
+    if (size > UINT8_MAX) size = UINT8_MAX;
+    statemachine_journal_record_t record = {.timestamp = journal_now(), .inputs = statemachine->evaluating,
+                                            .statemachine = statemachine->id, .event = trigger->event,
+                                            .kind = STATEMACHINE_JOURNAL_EVENT, .size = (uint8_t) size};
+    journal_append(&record, trigger->data);
+}
+
+void statemachine_journal_write_transition(statemachine_t *statemachine, const transition_t *transition,
+                                           const trigger_t *trigger) {
+    if (atomic_load_explicit(&statemachine_journaling, memory_order_relaxed) == JOURNAL_REPLAYING) {
+        replay_transition(statemachine, transition, trigger);
+        return;
+    }
+    statemachine_journal_record_t record = {.timestamp = journal_now(), .statemachine = statemachine->id,
+                                            .event = trigger != NULL ? trigger->event : NULL_ELEMENT_ID,
+                                            .source = transition->source, .target = transition->target,
+                                            .kind = STATEMACHINE_JOURNAL_TRANSITION};
+    journal_append(&record, NULL);
+}
+
+/**
+ * Find the entry of a statemachine id, adding it if it isn't there
+ * @param id
+ * @return
+ */
+static replay_machine_t *replay_machine(uint32_t id) {
+    size_t slot = (id * 2654435761U) & (replayer.capacity - 1);
+    while (replayer.machines[slot].last != JOURNAL_NONE && replayer.machines[slot].id != id) {
+        slot = (slot + 1) & (replayer.capacity - 1);
+    }
+    return &replayer.machines[slot];
+}
+
+/**
+ * Find the records of a journal and chain the records of each statemachine together
+ * @param length bytes in the journal
+ * @return 0 on success, -1 if memory couldn't be allocated
+ */
+static int replay_index(size_t length) {
+    statemachine_journal_record_t record;
+    size_t offset = sizeof(statemachine_journal_header_t), count = 0;
+    while (offset + sizeof(record) <= length) {
+        memcpy(&record, replayer.bytes + offset, sizeof(record));
+        if (offset + sizeof(record) + record.size > length) break;
+        offset += sizeof(record) + record.size;
+        count++;
+    }
+    // a write cut short leaves part of a record at the end
+    replayer.result->truncated = length - offset;
+    replayer.count = count;
+    replayer.offsets = malloc((count + 1) * sizeof(size_t));
+    replayer.next = malloc((count ? count : 1) * sizeof(size_t));
+    for (replayer.capacity = 16; replayer.capacity < count * 2; replayer.capacity <<= 1);
+    replayer.machines = malloc(replayer.capacity * sizeof(replay_machine_t));
+    if (replayer.offsets == NULL || replayer.next == NULL || replayer.machines == NULL) return -1;
+    for (size_t i = 0; i < replayer.capacity; i++) {
+        replayer.machines[i] = (replay_machine_t) {.cursor = JOURNAL_NONE, .last = JOURNAL_NONE};
+    }
+    offset = sizeof(statemachine_journal_header_t);
+    for (size_t i = 0; i < count; i++) {
+        replayer.offsets[i] = offset;
+        replay_record(i, &record);
+        offset += sizeof(record) + record.size;
+        replay_machine_t *machine = replay_machine(record.statemachine);
+        if (machine->last == JOURNAL_NONE) {
+            machine->id = record.statemachine;
+            machine->cursor = i;
+        } else {
+            replayer.next[machine->last] = i;
+        }
+        machine->last = i;
+        replayer.next[i] = JOURNAL_NONE;
+    }
+    replayer.offsets[count] = offset;
+    return 0;
+}
+
+/**
+ * Replay the event records of the indexed journal in order
+ * @param resolve
+ * @param context
+ * @return 0 once every record was replayed or the replay diverged, -1 if a statemachine couldn't be resolved
+ */
+static int replay_events(statemachine_t *(*resolve)(uint32_t id, void *context), void *context) {
+    statemachine_journal_record_t record;
+    // payloads are copied out so they are aligned for whatever they hold
+    _Alignas(max_align_t) unsigned char payload[UINT8_MAX];
+    for (size_t i = 0; i < replayer.count && replayer.result->mismatch == 0; i++) {
+        if (replay_record(i, &record)->kind != STATEMACHINE_JOURNAL_EVENT) continue;
+        replay_machine_t *machine = replay_machine(record.statemachine);
+        if (machine->statemachine == NULL && (machine->statemachine = resolve(record.statemachine, context)) == NULL) {
+            return -1;
+        }
+        if (machine->cursor != i) {
+            replay_diverge(machine->cursor, "a journaled transition wasn't taken");
+            break;
+        }
+        machine->cursor = replayer.next[i];
+        replayer.current = machine;
+        replayer.expected = i;
+        statemachine_t *statemachine = machine->statemachine;
+        atomic_store_explicit(&statemachine->changed, record.inputs, memory_order_relaxed);
+        statemachine_timer_virtual(record.timestamp / 1000000ULL);
+        if (record.event < NULL_ELEMENT_ID) {
+            // timers never expire on the virtual clock, the journaled one is expired here so time events can't
+            // overtake the events they followed
+            size_t timeout = (size_t) (-(record.event + 1));
+            if (timeout >= statemachine->model->table->timeout_count ||
+                statemachine_timer_expires(&statemachine->timeouts[timeout].timer) == 0) {
+                replay_diverge(i, "the timer of a journaled time event isn't armed");
+                break;
+            }
+            statemachine_timer_cancel(&statemachine->timeouts[timeout].timer);
+            statemachine_dispatch(statemachine, record.event,
+                                  (void *) (uintptr_t) statemachine->timeouts[timeout].timer.generation);
+        } else {
+            memcpy(payload, replayer.bytes + replayer.offsets[i] + sizeof(record), record.size);
+            statemachine_dispatch(statemachine, record.event, record.size ? payload : NULL);
+        }
+        if (replayer.expected != JOURNAL_NONE) replay_diverge(i, "a journaled event wasn't processed");
+    }
+    // every statemachine must have taken all of its journaled transitions
+    for (size_t i = 0; i < replayer.capacity && replayer.result->mismatch == 0; i++) {
+        if (replayer.machines[i].statemachine != NULL && replayer.machines[i].cursor != JOURNAL_NONE) {
+            replay_diverge(replayer.machines[i].cursor, "a journaled transition wasn't taken");
+        }
+    }
+    return 0;
+}
+
+int statemachine_journal_replay(const char *path, statemachine_t *(*resolve)(uint32_t id, void *context),
+                                void *context, statemachine_journal_replay_t *replay) {
+    statemachine_journal_header_t header;
+    *replay = (statemachine_journal_replay_t) {0};
+    int file = open(path, O_RDONLY);
+    if (file < 0) return -1;
+    off_t length = lseek(file, 0, SEEK_END);
+    const unsigned char *bytes = length >= (off_t) sizeof(header)
+                                 ? mmap(NULL, (size_t) length, PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+    close(file);
+    if (bytes == MAP_FAILED) return -1;
+    memcpy(&header, bytes, sizeof(header));
+    char expected = 0;
+    int result = -1;
+    replayer = (replayer_t) {.bytes = bytes, .result = replay, .expected = JOURNAL_NONE};
+    if (memcmp(header.magic, STATEMACHINE_JOURNAL_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == STATEMACHINE_JOURNAL_VERSION && header.record_size == sizeof(statemachine_journal_record_t) &&
+        replay_index((size_t) length) == 0 &&
+        atomic_compare_exchange_strong(&statemachine_journaling, &expected, JOURNAL_REPLAYING)) {
+        statemachine_journal_record_t first;
+        madvise((void *) bytes, (size_t) length, MADV_SEQUENTIAL);
+        if (replayer.count == 0 || statemachine_timer_virtual(replay_record(0, &first)->timestamp / 1000000ULL) == 0) {
+            result = replay_events(resolve, context);
+        }
+        atomic_store_explicit(&statemachine_journaling, 0, memory_order_release);
+        if (result == 0 && replay->mismatch != 0) result = 1;
+    }
+    free(replayer.offsets);
+    free(replayer.next);
+    free(replayer.machines);
+    munmap((void *) bytes, (size_t) length);
+    replayer = (replayer_t) {0};
+    return result;
+}
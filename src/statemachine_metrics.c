@@ -0,0 +1,211 @@
+//
+// Counters and latency histograms of statemachine models
+//
+
+#include "statemachine.h"
+#include <stdlib.h>
+
+#define SUB_BUCKETS (1U << STATEMACHINE_HISTOGRAM_SUB_BITS)
+
+atomic_char statemachine_measuring;
+
+void statemachine_metrics_enable(char enabled) {
+    atomic_store_explicit(&statemachine_measuring, enabled, memory_order_relaxed);
+}
+
+statemachine_metrics_t *statemachine_metrics_create(size_t transition_count, size_t state_count) {
+    statemachine_metrics_t *metrics = calloc(1, sizeof(statemachine_metrics_t));
+    if (metrics == NULL) return NULL;
+    metrics->transitions = calloc(transition_count ? transition_count : 1, sizeof(statemachine_transition_metrics_t));
+    metrics->states = calloc(state_count ? state_count : 1, sizeof(statemachine_state_metrics_t));
+    if (metrics->transitions == NULL || metrics->states == NULL) {
+        statemachine_metrics_destroy(metrics);
+        return NULL;
+    }
+    return metrics;
+}
+
+void statemachine_metrics_destroy(statemachine_metrics_t *metrics) {
+    if (metrics == NULL) return;
+    free(metrics->transitions);
+    free(metrics->states);
+    free(metrics);
+}
+
+/**
+ * Find the bucket of a value. Values below the number of sub-buckets get a bucket each, above that every power of two
+ * is split into the same number of sub-buckets.
+ * @param value
+ * @return
+ */
+static unsigned int histogram_bucket(uint64_t value) {
+    if (value < SUB_BUCKETS) return (unsigned int) value;
+    unsigned int exponent = 63U - (unsigned int) __builtin_clzll(value);
+    unsigned int shift = exponent - STATEMACHINE_HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << STATEMACHINE_HISTOGRAM_SUB_BITS) + (unsigned int) ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+/**
+ * Get the largest value a bucket holds
+ * @param bucket
+ * @return
+ */
+static uint64_t histogram_bucket_limit(unsigned int bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+    unsigned int shift = (bucket >> STATEMACHINE_HISTOGRAM_SUB_BITS) - 1;
+    uint64_t lowest = (uint64_t) (SUB_BUCKETS + (bucket & (SUB_BUCKETS - 1))) << shift;
+    return lowest + ((1ULL << shift) - 1);
+}
+
+void statemachine_histogram_record(statemachine_histogram_t *histogram, uint64_t nanoseconds) {
+    atomic_fetch_add_explicit(&histogram->counts[histogram_bucket(nanoseconds)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, nanoseconds, memory_order_relaxed);
+    unsigned long long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (nanoseconds > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, nanoseconds,
+                                                                       memory_order_relaxed, memory_order_relaxed));
+}
+
+uint64_t statemachine_histogram_percentile(statemachine_histogram_t *histogram, double fraction) {
+    unsigned long count = atomic_load_explicit(&histogram->count, memory_order_relaxed), seen = 0;
+    if (count == 0) return 0;
+    // the rank of the percentile rounded up, at least the first value
+    unsigned long rank = (unsigned long) ((double) count * fraction);
+    if ((double) rank < (double) count * fraction || rank == 0) rank++;
+    for (unsigned int bucket = 0; bucket < STATEMACHINE_HISTOGRAM_BUCKETS; bucket++) {
+        seen += atomic_load_explicit(&histogram->counts[bucket], memory_order_relaxed);
+        if (seen >= rank) return histogram_bucket_limit(bucket);
+    }
+    return atomic_load_explicit(&histogram->max, memory_order_relaxed);
+}
+
+static void histogram_reset(statemachine_histogram_t *histogram) {
+    for (unsigned int bucket = 0; bucket < STATEMACHINE_HISTOGRAM_BUCKETS; bucket++) {
+        atomic_store_explicit(&histogram->counts[bucket], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&histogram->count, 0, memory_order_relaxed);
+    atomic_store_explicit(&histogram->sum, 0, memory_order_relaxed);
+    atomic_store_explicit(&histogram->max, 0, memory_order_relaxed);
+}
+
+void statemachine_metrics_reset(statemachine_model_t *model) {
+    if (model->table == NULL || model->table->metrics == NULL) return;
+    statemachine_metrics_t *metrics = model->table->metrics;
+    histogram_reset(&metrics->latency);
+    histogram_reset(&metrics->guard);
+    histogram_reset(&metrics->effect);
+    for (size_t i = 0; i < model->table->transition_count; i++) {
+        statemachine_transition_metrics_t *transition = &metrics->transitions[i];
+        atomic_store_explicit(&transition->fired, 0, memory_order_relaxed);
+        atomic_store_explicit(&transition->rejected, 0, memory_order_relaxed);
+        atomic_store_explicit(&transition->guard_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&transition->effect_ns, 0, memory_order_relaxed);
+    }
+    for (unsigned short i = 0; i < model->table->state_count; i++) {
+        atomic_store_explicit(&metrics->states[i].entries, 0, memory_order_relaxed);
+        atomic_store_explicit(&metrics->states[i].residency_ns, 0, memory_order_relaxed);
+    }
+}
+
+static void print_histogram(FILE *file, const char *name, statemachine_histogram_t *histogram, char json) {
+    unsigned long count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    unsigned long long sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+    double mean = count ? (double) sum / (double) count : 0;
+    fprintf(file, json ? "\"%s\": {\"count\": %lu, \"mean_ns\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+                         "\"p999_ns\": %llu, \"max_ns\": %llu}"
+                       : "%-10s count=%lu mean_ns=%.1f p50_ns=%llu p99_ns=%llu p999_ns=%llu max_ns=%llu\n",
+            name, count, mean,
+            (unsigned long long) statemachine_histogram_percentile(histogram, 0.5),
+            (unsigned long long) statemachine_histogram_percentile(histogram, 0.99),
+            (unsigned long long) statemachine_histogram_percentile(histogram, 0.999),
+            atomic_load_explicit(&histogram->max, memory_order_relaxed));
+}
+
+/**
+ * Print a state as its name, or its id if it has none. The missing target of an internal transition is printed as
+ * internal, or null in JSON.
+ * @param file
+ * @param id
+ * @param state_name
+ * @param json
+ */
+static void print_state(FILE *file, short id, const char *(*state_name)(short), char json) {
+    const char *name = state_name != NULL && id != NULL_ELEMENT_ID ? state_name(id) : NULL;
+    if (id == NULL_ELEMENT_ID) {
+        fprintf(file, json ? "null" : "internal");
+    } else if (name != NULL) {
+        fprintf(file, json ? "\"%s\"" : "%s", name);
+    } else {
+        fprintf(file, "%d", id);
+    }
+}
+
+/**
+ * Print the event of a transition, completion and time event transitions have none
+ * @param file
+ * @param transition
+ * @param event_name
+ * @param json
+ */
+static void print_event(FILE *file, transition_t *transition, const char *(*event_name)(event_t), char json) {
+    const char *name = event_name != NULL ? event_name(transition->trigger.event) : NULL;
+    if (transition->after != NULL) {
+        fprintf(file, json ? "\"after\"" : "after");
+    } else if (transition->trigger.event == NULL_ELEMENT_ID) {
+        fprintf(file, json ? "\"completion\"" : "completion");
+    } else if (name != NULL) {
+        fprintf(file, json ? "\"%s\"" : "%s", name);
+    } else {
+        fprintf(file, "%d", transition->trigger.event);
+    }
+}
+
+void statemachine_metrics_print(FILE *file, statemachine_model_t *model, char json,
+                                const char *(*state_name)(short id), const char *(*event_name)(event_t event)) {
+    if (model->table == NULL || model->table->metrics == NULL) return;
+    statemachine_table_t *table = model->table;
+    statemachine_metrics_t *metrics = table->metrics;
+    if (json) fprintf(file, "{");
+    print_histogram(file, "latency", &metrics->latency, json);
+    if (json) fprintf(file, ", ");
+    print_histogram(file, "guard", &metrics->guard, json);
+    if (json) fprintf(file, ", ");
+    print_histogram(file, "effect", &metrics->effect, json);
+    if (json) fprintf(file, ", \"transitions\": [");
+    for (size_t i = 0; i < table->transition_count; i++) {
+        transition_t *transition = &table->transitions[i];
+        unsigned long fired = atomic_load_explicit(&metrics->transitions[i].fired, memory_order_relaxed);
+        unsigned long rejected = atomic_load_explicit(&metrics->transitions[i].rejected, memory_order_relaxed);
+        // transitions that never came up only clutter the text output
+        if (!json && fired == 0 && rejected == 0) continue;
+        if (json) {
+            fprintf(file, "%s{\"index\": %zu, \"source\": ", i ? ", " : "", i);
+        } else {
+            fprintf(file, "transition %zu ", i);
+        }
+        print_state(file, transition->source, state_name, json);
+        fprintf(file, json ? ", \"target\": " : " -> ");
+        print_state(file, transition->target, state_name, json);
+        fprintf(file, json ? ", \"event\": " : " on ");
+        print_event(file, transition, event_name, json);
+        fprintf(file, json ? ", \"fired\": %lu, \"rejected\": %lu, \"guard_ns\": %llu, \"effect_ns\": %llu}"
+                           : " fired=%lu rejected=%lu guard_ns=%llu effect_ns=%llu\n", fired, rejected,
+                atomic_load_explicit(&metrics->transitions[i].guard_ns, memory_order_relaxed),
+                atomic_load_explicit(&metrics->transitions[i].effect_ns, memory_order_relaxed));
+    }
+    if (json) fprintf(file, "], \"states\": [");
+    for (unsigned short i = 0; i < table->state_count; i++) {
+        unsigned long entries = atomic_load_explicit(&metrics->states[i].entries, memory_order_relaxed);
+        unsigned long long residency = atomic_load_explicit(&metrics->states[i].residency_ns, memory_order_relaxed);
+        if (!json && entries == 0) continue;
+        if (json) {
+            fprintf(file, "%s{\"state\": ", i ? ", " : "");
+        } else {
+            fprintf(file, "state ");
+        }
+        print_state(file, table->states[i]->id, state_name, json);
+        fprintf(file, json ? ", \"entries\": %lu, \"residency_ns\": %llu}" : " entries=%lu residency_ns=%llu\n",
+                entries, residency);
+    }
+    if (json) fprintf(file, "]}\n");
+}
@@ -0,0 +1,305 @@
+//
+// Hierarchical timer wheel shared by every statemachine in the process
+//
+
+#include "statemachine_timer.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+// largest distance in ticks a timer can be placed from the current tick
+#define TIMER_RANGE ((1ULL << (TIMER_SLOT_BITS * STATEMACHINE_TIMER_LEVELS)) - 1)
+// number of expired timers handed to their callbacks per batch
+#define TIMER_BATCH 64
+
+/**
+ * Each level has 64 slots, a slot on level n covers 64^n ticks. Timers are placed on the lowest level whose range
+ * reaches their expiry and are moved down a level every time the slot they are in comes around. A bitmap per level
+ * marks the slots holding timers so the thread can work out how long to sleep without visiting empty slots.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // signalled when a timer is armed before the thread's next wakeup
+    pthread_cond_t synced; // broadcast when the thread is done calling expire callbacks
+    pthread_t thread;
+    unsigned long long now; // tick the wheel has been advanced to
+    unsigned long long wakeup; // tick the thread is sleeping until, 0 while sleeping until a timer is armed
+    char expiring; // the thread is calling expire callbacks without holding the lock
+    unsigned long long occupied[STATEMACHINE_TIMER_LEVELS]; // bit n is set when slot n has timers
+    statemachine_timer_t *slots[STATEMACHINE_TIMER_LEVELS][TIMER_SLOTS];
+} timer_wheel_t;
+
+typedef struct {
+    statemachine_timer_t *timer;
+    unsigned long generation;
+} timer_expiry_t;
+
+static timer_wheel_t wheel;
+static pthread_once_t wheel_once = PTHREAD_ONCE_INIT;
+static atomic_int wheel_started;
+static atomic_char wheel_virtual; // time only moves when statemachine_timer_virtual says so
+static atomic_ullong virtual_now;
+
+unsigned long long statemachine_timer_now() {
+    if (atomic_load_explicit(&wheel_virtual, memory_order_acquire)) {
+        return atomic_load_explicit(&virtual_now, memory_order_acquire);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000ULL + (unsigned long long) now.tv_nsec / 1000000ULL;
+}
+
+/**
+ * Link a timer into the slot matching its expiry relative to the current tick
+ * @param timer
+ */
+static void wheel_insert(statemachine_timer_t *timer) {
+    unsigned long long expires = timer->expires, delta = expires > wheel.now ? expires - wheel.now : 0;
+    unsigned int level = 0;
+    if (delta > TIMER_RANGE) {
+        // park it as far out as the wheel reaches, it is placed again when that slot comes around
+        expires = wheel.now + TIMER_RANGE;
+        delta = TIMER_RANGE;
+    }
+    while (delta >> (TIMER_SLOT_BITS * (level + 1))) level++;
+    unsigned int slot = (unsigned int) (expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+    statemachine_timer_t **head = &wheel.slots[level][slot];
+    timer->next = *head;
+    if (timer->next != NULL) timer->next->link = &timer->next;
+    timer->link = head;
+    timer->slot = (unsigned short) (level * TIMER_SLOTS + slot);
+    *head = timer;
+    wheel.occupied[level] |= 1ULL << slot;
+}
+
+/**
+ * Unlink a timer from its slot
+ * @param timer an armed timer
+ */
+static void wheel_remove(statemachine_timer_t *timer) {
+    unsigned int level = timer->slot / TIMER_SLOTS, slot = timer->slot % TIMER_SLOTS;
+    *timer->link = timer->next;
+    if (timer->next != NULL) timer->next->link = timer->link;
+    timer->next = NULL;
+    timer->link = NULL;
+    if (wheel.slots[level][slot] == NULL) wheel.occupied[level] &= ~(1ULL << slot);
+}
+
+/**
+ * Find the next tick at which a timer expires or a slot has to be moved down a level
+ * @return the tick, 0 if no timer is armed
+ */
+static unsigned long long wheel_next_tick() {
+    unsigned long long next = 0;
+    for (unsigned int level = 0; level < STATEMACHINE_TIMER_LEVELS; level++) {
+        unsigned long long occupied = wheel.occupied[level];
+        if (occupied == 0) continue;
+        unsigned int shift = TIMER_SLOT_BITS * level;
+        unsigned long long block = wheel.now >> shift;
+        // rotate the bitmap so the slot after the current one is bit 0
+        unsigned int rotation = (unsigned int) (block + 1) & (TIMER_SLOTS - 1);
+        if (rotation) occupied = (occupied >> rotation) | (occupied << (TIMER_SLOTS - rotation));
+        unsigned long long tick = (block + (unsigned long long) __builtin_ctzll(occupied) + 1) << shift;
+        if (next == 0 || tick < next) next = tick;
+    }
+    return next;
+}
+
+/**
+ * Move the timers of every level whose slot boundary is the current tick down the wheel. Higher levels go first so a
+ * timer can drop more than one level at once.
+ */
+static void wheel_cascade() {
+    for (unsigned int level = STATEMACHINE_TIMER_LEVELS - 1; level > 0; level--) {
+        unsigned int shift = TIMER_SLOT_BITS * level;
+        if (wheel.now & ((1ULL << shift) - 1)) continue;
+        unsigned int slot = (unsigned int) (wheel.now >> shift) & (TIMER_SLOTS - 1);
+        statemachine_timer_t *timer = wheel.slots[level][slot];
+        wheel.slots[level][slot] = NULL;
+        wheel.occupied[level] &= ~(1ULL << slot);
+        while (timer != NULL) {
+            statemachine_timer_t *next = timer->next;
+            wheel_insert(timer);
+            timer = next;
+        }
+    }
+}
+
+/**
+ * Advance the wheel up to a tick and take the timers that expired off of it. Ticks without anything to do are skipped.
+ * @param now
+ * @param expired
+ * @return number of expired timers, stops early when the batch is full
+ */
+static unsigned int wheel_collect(unsigned long long now, timer_expiry_t *expired) {
+    unsigned int count = 0;
+    for (;;) {
+        statemachine_timer_t **head = &wheel.slots[0][wheel.now & (TIMER_SLOTS - 1)];
+        while (*head != NULL && count < TIMER_BATCH) {
+            statemachine_timer_t *timer = *head;
+            expired[count++] = (timer_expiry_t) {timer, timer->generation};
+            wheel_remove(timer);
+        }
+        if (count == TIMER_BATCH) return count;
+        unsigned long long next = wheel_next_tick();
+        if (next == 0 || next > now) {
+            if (now > wheel.now) wheel.now = now;
+            return count;
+        }
+        wheel.now = next;
+        wheel_cascade();
+    }
+}
+
+static void *wheel_task(void *argument) {
+    (void) (argument);
+    timer_expiry_t expired[TIMER_BATCH];
+    pthread_mutex_lock(&wheel.lock);
+    for (;;) {
+        // timers don't expire on a virtual clock
+        if (atomic_load_explicit(&wheel_virtual, memory_order_acquire)) {
+            pthread_cond_wait(&wheel.wake, &wheel.lock);
+            continue;
+        }
+        unsigned int count = wheel_collect(statemachine_timer_now(), expired);
+        if (count) {
+            wheel.expiring = 1;
+            pthread_mutex_unlock(&wheel.lock);
+            for (unsigned int i = 0; i < count; i++) {
+                expired[i].timer->expire(expired[i].timer, expired[i].generation);
+            }
+            pthread_mutex_lock(&wheel.lock);
+            wheel.expiring = 0;
+            pthread_cond_broadcast(&wheel.synced);
+            continue;
+        }
+        wheel.wakeup = wheel_next_tick();
+        if (wheel.wakeup == 0) {
+            pthread_cond_wait(&wheel.wake, &wheel.lock);
+        } else {
+            struct timespec deadline = {(time_t) (wheel.wakeup / 1000ULL), (long) (wheel.wakeup % 1000ULL) * 1000000L};
+            pthread_cond_timedwait(&wheel.wake, &wheel.lock, &deadline);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Set up the wheel and start the timer thread. The thread is detached and lives as long as the process.
+ */
+static void wheel_start() {
+    pthread_condattr_t attributes;
+    pthread_attr_t thread_attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_mutex_init(&wheel.lock, NULL);
+    pthread_cond_init(&wheel.wake, &attributes);
+    pthread_cond_init(&wheel.synced, &attributes);
+    pthread_condattr_destroy(&attributes);
+    wheel.now = statemachine_timer_now();
+    pthread_attr_init(&thread_attributes);
+    pthread_attr_setdetachstate(&thread_attributes, PTHREAD_CREATE_DETACHED);
+    atomic_store(&wheel_started, pthread_create(&wheel.thread, &thread_attributes, wheel_task, NULL) == 0);
+    pthread_attr_destroy(&thread_attributes);
+}
+
+unsigned long statemachine_timer_arm(statemachine_timer_t *timer, unsigned long milliseconds) {
+    pthread_once(&wheel_once, wheel_start);
+    if (!atomic_load(&wheel_started)) return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // round up so a timer never expires before its delay has passed
+    unsigned long long expires = ((unsigned long long) now.tv_sec * 1000000000ULL + (unsigned long long) now.tv_nsec +
+                                  (unsigned long long) milliseconds * 1000000ULL + 999999ULL) / 1000000ULL;
+    pthread_mutex_lock(&wheel.lock);
+    if (atomic_load_explicit(&wheel_virtual, memory_order_relaxed)) {
+        expires = atomic_load_explicit(&virtual_now, memory_order_relaxed) + milliseconds;
+    }
+    if (timer->link != NULL) wheel_remove(timer);
+    if (++timer->generation == 0) timer->generation = 1;
+    timer->expires = expires;
+    wheel_insert(timer);
+    if (wheel.wakeup == 0 || expires < wheel.wakeup) pthread_cond_signal(&wheel.wake);
+    unsigned long generation = timer->generation;
+    pthread_mutex_unlock(&wheel.lock);
+    return generation;
+}
+
+void statemachine_timer_cancel(statemachine_timer_t *timer) {
+    if (!atomic_load(&wheel_started)) return;
+    pthread_mutex_lock(&wheel.lock);
+    if (timer->link != NULL) wheel_remove(timer);
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+unsigned long long statemachine_timer_expires(statemachine_timer_t *timer) {
+    if (!atomic_load(&wheel_started)) return 0;
+    pthread_mutex_lock(&wheel.lock);
+    unsigned long long expires = timer->link != NULL ? timer->expires : 0;
+    pthread_mutex_unlock(&wheel.lock);
+    return expires;
+}
+
+int statemachine_timer_virtual(unsigned long long now) {
+    pthread_once(&wheel_once, wheel_start);
+    if (!atomic_load(&wheel_started)) return -1;
+    pthread_mutex_lock(&wheel.lock);
+    if (!atomic_load_explicit(&wheel_virtual, memory_order_relaxed)) {
+        // armed timers expire on the real clock, they can't be moved to another one
+        for (unsigned int level = 0; level < STATEMACHINE_TIMER_LEVELS; level++) {
+            if (wheel.occupied[level]) {
+                pthread_mutex_unlock(&wheel.lock);
+                return -1;
+            }
+        }
+        wheel.now = now;
+        atomic_store_explicit(&virtual_now, now, memory_order_release);
+        atomic_store_explicit(&wheel_virtual, 1, memory_order_release);
+        // the thread may be sleeping until a real deadline
+        pthread_cond_signal(&wheel.wake);
+    } else if (now > atomic_load_explicit(&virtual_now, memory_order_relaxed)) {
+        atomic_store_explicit(&virtual_now, now, memory_order_release);
+    }
+    pthread_mutex_unlock(&wheel.lock);
+    return 0;
+}
+
+unsigned long statemachine_timer_advance(unsigned long long now) {
+    timer_expiry_t expired[TIMER_BATCH];
+    unsigned long total = 0;
+    if (!atomic_load(&wheel_started) || !atomic_load_explicit(&wheel_virtual, memory_order_acquire)) return 0;
+    pthread_mutex_lock(&wheel.lock);
+    for (;;) {
+        unsigned long long at = atomic_load_explicit(&virtual_now, memory_order_relaxed);
+        unsigned int count = wheel_collect(at, expired);
+        if (count) {
+            // callbacks see the clock at the tick their timer expired on and arm timers relative to it
+            wheel.expiring = 1;
+            pthread_mutex_unlock(&wheel.lock);
+            for (unsigned int i = 0; i < count; i++) {
+                expired[i].timer->expire(expired[i].timer, expired[i].generation);
+            }
+            pthread_mutex_lock(&wheel.lock);
+            wheel.expiring = 0;
+            pthread_cond_broadcast(&wheel.synced);
+            total += count;
+            continue;
+        }
+        if (at >= now) break;
+        // jump straight to the next tick something is due at, or to the end
+        unsigned long long next = wheel_next_tick();
+        atomic_store_explicit(&virtual_now, next == 0 || next > now ? now : next, memory_order_release);
+    }
+    pthread_mutex_unlock(&wheel.lock);
+    return total;
+}
+
+void statemachine_timer_sync() {
+    // an expire callback waiting for itself would never return
+    if (!atomic_load(&wheel_started) || pthread_equal(pthread_self(), wheel.thread)) return;
+    pthread_mutex_lock(&wheel.lock);
+    while (wheel.expiring) pthread_cond_wait(&wheel.synced, &wheel.lock);
+    pthread_mutex_unlock(&wheel.lock);
+}
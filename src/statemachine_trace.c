@@ -0,0 +1,218 @@
+//
+// Binary tracing of statemachine activity through per-thread rings drained by a background thread
+//
+
+#include "statemachine_trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_MASK (STATEMACHINE_TRACE_RING_SIZE - 1)
+
+/**
+ * Single-producer single-consumer ring of a thread's records. The thread writes at head, the trace thread reads at tail.
+ */
+typedef struct trace_ring {
+    struct trace_ring *next;
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_char closed; // the thread exited, the ring is freed once it has been drained
+    uint16_t thread;
+    statemachine_trace_record_t records[STATEMACHINE_TRACE_RING_SIZE];
+} trace_ring_t;
+
+typedef struct {
+    pthread_mutex_t lock; // guards everything but the counters
+    pthread_cond_t wake; // signalled to stop the trace thread or when a ring fills up
+    pthread_t thread;
+    char running; // the trace thread is running
+    char stopping;
+    FILE *file;
+    trace_ring_t *rings;
+    uint16_t threads; // rings registered so far
+    atomic_ulong written;
+    atomic_ulong dropped;
+} tracer_t;
+
+atomic_char statemachine_tracing;
+
+static tracer_t tracer = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static pthread_once_t tracer_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tracer_key;
+static _Thread_local trace_ring_t *trace_ring;
+
+/**
+ * Unlink a ring from the tracer and free it. The tracer lock must be held.
+ * @param ring
+ */
+static void ring_free(trace_ring_t *ring) {
+    for (trace_ring_t **link = &tracer.rings; *link != NULL; link = &(*link)->next) {
+        if (*link == ring) {
+            *link = ring->next;
+            break;
+        }
+    }
+    free(ring);
+}
+
+/**
+ * Called when a thread that traced exits. The ring is left for the trace thread to drain if it is running.
+ * @param ring
+ */
+static void ring_close(void *ring) {
+    pthread_mutex_lock(&tracer.lock);
+    if (tracer.running) {
+        atomic_store_explicit(&((trace_ring_t *) ring)->closed, 1, memory_order_release);
+    } else {
+        ring_free(ring);
+    }
+    pthread_mutex_unlock(&tracer.lock);
+}
+
+static void tracer_init() {
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&tracer.wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_key_create(&tracer_key, ring_close);
+}
+
+/**
+ * Give the calling thread a ring
+ * @return NULL if it couldn't be allocated
+ */
+static trace_ring_t *ring_register() {
+    trace_ring_t *ring = calloc(1, sizeof(trace_ring_t));
+    if (ring == NULL) return NULL;
+    pthread_once(&tracer_once, tracer_init);
+    pthread_mutex_lock(&tracer.lock);
+    ring->thread = tracer.threads++;
+    ring->next = tracer.rings;
+    tracer.rings = ring;
+    pthread_mutex_unlock(&tracer.lock);
+    pthread_setspecific(tracer_key, ring);
+    return trace_ring = ring;
+}
+
+/**
+ * Write the records waiting in every ring to the trace file and free the rings of threads that exited. The tracer lock
+ * must be held.
+ */
+static void tracer_drain() {
+    trace_ring_t *ring = tracer.rings, *next;
+    for (; ring != NULL; ring = next) {
+        next = ring->next;
+        char closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        while (tail != head) {
+            // the waiting records are contiguous up to the end of the ring
+            size_t count = head - tail, end = STATEMACHINE_TRACE_RING_SIZE - (tail & TRACE_MASK);
+            if (count > end) count = end;
+            fwrite(&ring->records[tail & TRACE_MASK], sizeof(statemachine_trace_record_t), count, tracer.file);
+            atomic_fetch_add_explicit(&tracer.written, count, memory_order_relaxed);
+            tail += count;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        if (closed) ring_free(ring);
+    }
+    fflush(tracer.file);
+}
+
+static void *tracer_task(void *argument) {
+    (void) (argument);
+    pthread_mutex_lock(&tracer.lock);
+    while (!tracer.stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += STATEMACHINE_TRACE_INTERVAL * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&tracer.wake, &tracer.lock, &deadline);
+        tracer_drain();
+    }
+    pthread_mutex_unlock(&tracer.lock);
+    return NULL;
+}
+
+int statemachine_trace_start(const char *path) {
+    statemachine_trace_header_t header = {.version = STATEMACHINE_TRACE_VERSION,
+                                          .record_size = sizeof(statemachine_trace_record_t)};
+    memcpy(header.magic, STATEMACHINE_TRACE_MAGIC, sizeof(header.magic));
+    pthread_once(&tracer_once, tracer_init);
+    pthread_mutex_lock(&tracer.lock);
+    if (tracer.running || (tracer.file = fopen(path, "wb")) == NULL) {
+        pthread_mutex_unlock(&tracer.lock);
+        return -1;
+    }
+    fwrite(&header, sizeof(header), 1, tracer.file);
+    // records written after the last trace was stopped don't belong to this one
+    for (trace_ring_t *ring = tracer.rings; ring != NULL; ring = ring->next) {
+        atomic_store_explicit(&ring->tail, atomic_load_explicit(&ring->head, memory_order_acquire),
+                              memory_order_release);
+    }
+    atomic_store_explicit(&tracer.written, 0, memory_order_relaxed);
+    atomic_store_explicit(&tracer.dropped, 0, memory_order_relaxed);
+    tracer.stopping = 0;
+    if (pthread_create(&tracer.thread, NULL, tracer_task, NULL) != 0) {
+        fclose(tracer.file);
+        tracer.file = NULL;
+        pthread_mutex_unlock(&tracer.lock);
+        return -1;
+    }
+    tracer.running = 1;
+    pthread_mutex_unlock(&tracer.lock);
+    atomic_store_explicit(&statemachine_tracing, 1, memory_order_release);
+    return 0;
+}
+
+void statemachine_trace_stop() {
+    pthread_mutex_lock(&tracer.lock);
+    if (!tracer.running) {
+        pthread_mutex_unlock(&tracer.lock);
+        return;
+    }
+    atomic_store_explicit(&statemachine_tracing, 0, memory_order_release);
+    tracer.stopping = 1;
+    pthread_cond_signal(&tracer.wake);
+    pthread_mutex_unlock(&tracer.lock);
+    pthread_join(tracer.thread, NULL);
+    pthread_mutex_lock(&tracer.lock);
+    tracer_drain();
+    fclose(tracer.file);
+    tracer.file = NULL;
+    tracer.running = 0;
+    pthread_mutex_unlock(&tracer.lock);
+}
+
+void statemachine_trace_stats(statemachine_trace_stats_t *stats) {
+    stats->written = atomic_load_explicit(&tracer.written, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&tracer.dropped, memory_order_relaxed);
+}
+
+void statemachine_trace_write(unsigned int statemachine, statemachine_trace_kind_t kind, short event, short source,
+                              short target) {
+    trace_ring_t *ring = trace_ring != NULL ? trace_ring : ring_register();
+    struct timespec now;
+    if (ring == NULL) {
+        atomic_fetch_add_explicit(&tracer.dropped, 1, memory_order_relaxed);
+        return;
+    }
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t waiting = head - atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (waiting >= STATEMACHINE_TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&tracer.dropped, 1, memory_order_relaxed);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ring->records[head & TRACE_MASK] = (statemachine_trace_record_t) {
+            .timestamp = (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec,
+            .statemachine = statemachine, .thread = ring->thread, .event = event, .source = source,
+            .target = target, .kind = (uint8_t) kind};
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    // wake the trace thread early rather than dropping records, signalling doesn't need the lock
+    if (waiting == STATEMACHINE_TRACE_RING_SIZE / 2) pthread_cond_signal(&tracer.wake);
+}
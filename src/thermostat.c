@@ -3,14 +3,27 @@
 //
 
 #include "thermostat.h"
+#include "thermostat_control.h"
+#include <stdlib.h>
 #include <string.h>
 #include "menu.h"
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-pthread_mutex_t lock;
+// bytes of a thermostat snapshot before its statemachine snapshot: version, current mode, elapsed flags, temperature and
+// the setpoint and minimum active time of every mode
+#define THERMOSTAT_SNAPSHOT_HEADER (8 + THERMOSTAT_MODE_COUNT * 8)
+// bytes of a fleet snapshot file before its records: magic, version, record size and record count
+#define THERMOSTAT_FLEET_HEADER 16
+#define THERMOSTAT_FLEET_MAGIC "THFL"
 
 
-const char *state_id_map[] = {
+char thermostat_logging = 0;
+
+const char *const state_id_map[] = {
         "",
         "POWERED ON", // base state
         "SYSTEM OFF", // no mode selected
@@ -20,6 +33,46 @@ const char *state_id_map[] = {
         "SYSTEM COOLING"
 };
 
+const char *thermostat_state_name(short id) {
+    if (id < 0 || (size_t) id >= sizeof(state_id_map) / sizeof(state_id_map[0])) return NULL;
+    return state_id_map[id];
+}
+
+const char *thermostat_event_name(event_t event) {
+    switch (event) {
+        case THERMOSTAT_SET_MODE_OFF:
+            return "SET MODE OFF";
+        case THERMOSTAT_SET_MODE_HEAT:
+            return "SET MODE HEAT";
+        case THERMOSTAT_SET_MODE_COOL:
+            return "SET MODE COOL";
+        case THERMOSTAT_SET_TEMPERATURE:
+            return "SET TEMPERATURE";
+        case THERMOSTAT_SET_HEAT_SETPOINT:
+            return "SET HEAT SETPOINT";
+        case THERMOSTAT_SET_COOL_SETPOINT:
+            return "SET COOL SETPOINT";
+        case THERMOSTAT_SET_MIN_ACTIVE_TIME:
+            return "SET MIN ACTIVE TIME";
+        case THERMOSTAT_POWER_OFF:
+            return "POWER OFF";
+        default:
+            return NULL;
+    }
+}
+
+size_t thermostat_payload_size(event_t event) {
+    switch (event) {
+        case THERMOSTAT_SET_TEMPERATURE:
+        case THERMOSTAT_SET_HEAT_SETPOINT:
+        case THERMOSTAT_SET_COOL_SETPOINT:
+        case THERMOSTAT_SET_MIN_ACTIVE_TIME:
+            return sizeof(float);
+        default:
+            return 0;
+    }
+}
+
 /**
  * Handle user input from cmd line
  * @param thermostat
@@ -29,41 +82,48 @@ void thermostat_cmd_handler(thermostat_t *thermostat) {
     float value;
     menu_get_cmd(buffer);
     if (buffer[0] != '\n') {
-        pthread_mutex_lock(&lock);
         switch(buffer[0]) {
-            case '3':
+            case THERMOSTAT_SET_TEMPERATURE:
+            case THERMOSTAT_SET_HEAT_SETPOINT:
+            case THERMOSTAT_SET_COOL_SETPOINT:
+            case THERMOSTAT_SET_MIN_ACTIVE_TIME:
                 printf("enter value: ");
                 scanf("%f", &value);
                 // clear the console of spaces and up until newline
                 printf("you entered: %0.2f\n", value);
                 char c;
                 while((c = getchar()) != '\n' && c != '\r');
-                statemachine_dispatch(&thermostat->statemachine, buffer[0], (void *)&value);
+                statemachine_dispatch_float(&thermostat->statemachine, buffer[0], value);
                 break;
+            case THERMOSTAT_PRINT_METRICS:
+                statemachine_metrics_print(stdout, &thermostat_model, 0, thermostat_state_name, thermostat_event_name);
+                return;
 
             default:
                 printf("dispatching\n");
                 statemachine_dispatch(&thermostat->statemachine, buffer[0], NULL);
         }
-        pthread_mutex_unlock(&lock);
+        // wait for the statemachine thread so the transitions are logged before the menu is drawn again
+        statemachine_flush(&thermostat->statemachine);
     }
 }
 /**
- * The menu for this thermostat displays all important values and available commands
+ * The menu for this thermostat displays all important values and available commands. They are read from the view the
+ * statemachine thread publishes, so drawing the menu never waits on it.
  * @param thermostat
- * @param mode
  */
-void thermostat_menu(thermostat_t *thermostat, const char *mode) {
+void thermostat_menu(thermostat_t *thermostat) {
     char buffer[MENU_WIDTH];
+    thermostat_view_t view;
+    thermostat_view(thermostat, &view);
     menu_put_divider();
     menu_put_centered("EMERSON THERMOSTAT");
-    sprintf(buffer, "[MODE: %s]", mode);
+    sprintf(buffer, "[MODE: %s]", state_id_map[view.state]);
     menu_put_centered(buffer);
     memset(buffer, '\0', MENU_WIDTH);
-    sprintf(buffer, "[TEMPERATURE: %0.2f]", thermostat->current_temperature);
+    sprintf(buffer, "[TEMPERATURE: %0.2f]", view.temperature);
     menu_put_centered(buffer);
-    sprintf(buffer, "[COOL SETPOINT: %0.2f, HEAT SETPOINT: %0.2f]", thermostat->mode.cool->setpoint,
-            thermostat->mode.heat->setpoint);
+    sprintf(buffer, "[COOL SETPOINT: %0.2f, HEAT SETPOINT: %0.2f]", view.cool_setpoint, view.heat_setpoint);
     menu_put_centered(buffer);
     menu_put_divider();
     menu_put_option('0', "set off");
@@ -73,6 +133,7 @@ void thermostat_menu(thermostat_t *thermostat, const char *mode) {
     menu_put_option('4', "set heat setpoint");
     menu_put_option('5', "set cool setpoint");
     menu_put_option('6', "set cool minimum active time");
+    menu_put_option(THERMOSTAT_PRINT_METRICS, "print metrics");
     menu_put_option('9', "power off");
 }
 
@@ -85,7 +146,7 @@ void thermostat_menu(thermostat_t *thermostat, const char *mode) {
 void thermostat_log_entry(statemachine_t *statemachine, state_t *state, trigger_t *trigger) {
     (void)(statemachine);
     (void)(trigger);
-    printf("[THERMOSTAT] %s ENTRY\n", state_id_map[state->id]);
+    if (thermostat_logging) printf("[THERMOSTAT] %s ENTRY\n", state_id_map[state->id]);
 }
 /**
  * This logs each state exit to the console
@@ -96,16 +157,19 @@ void thermostat_log_entry(statemachine_t *statemachine, state_t *state, trigger_
 void thermostat_log_exit(statemachine_t *statemachine, state_t *state, trigger_t *trigger) {
     (void)(statemachine);
     (void)(trigger);
-    printf("[THERMOSTAT] %s EXIT\n", state_id_map[state->id]);
+    if (thermostat_logging) printf("[THERMOSTAT] %s EXIT\n", state_id_map[state->id]);
 }
 /**
  * Log transition effects to the console
  * @param statemachine
  * @param transition
  */
-void thermostat_log_effect(statemachine_t *statemachine, transition_t *transition) {
+void thermostat_log_effect(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
     (void)(statemachine);
-    printf("[THERMOSTAT] %s -> %s\n", state_id_map[transition->source], state_id_map[transition->target]);
+    (void)(trigger);
+    if (thermostat_logging) {
+        printf("[THERMOSTAT] %s -> %s\n", state_id_map[transition->source], state_id_map[transition->target]);
+    }
 }
 
 /**
@@ -115,9 +179,35 @@ void thermostat_log_effect(statemachine_t *statemachine, transition_t *transitio
  * @param trigger
  */
 void thermostat_mode_entry(statemachine_t *statemachine, state_t *state, trigger_t *trigger) {
+    thermostat_t *thermostat = (thermostat_t *) statemachine;
     thermostat_log_entry(statemachine, state, trigger);
-    ((thermostat_t *) statemachine)->mode.current = state->data;
-    ((thermostat_mode_data_t *) state->data)->active_timestamp = time(NULL);
+    // the state data points at the defaults of the mode, the same position in modes holds this thermostat's copy
+    thermostat->mode.current = &thermostat->modes[(const thermostat_mode_data_t *) state->data - thermostat_mode_data];
+    thermostat->mode.current->minimum_active_time_elapsed = 0;
+}
+
+/**
+ * How long a mode has to stay active before it can be left
+ * @param statemachine
+ * @param transition
+ * @return milliseconds
+ */
+unsigned long thermostat_minimum_active_time(statemachine_t *statemachine, transition_t *transition) {
+    (void)(transition);
+    float seconds = ((thermostat_t *) statemachine)->mode.current->minimum_active_time;
+    return seconds > 0 ? (unsigned long) (seconds * 1000) : 0;
+}
+
+/**
+ * The current mode has been active for its minimum active time
+ * @param statemachine
+ * @param transition
+ * @param trigger
+ */
+void thermostat_minimum_active_time_elapsed(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    (void)(transition);
+    (void)(trigger);
+    ((thermostat_t *) statemachine)->mode.current->minimum_active_time_elapsed = 1;
 }
 /**
  * Th
@@ -129,8 +219,8 @@ void thermostat_off_entry(statemachine_t *statemachine, state_t *state, trigger_
     thermostat_log_entry(statemachine, state, trigger);
 }
 
-void thermostat_power_off(statemachine_t *statemachine, transition_t *transition) {
-    thermostat_log_effect(statemachine, transition);
+void thermostat_power_off(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    thermostat_log_effect(statemachine, transition, trigger);
     statemachine_terminate(statemachine);
 }
 
@@ -138,8 +228,9 @@ void thermostat_mode_on_entry(statemachine_t *statemachine, state_t *state, trig
     thermostat_log_entry(statemachine, state, trigger);
 }
 
-int thermostat_mode_on_constraint(statemachine_t *statemachine, transition_t *transition) {
+int thermostat_mode_on_constraint(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
     (void)(transition);
+    (void)(trigger);
     thermostat_t *thermostat = (thermostat_t *) statemachine;
     if (thermostat->mode.current->invert) {
         return thermostat->current_temperature > thermostat->mode.current->setpoint;
@@ -149,17 +240,16 @@ int thermostat_mode_on_constraint(statemachine_t *statemachine, transition_t *tr
 }
 
 
-int thermostat_mode_active_constraint(statemachine_t *statemachine, transition_t *transition) {
+int thermostat_mode_active_constraint(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
     (void)(transition); // avoiding compiler warnings
-    thermostat_t *thermostat = (thermostat_t *) statemachine;
-    time_t now = time(NULL);
-    return (now - thermostat->mode.current->active_timestamp) > thermostat->mode.current->minimum_active_time;
+    (void)(trigger);
+    return ((thermostat_t *) statemachine)->mode.current->minimum_active_time_elapsed;
 }
 
 
 
-int thermostat_mode_off_constraint(statemachine_t *statemachine, transition_t *transition) {
-    if (thermostat_mode_active_constraint(statemachine, transition)) {
+int thermostat_mode_off_constraint(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    if (thermostat_mode_active_constraint(statemachine, transition, trigger)) {
         thermostat_t *thermostat = (thermostat_t *) statemachine;
         if (thermostat->mode.current->invert) {
             return thermostat->current_temperature <= thermostat->mode.current->setpoint;
@@ -175,35 +265,47 @@ int thermostat_mode_off_constraint(statemachine_t *statemachine, transition_t *t
  * @param statemachine
  * @param transition
  */
-void thermostat_set_temperature(statemachine_t *statemachine, transition_t *transition) {
-    puts("thermostat_set_temperature");
-    ((thermostat_t *)statemachine)->current_temperature = *((float *)transition->trigger.data);
+void thermostat_set_temperature(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
+    (void)(transition);
+    if (thermostat_logging) puts("thermostat_set_temperature");
+    ((thermostat_t *)statemachine)->current_temperature = statemachine_trigger_float(trigger);
 }
 /**
  * set the point at which the thermostat enters the cooling state
  * @param statemachine
  * @param transition
  */
-void thermostat_set_cool_setpoint(statemachine_t *statemachine, transition_t *transition) {
+void thermostat_set_cool_setpoint(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
     (void)(transition); // avoid compiler warnings
-    ((thermostat_t *) statemachine)->mode.cool->setpoint = *((float *)transition->trigger.data);
+    ((thermostat_t *) statemachine)->mode.cool->setpoint = statemachine_trigger_float(trigger);
 }
 
-void thermostat_set_heat_setpoint(statemachine_t *statemachine, transition_t *transition) {
+void thermostat_set_heat_setpoint(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
     (void)(transition); // avoid compiler warnings
-    ((thermostat_t *) statemachine)->mode.heat->setpoint = *((float *)transition->trigger.data);
+    ((thermostat_t *) statemachine)->mode.heat->setpoint = statemachine_trigger_float(trigger);
 }
 
 
-void thermostat_set_minimum_active_time(statemachine_t *statemachine, transition_t *transition) {
+/**
+ * set how long in seconds the cool mode stays active before it may turn off. While cooling the new time counts from
+ * when the mode was entered, a time that has already passed lets it turn off right away.
+ * @param statemachine
+ * @param transition
+ */
+void thermostat_set_minimum_active_time(statemachine_t *statemachine, transition_t *transition, trigger_t *trigger) {
     (void)(transition); // avoid compiler warnings
-//     thermostat_set_float(&((thermostat_t *) statemachine)->mode.cool->minimum_active_time);
+    thermostat_t *thermostat = (thermostat_t *) statemachine;
+    thermostat->mode.cool->minimum_active_time = statemachine_trigger_float(trigger);
+    if (thermostat->mode.current != thermostat->mode.cool) return;
+    // the time event sets it again once the new time has passed
+    thermostat->mode.cool->minimum_active_time_elapsed = 0;
+    statemachine_rearm(statemachine, THERMOSTAT_COOL);
 }
 
 /**
  * Heating substates
  */
-state_t heating_substates[] = {
+const state_t heating_substates[] = {
         {
                 THERMOSTAT_HEATING,
                 NULL,
@@ -215,7 +317,7 @@ state_t heating_substates[] = {
 /**
  * Cooling substates
  */
-state_t cooling_substates[] = {
+const state_t cooling_substates[] = {
         {
                 THERMOSTAT_COOLING,
                 NULL,
@@ -225,7 +327,7 @@ state_t cooling_substates[] = {
         NULL_ELEMENT
 };
 
-thermostat_mode_data_t thermostat_mode_data[3] = {
+const thermostat_mode_data_t thermostat_mode_data[THERMOSTAT_MODE_COUNT] = {
         {0},
         {
                 .setpoint=72
@@ -237,33 +339,33 @@ thermostat_mode_data_t thermostat_mode_data[3] = {
         }
 };
 
-state_t thermostat_powered_on_states[] = {
+const state_t thermostat_powered_on_states[] = {
         {
                 THERMOSTAT_OFF,
                 NULL,
                 .entry = thermostat_off_entry,
                 .exit = thermostat_log_exit,
-                .data = &thermostat_mode_data[0]
+                .data = (void *) &thermostat_mode_data[0]
         },
         {
                 THERMOSTAT_HEAT,
-                heating_substates,
+                (state_t *) heating_substates,
                 .entry = thermostat_mode_entry,
                 .exit = thermostat_log_exit,
-                .data = &thermostat_mode_data[1]
+                .data = (void *) &thermostat_mode_data[1]
         },
         {
                 THERMOSTAT_COOL,
-                cooling_substates,
+                (state_t *) cooling_substates,
                 .entry = thermostat_mode_entry,
                 .exit = thermostat_log_exit,
-                .data = &thermostat_mode_data[2]
+                .data = (void *) &thermostat_mode_data[2]
         },
         NULL_ELEMENT
 };
 
 
-transition_t thermostat_transitions[] = {
+const transition_t thermostat_transitions[] = {
         // from OFF to COOLING
         {
                 THERMOSTAT_OFF,
@@ -308,86 +410,335 @@ transition_t thermostat_transitions[] = {
                 .trigger.event = THERMOSTAT_POWER_OFF,
                 .effect = thermostat_power_off
         },
+        // the completion transitions between idling and running a mode are only evaluated when their inputs change
         {
                 .source = THERMOSTAT_COOLING,
                 .target = THERMOSTAT_COOL,
-                .guard = thermostat_mode_off_constraint
+                .guard = thermostat_mode_off_constraint,
+                .depends = THERMOSTAT_INPUT_TEMPERATURE | THERMOSTAT_INPUT_SETPOINT | THERMOSTAT_INPUT_ACTIVE_TIME
         },
         {
                 .source = THERMOSTAT_HEATING,
                 .target = THERMOSTAT_HEAT,
-                .guard = thermostat_mode_off_constraint
+                .guard = thermostat_mode_off_constraint,
+                .depends = THERMOSTAT_INPUT_TEMPERATURE | THERMOSTAT_INPUT_SETPOINT | THERMOSTAT_INPUT_ACTIVE_TIME
         },
         {
                 .source = THERMOSTAT_COOL,
                 .target = THERMOSTAT_COOLING,
-                .guard = thermostat_mode_on_constraint
+                .guard = thermostat_mode_on_constraint,
+                .depends = THERMOSTAT_INPUT_TEMPERATURE | THERMOSTAT_INPUT_SETPOINT
         },
         {
                 .source = THERMOSTAT_HEAT,
                 .target = THERMOSTAT_HEATING,
-                .guard = thermostat_mode_on_constraint
+                .guard = thermostat_mode_on_constraint,
+                .depends = THERMOSTAT_INPUT_TEMPERATURE | THERMOSTAT_INPUT_SETPOINT
+        },
+        {
+                .source = THERMOSTAT_HEAT,
+                .after = thermostat_minimum_active_time,
+                .effect = thermostat_minimum_active_time_elapsed,
+                .changes = THERMOSTAT_INPUT_ACTIVE_TIME
+        },
+        {
+                .source = THERMOSTAT_COOL,
+                .after = thermostat_minimum_active_time,
+                .effect = thermostat_minimum_active_time_elapsed,
+                .changes = THERMOSTAT_INPUT_ACTIVE_TIME
         },
         {
                 .source = THERMOSTAT_POWERED_ON,
                 .trigger.event = THERMOSTAT_SET_TEMPERATURE,
-                .effect = thermostat_set_temperature
+                .effect = thermostat_set_temperature,
+                .changes = THERMOSTAT_INPUT_TEMPERATURE
         },
         {
                 .source = THERMOSTAT_POWERED_ON,
                 .trigger.event = THERMOSTAT_SET_HEAT_SETPOINT,
-                .effect = thermostat_set_heat_setpoint
+                .effect = thermostat_set_heat_setpoint,
+                .changes = THERMOSTAT_INPUT_SETPOINT
         },
         {
                 .source = THERMOSTAT_POWERED_ON,
                 .trigger.event = THERMOSTAT_SET_COOL_SETPOINT,
-                .effect = thermostat_set_cool_setpoint
+                .effect = thermostat_set_cool_setpoint,
+                .changes = THERMOSTAT_INPUT_SETPOINT
         },
         {
                 .source = THERMOSTAT_POWERED_ON,
                 .trigger.event = THERMOSTAT_SET_MIN_ACTIVE_TIME,
-                .effect = thermostat_set_minimum_active_time
+                .effect = thermostat_set_minimum_active_time,
+                .changes = THERMOSTAT_INPUT_ACTIVE_TIME
         },
         NULL_ELEMENT
 
 };
 
-thermostat_t thermostat = {
+_Static_assert(sizeof(thermostat_view_t) == sizeof(((thermostat_t *) NULL)->view), "the view is published in words");
+
+/**
+ * Publish what other threads can read of a thermostat. Only the thread processing it writes, so the sequence is only
+ * made odd while the words are stored.
+ * @param thermostat
+ */
+static void thermostat_publish(thermostat_t *thermostat) {
+    state_t *state = statemachine_is_active(&thermostat->statemachine)
+                     ? statemachine_get_active_state(&thermostat->statemachine) : NULL;
+    thermostat_view_t view = {state != NULL ? state->id : 0, (short) (thermostat->mode.current - thermostat->modes),
+                              thermostat->current_temperature, thermostat->mode.heat->setpoint,
+                              thermostat->mode.cool->setpoint};
+    uint64_t words[2];
+    memcpy(words, &view, sizeof(words));
+    unsigned int sequence = atomic_load_explicit(&thermostat->view_sequence, memory_order_relaxed);
+    atomic_store_explicit(&thermostat->view_sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&thermostat->view[0], words[0], memory_order_relaxed);
+    atomic_store_explicit(&thermostat->view[1], words[1], memory_order_relaxed);
+    atomic_store_explicit(&thermostat->view_sequence, sequence + 2, memory_order_release);
+}
+
+void thermostat_view(thermostat_t *thermostat, thermostat_view_t *view) {
+    uint64_t words[2];
+    for (;;) {
+        unsigned int sequence = atomic_load_explicit(&thermostat->view_sequence, memory_order_acquire);
+        if (sequence & 1) {
+            // the writer may have been preempted halfway, let it finish
+            sched_yield();
+            continue;
+        }
+        words[0] = atomic_load_explicit(&thermostat->view[0], memory_order_relaxed);
+        words[1] = atomic_load_explicit(&thermostat->view[1], memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&thermostat->view_sequence, memory_order_relaxed) == sequence) break;
+    }
+    memcpy(view, words, sizeof(*view));
+}
+
+/**
+ * Publish the thermostat once an event has run to completion
+ * @param statemachine
+ */
+static void thermostat_settled(statemachine_t *statemachine) {
+    thermostat_publish((thermostat_t *) statemachine);
+}
+
+/**
+ * The thermostat chart shared by every thermostat. Its arrays are const so they are kept with the read-only data, the
+ * engine only ever reads them.
+ */
+statemachine_model_t thermostat_model = {
         {
-                {
-                        THERMOSTAT_POWERED_ON,
-                        (state_t *) thermostat_powered_on_states,
-                        .initial.target = THERMOSTAT_OFF,
-                        .entry = thermostat_log_entry,
-                        thermostat_log_exit,
-                },
-                thermostat_transitions,
+                THERMOSTAT_POWERED_ON,
+                (state_t *) thermostat_powered_on_states,
+                .initial.target = THERMOSTAT_OFF,
+                .entry = thermostat_log_entry,
+                thermostat_log_exit,
         },
-        .mode.heat = &thermostat_mode_data[1],
-        .mode.cool = &thermostat_mode_data[2],
-        .current_temperature = 72
+        (transition_t *) thermostat_transitions,
+        .settled = thermostat_settled
 };
 
-void *user_input_task(void *active) {
-    while (*((char *)active)) {
-        pthread_mutex_lock(&lock);
-        statemachine_step((statemachine_t *)&thermostat);
-        pthread_mutex_unlock(&lock);
+static pthread_once_t thermostat_model_once = PTHREAD_ONCE_INIT;
+
+static void thermostat_compile() {
+    // a generated dispatcher may have been installed on the compiled chart already
+    if (thermostat_model.table == NULL) statemachine_compile(&thermostat_model);
+}
+
+thermostat_t *thermostat_create() {
+    pthread_once(&thermostat_model_once, thermostat_compile);
+    if (thermostat_model.table == NULL) return NULL;
+    thermostat_t *thermostat = calloc(1, sizeof(thermostat_t));
+    if (thermostat == NULL) return NULL;
+    memcpy(thermostat->modes, thermostat_mode_data, sizeof(thermostat_mode_data));
+    thermostat->mode.current = &thermostat->modes[THERMOSTAT_MODE_OFF];
+    thermostat->mode.heat = &thermostat->modes[THERMOSTAT_MODE_HEAT];
+    thermostat->mode.cool = &thermostat->modes[THERMOSTAT_MODE_COOL];
+    thermostat->current_temperature = 72;
+    if (statemachine_init(&thermostat->statemachine, &thermostat_model) == NULL) {
+        free(thermostat);
+        return NULL;
     }
+    return thermostat;
+}
+
+void thermostat_destroy(thermostat_t *thermostat) {
+    if (thermostat != NULL) {
+        statemachine_deinit(&thermostat->statemachine);
+        free(thermostat);
+    }
+}
+
+size_t thermostat_snapshot_size() {
+    pthread_once(&thermostat_model_once, thermostat_compile);
+    if (thermostat_model.table == NULL) return 0;
+    return THERMOSTAT_SNAPSHOT_HEADER + statemachine_snapshot_size(&thermostat_model);
+}
+
+size_t thermostat_snapshot(thermostat_t *thermostat, void *buffer, size_t size) {
+    unsigned char *bytes = buffer;
+    size_t length = THERMOSTAT_SNAPSHOT_HEADER + statemachine_snapshot(&thermostat->statemachine,
+                                                                       bytes + THERMOSTAT_SNAPSHOT_HEADER,
+                                                                       size > THERMOSTAT_SNAPSHOT_HEADER
+                                                                       ? size - THERMOSTAT_SNAPSHOT_HEADER : 0);
+    if (length > size) return length;
+    uint16_t version = THERMOSTAT_SNAPSHOT_VERSION;
+    memcpy(bytes, &version, sizeof(version));
+    bytes[2] = (unsigned char) (thermostat->mode.current - thermostat->modes);
+    bytes[3] = 0;
+    for (int i = 0; i < THERMOSTAT_MODE_COUNT; i++) {
+        if (thermostat->modes[i].minimum_active_time_elapsed) bytes[3] |= (unsigned char) (1 << i);
+        memcpy(bytes + 8 + i * 8, &thermostat->modes[i].setpoint, sizeof(float));
+        memcpy(bytes + 12 + i * 8, &thermostat->modes[i].minimum_active_time, sizeof(float));
+    }
+    memcpy(bytes + 4, &thermostat->current_temperature, sizeof(float));
+    return length;
+}
+
+thermostat_t *thermostat_restore(const void *snapshot, size_t size) {
+    const unsigned char *bytes = snapshot;
+    uint16_t version;
+    pthread_once(&thermostat_model_once, thermostat_compile);
+    if (thermostat_model.table == NULL || size < THERMOSTAT_SNAPSHOT_HEADER) return NULL;
+    memcpy(&version, bytes, sizeof(version));
+    if (version != THERMOSTAT_SNAPSHOT_VERSION || bytes[2] >= THERMOSTAT_MODE_COUNT) return NULL;
+    thermostat_t *thermostat = calloc(1, sizeof(thermostat_t));
+    if (thermostat == NULL) return NULL;
+    // the modes keep their defaults for what isn't saved
+    memcpy(thermostat->modes, thermostat_mode_data, sizeof(thermostat_mode_data));
+    for (int i = 0; i < THERMOSTAT_MODE_COUNT; i++) {
+        thermostat->modes[i].minimum_active_time_elapsed = (char) ((bytes[3] >> i) & 1);
+        memcpy(&thermostat->modes[i].setpoint, bytes + 8 + i * 8, sizeof(float));
+        memcpy(&thermostat->modes[i].minimum_active_time, bytes + 12 + i * 8, sizeof(float));
+    }
+    memcpy(&thermostat->current_temperature, bytes + 4, sizeof(float));
+    thermostat->mode.current = &thermostat->modes[bytes[2]];
+    thermostat->mode.heat = &thermostat->modes[THERMOSTAT_MODE_HEAT];
+    thermostat->mode.cool = &thermostat->modes[THERMOSTAT_MODE_COOL];
+    if (statemachine_restore(&thermostat->statemachine, &thermostat_model, bytes + THERMOSTAT_SNAPSHOT_HEADER,
+                             size - THERMOSTAT_SNAPSHOT_HEADER) != 0) {
+        free(thermostat);
+        return NULL;
+    }
+    return thermostat;
+}
+
+int thermostat_fleet_save(const char *path, thermostat_t **thermostats, size_t count) {
+    size_t record = thermostat_snapshot_size(), length = THERMOSTAT_FLEET_HEADER + record * count;
+    if (record == 0) return -1;
+    size_t path_length = strlen(path);
+    char *temporary = malloc(path_length + sizeof(".tmp"));
+    if (temporary == NULL) return -1;
+    memcpy(temporary, path, path_length);
+    memcpy(temporary + path_length, ".tmp", sizeof(".tmp"));
+    int file = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0644), result = -1;
+    unsigned char *bytes = MAP_FAILED;
+    if (file >= 0 && ftruncate(file, (off_t) length) == 0) {
+        bytes = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    }
+    if (bytes != MAP_FAILED) {
+        uint16_t version = THERMOSTAT_SNAPSHOT_VERSION, size = (uint16_t) record;
+        uint64_t records = count;
+        memcpy(bytes, THERMOSTAT_FLEET_MAGIC, 4);
+        memcpy(bytes + 4, &version, sizeof(version));
+        memcpy(bytes + 6, &size, sizeof(size));
+        memcpy(bytes + 8, &records, sizeof(records));
+        result = 0;
+        // the file was truncated so the unused end of every record is already zero
+        for (size_t i = 0; i < count && result == 0; i++) {
+            if (thermostat_snapshot(thermostats[i], bytes + THERMOSTAT_FLEET_HEADER + i * record, record) > record) {
+                result = -1;
+            }
+        }
+        if (msync(bytes, length, MS_SYNC) != 0) result = -1;
+        munmap(bytes, length);
+    }
+    if (file >= 0 && close(file) != 0) result = -1;
+    if (result == 0 && rename(temporary, path) != 0) result = -1;
+    if (result != 0) unlink(temporary);
+    free(temporary);
+    return result;
+}
+
+thermostat_t **thermostat_fleet_restore(const char *path, size_t *count) {
+    int file = open(path, O_RDONLY);
+    if (file < 0) return NULL;
+    off_t length = lseek(file, 0, SEEK_END);
+    const unsigned char *bytes = length >= THERMOSTAT_FLEET_HEADER
+                                 ? mmap(NULL, (size_t) length, PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+    close(file);
+    if (bytes == MAP_FAILED) return NULL;
+    thermostat_t **thermostats = NULL;
+    uint16_t version, record;
+    uint64_t records;
+    memcpy(&version, bytes + 4, sizeof(version));
+    memcpy(&record, bytes + 6, sizeof(record));
+    memcpy(&records, bytes + 8, sizeof(records));
+    if (memcmp(bytes, THERMOSTAT_FLEET_MAGIC, 4) == 0 && version == THERMOSTAT_SNAPSHOT_VERSION && record != 0 &&
+        records <= ((uint64_t) length - THERMOSTAT_FLEET_HEADER) / record) {
+        madvise((void *) bytes, (size_t) length, MADV_SEQUENTIAL);
+        thermostats = calloc(records ? records : 1, sizeof(thermostat_t *));
+    }
+    for (size_t i = 0; thermostats != NULL && i < records; i++) {
+        thermostats[i] = thermostat_restore(bytes + THERMOSTAT_FLEET_HEADER + i * record, record);
+        if (thermostats[i] == NULL) {
+            while (i > 0) thermostat_destroy(thermostats[--i]);
+            free(thermostats);
+            thermostats = NULL;
+        }
+    }
+    munmap((void *) bytes, (size_t) length);
+    if (thermostats != NULL) *count = records;
+    return thermostats;
+}
+
+void *user_input_task(void *statemachine) {
+    statemachine_run((statemachine_t *) statemachine);
     return NULL;
 }
 /**
  * run the thermostat program
  */
-void thermostat_run() {
+void thermostat_run(const char *snapshot, const char *control) {
     pthread_t thread;
-    statemachine_init((statemachine_t *) &thermostat);
-    pthread_create(&thread, NULL, user_input_task, &((state_t*)&thermostat)->active);
-    while(thermostat.statemachine.root.active) {
-//        statemachine_step((statemachine_t *) &thermostat);
-        state_t *active = statemachine_get_active_state((state_t *) &thermostat);
-        thermostat_menu(&thermostat, state_id_map[active == NULL ? 0 : active->id]);
-        thermostat_cmd_handler(&thermostat);
+    thermostat_control_t server;
+    size_t count = 0;
+    thermostat_t **restored = snapshot != NULL ? thermostat_fleet_restore(snapshot, &count) : NULL;
+    thermostat_t *thermostat = count == 1 ? restored[0] : thermostat_create();
+    if (restored != NULL && count != 1) {
+        for (size_t i = 0; i < count; i++) thermostat_destroy(restored[i]);
+    }
+    free(restored);
+    if (thermostat == NULL) {
+        puts("[THERMOSTAT] FAILED TO START");
+        return;
+    }
+    // the menu can print them at any time
+    statemachine_metrics_enable(1);
+    pthread_create(&thread, NULL, user_input_task, &thermostat->statemachine);
+    // clients address the thermostat as 0
+    if (control != NULL && (thermostat_control_init(&server, &thermostat, 1) != 0 ||
+                            thermostat_control_start(&server, control) != 0)) {
+        printf("[THERMOSTAT] FAILED TO LISTEN ON %s\n", control);
+        thermostat_control_deinit(&server);
+        control = NULL;
+    }
+    while(statemachine_is_active(&thermostat->statemachine)) {
+        thermostat_menu(thermostat);
+        thermostat_cmd_handler(thermostat);
+        // a thermostat that was powered off starts over the next time
+        if (snapshot != NULL && statemachine_is_active(&thermostat->statemachine)) {
+            // the input thread, the control server and the timers may be processing it at any time
+            statemachine_hold(&thermostat->statemachine);
+            int saved = thermostat_fleet_save(snapshot, &thermostat, 1);
+            statemachine_unhold(&thermostat->statemachine);
+            if (saved != 0) printf("[THERMOSTAT] FAILED TO SAVE %s\n", snapshot);
+        }
     }
+    if (snapshot != NULL && !statemachine_is_active(&thermostat->statemachine)) unlink(snapshot);
+    if (control != NULL) thermostat_control_deinit(&server);
+    pthread_join(thread, NULL);
+    thermostat_destroy(thermostat);
     puts("[THERMOSTAT] POWERED OFF");
 }
\ No newline at end of file
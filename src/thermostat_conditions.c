@@ -0,0 +1,157 @@
+//
+// Evaluates the on and off conditions of the heat and cool modes of a fleet of thermostats a block at a time
+//
+
+#include "thermostat_conditions.h"
+#include <math.h>
+#include <stdlib.h>
+// SSE2 is part of every x86-64 cpu, AVX2 is checked for at runtime
+#ifdef __SSE2__
+#include <immintrin.h>
+#define CONDITIONS_X86
+#endif
+
+int thermostat_conditions_init(thermostat_conditions_t *conditions, size_t count) {
+    conditions->count = count;
+    conditions->temperature = calloc(count ? count : 1, sizeof(float));
+    conditions->setpoint = malloc((count ? count : 1) * sizeof(float));
+    conditions->invert = calloc(count ? count : 1, sizeof(uint32_t));
+    conditions->kernel = THERMOSTAT_KERNEL_SCALAR;
+#ifdef CONDITIONS_X86
+    __builtin_cpu_init();
+    conditions->kernel = __builtin_cpu_supports("avx2") ? THERMOSTAT_KERNEL_AVX2 : THERMOSTAT_KERNEL_SSE;
+#endif
+    if (conditions->temperature == NULL || conditions->setpoint == NULL || conditions->invert == NULL) {
+        thermostat_conditions_deinit(conditions);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        conditions->setpoint[i] = NAN;
+    }
+    return 0;
+}
+
+void thermostat_conditions_deinit(thermostat_conditions_t *conditions) {
+    free(conditions->temperature);
+    free(conditions->setpoint);
+    free(conditions->invert);
+    conditions->temperature = conditions->setpoint = NULL;
+    conditions->invert = NULL;
+    conditions->count = 0;
+}
+
+void thermostat_conditions_track(thermostat_conditions_t *conditions, size_t position, thermostat_t *thermostat) {
+    thermostat_view_t view;
+    thermostat_view(thermostat, &view);
+    conditions->temperature[position] = view.temperature;
+    conditions->setpoint[position] = view.mode == THERMOSTAT_MODE_HEAT ? view.heat_setpoint :
+                                     view.mode == THERMOSTAT_MODE_COOL ? view.cool_setpoint : NAN;
+    // the modes' invert flags never change once the thermostat is created
+    conditions->invert[position] = thermostat->modes[view.mode].invert ? UINT32_MAX : 0;
+}
+
+/**
+ * Whether a reading changes the on or off condition of a thermostat
+ * @param conditions
+ * @param position of the thermostat
+ * @param reading
+ * @return non-zero if it does
+ */
+static inline int conditions_differ(const thermostat_conditions_t *conditions, size_t position, float reading) {
+    float temperature = conditions->temperature[position], setpoint = conditions->setpoint[position];
+    if (conditions->invert[position]) {
+        return (temperature > setpoint) != (reading > setpoint) || (temperature <= setpoint) != (reading <= setpoint);
+    }
+    return (temperature < setpoint) != (reading < setpoint) || (temperature >= setpoint) != (reading >= setpoint);
+}
+
+/**
+ * Record the thermostats of a block whose bit is set in a mask and make their readings their last ones
+ * @param conditions
+ * @param readings
+ * @param position of the first thermostat of the block
+ * @param mask a bit per thermostat of the block
+ * @param changed where the next position found goes
+ * @return positions recorded
+ */
+static inline size_t conditions_emit(thermostat_conditions_t *conditions, const float *readings, size_t position,
+                                     unsigned int mask, size_t *changed) {
+    size_t found = 0;
+    while (mask != 0) {
+        size_t i = position + (size_t) __builtin_ctz(mask);
+        conditions->temperature[i] = readings[i];
+        changed[found++] = i;
+        mask &= mask - 1;
+    }
+    return found;
+}
+
+static size_t conditions_scalar(thermostat_conditions_t *conditions, const float *readings, size_t first, size_t last,
+                                size_t *changed) {
+    size_t found = 0;
+    for (size_t i = first; i < last; i++) {
+        if (conditions_differ(conditions, i, readings[i])) found += conditions_emit(conditions, readings, i, 1,
+                                                                                    changed + found);
+    }
+    return found;
+}
+
+#ifdef CONDITIONS_X86
+/*
+ * Flipping the sign of the temperature and the setpoint of an inverted mode turns its comparisons into the ones of a
+ * mode that isn't, so every lane compares the same way. The sign flip keeps NaNs NaN and comparisons exact.
+ */
+
+static size_t conditions_sse(thermostat_conditions_t *conditions, const float *readings, size_t first, size_t last,
+                             size_t *changed) {
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    size_t found = 0, i = first;
+    for (; i + 4 <= last; i += 4) {
+        __m128 flip = _mm_and_ps(_mm_loadu_ps((const float *) &conditions->invert[i]), sign);
+        __m128 setpoint = _mm_xor_ps(_mm_loadu_ps(&conditions->setpoint[i]), flip);
+        __m128 before = _mm_xor_ps(_mm_loadu_ps(&conditions->temperature[i]), flip);
+        __m128 after = _mm_xor_ps(_mm_loadu_ps(&readings[i]), flip);
+        __m128 on = _mm_xor_ps(_mm_cmplt_ps(before, setpoint), _mm_cmplt_ps(after, setpoint));
+        __m128 off = _mm_xor_ps(_mm_cmpge_ps(before, setpoint), _mm_cmpge_ps(after, setpoint));
+        unsigned int mask = (unsigned int) _mm_movemask_ps(_mm_or_ps(on, off));
+        if (mask != 0) found += conditions_emit(conditions, readings, i, mask, changed + found);
+    }
+    return found + conditions_scalar(conditions, readings, i, last, changed + found);
+}
+
+__attribute__((target("avx2")))
+static size_t conditions_avx2(thermostat_conditions_t *conditions, const float *readings, size_t first, size_t last,
+                              size_t *changed) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    size_t found = 0, i = first;
+    for (; i + 8 <= last; i += 8) {
+        __m256 flip = _mm256_and_ps(_mm256_loadu_ps((const float *) &conditions->invert[i]), sign);
+        __m256 setpoint = _mm256_xor_ps(_mm256_loadu_ps(&conditions->setpoint[i]), flip);
+        __m256 before = _mm256_xor_ps(_mm256_loadu_ps(&conditions->temperature[i]), flip);
+        __m256 after = _mm256_xor_ps(_mm256_loadu_ps(&readings[i]), flip);
+        __m256 on = _mm256_xor_ps(_mm256_cmp_ps(before, setpoint, _CMP_LT_OQ),
+                                  _mm256_cmp_ps(after, setpoint, _CMP_LT_OQ));
+        __m256 off = _mm256_xor_ps(_mm256_cmp_ps(before, setpoint, _CMP_GE_OQ),
+                                   _mm256_cmp_ps(after, setpoint, _CMP_GE_OQ));
+        unsigned int mask = (unsigned int) _mm256_movemask_ps(_mm256_or_ps(on, off));
+        if (mask != 0) found += conditions_emit(conditions, readings, i, mask, changed + found);
+    }
+    // the rest is narrower than a vector
+    return found + conditions_sse(conditions, readings, i, last, changed + found);
+}
+#endif
+
+size_t thermostat_conditions_changed(thermostat_conditions_t *conditions, const float *readings, size_t first,
+                                     size_t last, size_t *changed) {
+#ifdef CONDITIONS_X86
+    switch (conditions->kernel) {
+        case THERMOSTAT_KERNEL_AVX2:
+            return conditions_avx2(conditions, readings, first, last, changed);
+        case THERMOSTAT_KERNEL_SSE:
+            return conditions_sse(conditions, readings, first, last, changed);
+        default:
+            break;
+    }
+#endif
+    return conditions_scalar(conditions, readings, first, last, changed);
+}
@@ -0,0 +1,409 @@
+//
+// Non-blocking control server driving a fleet of thermostats from local clients over a Unix domain socket
+//
+
+#define _GNU_SOURCE
+#include "thermostat_control.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// room a response needs in the output buffer before the request is handled
+#define CONTROL_RESPONSE 128
+// readiness reported by a single epoll_wait
+#define CONTROL_EVENTS 64
+// epoll data of the wake pipe and the listener, connections carry their pointer
+#define CONTROL_WAKE ((void *) 1)
+#define CONTROL_LISTENER ((void *) 2)
+
+/**
+ * A client connection and the requests and responses it has in flight
+ */
+typedef struct control_connection {
+    struct control_connection *next; // connections are only reachable through epoll otherwise
+    struct control_connection **link; // pointer to this connection in the list of open connections
+    int fd;
+    uint32_t events; // what epoll watches it for
+    char closing; // the client has sent everything it will, the connection closes once it has been answered
+    size_t received; // bytes of requests in input
+    size_t queued; // bytes of responses in output
+    size_t sent; // bytes of output already written
+    char input[THERMOSTAT_CONTROL_LINE];
+    char output[THERMOSTAT_CONTROL_OUTPUT];
+} control_connection_t;
+
+int thermostat_control_init(thermostat_control_t *control, thermostat_t **thermostats, size_t count) {
+    memset(control, 0, sizeof(thermostat_control_t));
+    control->thermostats = thermostats;
+    control->count = count;
+    control->listener = control->epoll = -1;
+    // the write end never blocks so stopping is safe from a signal handler
+    if (pipe2(control->wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+        control->wake[0] = control->wake[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void thermostat_control_deinit(thermostat_control_t *control) {
+    if (control->started) {
+        thermostat_control_stop(control);
+        pthread_join(control->thread, NULL);
+        control->started = 0;
+    }
+    if (control->wake[0] >= 0) close(control->wake[0]);
+    if (control->wake[1] >= 0) close(control->wake[1]);
+    control->wake[0] = control->wake[1] = -1;
+}
+
+void thermostat_control_stop(thermostat_control_t *control) {
+    char byte = 0;
+    ssize_t written = write(control->wake[1], &byte, 1);
+    (void) (written);
+}
+
+/**
+ * Queue a response to a request
+ * @param control
+ * @param connection
+ * @param format
+ * @param ... arguments of format
+ */
+__attribute__((format(printf, 3, 4)))
+static void control_respond(thermostat_control_t *control, control_connection_t *connection, const char *format,
+                            ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(connection->output + connection->queued, THERMOSTAT_CONTROL_OUTPUT - connection->queued,
+                           format, arguments);
+    va_end(arguments);
+    if (length > 0) connection->queued += (size_t) length;
+    control->stats.requests++;
+}
+
+/**
+ * Queue an error response
+ * @param control
+ * @param connection
+ * @param reason
+ */
+static void control_refuse(thermostat_control_t *control, control_connection_t *connection, const char *reason) {
+    control_respond(control, connection, "error %s\n", reason);
+    control->stats.errors++;
+}
+
+/**
+ * Count the thermostats in a state and queue the response
+ * @param control
+ * @param connection
+ * @param text the state id
+ */
+static void control_fleet(thermostat_control_t *control, control_connection_t *connection, const char *text) {
+    char *end;
+    long id = strtol(text, &end, 10);
+    if (end == text || *end != '\0') {
+        control_refuse(control, connection, "missing value");
+        return;
+    }
+    const char *name = id > 0 && id <= SHRT_MAX ? thermostat_state_name((short) id) : NULL;
+    if (name == NULL) {
+        control_refuse(control, connection, "unknown state");
+        return;
+    }
+    control_respond(control, connection, "ok * %ld %zu %s\n", id, statemachine_index_count(control->index, (short) id),
+                    name);
+}
+
+/**
+ * Carry out a request and queue its response
+ * @param control
+ * @param connection
+ * @param line the request, terminated in place
+ */
+static void control_request(thermostat_control_t *control, control_connection_t *connection, char *line) {
+    if (line[0] == THERMOSTAT_CONTROL_FLEET && line[1] == ' ') {
+        if (control->index == NULL) {
+            control_refuse(control, connection, "no index");
+        } else {
+            control_fleet(control, connection, line + 2);
+        }
+        return;
+    }
+    char *end;
+    unsigned long id = strtoul(line, &end, 10);
+    if (end == line || *end != ' ') {
+        control_refuse(control, connection, "malformed request");
+        return;
+    }
+    if (id >= control->count) {
+        control_refuse(control, connection, "unknown thermostat");
+        return;
+    }
+    while (*end == ' ') end++;
+    event_t command = (event_t) *end;
+    if (command == '\0' || (end[1] != '\0' && end[1] != ' ')) {
+        control_refuse(control, connection, "malformed request");
+        return;
+    }
+    thermostat_t *thermostat = control->thermostats[id];
+    switch (command) {
+        case THERMOSTAT_SET_TEMPERATURE:
+        case THERMOSTAT_SET_HEAT_SETPOINT:
+        case THERMOSTAT_SET_COOL_SETPOINT:
+        case THERMOSTAT_SET_MIN_ACTIVE_TIME: {
+            char *text = end + 1;
+            float value = strtof(text, &end);
+            if (end == text || *end != '\0') {
+                control_refuse(control, connection, "missing value");
+                return;
+            }
+            statemachine_dispatch_float(&thermostat->statemachine, command, value);
+            break;
+        }
+        case THERMOSTAT_SET_MODE_OFF:
+        case THERMOSTAT_SET_MODE_HEAT:
+        case THERMOSTAT_SET_MODE_COOL:
+        case THERMOSTAT_POWER_OFF:
+            statemachine_dispatch(&thermostat->statemachine, command, NULL);
+            break;
+        case THERMOSTAT_CONTROL_QUERY:
+            break;
+        default:
+            control_refuse(control, connection, "unknown command");
+            return;
+    }
+    // answer a command with the state it left the thermostat in, not one it is still on its way out of, and a query
+    // with whatever was published last without waiting for the thermostat
+    if (command != THERMOSTAT_CONTROL_QUERY) statemachine_flush(&thermostat->statemachine);
+    thermostat_view_t view;
+    thermostat_view(thermostat, &view);
+    control_respond(control, connection, "ok %lu %d %.2f %.2f %.2f %s\n", id, view.state, view.temperature,
+                    view.heat_setpoint, view.cool_setpoint, view.state != 0 ? thermostat_state_name(view.state)
+                                                                            : "POWERED OFF");
+}
+
+/**
+ * Handle the complete requests a connection has received for as long as there is room for their responses
+ * @param control
+ * @param connection
+ */
+static void control_handle(thermostat_control_t *control, control_connection_t *connection) {
+    size_t offset = 0;
+    char *newline;
+    while (THERMOSTAT_CONTROL_OUTPUT - connection->queued >= CONTROL_RESPONSE &&
+           (newline = memchr(connection->input + offset, '\n', connection->received - offset)) != NULL) {
+        char *line = connection->input + offset;
+        offset = (size_t) (newline - connection->input) + 1;
+        if (newline > line && newline[-1] == '\r') newline--;
+        *newline = '\0';
+        control_request(control, connection, line);
+    }
+    if (offset == 0 && connection->received == THERMOSTAT_CONTROL_LINE &&
+        THERMOSTAT_CONTROL_OUTPUT - connection->queued >= CONTROL_RESPONSE) {
+        // a line that doesn't fit can't be answered, the client is out of step with the protocol
+        control_refuse(control, connection, "request too long");
+        connection->closing = 1;
+        offset = connection->received;
+    }
+    memmove(connection->input, connection->input + offset, connection->received - offset);
+    connection->received -= offset;
+}
+
+/**
+ * Write as much of the queued responses as the socket takes
+ * @param connection
+ * @return 0 on success, -1 if the client went away
+ */
+static int control_send(control_connection_t *connection) {
+    while (connection->sent < connection->queued) {
+        ssize_t written = send(connection->fd, connection->output + connection->sent,
+                               connection->queued - connection->sent, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        connection->sent += (size_t) written;
+    }
+    connection->queued = connection->sent = 0;
+    return 0;
+}
+
+/**
+ * Read, answer and write what a connection is ready for, then watch it for what it needs next
+ * @param control
+ * @param epoll
+ * @param connection
+ * @param events epoll reported
+ * @return 0 on success, -1 if the connection is done and has to be closed
+ */
+static int control_serve(thermostat_control_t *control, int epoll, control_connection_t *connection,
+                         uint32_t events) {
+    if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN)) return -1;
+    if (events & EPOLLIN) {
+        ssize_t received = recv(connection->fd, connection->input + connection->received,
+                                THERMOSTAT_CONTROL_LINE - connection->received, 0);
+        if (received == 0) {
+            connection->closing = 1;
+        } else if (received > 0) {
+            connection->received += (size_t) received;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+    }
+    control_handle(control, connection);
+    if (control_send(connection) != 0) return -1;
+    // requests blocked on a full output go once it has been written
+    if (connection->received > 0 && connection->queued == 0) {
+        control_handle(control, connection);
+        if (control_send(connection) != 0) return -1;
+    }
+    uint32_t wanted = connection->queued > 0 ? EPOLLOUT : 0;
+    if (!connection->closing && connection->received < THERMOSTAT_CONTROL_LINE) wanted |= EPOLLIN;
+    if (wanted == 0) return -1;
+    if (wanted != connection->events) {
+        struct epoll_event event = {wanted, {.ptr = connection}};
+        if (epoll_ctl(epoll, EPOLL_CTL_MOD, connection->fd, &event) != 0) return -1;
+        connection->events = wanted;
+    }
+    return 0;
+}
+
+/**
+ * Accept every client waiting on the listener
+ * @param control
+ * @param epoll
+ * @param listener
+ * @param connections list of open connections the new ones are added to
+ */
+static void control_accept(thermostat_control_t *control, int epoll, int listener,
+                           control_connection_t **connections) {
+    int fd;
+    while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        control_connection_t *connection = malloc(sizeof(control_connection_t));
+        struct epoll_event event = {EPOLLIN, {.ptr = connection}};
+        if (connection == NULL || epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+            free(connection);
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->events = EPOLLIN;
+        connection->closing = 0;
+        connection->received = connection->queued = connection->sent = 0;
+        connection->next = *connections;
+        if (connection->next != NULL) connection->next->link = &connection->next;
+        connection->link = connections;
+        *connections = connection;
+        control->stats.connections++;
+    }
+}
+
+/**
+ * Close a connection and free it
+ * @param epoll
+ * @param connection
+ */
+static void control_close(int epoll, control_connection_t *connection) {
+    *connection->link = connection->next;
+    if (connection->next != NULL) connection->next->link = connection->link;
+    epoll_ctl(epoll, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    free(connection);
+}
+
+/**
+ * Create the socket and the epoll instance watching it and the wake pipe
+ * @param control
+ * @param path
+ * @return 0 on success, -1 if either couldn't be created
+ */
+static int control_open(thermostat_control_t *control, const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) return -1;
+    strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0) return -1;
+    unlink(path);
+    int epoll = -1;
+    struct epoll_event wake = {EPOLLIN, {.ptr = CONTROL_WAKE}}, accepting = {EPOLLIN, {.ptr = CONTROL_LISTENER}};
+    if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0 ||
+        (epoll = epoll_create1(EPOLL_CLOEXEC)) < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, control->wake[0], &wake) != 0 ||
+        epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &accepting) != 0) {
+        if (epoll >= 0) close(epoll);
+        close(listener);
+        unlink(path);
+        return -1;
+    }
+    control->path = path;
+    control->listener = listener;
+    control->epoll = epoll;
+    return 0;
+}
+
+/**
+ * Serve clients until stopped, then close them, the socket and the epoll instance
+ * @param control opened with control_open
+ */
+static void control_loop(thermostat_control_t *control) {
+    control_connection_t *connections = NULL;
+    struct epoll_event events[CONTROL_EVENTS];
+    char stopping = 0;
+    while (!stopping) {
+        int ready = epoll_wait(control->epoll, events, CONTROL_EVENTS, -1);
+        if (ready < 0 && errno != EINTR) break;
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == CONTROL_WAKE) {
+                char byte;
+                ssize_t drained = read(control->wake[0], &byte, 1);
+                (void) (drained);
+                stopping = 1;
+            } else if (events[i].data.ptr == CONTROL_LISTENER) {
+                control_accept(control, control->epoll, control->listener, &connections);
+            } else if (control_serve(control, control->epoll, events[i].data.ptr, events[i].events) != 0) {
+                control_close(control->epoll, events[i].data.ptr);
+            }
+        }
+    }
+    while (connections != NULL) control_close(control->epoll, connections);
+    close(control->epoll);
+    close(control->listener);
+    unlink(control->path);
+    control->epoll = control->listener = -1;
+}
+
+/**
+ * Body of the thread thermostat_control_start creates
+ * @param control
+ * @return NULL
+ */
+static void *control_task(void *control) {
+    control_loop(control);
+    return NULL;
+}
+
+int thermostat_control_serve(thermostat_control_t *control, const char *path) {
+    if (control_open(control, path) != 0) return -1;
+    control_loop(control);
+    return 0;
+}
+
+int thermostat_control_start(thermostat_control_t *control, const char *path) {
+    if (control_open(control, path) != 0) return -1;
+    if (pthread_create(&control->thread, NULL, control_task, control) != 0) {
+        close(control->epoll);
+        close(control->listener);
+        unlink(path);
+        control->epoll = control->listener = -1;
+        return -1;
+    }
+    control->started = 1;
+    return 0;
+}
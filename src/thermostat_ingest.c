@@ -0,0 +1,368 @@
+//
+// Streams temperature readings from files, pipes and Unix domain sockets into a fleet of thermostats
+//
+
+#define _GNU_SOURCE
+#include "thermostat_ingest.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// protocol of a stream, known once its first bytes have been read
+#define INGEST_UNKNOWN 0
+#define INGEST_TEXT 1
+#define INGEST_BINARY 2
+
+// digits of an id or timestamp, and of the integer part of a temperature, that are parsed before it is refused
+#define INGEST_INTEGER_DIGITS 19
+#define INGEST_TEMPERATURE_DIGITS 9
+
+/**
+ * A file, pipe or socket connection being read
+ */
+typedef struct {
+    int fd;
+    char format;
+    char skipping; // the line being read is longer than the buffer, it is dropped up to its end
+    size_t used; // bytes in buffer not parsed yet
+    char buffer[THERMOSTAT_INGEST_BUFFER];
+} ingest_stream_t;
+
+static const double ingest_scales[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+
+int thermostat_ingest_init(thermostat_ingest_t *ingest, thermostat_t **thermostats, size_t count) {
+    memset(ingest, 0, sizeof(thermostat_ingest_t));
+    ingest->thermostats = thermostats;
+    ingest->count = count;
+    ingest->timestamps = calloc(count ? count : 1, sizeof(uint64_t));
+    // the write end never blocks so stopping is safe from a signal handler
+    if (ingest->timestamps == NULL || pipe2(ingest->wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+        ingest->wake[0] = ingest->wake[1] = -1;
+        thermostat_ingest_deinit(ingest);
+        return -1;
+    }
+    return 0;
+}
+
+void thermostat_ingest_deinit(thermostat_ingest_t *ingest) {
+    free(ingest->timestamps);
+    ingest->timestamps = NULL;
+    if (ingest->wake[0] >= 0) close(ingest->wake[0]);
+    if (ingest->wake[1] >= 0) close(ingest->wake[1]);
+    ingest->wake[0] = ingest->wake[1] = -1;
+}
+
+void thermostat_ingest_stop(thermostat_ingest_t *ingest) {
+    char byte = 0;
+    ssize_t written = write(ingest->wake[1], &byte, 1);
+    (void) (written);
+}
+
+/**
+ * Dispatch the readings collected in the batch
+ * @param ingest
+ */
+static void ingest_flush(thermostat_ingest_t *ingest) {
+    if (ingest->size == 0) return;
+    size_t accepted = statemachine_dispatch_batch(ingest->entries, ingest->size);
+    ingest->stats.dispatched += accepted;
+    ingest->stats.dropped += ingest->size - accepted;
+    ingest->size = 0;
+}
+
+/**
+ * Add a reading to the batch, its temperature travels inline with the event
+ * @param ingest
+ * @param id
+ * @param temperature
+ * @param timestamp
+ */
+static void ingest_reading(thermostat_ingest_t *ingest, uint64_t id, float temperature, uint64_t timestamp) {
+    ingest->stats.readings++;
+    if (id >= ingest->count) {
+        ingest->stats.unknown++;
+        return;
+    }
+    if (timestamp != 0) {
+        if (timestamp < ingest->timestamps[id]) {
+            ingest->stats.stale++;
+            return;
+        }
+        ingest->timestamps[id] = timestamp;
+    }
+    if (ingest->size == THERMOSTAT_INGEST_BATCH) ingest_flush(ingest);
+    ingest->entries[ingest->size++] = (statemachine_batch_entry_t) {&ingest->thermostats[id]->statemachine,
+                                                                    THERMOSTAT_SET_TEMPERATURE, NULL, sizeof(float),
+                                                                    {.f = temperature}};
+}
+
+/**
+ * Skip the separators between the fields of a line
+ * @param at
+ * @param end
+ * @return first byte that isn't a separator
+ */
+static const char *skip_separators(const char *at, const char *end) {
+    while (at < end && (*at == ' ' || *at == '\t' || *at == ',')) at++;
+    return at;
+}
+
+/**
+ * Parse an unsigned decimal integer
+ * @param at
+ * @param end
+ * @param value
+ * @return byte after the number, NULL if there isn't one or it has too many digits
+ */
+static const char *parse_integer(const char *at, const char *end, uint64_t *value) {
+    const char *digits = at;
+    uint64_t parsed = 0;
+    while (at < end && *at >= '0' && *at <= '9') {
+        if (at - digits == INGEST_INTEGER_DIGITS) return NULL;
+        parsed = parsed * 10 + (uint64_t) (*at++ - '0');
+    }
+    if (at == digits) return NULL;
+    *value = parsed;
+    return at;
+}
+
+/**
+ * Parse a temperature in decimal notation with an optional sign and fraction, digits of the fraction beyond the
+ * precision of a float are skipped
+ * @param at
+ * @param end
+ * @param value
+ * @return byte after the temperature, NULL if there isn't one
+ */
+static const char *parse_temperature(const char *at, const char *end, float *value) {
+    char negative = at < end && *at == '-';
+    if (at < end && (*at == '-' || *at == '+')) at++;
+    const char *digits = at;
+    uint64_t whole = 0, fraction = 0;
+    size_t places = 0;
+    while (at < end && *at >= '0' && *at <= '9') {
+        if (at - digits == INGEST_TEMPERATURE_DIGITS) return NULL;
+        whole = whole * 10 + (uint64_t) (*at++ - '0');
+    }
+    char integral = at != digits;
+    if (at < end && *at == '.') {
+        digits = ++at;
+        while (at < end && *at >= '0' && *at <= '9') {
+            if (places + 1 < sizeof(ingest_scales) / sizeof(ingest_scales[0])) {
+                fraction = fraction * 10 + (uint64_t) (*at - '0');
+                places++;
+            }
+            at++;
+        }
+        if (!integral && at == digits) return NULL;
+    } else if (!integral) {
+        return NULL;
+    }
+    double parsed = (double) whole + (double) fraction / ingest_scales[places];
+    *value = (float) (negative ? -parsed : parsed);
+    return at;
+}
+
+/**
+ * Parse a line of the text protocol and add its reading to the batch
+ * @param ingest
+ * @param at first byte of the line
+ * @param end byte after the line, its newline isn't included
+ */
+static void ingest_line(thermostat_ingest_t *ingest, const char *at, const char *end) {
+    if (end > at && end[-1] == '\r') end--;
+    at = skip_separators(at, end);
+    if (at == end || *at == '#') return;
+    uint64_t id, timestamp = 0;
+    float temperature;
+    const char *next;
+    if ((next = parse_integer(at, end, &id)) == NULL || (at = skip_separators(next, end)) == next ||
+        (at = parse_temperature(at, end, &temperature)) == NULL) {
+        ingest->stats.malformed++;
+        return;
+    }
+    next = skip_separators(at, end);
+    if (next != at && next < end) {
+        if ((at = parse_integer(next, end, &timestamp)) == NULL) {
+            ingest->stats.malformed++;
+            return;
+        }
+        next = skip_separators(at, end);
+    }
+    if (next != end) {
+        ingest->stats.malformed++;
+        return;
+    }
+    ingest_reading(ingest, id, temperature, timestamp);
+}
+
+/**
+ * Parse what a stream has buffered, dispatch its readings and keep the incomplete line or record at its end
+ * @param ingest
+ * @param stream
+ * @param ended nothing more will be read from the stream
+ * @return 0 on success, -1 if the stream announced a binary layout this build doesn't read
+ */
+static int ingest_parse(thermostat_ingest_t *ingest, ingest_stream_t *stream, char ended) {
+    const size_t magic = sizeof(THERMOSTAT_INGEST_MAGIC) - 1;
+    char *bytes = stream->buffer;
+    size_t size = stream->used, offset = 0;
+    if (stream->format == INGEST_UNKNOWN) {
+        // a stream that could still turn out to be binary waits for its header
+        if (!ended && size < sizeof(thermostat_ingest_header_t) &&
+            memcmp(bytes, THERMOSTAT_INGEST_MAGIC, size < magic ? size : magic) == 0) {
+            return 0;
+        }
+        if (size >= sizeof(thermostat_ingest_header_t) && memcmp(bytes, THERMOSTAT_INGEST_MAGIC, magic) == 0) {
+            thermostat_ingest_header_t header;
+            memcpy(&header, bytes, sizeof(header));
+            if (header.version != THERMOSTAT_INGEST_VERSION || header.record_size != sizeof(thermostat_reading_t)) {
+                ingest->stats.malformed++;
+                return -1;
+            }
+            stream->format = INGEST_BINARY;
+            offset = sizeof(header);
+        } else {
+            stream->format = INGEST_TEXT;
+        }
+    }
+    if (stream->format == INGEST_BINARY) {
+        for (; size - offset >= sizeof(thermostat_reading_t); offset += sizeof(thermostat_reading_t)) {
+            thermostat_reading_t reading;
+            memcpy(&reading, bytes + offset, sizeof(reading));
+            ingest_reading(ingest, reading.id, reading.temperature, reading.timestamp);
+        }
+        if (ended && offset < size) {
+            // truncated record
+            ingest->stats.malformed++;
+            offset = size;
+        }
+    } else {
+        char *newline;
+        while ((newline = memchr(bytes + offset, '\n', size - offset)) != NULL) {
+            if (!stream->skipping) ingest_line(ingest, bytes + offset, newline);
+            stream->skipping = 0;
+            offset = (size_t) (newline - bytes) + 1;
+        }
+        if (ended && offset < size) {
+            // last line without a newline
+            if (!stream->skipping) ingest_line(ingest, bytes + offset, bytes + size);
+            offset = size;
+        } else if (offset == 0 && size == THERMOSTAT_INGEST_BUFFER) {
+            if (!stream->skipping) ingest->stats.malformed++;
+            stream->skipping = 1;
+            offset = size;
+        }
+    }
+    memmove(bytes, bytes + offset, size - offset);
+    stream->used = size - offset;
+    // readings don't wait for more of the stream
+    ingest_flush(ingest);
+    return 0;
+}
+
+/**
+ * Read what a stream has available and ingest it
+ * @param ingest
+ * @param stream
+ * @return 1 if more can be read, 0 once the stream ended, -1 if reading it failed
+ */
+static int ingest_receive(thermostat_ingest_t *ingest, ingest_stream_t *stream) {
+    ssize_t received = read(stream->fd, stream->buffer + stream->used, THERMOSTAT_INGEST_BUFFER - stream->used);
+    if (received < 0) return errno == EINTR || errno == EAGAIN ? 1 : -1;
+    ingest->stats.bytes += (unsigned long long) received;
+    stream->used += (size_t) received;
+    if (ingest_parse(ingest, stream, received == 0) != 0) return 0;
+    return received > 0;
+}
+
+/**
+ * Allocate the buffer of a stream
+ * @param fd
+ * @return NULL if it couldn't be allocated
+ */
+static ingest_stream_t *ingest_stream_create(int fd) {
+    ingest_stream_t *stream = malloc(sizeof(ingest_stream_t));
+    if (stream == NULL) return NULL;
+    stream->fd = fd;
+    stream->format = INGEST_UNKNOWN;
+    stream->skipping = 0;
+    stream->used = 0;
+    return stream;
+}
+
+int thermostat_ingest_fd(thermostat_ingest_t *ingest, int fd) {
+    ingest_stream_t *stream = ingest_stream_create(fd);
+    if (stream == NULL) return -1;
+    int result;
+    while ((result = ingest_receive(ingest, stream)) > 0);
+    free(stream);
+    return result;
+}
+
+int thermostat_ingest_listen(thermostat_ingest_t *ingest, const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) return -1;
+    strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) return -1;
+    unlink(path);
+    if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(listener, THERMOSTAT_INGEST_CONNECTIONS) != 0) {
+        close(listener);
+        return -1;
+    }
+    // the wake pipe, the listener and then one entry per connection
+    struct pollfd polls[2 + THERMOSTAT_INGEST_CONNECTIONS] = {{ingest->wake[0], POLLIN, 0}, {listener, POLLIN, 0}};
+    ingest_stream_t *streams[THERMOSTAT_INGEST_CONNECTIONS];
+    size_t connected = 0;
+    for (;;) {
+        // connections beyond the limit wait in the backlog
+        polls[1].events = connected < THERMOSTAT_INGEST_CONNECTIONS ? POLLIN : 0;
+        if (poll(polls, 2 + connected, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (polls[0].revents != 0) {
+            char byte;
+            ssize_t drained = read(ingest->wake[0], &byte, 1);
+            (void) (drained);
+            break;
+        }
+        for (size_t i = 0; i < connected;) {
+            if (polls[2 + i].revents != 0 && ingest_receive(ingest, streams[i]) <= 0) {
+                close(streams[i]->fd);
+                free(streams[i]);
+                // the last connection takes its place and is looked at next
+                connected--;
+                streams[i] = streams[connected];
+                polls[2 + i] = polls[2 + connected];
+                continue;
+            }
+            i++;
+        }
+        if (polls[1].revents & POLLIN) {
+            int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+            ingest_stream_t *stream = fd >= 0 ? ingest_stream_create(fd) : NULL;
+            if (stream != NULL) {
+                streams[connected] = stream;
+                polls[2 + connected] = (struct pollfd) {fd, POLLIN, 0};
+                connected++;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+    for (size_t i = 0; i < connected; i++) {
+        close(streams[i]->fd);
+        free(streams[i]);
+    }
+    close(listener);
+    unlink(path);
+    return 0;
+}
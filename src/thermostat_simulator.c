@@ -0,0 +1,257 @@
+//
+// Runs a fleet of thermostats against a thermal model of their rooms on the virtual timer clock, faster than real time
+//
+
+#include "thermostat_simulator.h"
+#include "statemachine_timer.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIMULATOR_HOUR 3600000.0
+// hour of the day the outdoor temperature peaks at
+#define SIMULATOR_PEAK 15.0
+
+/**
+ * A thread moving a slice of the rooms forward
+ */
+typedef struct {
+    thermostat_simulation_t *simulation;
+    size_t first; // first room of the slice, the thread of the first slice also drives the clock
+    size_t last; // one past the last room of the slice
+    unsigned long long steps;
+    pthread_rwlock_t *gate; // held by the thread starting the workers until every one of them has been told its slice
+    pthread_barrier_t *barrier; // NULL if a single thread runs every room
+    pthread_t thread;
+    thermostat_simulation_stats_t stats;
+} simulation_worker_t;
+
+/**
+ * Draw a number from a xorshift generator
+ * @param state
+ * @param low
+ * @param high
+ * @return uniformly distributed between low and high
+ */
+static float simulation_random(unsigned long long *state, float low, float high) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return low + (high - low) * (float) (*state >> 40) / (float) (1ULL << 24);
+}
+
+int thermostat_simulation_init(thermostat_simulation_t *simulation, size_t count, unsigned long step,
+                               unsigned long seed) {
+    memset(simulation, 0, sizeof(thermostat_simulation_t));
+    // timers have to be on the virtual clock before the thermostats arm any
+    if (statemachine_timer_virtual(statemachine_timer_now()) != 0) return -1;
+    simulation->step = step ? step : THERMOSTAT_SIMULATOR_STEP;
+    simulation->start = simulation->now = statemachine_timer_now();
+    simulation->thermostats = calloc(count ? count : 1, sizeof(thermostat_t *));
+    simulation->rooms = calloc(count ? count : 1, sizeof(thermostat_room_t));
+    simulation->readings = calloc(count ? count : 1, sizeof(float));
+    simulation->changed = calloc(count ? count : 1, sizeof(size_t));
+    if (simulation->thermostats == NULL || simulation->rooms == NULL || simulation->readings == NULL ||
+        simulation->changed == NULL || thermostat_conditions_init(&simulation->conditions, count) != 0) {
+        thermostat_simulation_deinit(simulation);
+        return -1;
+    }
+    unsigned long long random = seed ? seed : 1;
+    for (size_t i = 0; i < count; i++) {
+        thermostat_room_t *room = &simulation->rooms[i];
+        thermostat_t *thermostat = thermostat_create();
+        if (thermostat == NULL) {
+            thermostat_simulation_deinit(simulation);
+            return -1;
+        }
+        simulation->thermostats[i] = thermostat;
+        simulation->count++;
+        room->outdoor = simulation_random(&random, 10, 100);
+        room->swing = simulation_random(&random, 5, 15);
+        room->leakage = simulation_random(&random, 0.05f, 0.2f);
+        // enough to hold the setpoint on the coldest night and the hottest afternoon the climates have
+        room->heating = simulation_random(&random, 16, 24);
+        room->cooling = simulation_random(&random, 10, 16);
+        room->temperature = simulation_random(&random, 69, 75);
+        char heated = room->outdoor < thermostat->mode.heat->setpoint;
+        simulation->heated += (size_t) heated;
+        statemachine_dispatch(&thermostat->statemachine, heated ? THERMOSTAT_SET_MODE_HEAT : THERMOSTAT_SET_MODE_COOL,
+                              NULL);
+        statemachine_dispatch_float(&thermostat->statemachine, THERMOSTAT_SET_TEMPERATURE, room->temperature);
+        room->running = statemachine_is_in(&thermostat->statemachine, THERMOSTAT_HEATING) ? THERMOSTAT_HEATING :
+                        statemachine_is_in(&thermostat->statemachine, THERMOSTAT_COOLING) ? THERMOSTAT_COOLING : 0;
+        simulation->readings[i] = room->temperature;
+        thermostat_conditions_track(&simulation->conditions, i, thermostat);
+    }
+    return 0;
+}
+
+void thermostat_simulation_deinit(thermostat_simulation_t *simulation) {
+    for (size_t i = 0; i < simulation->count; i++) {
+        thermostat_destroy(simulation->thermostats[i]);
+    }
+    free(simulation->thermostats);
+    free(simulation->rooms);
+    free(simulation->readings);
+    free(simulation->changed);
+    thermostat_conditions_deinit(&simulation->conditions);
+    simulation->thermostats = NULL;
+    simulation->rooms = NULL;
+    simulation->readings = NULL;
+    simulation->changed = NULL;
+    simulation->count = 0;
+}
+
+/**
+ * Check whether a room's thermostat is running its equipment and count the cycle if it just turned on
+ * @param room
+ * @param thermostat
+ * @param stats
+ */
+static void simulation_observe(thermostat_room_t *room, thermostat_t *thermostat, thermostat_simulation_stats_t *stats) {
+    short running = statemachine_is_in(&thermostat->statemachine, THERMOSTAT_HEATING) ? THERMOSTAT_HEATING :
+                    statemachine_is_in(&thermostat->statemachine, THERMOSTAT_COOLING) ? THERMOSTAT_COOLING : 0;
+    if (running != room->running) {
+        if (running == THERMOSTAT_HEATING) stats->heating_cycles++;
+        if (running == THERMOSTAT_COOLING) stats->cooling_cycles++;
+        room->running = running;
+    }
+}
+
+/**
+ * Move a room forward by a step with the equipment as its thermostat left it and take a reading
+ * @param simulation
+ * @param index of the room
+ * @param daily where the outdoor temperature is in its daily swing, from -1 to 1
+ * @param stats
+ */
+static void simulation_step(thermostat_simulation_t *simulation, size_t index, float daily,
+                            thermostat_simulation_stats_t *stats) {
+    thermostat_room_t *room = &simulation->rooms[index];
+    thermostat_t *thermostat = simulation->thermostats[index];
+    // time events may have let the thermostat turn its equipment off at the start of the step
+    simulation_observe(room, thermostat, stats);
+    short running = room->running;
+    float hours = (float) ((double) simulation->step / SIMULATOR_HOUR);
+    float outdoor = room->outdoor + room->swing * daily;
+    float rate = room->leakage * (outdoor - room->temperature);
+    if (running == THERMOSTAT_HEATING) {
+        rate += room->heating;
+        stats->heating_time += simulation->step;
+    } else if (running == THERMOSTAT_COOLING) {
+        rate -= room->cooling;
+        stats->cooling_time += simulation->step;
+    }
+    room->temperature += rate * hours;
+    simulation->readings[index] = room->temperature;
+    stats->readings++;
+}
+
+/**
+ * Send the readings of a slice of the rooms to their thermostats, only those that can make a thermostat turn its
+ * equipment on or off unless every reading is sent
+ * @param simulation
+ * @param first room of the slice
+ * @param last one past the last room of the slice
+ * @param stats
+ */
+static void simulation_send(thermostat_simulation_t *simulation, size_t first, size_t last,
+                            thermostat_simulation_stats_t *stats) {
+    size_t *changed = simulation->changed + first, count = last - first;
+    if (simulation->unfiltered) {
+        for (size_t i = 0; i < count; i++) {
+            changed[i] = first + i;
+        }
+    } else {
+        count = thermostat_conditions_changed(&simulation->conditions, simulation->readings, first, last, changed);
+    }
+    for (size_t i = 0; i < count; i++) {
+        thermostat_t *thermostat = simulation->thermostats[changed[i]];
+        statemachine_dispatch_float(&thermostat->statemachine, THERMOSTAT_SET_TEMPERATURE,
+                                    simulation->readings[changed[i]]);
+        simulation_observe(&simulation->rooms[changed[i]], thermostat, stats);
+    }
+    stats->dispatched += count;
+}
+
+static void *simulation_work(void *argument) {
+    simulation_worker_t *worker = argument;
+    if (worker->gate != NULL) {
+        pthread_rwlock_rdlock(worker->gate);
+        pthread_rwlock_unlock(worker->gate);
+    }
+    thermostat_simulation_t *simulation = worker->simulation;
+    for (unsigned long long step = 1; step <= worker->steps; step++) {
+        unsigned long long now = simulation->now + step * simulation->step;
+        if (worker->first == 0) worker->stats.time_events += statemachine_timer_advance(now);
+        // rooms move on once every time event due has been processed, and the clock once every room has
+        if (worker->barrier != NULL) pthread_barrier_wait(worker->barrier);
+        double hour = fmod((double) (now - simulation->start) / SIMULATOR_HOUR, 24.0);
+        float daily = (float) sin(2 * M_PI * (hour - SIMULATOR_PEAK + 6) / 24);
+        for (size_t i = worker->first; i < worker->last; i++) {
+            simulation_step(simulation, i, daily, &worker->stats);
+        }
+        simulation_send(simulation, worker->first, worker->last, &worker->stats);
+        if (worker->barrier != NULL) pthread_barrier_wait(worker->barrier);
+    }
+    return NULL;
+}
+
+int thermostat_simulation_run(thermostat_simulation_t *simulation, unsigned long long duration, unsigned int threads) {
+    if (threads == 0) threads = 1;
+    if (threads > simulation->count) threads = simulation->count ? (unsigned int) simulation->count : 1;
+    simulation_worker_t *workers = calloc(threads, sizeof(simulation_worker_t));
+    pthread_rwlock_t gate = PTHREAD_RWLOCK_INITIALIZER;
+    pthread_barrier_t barrier;
+    if (workers == NULL) return -1;
+    unsigned long long steps = duration / simulation->step;
+    uint64_t start = statemachine_metrics_now();
+    unsigned int started;
+    pthread_rwlock_wrlock(&gate);
+    for (started = 1; started < threads; started++) {
+        workers[started].gate = &gate;
+        if (pthread_create(&workers[started].thread, NULL, simulation_work, &workers[started]) != 0) break;
+    }
+    // the rooms are split between the threads that could be started
+    threads = started;
+    for (unsigned int i = 0; i < threads; i++) {
+        workers[i].simulation = simulation;
+        workers[i].first = simulation->count * i / threads;
+        workers[i].last = simulation->count * (i + 1) / threads;
+        workers[i].steps = steps;
+        workers[i].barrier = threads > 1 ? &barrier : NULL;
+    }
+    if (threads > 1) pthread_barrier_init(&barrier, NULL, threads);
+    pthread_rwlock_unlock(&gate);
+    simulation_work(&workers[0]);
+    for (unsigned int i = 1; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (threads > 1) pthread_barrier_destroy(&barrier);
+    thermostat_simulation_stats_t *stats = &simulation->stats;
+    simulation->now += steps * simulation->step;
+    stats->simulated += steps * simulation->step;
+    stats->elapsed += statemachine_metrics_now() - start;
+    for (unsigned int i = 0; i < threads; i++) {
+        stats->readings += workers[i].stats.readings;
+        stats->dispatched += workers[i].stats.dispatched;
+        stats->time_events += workers[i].stats.time_events;
+        stats->heating_cycles += workers[i].stats.heating_cycles;
+        stats->cooling_cycles += workers[i].stats.cooling_cycles;
+        stats->heating_time += workers[i].stats.heating_time;
+        stats->cooling_time += workers[i].stats.cooling_time;
+    }
+    free(workers);
+    pthread_rwlock_destroy(&gate);
+    // the readings held back change nothing but the temperature the thermostats show
+    for (size_t i = 0; !simulation->unfiltered && i < simulation->count; i++) {
+        if (simulation->conditions.temperature[i] != simulation->readings[i]) {
+            simulation->conditions.temperature[i] = simulation->readings[i];
+            statemachine_dispatch_float(&simulation->thermostats[i]->statemachine, THERMOSTAT_SET_TEMPERATURE,
+                                        simulation->readings[i]);
+            stats->dispatched++;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,405 @@
+//
+// Generates a switch-based C dispatcher from a compiled statemachine model
+//
+
+#define _GNU_SOURCE
+#include "statemachine_codegen.h"
+#include <ctype.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * What the generator is writing
+ */
+typedef struct {
+    FILE *file;
+    const statemachine_table_t *table;
+    const char *prefix;
+    const char **symbols; // guards and effects declared so far
+    size_t symbol_count;
+} codegen_t;
+
+/**
+ * Find the exported name of a guard or effect
+ * @param function
+ * @return NULL if the function isn't exported by the running program
+ */
+static const char *codegen_symbol(void *function) {
+    Dl_info info;
+    if (function == NULL || dladdr(function, &info) == 0 || info.dli_sname == NULL || info.dli_saddr != function) {
+        return NULL;
+    }
+    return info.dli_sname;
+}
+
+/**
+ * Declare a guard or effect the first time it is called by name
+ * @param codegen
+ * @param name
+ * @param declaration the prototype with %s where the name goes
+ */
+static void codegen_declare(codegen_t *codegen, const char *name, const char *declaration) {
+    if (name == NULL) return;
+    for (size_t i = 0; i < codegen->symbol_count; i++) {
+        if (strcmp(codegen->symbols[i], name) == 0) return;
+    }
+    codegen->symbols[codegen->symbol_count++] = name;
+    fprintf(codegen->file, declaration, name);
+}
+
+/**
+ * Render the expression a generated function reaches a transition by. Initial transitions aren't part of the
+ * transitions array and are reached through the state they belong to.
+ * @param codegen
+ * @param transition
+ * @param buffer
+ * @param size
+ * @return buffer
+ */
+static const char *codegen_transition(const codegen_t *codegen, const transition_t *transition, char *buffer,
+                                      size_t size) {
+    const statemachine_table_t *table = codegen->table;
+    if (transition >= table->transitions && transition < table->transitions + table->transition_count) {
+        snprintf(buffer, size, "TRANSITION(%zu)", (size_t) (transition - table->transitions));
+        return buffer;
+    }
+    for (unsigned short i = 0; i < table->state_count; i++) {
+        if (transition == &table->states[i]->initial) {
+            snprintf(buffer, size, "&STATE(%u)->initial", i);
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Write the call of a transition's effect, directly unless metrics are collected
+ * @param codegen
+ * @param transition
+ */
+static void codegen_effect(const codegen_t *codegen, const transition_t *transition) {
+    char reference[64];
+    if (transition->effect == NULL || codegen_transition(codegen, transition, reference, sizeof(reference)) == NULL) {
+        return;
+    }
+    const char *name = codegen_symbol((void *) transition->effect);
+    if (name == NULL) {
+        fprintf(codegen->file, "    statemachine_execute_effect(statemachine, %s, trigger);\n", reference);
+        return;
+    }
+    fprintf(codegen->file, "    if (statemachine_metrics_enabled()) {\n"
+                           "        statemachine_execute_effect(statemachine, %s, trigger);\n"
+                           "    } else {\n"
+                           "        %s(statemachine, %s, trigger);\n"
+                           "    }\n", reference, name, reference);
+}
+
+/**
+ * Write the condition of a transition's guard, a direct call unless metrics are collected
+ * @param codegen
+ * @param transition
+ * @param trigger what the guard is passed
+ */
+static void codegen_guard(const codegen_t *codegen, const transition_t *transition, const char *trigger) {
+    size_t index = (size_t) (transition - codegen->table->transitions);
+    const char *name = codegen_symbol((void *) transition->guard);
+    if (name == NULL) {
+        fprintf(codegen->file, "statemachine_evaluate_guard(statemachine, TRANSITION(%zu), %s)", index, trigger);
+        return;
+    }
+    fprintf(codegen->file, "(statemachine_metrics_enabled() ? statemachine_evaluate_guard(statemachine, "
+                           "TRANSITION(%zu), %s) : %s(statemachine, TRANSITION(%zu), %s))",
+            index, trigger, name, index, trigger);
+}
+
+/**
+ * Write the function taking a transition. The active descendants of the source are left from the end of the active
+ * path, the rest of the exits and the entries are the ones of its plan.
+ * @param codegen
+ * @param index position of the transition in the transitions array
+ */
+static void codegen_execute(const codegen_t *codegen, size_t index) {
+    const statemachine_table_t *table = codegen->table;
+    const transition_t *transition = &table->transitions[index];
+    const statemachine_plan_t *plan = &table->plans[index];
+    unsigned short source = table->state_index[transition->source];
+    FILE *file = codegen->file;
+    fprintf(file, "\n// transition %zu from state %d to %d\n", index, transition->source, transition->target);
+    fprintf(file, "static state_t *transition_%zu(statemachine_t *statemachine, trigger_t *trigger) {\n", index);
+    fprintf(file, "    statemachine_begin_transition(statemachine, TRANSITION(%zu), trigger);\n", index);
+    if (plan->internal) {
+        codegen_effect(codegen, transition);
+        fprintf(file, "    return STATE(%u);\n}\n", source);
+        return;
+    }
+    fprintf(file, "    while (statemachine->path_length > %u) {\n"
+                  "        statemachine_leave_state(statemachine, statemachine->path[statemachine->path_length - 1], "
+                  "trigger);\n"
+                  "    }\n", table->depth[source] + 1U);
+    const unsigned short *exits = table->plan_states + plan->first, *entries = exits + plan->exit_count;
+    const unsigned short *effects = table->plan_effects + plan->first + plan->exit_count;
+    for (unsigned short i = 0; i < plan->exit_count; i++) {
+        fprintf(file, "    statemachine_leave_state(statemachine, STATE(%u), trigger);\n", exits[i]);
+    }
+    codegen_effect(codegen, transition);
+    for (unsigned short i = 0; i < plan->entry_count; i++) {
+        if (effects[i] != USHRT_MAX) codegen_effect(codegen, &table->states[effects[i]]->initial);
+        fprintf(file, "    statemachine_enter_state(statemachine, STATE(%u), trigger);\n", entries[i]);
+    }
+    fprintf(file, "    return STATE(%u);\n}\n", plan->settled);
+}
+
+/**
+ * Check whether a completion transition can ever be taken from a state. Its target must not be active unless it is an
+ * ancestor of the state, so one targeting the state itself never is.
+ * @param table
+ * @param transition
+ * @param index pre-order index of the state
+ * @return
+ */
+static char codegen_completes(const statemachine_table_t *table, const transition_t *transition, unsigned short index) {
+    if (transition->target <= NULL_ELEMENT_ID || transition->target > table->max_state_id) return 0;
+    return table->state_index[transition->target] != USHRT_MAX && table->state_index[transition->target] != index;
+}
+
+/**
+ * Write the function processing a trigger in a state. Like the interpreter it checks the completion transitions first,
+ * then the transitions of the event in the order they were authored.
+ * @param codegen
+ * @param index pre-order index of the state
+ */
+static void codegen_state(const codegen_t *codegen, unsigned short index) {
+    const statemachine_table_t *table = codegen->table;
+    short id = table->states[index]->id;
+    FILE *file = codegen->file;
+    fprintf(file, "\n// state %d\n", id);
+    fprintf(file, "static state_t *state_%u(statemachine_t *statemachine, trigger_t *trigger) {\n", index);
+    for (unsigned short i = table->completion_offsets[id]; i < table->completion_offsets[id + 1]; i++) {
+        const transition_t *transition = &table->transitions[table->completion_transitions[i]];
+        if (!codegen_completes(table, transition, index)) continue;
+        unsigned short target = table->state_index[transition->target];
+        // completing into an ancestor is always allowed since it is exited first
+        char ancestor = target < index && table->post[index] < table->post[target];
+        const char *separator = "";
+        fprintf(file, "    if (");
+        if (transition->depends != 0) {
+            // skipped while none of the inputs its guard reads changed, like the interpreter does
+            fprintf(file, "(statemachine->evaluating & 0x%lxUL)", transition->depends);
+            separator = " && ";
+        }
+        if (!ancestor) {
+            fprintf(file, "%s!ACTIVE(%u)", separator, target);
+            separator = " && ";
+        }
+        if (transition->guard != NULL) {
+            fprintf(file, "%s", separator);
+            codegen_guard(codegen, transition, "NULL");
+        } else if (separator[0] == '\0') {
+            fprintf(file, "1");
+        }
+        fprintf(file, ") return transition_%zu(statemachine, NULL);\n",
+                (size_t) (transition - table->transitions));
+    }
+    size_t bucket = (size_t) id * table->event_count;
+    if (table->event_offsets[bucket + 1] == table->event_offsets[bucket + table->event_count]) {
+        fprintf(file, "    (void) (trigger);\n    return NULL;\n}\n");
+        return;
+    }
+    fprintf(file, "    if (trigger == NULL) return NULL;\n    switch (trigger->event) {\n");
+    for (event_t event = 1; event > 0 && event <= table->max_event; event++) {
+        unsigned short event_index = table->event_index[event];
+        if (event_index == 0) continue;
+        unsigned short first = table->event_offsets[bucket + event_index];
+        unsigned short last = table->event_offsets[bucket + event_index + 1];
+        if (first == last) continue;
+        fprintf(file, "        case %d:\n", event);
+        for (unsigned short i = first; i < last; i++) {
+            const transition_t *transition = &table->transitions[table->event_transitions[i]];
+            size_t transition_index = (size_t) (transition - table->transitions);
+            if (transition->guard == NULL) {
+                // nothing after a transition without a guard can be taken
+                fprintf(file, "            return transition_%zu(statemachine, trigger);\n", transition_index);
+                break;
+            }
+            fprintf(file, "            if (");
+            codegen_guard(codegen, transition, "trigger");
+            fprintf(file, ") return transition_%zu(statemachine, trigger);\n", transition_index);
+            if (i + 1 == last) fprintf(file, "            return NULL;\n");
+        }
+    }
+    fprintf(file, "        default:\n            return NULL;\n    }\n}\n");
+}
+
+/**
+ * Write the prototypes of the guards and effects called by name
+ * @param codegen
+ */
+static void codegen_declarations(codegen_t *codegen) {
+    const statemachine_table_t *table = codegen->table;
+    for (size_t i = 0; i < table->transition_count; i++) {
+        codegen_declare(codegen, codegen_symbol((void *) table->transitions[i].guard),
+                        "int %s(struct statemachine *, struct transition *, trigger_t *);\n");
+        codegen_declare(codegen, codegen_symbol((void *) table->transitions[i].effect),
+                        "void %s(struct statemachine *, struct transition *, trigger_t *);\n");
+    }
+    for (unsigned short i = 0; i < table->state_count; i++) {
+        codegen_declare(codegen, codegen_symbol((void *) table->states[i]->initial.effect),
+                        "void %s(struct statemachine *, struct transition *, trigger_t *);\n");
+    }
+}
+
+/**
+ * Write the dispatcher, which processes the trigger in the most nested active state and then in each of its ancestors
+ * until one takes a transition
+ * @param codegen
+ * @param processed states with transitions
+ */
+static void codegen_dispatch(const codegen_t *codegen, const char *processed) {
+    const statemachine_table_t *table = codegen->table;
+    FILE *file = codegen->file;
+    char any = 0;
+    for (unsigned short i = 0; i < table->state_count; i++) any |= processed[i];
+    fprintf(file, "\nstate_t *%s_dispatch(statemachine_t *statemachine, trigger_t *trigger) {\n", codegen->prefix);
+    if (any) fprintf(file, "    state_t *state;\n");
+    fprintf(file, "    if (statemachine->path_length == 0) return NULL;\n"
+                  "    switch (statemachine->path[statemachine->path_length - 1]->id) {\n");
+    for (unsigned short leaf = 0; leaf < table->state_count; leaf++) {
+        char path = 0;
+        for (unsigned short i = leaf;; i = table->parent[i]) {
+            path |= processed[i];
+            if (i == 0) break;
+        }
+        if (!path) continue;
+        fprintf(file, "        case %d:\n", table->states[leaf]->id);
+        for (unsigned short i = leaf;; i = table->parent[i]) {
+            if (processed[i]) {
+                fprintf(file, "            if ((state = state_%u(statemachine, trigger)) != NULL) return state;\n", i);
+            }
+            if (i == 0) break;
+        }
+        fprintf(file, "            return NULL;\n");
+    }
+    fprintf(file, "        default:\n            (void) (trigger);\n            return NULL;\n    }\n}\n");
+}
+
+/**
+ * Write the function installing the dispatcher. It only accepts the model the dispatcher was generated from, checked
+ * by comparing the order of its states and the ends, events and inputs of its transitions.
+ * @param codegen
+ */
+static void codegen_install(const codegen_t *codegen) {
+    const statemachine_table_t *table = codegen->table;
+    FILE *file = codegen->file;
+    fprintf(file, "\nstatic const short state_ids[%u] = {", table->state_count);
+    for (unsigned short i = 0; i < table->state_count; i++) {
+        fprintf(file, "%s%d", i ? ", " : "", table->states[i]->id);
+    }
+    fprintf(file, "};\n");
+    if (table->transition_count) {
+        fprintf(file, "\n// source, target and event of each transition\n"
+                      "static const short transition_ids[%zu][3] = {", table->transition_count);
+        for (size_t i = 0; i < table->transition_count; i++) {
+            const transition_t *transition = &table->transitions[i];
+            fprintf(file, "%s{%d, %d, %d}", i ? ", " : "", transition->source, transition->target,
+                    transition->trigger.event);
+        }
+        fprintf(file, "};\n\n// inputs each transition depends on, the dispatcher skips completion transitions with them\n"
+                      "static const unsigned long transition_depends[%zu] = {", table->transition_count);
+        for (size_t i = 0; i < table->transition_count; i++) {
+            fprintf(file, "%s0x%lxUL", i ? ", " : "", table->transitions[i].depends);
+        }
+        fprintf(file, "};\n");
+    }
+    fprintf(file, "\nint %s_dispatch_install(statemachine_model_t *model) {\n"
+                  "    if (model->table == NULL && statemachine_compile(model) != 0) return -1;\n"
+                  "    const statemachine_table_t *table = model->table;\n"
+                  "    if (table->state_count != %u || table->transition_count != %zu) return -1;\n"
+                  "    for (unsigned short i = 0; i < table->state_count; i++) {\n"
+                  "        if (table->states[i]->id != state_ids[i]) return -1;\n"
+                  "    }\n", codegen->prefix, table->state_count, table->transition_count);
+    if (table->transition_count) {
+        fprintf(file, "    for (size_t i = 0; i < table->transition_count; i++) {\n"
+                      "        const transition_t *transition = &table->transitions[i];\n"
+                      "        if (transition->source != transition_ids[i][0] || transition->target != transition_ids[i][1] ||\n"
+                      "            transition->trigger.event != transition_ids[i][2] ||\n"
+                      "            transition->depends != transition_depends[i]) return -1;\n"
+                      "    }\n");
+    }
+    fprintf(file, "    model->dispatcher = %s_dispatch;\n    return 0;\n}\n", codegen->prefix);
+}
+
+/**
+ * Write the header declaring the dispatcher
+ * @param header
+ * @param prefix
+ */
+static void codegen_header(FILE *header, const char *prefix) {
+    char guard[64];
+    size_t length = 0;
+    for (; prefix[length] != '\0' && length + 1 < sizeof(guard); length++) {
+        guard[length] = (char) toupper((unsigned char) prefix[length]);
+    }
+    guard[length] = '\0';
+    fprintf(header, "//\n// Generated by statemachine_codegen, do not edit\n//\n\n"
+                    "#ifndef STATEMACHINE_CODEGEN_%s_DISPATCH_H\n#define STATEMACHINE_CODEGEN_%s_DISPATCH_H\n\n"
+                    "#include \"statemachine.h\"\n\n", guard, guard);
+    fprintf(header, "/**\n * Process a trigger from the most nested active state up, the generated equivalent of the "
+                    "interpreter\n * @param statemachine\n * @param trigger NULL to only process completion transitions\n"
+                    " * @return the state the statemachine settled on or NULL if no transition was taken\n */\n"
+                    "state_t *%s_dispatch(statemachine_t *statemachine, trigger_t *trigger);\n", prefix);
+    fprintf(header, "/**\n * Make a model process events with %s_dispatch. Call it before any statemachine runs the "
+                    "model.\n * @param model the model the dispatcher was generated from, compiled if it isn't yet\n"
+                    " * @return 0 on success, -1 if the model couldn't be compiled or doesn't match the dispatcher\n */\n"
+                    "int %s_dispatch_install(statemachine_model_t *model);\n\n"
+                    "#endif\n", prefix, prefix);
+}
+
+int statemachine_codegen(FILE *source, FILE *header, statemachine_model_t *model, const char *prefix,
+                         const char *header_name) {
+    const statemachine_table_t *table = model->table;
+    if (table == NULL) return -1;
+    codegen_t codegen = {source, table, prefix, calloc(table->transition_count + table->state_count + 1,
+                                                       sizeof(char *)), 0};
+    char *processed = calloc(table->state_count, sizeof(char));
+    char *used = calloc(table->transition_count + 1, sizeof(char));
+    if (codegen.symbols == NULL || processed == NULL || used == NULL) {
+        free(codegen.symbols);
+        free(processed);
+        free(used);
+        return -1;
+    }
+    codegen_header(header, prefix);
+    fprintf(source, "//\n// Generated by statemachine_codegen, do not edit\n//\n\n#include \"%s\"\n\n", header_name);
+    fprintf(source, "#define STATE(index) (statemachine->model->table->states[index])\n"
+                    "#define TRANSITION(index) (&statemachine->model->table->transitions[index])\n"
+                    "#define ACTIVE(index) ((statemachine->active[(index) >> 6] >> ((index) & 63)) & 1)\n\n");
+    codegen_declarations(&codegen);
+    // time event transitions are taken by the interpreter, only those processed from a state are generated
+    for (unsigned short i = 0; i < table->state_count; i++) {
+        short id = table->states[i]->id;
+        size_t bucket = (size_t) id * table->event_count;
+        for (unsigned short j = table->completion_offsets[id]; j < table->completion_offsets[id + 1]; j++) {
+            if (codegen_completes(table, &table->transitions[table->completion_transitions[j]], i)) {
+                used[table->completion_transitions[j]] = processed[i] = 1;
+            }
+        }
+        for (unsigned short j = table->event_offsets[bucket + 1]; j < table->event_offsets[bucket + table->event_count];
+             j++) {
+            used[table->event_transitions[j]] = processed[i] = 1;
+        }
+    }
+    for (size_t i = 0; i < table->transition_count; i++) {
+        if (used[i]) codegen_execute(&codegen, i);
+    }
+    for (unsigned short i = 0; i < table->state_count; i++) {
+        if (processed[i]) codegen_state(&codegen, i);
+    }
+    codegen_dispatch(&codegen, processed);
+    codegen_install(&codegen);
+    free(codegen.symbols);
+    free(processed);
+    free(used);
+    return ferror(source) || ferror(header) ? -1 : 0;
+}
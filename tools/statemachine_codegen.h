@@ -0,0 +1,32 @@
+//
+// Generates a switch-based C dispatcher from a compiled statemachine model
+//
+
+#ifndef EMERSON_THERMOSTAT_STATEMACHINE_CODEGEN_H
+#define EMERSON_THERMOSTAT_STATEMACHINE_CODEGEN_H
+
+#include "statemachine.h"
+#include <stdio.h>
+
+/**
+ * Write a dispatcher specialized to a model. The source defines
+ *
+ *     state_t *<prefix>_dispatch(statemachine_t *statemachine, trigger_t *trigger);
+ *     int <prefix>_dispatch_install(statemachine_model_t *model);
+ *
+ * and the header declares them. The dispatcher switches on the most nested active state and then on the event, calls
+ * guards and effects directly and runs the exits and entries the model's plans worked out, so it makes the same
+ * decisions as the interpreter without looking anything up in the tables. Guards and effects are called by name when
+ * the running program exports them, so the generator must be linked with its symbols exported, otherwise they are
+ * called through the model like the interpreter does.
+ * @param source
+ * @param header
+ * @param model compiled with statemachine_compile
+ * @param prefix
+ * @param header_name path the source includes the header by
+ * @return 0 on success, -1 if the model isn't compiled or a file couldn't be written
+ */
+int statemachine_codegen(FILE *source, FILE *header, statemachine_model_t *model, const char *prefix,
+                         const char *header_name);
+
+#endif //EMERSON_THERMOSTAT_STATEMACHINE_CODEGEN_H
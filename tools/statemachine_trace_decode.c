@@ -0,0 +1,144 @@
+//
+// Renders a statemachine trace file written by statemachine_trace_start as text
+//
+
+#include "statemachine_trace.h"
+#include "thermostat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char decode_raw; // print ids instead of thermostat names
+
+/**
+ * A record and its position in the file, so records with the same timestamp keep their order when sorted
+ */
+typedef struct {
+    statemachine_trace_record_t record;
+    size_t position;
+} decode_entry_t;
+
+static int decode_compare(const void *a, const void *b) {
+    const decode_entry_t *x = a, *y = b;
+    if (x->record.timestamp != y->record.timestamp) return x->record.timestamp < y->record.timestamp ? -1 : 1;
+    return (x->position > y->position) - (x->position < y->position);
+}
+
+/**
+ * Render a state id
+ * @param buffer
+ * @param size
+ * @param id
+ * @return buffer
+ */
+static const char *decode_state(char *buffer, size_t size, short id) {
+    const char *name = decode_raw ? NULL : thermostat_state_name(id);
+    if (name != NULL && name[0] != '\0') {
+        snprintf(buffer, size, "%s", name);
+    } else {
+        snprintf(buffer, size, "%d", id);
+    }
+    return buffer;
+}
+
+/**
+ * Render an event, time events are shown by the position of their transition among the time event transitions
+ * @param buffer
+ * @param size
+ * @param event
+ * @return buffer
+ */
+static const char *decode_event(char *buffer, size_t size, short event) {
+    const char *name = decode_raw ? NULL : thermostat_event_name(event);
+    if (event == 0) {
+        snprintf(buffer, size, "completion");
+    } else if (event < 0) {
+        snprintf(buffer, size, "time event %d", -(event + 1));
+    } else if (name != NULL) {
+        snprintf(buffer, size, "%s", name);
+    } else {
+        snprintf(buffer, size, "%d", event);
+    }
+    return buffer;
+}
+
+static void decode_print(const statemachine_trace_record_t *record, uint64_t start) {
+    char source[32], target[32], event[32];
+    printf("%12.6f ms  sm %-6u thread %-3u ", (double) (record->timestamp - start) / 1e6, record->statemachine,
+           record->thread);
+    switch (record->kind) {
+        case STATEMACHINE_TRACE_ENTRY:
+            printf("ENTRY       %s\n", decode_state(source, sizeof(source), record->source));
+            break;
+        case STATEMACHINE_TRACE_EXIT:
+            printf("EXIT        %s\n", decode_state(source, sizeof(source), record->source));
+            break;
+        case STATEMACHINE_TRACE_TRANSITION:
+            if (record->target == 0) {
+                printf("INTERNAL    %s on %s\n", decode_state(source, sizeof(source), record->source),
+                       decode_event(event, sizeof(event), record->event));
+            } else {
+                printf("TRANSITION  %s -> %s on %s\n", decode_state(source, sizeof(source), record->source),
+                       decode_state(target, sizeof(target), record->target),
+                       decode_event(event, sizeof(event), record->event));
+            }
+            break;
+        case STATEMACHINE_TRACE_UNHANDLED:
+            printf("UNHANDLED   %s\n", decode_event(event, sizeof(event), record->event));
+            break;
+        case STATEMACHINE_TRACE_DROPPED:
+            printf("DROPPED     %s\n", decode_event(event, sizeof(event), record->event));
+            break;
+        default:
+            printf("UNKNOWN     kind %u\n", record->kind);
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--raw") == 0) {
+            decode_raw = 1;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "usage: %s [--raw] trace\n", argv[0]);
+        return 1;
+    }
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    statemachine_trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, STATEMACHINE_TRACE_MAGIC, 4) != 0 ||
+        header.version != STATEMACHINE_TRACE_VERSION || header.record_size != sizeof(statemachine_trace_record_t)) {
+        fprintf(stderr, "%s is not a version %d statemachine trace\n", path, STATEMACHINE_TRACE_VERSION);
+        fclose(file);
+        return 1;
+    }
+    size_t count = 0, capacity = 4096;
+    decode_entry_t *entries = malloc(capacity * sizeof(decode_entry_t));
+    // records of different threads are written ring by ring, sort them back into the order they happened in
+    while (entries != NULL && fread(&entries[count].record, sizeof(statemachine_trace_record_t), 1, file) == 1) {
+        entries[count].position = count;
+        if (++count == capacity) {
+            decode_entry_t *grown = realloc(entries, (capacity *= 2) * sizeof(decode_entry_t));
+            if (grown == NULL) free(entries);
+            entries = grown;
+        }
+    }
+    fclose(file);
+    if (entries == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    qsort(entries, count, sizeof(decode_entry_t), decode_compare);
+    for (size_t i = 0; i < count; i++) {
+        decode_print(&entries[i].record, entries[0].record.timestamp);
+    }
+    free(entries);
+    return 0;
+}
@@ -0,0 +1,32 @@
+//
+// Generates the switch-based dispatcher of the thermostat chart
+//
+
+#include "statemachine_codegen.h"
+#include "thermostat.h"
+#include <string.h>
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s source header\n", argv[0]);
+        return 1;
+    }
+    if (statemachine_compile(&thermostat_model) != 0) {
+        fprintf(stderr, "couldn't compile the thermostat chart\n");
+        return 1;
+    }
+    FILE *source = fopen(argv[1], "w"), *header = fopen(argv[2], "w");
+    if (source == NULL || header == NULL) {
+        perror(source == NULL ? argv[1] : argv[2]);
+        return 1;
+    }
+    // the source includes the header by its name, both are written to the same directory
+    const char *header_name = strrchr(argv[2], '/') != NULL ? strrchr(argv[2], '/') + 1 : argv[2];
+    int result = statemachine_codegen(source, header, &thermostat_model, "thermostat", header_name);
+    if (fclose(source) != 0 || fclose(header) != 0 || result != 0) {
+        fprintf(stderr, "couldn't write the thermostat dispatcher\n");
+        return 1;
+    }
+    statemachine_release(&thermostat_model);
+    return 0;
+}